@@ -0,0 +1,492 @@
+#!/usr/bin/env python3
+#
+# Per feature flash/RAM budget for the OpenEVSE firmware
+#
+# Builds each PlatformIO environment once as configured, then once more per
+# feature with that feature flipped, and reports what each feature costs:
+# flash, .data, .bss and worst case stack, plus the symbols that account
+# for it. A feature that's on is turned off and vice versa, and the numbers
+# are always "with it" minus "without it"
+#
+# usage: python3 ci/feature_budget.py [-e env]... [-f FEATURE]... [-j jobs]
+#   see ci/feature-budget.md
+#
+# This file is part of Open EVSE.
+#
+# Open EVSE is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3, or (at your option)
+# any later version.
+#
+# Open EVSE is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+import argparse
+import concurrent.futures
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SRC_DIR = os.path.join(ROOT, 'firmware', 'open_evse')
+HEADER = 'open_evse.h'
+
+DEFAULT_ENVS = ['openevse']
+# the switches in open_evse.h worth knowing the price of
+DEFAULT_FEATURES = [
+    'AMMETER', 'VOLTMETER', 'KWH_RECORDING', 'TIME_LIMIT', 'CHARGE_LIMIT',
+    'RAPI_WF', 'RAPI_BTN', 'RAPI_I2C', 'RAPI_SENDER',
+    'TEMPERATURE_MONITORING', 'HEARTBEAT_SUPERVISION', 'DELAYTIMER',
+    'DELAYTIMER_MENU', 'MENNEKES_LOCK', 'AUTOSVCLEVEL', 'BOOTLOCK',
+    'GFI_SELFTEST', 'ADVPWR', 'BTN_MENU', 'EVENT_LOG', 'EVENT_LOG_EEPROM',
+    'AUTO_PAUSE', 'GROUP_SHARE', 'PV_SURPLUS', 'PILOT_CHECK', 'THRESH_CAL',
+    'PAFC_PWM', 'RELAY_PWM',
+]
+
+# return address pushed by call/rcall and on interrupt entry, 16 bit PC
+RET_ADDR = 2
+
+TEXT_TYPES = 'TtWwVv'
+DATA_TYPES = 'DdGgRr'
+BSS_TYPES = 'BbSs'
+
+
+def run(cmd, cwd=None, env=None):
+    p = subprocess.run(cmd, cwd=cwd, env=env, stdout=subprocess.PIPE,
+                       stderr=subprocess.STDOUT, universal_newlines=True)
+    return p.returncode, p.stdout
+
+
+#
+# source/config variants
+#
+
+def define_re(name):
+    # "#define NAME", "#define NAME value // comment", commented out or not
+    return re.compile(r'^(\s*)(//\s*)?(#\s*define\s+' + re.escape(name) + r'\b.*)$')
+
+
+def header_state(text, name):
+    # 1 if an uncommented #define NAME is there, 0 if only a commented out
+    # one, None if neither
+    state = None
+    for line in text.splitlines():
+        m = define_re(name).match(line)
+        if m:
+            if not m.group(2):
+                return 1
+            state = 0
+    return state
+
+
+def toggle_header(text, name, on):
+    # on: uncomment the first commented out #define NAME
+    # off: comment out every #define NAME
+    out = []
+    done = False
+    for line in text.splitlines(True):
+        m = define_re(name).match(line)
+        if m and on and m.group(2) and not done:
+            line = m.group(1) + m.group(3) + '\n'
+            done = True
+        elif m and not on and not m.group(2):
+            line = m.group(1) + '//' + m.group(3) + '\n'
+            done = True
+        out.append(line)
+    return ''.join(out), done
+
+
+def flag_re(name):
+    return re.compile(r'^\s*-D\s*' + re.escape(name) + r'(=\S*)?\s*$')
+
+
+def make_ini(text, cache_dir, drop_flag=None):
+    # point the project at the copied sources, the repo's boards and a
+    # shared build cache, so the Arduino core is only compiled once
+    out = []
+    for line in text.splitlines(True):
+        if re.match(r'^\s*src_dir\s*=', line):
+            line = 'src_dir = src\n'
+            line += 'boards_dir = %s\n' % os.path.join(ROOT, 'boards')
+            line += 'build_cache_dir = %s\n' % cache_dir
+        elif drop_flag and flag_re(drop_flag).match(line):
+            continue
+        out.append(line)
+    return ''.join(out)
+
+
+def env_flags(ini, env):
+    # build flags for env with ${...} and extends resolved
+    rc, out = run(['pio', 'project', 'config', '--json-output',
+                   '-d', os.path.dirname(ini)])
+    if rc:
+        return []
+    try:
+        cfg = json.loads(out)
+    except ValueError:
+        return []
+    for section, items in cfg:
+        if section == 'env:' + env:
+            flags = []
+            for k, v in items:
+                if k in ('build_flags', 'build_src_flags'):
+                    flags += v if isinstance(v, list) else [v]
+            return flags
+    return []
+
+
+def feature_on_in_flags(flags, name):
+    return any(flag_re(name).match(f) for f in flags)
+
+
+#
+# build & measure
+#
+
+def prepare(workdir, ini_text, header_text):
+    if os.path.isdir(workdir):
+        shutil.rmtree(workdir)
+    shutil.copytree(SRC_DIR, os.path.join(workdir, 'src'),
+                    ignore=shutil.ignore_patterns('__vm', '*.exe', '*.hex', '*.bat',
+                                                  '*.sln', '*.vcxproj*'))
+    with open(os.path.join(workdir, 'src', HEADER), 'w') as f:
+        f.write(header_text)
+    with open(os.path.join(workdir, 'platformio.ini'), 'w') as f:
+        f.write(ini_text)
+
+
+def build(workdir, env, toolchain, extra_flags=''):
+    penv = dict(os.environ)
+    if extra_flags:
+        penv['PLATFORMIO_BUILD_FLAGS'] = extra_flags
+    rc, out = run(['pio', 'run', '-e', env, '-d', workdir], env=penv)
+    if rc:
+        m = re.search(r"region `(\w+)' overflowed by (\d+) bytes", out)
+        if m:
+            return {'error': '%s overflowed by %s' % (m.group(1), m.group(2))}
+        errs = [l for l in out.splitlines() if 'error' in l.lower()]
+        return {'error': (errs[0] if errs else 'build failed').strip()[:100]}
+    elf = os.path.join(workdir, '.pio', 'build', env, 'firmware.elf')
+    return measure(elf, toolchain)
+
+
+def tool(toolchain, name):
+    return os.path.join(toolchain, 'bin', name) if toolchain else name
+
+
+def measure(elf, toolchain):
+    rc, out = run([tool(toolchain, 'avr-size'), '-A', elf])
+    if rc:
+        return {'error': 'avr-size failed'}
+    res = parse_size(out)
+    rc, out = run([tool(toolchain, 'avr-nm'), '-S', '-C', '--size-sort', elf])
+    res['symbols'] = parse_nm(out) if not rc else {}
+    rc, out = run([tool(toolchain, 'avr-objdump'), '-d', elf])
+    res['stack'], res['stackNote'] = max_stack(out) if not rc else (None, 'objdump failed')
+    return res
+
+
+def parse_size(out):
+    # avr-size -A: section size addr
+    sec = {}
+    for line in out.splitlines():
+        f = line.split()
+        if len(f) >= 2 and f[0].startswith('.') and f[1].isdigit():
+            sec[f[0]] = int(f[1])
+    text = sec.get('.text', 0)
+    data = sec.get('.data', 0)
+    bss = sec.get('.bss', 0) + sec.get('.noinit', 0)
+    # .data is stored in flash too, to be copied to RAM at startup
+    return {'flash': text + data, 'data': data, 'bss': bss}
+
+
+def parse_nm(out):
+    # avr-nm -S -C: addr size type name. statics with the same name in
+    # different files are added up
+    syms = {}
+    for line in out.splitlines():
+        f = line.split(None, 3)
+        if len(f) < 4 or len(f[2]) != 1:
+            continue
+        t = f[2]
+        if t in TEXT_TYPES:
+            kind = 'flash'
+        elif t in DATA_TYPES:
+            kind = 'data'
+        elif t in BSS_TYPES:
+            kind = 'bss'
+        else:
+            continue
+        key = (f[3], kind)
+        syms[key] = syms.get(key, 0) + int(f[1], 16)
+    return syms
+
+
+FUNC_RE = re.compile(r'^[0-9a-f]+ <([^>]+)>:$')
+INSN_RE = re.compile(r'^\s*[0-9a-f]+:\s+(?:[0-9a-f]{2} )+\s*\t(\w+)\t?([^;]*)(?:;\s*0x[0-9a-f]+ <([^>]+)>)?')
+
+
+def stack_frames(objdump):
+    # per function: worst case bytes pushed/allocated, callees, and whether
+    # it calls through a pointer. straight line scan, so every call is
+    # assumed to happen at the function's deepest point. that can only
+    # overestimate
+    funcs = {}
+    cur = None
+    for line in objdump.splitlines():
+        m = FUNC_RE.match(line)
+        if m:
+            cur = {'frame': 0, 'calls': set(), 'icall': False}
+            funcs[m.group(1)] = cur
+            depth = 0
+            yadj = None
+            subi = 0
+            continue
+        if cur is None:
+            continue
+        m = INSN_RE.match(line)
+        if not m:
+            continue
+        op, args, target = m.group(1), m.group(2).strip(), m.group(3)
+        a = [x.strip() for x in args.split(',')]
+        if op == 'push':
+            depth += 1
+        elif op == 'pop':
+            depth -= 1
+        elif op == 'rcall' and args == '.+0':
+            depth += RET_ADDR # gcc's short way to allocate 2 bytes
+        elif op == 'in' and a == ['r28', '0x3d']:
+            yadj = 0
+        elif yadj is not None and op in ('sbiw', 'adiw') and a[0] == 'r28':
+            n = int(a[1], 0)
+            yadj += n if op == 'sbiw' else -n
+        elif yadj is not None and op == 'subi' and a[0] == 'r28':
+            subi = int(a[1], 0) & 0xff
+        elif yadj is not None and op == 'sbci' and a[0] == 'r29':
+            v = ((int(a[1], 0) & 0xff) << 8) | subi
+            yadj += v if v < 0x8000 else v - 0x10000
+        elif yadj is not None and op == 'out' and a == ['0x3d', 'r28']:
+            # SP written from Y, the frame is allocated now
+            depth += yadj
+            yadj = None
+        elif op in ('call', 'rcall', 'jmp', 'rjmp') and target:
+            callee = target.split('+')[0]
+            if op in ('call', 'rcall'):
+                cur['calls'].add((callee, RET_ADDR))
+            else:
+                cur['calls'].add((callee, 0)) # tail call, or a branch
+        elif op in ('icall', 'eicall', 'ijmp', 'eijmp'):
+            cur['icall'] = True
+        if depth > cur['frame']:
+            cur['frame'] = depth
+    return funcs
+
+
+def max_stack(objdump):
+    # worst main() path plus the worst interrupt on top of it.
+    # interrupts don't nest, the firmware never sets I inside an ISR
+    funcs = stack_frames(objdump)
+    memo = {}
+    notes = set()
+
+    def worst(name, path):
+        if name in memo:
+            return memo[name]
+        f = funcs.get(name)
+        if f is None:
+            return 0
+        if name in path:
+            notes.add('recursion')
+            return 0
+        if f['icall']:
+            notes.add('indirect calls not counted')
+        path.add(name)
+        deepest = 0
+        for callee, ret in f['calls']:
+            if callee == name:
+                continue # branch within the function
+            deepest = max(deepest, ret + worst(callee, path))
+        path.discard(name)
+        memo[name] = f['frame'] + deepest
+        return memo[name]
+
+    if 'main' not in funcs:
+        return None, 'no main'
+    total = worst('main', set())
+    isr = [RET_ADDR + worst(n, set()) for n in funcs if re.match(r'^__vector_\d+$', n)]
+    if isr:
+        total += max(isr)
+    return total, ', '.join(sorted(notes))
+
+
+#
+# report
+#
+
+def cost(with_f, without_f):
+    # with minus without, None if either didn't build
+    if 'error' in with_f or 'error' in without_f:
+        return None
+    c = {k: with_f[k] - without_f[k] for k in ('flash', 'data', 'bss')}
+    if with_f.get('stack') is not None and without_f.get('stack') is not None:
+        c['stack'] = with_f['stack'] - without_f['stack']
+    else:
+        c['stack'] = None
+    syms = {}
+    for k in set(with_f['symbols']) | set(without_f['symbols']):
+        d = with_f['symbols'].get(k, 0) - without_f['symbols'].get(k, 0)
+        if d:
+            syms[k] = d
+    c['symbols'] = syms
+    return c
+
+
+def fmt(v):
+    return '?' if v is None else '%+d' % v
+
+
+def report(results, limits, top):
+    lines = []
+    for env, (base, feats) in results.items():
+        lines.append('## %s' % env)
+        lines.append('')
+        if 'error' in base:
+            lines.append('baseline build FAILED: %s' % base['error'])
+            lines.append('')
+            continue
+        ram = base['data'] + base['bss']
+        lines.append('baseline: flash %d of %d (%d free), .data %d, .bss %d, '
+                     'RAM %d of %d, max stack %s%s' % (
+                         base['flash'], limits['flash'], limits['flash'] - base['flash'],
+                         base['data'], base['bss'], ram, limits['ram'],
+                         '?' if base['stack'] is None else base['stack'],
+                         ' (%s)' % base['stackNote'] if base['stackNote'] else ''))
+        lines.append('')
+        lines.append('| feature | baseline | flash | .data | .bss | max stack |')
+        lines.append('|---|---|---:|---:|---:|---:|')
+        details = []
+        for name, on, res, c in feats:
+            state = {1: 'on', 0: 'off', None: 'absent'}[on]
+            if c is None:
+                err = res.get('error', base.get('error', ''))
+                lines.append('| %s | %s | %s | | | |' % (name, state, 'FAILED: ' + err))
+                continue
+            if not (c['flash'] or c['data'] or c['bss'] or c['symbols']):
+                # e.g. the #define is inside an #if that's off in this env
+                lines.append('| %s | %s, no effect | 0 | 0 | 0 | %s |' % (name, state, fmt(c['stack'])))
+                continue
+            lines.append('| %s | %s | %s | %s | %s | %s |' % (
+                name, state, fmt(c['flash']), fmt(c['data']), fmt(c['bss']), fmt(c['stack'])))
+            syms = sorted(c['symbols'].items(), key=lambda kv: (-abs(kv[1]), kv[0]))
+            if syms:
+                details.append((name, syms))
+
+        for name, syms in details:
+            lines.append('')
+            lines.append('### %s' % name)
+            lines.append('')
+            lines.append('| symbol | section | bytes |')
+            lines.append('|---|---|---:|')
+            for (sym, kind), d in syms[:top]:
+                lines.append('| `%s` | %s | %+d |' % (sym.replace('|', '\\|'), kind, d))
+            if len(syms) > top:
+                rest = sum(d for _, d in syms[top:])
+                lines.append('| %d more | | %+d |' % (len(syms) - top, rest))
+        lines.append('')
+    return '\n'.join(lines)
+
+
+def board_limits():
+    with open(os.path.join(ROOT, 'boards', 'openevse.json')) as f:
+        up = json.load(f)['upload']
+    return {'flash': up['maximum_size'], 'ram': up['maximum_ram_size']}
+
+
+def main():
+    ap = argparse.ArgumentParser(description='per feature flash/RAM budget')
+    ap.add_argument('-e', '--env', action='append', help='PlatformIO environment (default openevse)')
+    ap.add_argument('-f', '--feature', action='append', help='feature #define to flip (default: a list of the main ones)')
+    ap.add_argument('-j', '--jobs', type=int, default=os.cpu_count() or 1, help='parallel builds')
+    ap.add_argument('-o', '--output', help='write the markdown report here too')
+    ap.add_argument('--json', help='write the raw numbers here')
+    ap.add_argument('--top', type=int, default=10, help='symbols to list per feature')
+    ap.add_argument('--toolchain', default=os.path.expanduser('~/.platformio/packages/toolchain-atmelavr'),
+                    help='avr-gcc toolchain dir, with bin/avr-size etc')
+    ap.add_argument('--workdir', default=os.path.join(ROOT, '.pio', 'budget'))
+    args = ap.parse_args()
+
+    envs = args.env or DEFAULT_ENVS
+    features = args.feature or DEFAULT_FEATURES
+    if not os.path.isdir(args.toolchain):
+        args.toolchain = '' # hope the avr tools are on the PATH
+    if not shutil.which('pio'):
+        sys.exit('pio not found, pip install platformio')
+
+    with open(os.path.join(ROOT, 'platformio.ini')) as f:
+        ini_text = f.read()
+    with open(os.path.join(SRC_DIR, HEADER)) as f:
+        header_text = f.read()
+    cache_dir = os.path.join(args.workdir, 'cache')
+
+    # baselines first, they tell us which way to flip each feature
+    jobs = []
+    for env in envs:
+        wd = os.path.join(args.workdir, env, 'base')
+        prepare(wd, make_ini(ini_text, cache_dir), header_text)
+        jobs.append((env, None, None, wd, ''))
+
+    with concurrent.futures.ThreadPoolExecutor(args.jobs) as ex:
+        bases = dict(zip(envs, ex.map(lambda j: build(j[3], j[0], args.toolchain), jobs)))
+
+        jobs = []
+        for env in envs:
+            flags = env_flags(os.path.join(args.workdir, env, 'base', 'platformio.ini'), env)
+            for name in features:
+                hs = header_state(header_text, name)
+                on = 1 if (hs == 1 or feature_on_in_flags(flags, name)) else hs
+                wd = os.path.join(args.workdir, env, name)
+                hdr, found = toggle_header(header_text, name, not on)
+                extra = ''
+                if not on and not found:
+                    extra = '-D ' + name # not in the header at all
+                prepare(wd, make_ini(ini_text, cache_dir, name if on else None), hdr)
+                jobs.append((env, name, on, wd, extra))
+            print('%s: %d variants' % (env, len([j for j in jobs if j[0] == env])), file=sys.stderr)
+
+        variants = list(ex.map(lambda j: build(j[3], j[0], args.toolchain, j[4]), jobs))
+
+    results = {}
+    for env in envs:
+        results[env] = (bases[env], [])
+    for (env, name, on, wd, extra), res in zip(jobs, variants):
+        base = bases[env]
+        c = cost(base, res) if on else cost(res, base)
+        results[env][1].append((name, on, res, c))
+
+    md = report(results, board_limits(), args.top)
+    print(md)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(md)
+    if args.json:
+        raw = {}
+        for env, (base, feats) in results.items():
+            raw[env] = {
+                'baseline': {k: v for k, v in base.items() if k != 'symbols'},
+                'features': {name: (None if c is None else
+                                    dict({k: v for k, v in c.items() if k != 'symbols'},
+                                         baseline='on' if on else 'off',
+                                         symbols=[[s, kind, d] for (s, kind), d in c['symbols'].items()]))
+                             for name, on, res, c in feats},
+            }
+        with open(args.json, 'w') as f:
+            json.dump(raw, f, indent=1)
+
+
+if __name__ == '__main__':
+    main()
@@ -67,8 +67,11 @@ int16_t Adafruit_TMP007::readDieTempC(void) {
 
 // 读取物体温度（单位：摄氏度 * 10）
 int16_t Adafruit_TMP007::readObjTempC10(void) {
-  int16_t raw = read16(TMP007_TOBJ);  // 从 TOBJ 寄存器读取温度原始值
+  return objTempC10(read16(TMP007_TOBJ));  // 从 TOBJ 寄存器读取温度原始值
+}
 
+// 把 TOBJ 寄存器的值转换为摄氏度 × 10
+int16_t Adafruit_TMP007::objTempC10(int16_t raw) {
   // 检查最低位是否为 1，表示没有传感器安装（或数据无效）
   if (raw & 0x1) return (int16_t)TEMPERATURE_NOT_INSTALLED;
 
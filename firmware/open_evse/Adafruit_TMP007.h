@@ -60,6 +60,9 @@ class Adafruit_TMP007  {
   int16_t readRawVoltage(void);
   int16_t readObjTempC10(void);
   int16_t readDieTempC(void);
+  uint8_t address() { return _addr; }
+  // TMP007_TOBJ value -> C*10
+  static int16_t objTempC10(int16_t raw);
 
  private:
   uint8_t _addr;
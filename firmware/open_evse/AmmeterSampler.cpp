@@ -0,0 +1,113 @@
+/*
+ * 该文件是 Open EVSE 的一部分。
+ *
+ * Open EVSE 是自由软件；你可以在 GNU 通用公共许可证（由自由软件基金会发布）的条款下重新分发和/或修改它；无论是版本 3，还是（你选择的）任何更高版本。
+ *
+ * Open EVSE 被分发的目的是希望它能有用，但不提供任何担保；甚至没有对适销性或特定用途的隐含担保。详见 GNU 通用公共许可证的详细说明。
+ *
+ * 你应该已收到一份 GNU 通用公共许可证副本；与 Open EVSE 一起，查看文件 COPYING。如果没有，请写信给自由软件基金会，地址为：
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA。
+ */
+
+#include "AmmeterSampler.h"
+
+unsigned long ulong_sqrt(unsigned long in)
+{
+  unsigned long out = 0;
+  unsigned long bit = 0x40000000ul;
+
+  // "bit" starts at the highest power of four <= the argument.
+  while (bit > in)
+    bit >>= 2;
+
+  while (bit) {
+    unsigned long sum = out + bit;
+    if (in >= sum) {
+      in -= sum;
+      out = (out >> 1) + bit;
+    }
+    else
+      out >>= 1;
+    bit >>= 2;
+  }
+
+  return out;
+}
+
+void AmmeterSampler::Start()
+{
+  m_Sum = 0;
+  m_Cnt = 0;
+  m_LastCrossMs = 0;
+  m_Last = AS_MIDPOINT;
+  m_LastMag = 0;
+  m_HalfPeak[0] = 0;
+  m_HalfPeak[1] = 0;
+  m_Crossings = 0;
+  m_First = 1;
+}
+
+uint8_t AmmeterSampler::Sample(uint16_t sample,unsigned long ms)
+{
+  // 如果这不是第一次采样，并且当前值与上一个值的符号不同，则计为零交叉
+  if (!m_First && ((m_Last > AS_MIDPOINT) != (sample > AS_MIDPOINT))) {
+    // 一旦检测到零交叉，避免由于噪声造成的误判断，设置去抖动时间
+    if ((ms - m_LastCrossMs) > CURRENT_ZERO_DEBOUNCE_INTERVAL) {
+      m_Crossings++; // 记录零交叉
+      m_LastCrossMs = ms;
+      m_LastMag = 0; // 新的半周期
+    }
+  }
+
+  m_First = 0;
+  m_Last = sample;
+
+  if ((m_Crossings == 1) || (m_Crossings == 2)) {
+    // 在零交叉后，累加每个采样的平方（用于计算有效值）
+    long d = (long)sample - AS_MIDPOINT;
+    m_Sum += (unsigned long)(d * d);
+    m_Cnt++;
+
+    // 半周期峰值取相邻两个采样中较小的一个，单个采样的尖峰不计入
+    uint16_t mag = (d < 0) ? (uint16_t)-d : (uint16_t)d;
+    uint16_t pk = (mag < m_LastMag) ? mag : m_LastMag;
+    if (pk > m_HalfPeak[m_Crossings-1]) m_HalfPeak[m_Crossings-1] = pk;
+    m_LastMag = mag;
+    return 0;
+  }
+
+  // 已经采集了三个零交叉点
+  return (m_Crossings >= 3) ? 1 : 0;
+}
+
+unsigned long AmmeterSampler::Rms()
+{
+  return m_Cnt ? ulong_sqrt(m_Sum / m_Cnt) : 0; // 计算平方和的均值，然后取平方根
+}
+
+uint8_t OverCurrent::Fast(int32_t peakma,int32_t limitma,uint8_t amps,uint8_t reads)
+{
+  if (peakma < limitma + amps * 1000L) {
+    m_FastCnt = 0;
+    return 0;
+  }
+  if (++m_FastCnt < reads) return 0;
+  Reset();
+  return 1;
+}
+
+uint8_t OverCurrent::Slow(int32_t avgma,int32_t limitma,uint8_t amps,unsigned long timeoutms,unsigned long ms)
+{
+  if (avgma < limitma + amps * 1000L) {
+    m_SlowStartMs = 0;
+    return 0;
+  }
+  if (!m_SlowStartMs) {
+    m_SlowStartMs = ms;  // 开始过流
+    return 0;
+  }
+  if ((ms - m_SlowStartMs) < timeoutms) return 0;
+  m_SlowStartMs = 0;
+  return 1;
+}
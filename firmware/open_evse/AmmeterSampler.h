@@ -0,0 +1,122 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#ifndef _AMMETER_SAMPLER_H_
+#define _AMMETER_SAMPLER_H_
+
+#include <stdint.h>
+
+// Measures one line cycle of the current transformer signal.
+// Samples are skipped until the first zero crossing, then accumulated
+// for the two half cycles up to the third crossing.
+// Besides the RMS value it keeps the peak of each half cycle, for
+// fast overcurrent detection.
+// utils/overcurrent_sim builds this file too
+
+// ADC midpoint, the CT signal is biased to Vcc/2
+#define AS_MIDPOINT 512
+
+// Once we detect a zero-crossing, we should not look for one for another
+// quarter cycle or so. 1/4 cycle at 50 Hz is 5 ms.
+#define CURRENT_ZERO_DEBOUNCE_INTERVAL 5
+
+// The maximum number of milliseconds to sample an ammeter pin in order to find three zero-crossings.
+// one and a half cycles at 50 Hz is 30 ms.
+#define CURRENT_SAMPLE_INTERVAL 35
+
+#define MA_PTS 32 // # points in moving average MUST BE power of 2
+#define MA_BITS 5 // log2(MA_PTS)
+
+// mA per ADC count, see the burden resistor notes in open_evse.h
+// NOTE: setting DEFAULT_CURRENT_SCALE_FACTOR TO 0 will disable the ammeter
+// until it is overridden via RAPI
+#ifdef OPENEVSE_2
+#define DEFAULT_CURRENT_SCALE_FACTOR 186   // OpenEVSE II with a 27 Ohm burden resistor, after a 2-point calibration at 12.5A and 50A
+#else
+#define DEFAULT_CURRENT_SCALE_FACTOR 220   // OpenEVSE v2.5 and v3 with a 22 Ohm burden resistor (note that the schematic may say 28 Ohms by mistake)
+#endif
+
+// subtract this from ammeter current reading to correct zero offset
+#ifdef OPENEVSE_2
+#define DEFAULT_AMMETER_CURRENT_OFFSET 230 // OpenEVSE II with a 27 Ohm burden resistor, after a 2-point calibration at 12.5A and 50A
+#else
+#define DEFAULT_AMMETER_CURRENT_OFFSET 0   // OpenEVSE v2.5 and v3 with a 22 Ohm burden resistor.  Could use a more thorough calibration exercise to nails this down.
+#endif
+
+// RMS equivalent of a sine peak, 1/sqrt(2) * 256
+#define AS_PEAK_TO_RMS_256 181
+
+class AmmeterSampler {
+  unsigned long m_Sum;        // sum of squares
+  unsigned int m_Cnt;
+  unsigned long m_LastCrossMs;
+  uint16_t m_Last;            // previous sample
+  uint16_t m_LastMag;         // previous sample's distance from midpoint
+  uint16_t m_HalfPeak[2];     // per half cycle peak, ADC counts from midpoint
+  uint8_t m_Crossings;
+  uint8_t m_First;
+public:
+  AmmeterSampler() { Start(); }
+  void Start();
+
+  // feed one ADC sample taken at ms
+  // returns 1 once a full cycle has been measured
+  uint8_t Sample(uint16_t sample,unsigned long ms);
+
+  // RMS of the measured cycle, ADC counts
+  unsigned long Rms();
+  // larger of the two half cycle peaks, ADC counts from midpoint.
+  // each half cycle peak is the lower of two adjacent samples, so a
+  // single sample noise spike doesn't count
+  uint16_t Peak() { return (m_HalfPeak[0] > m_HalfPeak[1]) ? m_HalfPeak[0] : m_HalfPeak[1]; }
+};
+
+unsigned long ulong_sqrt(unsigned long in);
+
+// overcurrent tier settings. open_evse.h turns the tiers on with
+// OVERCURRENT_THRESHOLD/OVERCURRENT_FAST_THRESHOLD, normally set to these
+#define OC_SLOW_AMPS 5          // average RMS over pilot amps + this
+#define OC_SLOW_MS 10000UL      // for this long
+#define OC_FAST_AMPS 20         // half cycle peak as RMS over pilot amps + this
+#define OC_FAST_READS 3         // for this many ammeter reads in a row
+
+// The two overcurrent tiers from J1772EVSEController::Update().
+// The slow tier works on the moving average, gives the EV time to react,
+// and allows a graceful shutdown. The fast tier works on the peak of
+// each read, and is for gross faults that can't wait.
+// Currents are mA, limitma is the pilot setting
+class OverCurrent {
+  unsigned long m_SlowStartMs; // 0 = not over
+  uint8_t m_FastCnt;           // consecutive reads over the fast threshold
+public:
+  OverCurrent() { Reset(); }
+  void Reset() { m_SlowStartMs = 0; m_FastCnt = 0; }
+  // half cycle peak from AmmeterSampler::Peak(), converted to RMS mA as a sine
+  static int32_t PeakMa(uint16_t peak,int16_t scale,int16_t offset) {
+    return (int32_t)(((uint32_t)peak * AS_PEAK_TO_RMS_256) >> 8) * scale - offset;
+  }
+  // once per ammeter read. returns 1 = trip now, and resets both tiers
+  uint8_t Fast(int32_t peakma,int32_t limitma,uint8_t amps,uint8_t reads);
+  // returns 1 = has been over for timeoutms, resets the timer
+  uint8_t Slow(int32_t avgma,int32_t limitma,uint8_t amps,unsigned long timeoutms,unsigned long ms);
+};
+
+#endif // _AMMETER_SAMPLER_H_
@@ -0,0 +1,74 @@
+/*
+ * 该文件是 Open EVSE 的一部分。
+ *
+ * Open EVSE 是自由软件；你可以在 GNU 通用公共许可证（由自由软件基金会发布）的条款下重新分发和/或修改它；无论是版本 3，还是（你选择的）任何更高版本。
+ *
+ * Open EVSE 被分发的目的是希望它能有用，但不提供任何担保；甚至没有对适销性或特定用途的隐含担保。详见 GNU 通用公共许可证的详细说明。
+ *
+ * 你应该已收到一份 GNU 通用公共许可证副本；与 Open EVSE 一起，查看文件 COPYING。如果没有，请写信给自由软件基金会，地址为：
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA。
+ */
+
+#include "open_evse.h"
+
+#ifdef EVENT_LOG
+EventLog g_EventLog;
+
+void EventLog::Init()
+{
+  m_Seq = 0;
+#ifdef EVENT_LOG_EEPROM
+  m_EeHead = eeprom_read_byte((uint8_t*)EOFS_EVENT_LOG_HEAD);
+  if (m_EeHead >= EVENT_LOG_EE_CNT) m_EeHead = 0;  // 未初始化的 EEPROM
+#endif
+}
+
+// 读取内存中的记录，n = 0 为最新的一条
+uint8_t EventLog::Get(uint8_t n,EVENT_REC *rec)
+{
+  uint8_t rc = 1;
+  uint8_t sreg = SREG;
+  cli();  // 防止读取过程中被中断里的 Log() 覆盖
+  if (n < Count()) {
+    *rec = m_Rec[(m_Seq - 1 - n) & (EVENT_LOG_CNT-1)];
+    rc = 0;
+  }
+  SREG = sreg;
+  return rc;
+}
+
+// 故障类事件：除了内存中的环形缓冲区，再保存一份到 EEPROM，重启后仍然可以读取
+void EventLog::LogFault(uint8_t type,uint8_t a,uint16_t b)
+{
+  Log(type,a,b);
+
+#ifdef EVENT_LOG_EEPROM
+  EVENT_REC rec;
+#ifdef RTC
+  rec.ms = RtcEpoch();  // 重启后 millis() 没有意义，用 RTC 时间
+#else
+  rec.ms = millis();
+#endif // RTC
+  rec.type = type;
+  rec.a = a;
+  rec.b = b;
+  eeprom_write_block(&rec,(void*)(EOFS_EVENT_LOG + m_EeHead * sizeof(EVENT_REC)),sizeof(EVENT_REC));
+  if (++m_EeHead == EVENT_LOG_EE_CNT) m_EeHead = 0;
+  eeprom_write_byte((uint8_t*)EOFS_EVENT_LOG_HEAD,m_EeHead);
+#endif // EVENT_LOG_EEPROM
+}
+
+#ifdef EVENT_LOG_EEPROM
+// 读取 EEPROM 中的故障记录，n = 0 为最新的一条
+uint8_t EventLog::GetSaved(uint8_t n,EVENT_REC *rec)
+{
+  if (n >= EVENT_LOG_EE_CNT) return 1;
+  uint8_t idx = (m_EeHead + EVENT_LOG_EE_CNT - 1 - n) % EVENT_LOG_EE_CNT;
+  eeprom_read_block(rec,(const void*)(EOFS_EVENT_LOG + idx * sizeof(EVENT_REC)),sizeof(EVENT_REC));
+  return (rec->type == 0xff) ? 1 : 0;  // 空记录
+}
+
+#endif // EVENT_LOG_EEPROM
+
+#endif // EVENT_LOG
@@ -0,0 +1,80 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#pragma once
+
+// event types. meaning of a and b for each
+#define EVT_BOOT     0 // a = MCUSR reset cause
+#define EVT_STATE    1 // a = new EVSE state, b = pilot high ADC reading
+#define EVT_RELAY    2 // a = 1 closed, 0 opened
+#define EVT_GFI      3 // a = trip count, b = isr -> relay open us
+#define EVT_NOGND    4 // a = trip count, b = AC pin state
+#define EVT_STUCK    5 // a = trip count, b = AC pin state
+#define EVT_AMPS     6 // a = new current capacity in whole amps, b = old | limiting SP_SRC_xxx << 8
+#define EVT_HB_MISS  7 // a = fallback amps, 0 if asleep, b = HS tier
+#define EVT_RAPI     8 // a = 1st cmd char, b = 2nd cmd char << 8 | 1st arg low byte
+#define EVT_HARDFAULT 9 // a = EVSE state
+#define EVT_PILOT    10 // pilot check failed. a = failed runs in a row, b = measured duty, 0.01%
+
+// fault class events are also kept in EEPROM, with the RTC time in place
+// of millis() if there is an RTC
+typedef struct event_rec {
+  uint32_t ms;
+  uint8_t type;
+  uint8_t a;
+  uint16_t b;
+} EVENT_REC;
+
+class EventLog {
+  EVENT_REC m_Rec[EVENT_LOG_CNT];
+  uint16_t m_Seq; // total events logged, so a reader can tell if it wrapped
+#ifdef EVENT_LOG_EEPROM
+  uint8_t m_EeHead; // next EEPROM slot
+#endif
+public:
+  void Init();
+
+  // cheap enough to call from anywhere, including ISRs
+  void Log(uint8_t type,uint8_t a=0,uint16_t b=0) { LogAt(millis(),type,a,b); }
+  void LogAt(uint32_t ms,uint8_t type,uint8_t a,uint16_t b) {
+    uint8_t sreg = SREG;
+    cli();
+    EVENT_REC *r = &m_Rec[m_Seq & (EVENT_LOG_CNT-1)];
+    r->ms = ms;
+    r->type = type;
+    r->a = a;
+    r->b = b;
+    m_Seq++;
+    SREG = sreg;
+  }
+  // Log() + copy to EEPROM. main loop only
+  void LogFault(uint8_t type,uint8_t a=0,uint16_t b=0);
+
+  uint16_t Seq() { return m_Seq; }
+  uint8_t Count() { return (m_Seq < EVENT_LOG_CNT) ? (uint8_t)m_Seq : EVENT_LOG_CNT; }
+  // n = 0 is the newest. returns 1 if n is out of range
+  uint8_t Get(uint8_t n,EVENT_REC *rec);
+#ifdef EVENT_LOG_EEPROM
+  uint8_t GetSaved(uint8_t n,EVENT_REC *rec);
+#endif
+};
+
+extern EventLog g_EventLog;
@@ -0,0 +1,57 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#ifndef _EVSE_STATES_H_
+#define _EVSE_STATES_H_
+
+#include <stdint.h>
+
+// GroupShare and the host tools in utils/ use these too, so they are kept
+// apart from J1772EvseController.h
+
+// EVSE states for m_EvseState
+#define EVSE_STATE_UNKNOWN 0x00
+#define EVSE_STATE_A       0x01 // vehicle state A 12V - not connected
+#define EVSE_STATE_B       0x02 // vehicle state B 9V - connected, ready
+#define EVSE_STATE_C       0x03 // vehicle state C 6V - charging
+#define EVSE_STATE_D       0x04 // vehicle state D 3V - vent required
+#define EVSE_FAULT_STATE_BEGIN EVSE_STATE_D
+#define EVSE_STATE_DIODE_CHK_FAILED 0x05 // diode check failed
+#define EVSE_STATE_GFCI_FAULT 0x06       // GFCI fault
+#define EVSE_STATE_NO_GROUND 0x07 //bad ground
+#define EVSE_STATE_STUCK_RELAY 0x08 //stuck relay
+#define EVSE_STATE_GFI_TEST_FAILED 0x09 // GFI self-test failure
+#define EVSE_STATE_OVER_TEMPERATURE 0x0A // over temperature error shutdown
+#define EVSE_STATE_OVER_CURRENT 0x0B // over current error shutdown
+#define EVSE_STATE_PILOT_ERROR 0x0C // pilot self test error
+//reserved #define EVSE_STATE_TEMP_SENSOR_FAULT 0x0D // temp sensor dead
+#define EVSE_STATE_RELAY_CLOSURE_FAULT 0x0E
+#define EVSE_FAULT_STATE_END EVSE_STATE_RELAY_CLOSURE_FAULT
+
+#define EVSE_STATE_SLEEPING 0xfe // waiting for timer
+#define EVSE_STATE_DISABLED 0xff // disabled
+
+inline int8_t IsEvseFaultState(uint8_t state) {
+  if ((state >= EVSE_FAULT_STATE_BEGIN) && (state <= EVSE_FAULT_STATE_END)) return 1;
+  else return 0;
+}
+
+#endif // _EVSE_STATES_H_
@@ -50,6 +50,8 @@ void Gfi::Reset()
   WDT_RESET();  // 重置看门狗计时器
 
 #ifdef GFI_SELFTEST  // 如果启用了自检功能
+  if (m_TestStep == GFI_ST_PULSE) pulseStop();
+  m_TestStep = GFI_ST_IDLE;
   testInProgress = 0;  // 清除测试进行标志
   testSuccess = 0;  // 清除测试成功标志
 #endif // GFI_SELFTEST
@@ -60,46 +62,123 @@ void Gfi::Reset()
 
 #ifdef GFI_SELFTEST  // 如果启用了自检功能
 
-// 自检函数
-uint8_t Gfi::SelfTest()
+// 自检脉冲由定时器2产生，主循环不再被delayMicroseconds()阻塞
+// 注意：Arduino的tone()也使用TIMER2_COMPA_vect，不能同时使用
+static Gfi *s_pPulseGfi;
+
+ISR(TIMER2_COMPA_vect)
 {
-  int i;
-  // 等待 GFI 引脚清零
-  for (i = 0; i < 20; i++) {
-    WDT_RESET();  // 重置看门狗计时器
-    if (!pin.read()) break;  // 如果 GFI 引脚为低电平，跳出循环
-    delay(50);  // 延迟 50 毫秒
-  }
-  if (i == 20) return 2;  // 如果超时未清除，则返回错误代码 2
+  s_pPulseGfi->PulseTick();
+}
 
-  testInProgress = 1;  // 设置测试进行标志
-  testSuccess = 0;  // 清除测试成功标志
-  for (int i = 0; !testSuccess && (i < GFI_TEST_CYCLES); i++) {
-    pinTest.write(1);  // 使自检引脚为高电平
-    delayMicroseconds(GFI_PULSE_ON_US);  // 延迟一定时间（高电平时间）
-    pinTest.write(0);  // 使自检引脚为低电平
-    delayMicroseconds(GFI_PULSE_OFF_US);  // 延迟一定时间（低电平时间）
+// 每半个周期调用一次，翻转测试引脚
+void Gfi::PulseTick()
+{
+  if (testSuccess || !m_PulseHalfCycles) {
+    pulseStop();  // 已经跳闸或者脉冲发完
+    return;
   }
+  pinTest.write(!(m_PulseHalfCycles & 1));  // 偶数 = 高电平，奇数 = 低电平
+  m_PulseHalfCycles--;
+}
 
-  // 等待 GFI 引脚清零
-  for (i = 0; i < 40; i++) {
-    WDT_RESET();  // 重置看门狗计时器
-    if (!pin.read()) break;  // 如果 GFI 引脚为低电平，跳出循环
-    delay(50);  // 延迟 50 毫秒
-  }
-  if (i == 40) return 3;  // 如果超时未清除，则返回错误代码 3
+// 启动定时器2：CTC模式，1024分频，每GFI_PULSE_ON_US中断一次
+void Gfi::pulseStart()
+{
+  s_pPulseGfi = this;
+  m_PulseHalfCycles = GFI_TEST_CYCLES * 2;
+  TCCR2A = _BV(WGM21);  // CTC
+  TCCR2B = 0;
+  TCNT2 = 0;
+  OCR2A = GFI_PULSE_OCR2A;
+  TIFR2 = _BV(OCF2A);
+  TIMSK2 = _BV(OCIE2A);
+  TCCR2B = _BV(CS22) | _BV(CS21) | _BV(CS20);  // 1024分频，开始计时
+}
+
+void Gfi::pulseStop()
+{
+  TCCR2B = 0;  // 停止定时器
+  TIMSK2 = 0;
+  pinTest.write(0);
+  m_PulseHalfCycles = 0;
+}
 
-#ifndef OPENEVSE_2  // 如果不是 OPENEVSE 2 版本
-  // 在测试接近闭合继电器之前，偶尔会出现虚假的 GFI 故障。
-  // 等待更多时间让系统稳定下来
-  // 如果电路中有 10uF 电容，延迟是必要的，直到电容放电完成，系统才会稳定
-  wdt_delay(1000);  // 延迟 1000 毫秒
+// 开始自检，之后由SelfTestPoll()推进
+void Gfi::SelfTestStart()
+{
+  testSuccess = 0;
+  m_TestStep = GFI_ST_WAIT_CLEAR;
+  m_TestStepMs = millis();
+}
+
+// 放弃正在进行的自检，例如车辆在自检过程中拔出
+void Gfi::SelfTestAbort()
+{
+  if (m_TestStep == GFI_ST_PULSE) pulseStop();
+  m_TestStep = GFI_ST_IDLE;
+  testInProgress = 0;
+}
+
+// 推进自检状态机，每次调用只检查状态，不等待
+// 返回GFI_SELFTEST_BUSY表示还没完成，否则返回与原来阻塞版本相同的结果
+uint8_t Gfi::SelfTestPoll()
+{
+  unsigned long curms = millis();
+  uint8_t rc = GFI_SELFTEST_BUSY;
+
+  switch (m_TestStep) {
+  case GFI_ST_WAIT_CLEAR:
+    // 等待 GFI 引脚清零，最多1秒
+    if (!pin.read()) {
+      testInProgress = 1;  // 设置测试进行标志
+      testSuccess = 0;
+      pulseStart();
+      m_TestStep = GFI_ST_PULSE;
+    }
+    else if ((curms - m_TestStepMs) >= 1000) rc = 2;  // 超时未清除
+    break;
+
+  case GFI_ST_PULSE:
+    // 定时器2在跳闸后或者发完GFI_TEST_CYCLES个周期后自己停止
+    if (!(TIMSK2 & _BV(OCIE2A))) {
+      m_TestStep = GFI_ST_WAIT_CLEAR2;
+      m_TestStepMs = curms;
+    }
+    break;
+
+  case GFI_ST_WAIT_CLEAR2:
+    // 等待 GFI 引脚清零，最多2秒
+    if (!pin.read()) {
+#ifdef OPENEVSE_2
+      rc = !testSuccess;
+#else
+      m_TestStep = GFI_ST_SETTLE;
+      m_TestStepMs = curms;
+#endif
+    }
+    else if ((curms - m_TestStepMs) >= 2000) rc = 3;  // 超时未清除
+    break;
+
+#ifndef OPENEVSE_2
+  case GFI_ST_SETTLE:
+    // 在测试接近闭合继电器之前，偶尔会出现虚假的 GFI 故障。
+    // 等待更多时间让系统稳定下来
+    // 如果电路中有 10uF 电容，延迟是必要的，直到电容放电完成，系统才会稳定
+    if ((curms - m_TestStepMs) >= 1000) rc = !testSuccess;
+    break;
 #endif // OPENEVSE_2
 
-  m_GfiFault = 0;  // 清除漏电保护故障标志
-  testInProgress = 0;  // 清除测试进行标志
+  default:
+    rc = 1;  // 没有启动
+  }
 
-  return !testSuccess;  // 返回测试是否成功（如果成功返回 0，否则返回 1）
+  if (rc != GFI_SELFTEST_BUSY) {
+    if (rc == 0) m_GfiFault = 0;  // 清除漏电保护故障标志
+    m_TestStep = GFI_ST_IDLE;
+    testInProgress = 0;  // 清除测试进行标志
+  }
+  return rc;
 }
 
 #endif // GFI_SELFTEST  // 结束自检功能的条件编译
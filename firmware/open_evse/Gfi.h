@@ -22,12 +22,30 @@
  */
 #pragma once
 
+#ifdef GFI_SELFTEST
+// self test steps
+#define GFI_ST_IDLE        0
+#define GFI_ST_WAIT_CLEAR  1 // wait for GFI pin to clear before pulsing
+#define GFI_ST_PULSE       2 // timer 2 ISR is pulsing the test pin
+#define GFI_ST_WAIT_CLEAR2 3 // wait for GFI pin to clear after pulsing
+#define GFI_ST_SETTLE      4 // let the circuit settle before closing the relay
+
+// SelfTestPoll() return value while the test is still running
+#define GFI_SELFTEST_BUSY 0xff
+#endif // GFI_SELFTEST
+
 class Gfi {
   DigitalPin pin;
   uint8_t m_GfiFault;
 #ifdef GFI_SELFTEST
-  uint8_t testSuccess;
-  uint8_t testInProgress;
+  volatile uint8_t testSuccess;
+  volatile uint8_t testInProgress;
+  volatile uint8_t m_PulseHalfCycles; // half cycles left to pulse, counted down by the ISR
+  uint8_t m_TestStep; // GFI_ST_xxx
+  unsigned long m_TestStepMs;
+
+  void pulseStart();
+  void pulseStop();
 #endif // GFI_SELFTEST
 public:
 #ifdef GFI_SELFTEST
@@ -41,9 +59,16 @@ public:
   void SetFault() { m_GfiFault = 1; }
   uint8_t Fault() { return m_GfiFault; }
 #ifdef GFI_SELFTEST
-  uint8_t SelfTest();
+  // non-blocking self test. call SelfTestStart() once, then SelfTestPoll()
+  // from the main loop until it returns something other than GFI_SELFTEST_BUSY
+  // 0 = pass, 1 = no trip seen, 2 = pin stuck before test, 3 = pin stuck after test
+  void SelfTestStart();
+  uint8_t SelfTestPoll();
+  void SelfTestAbort();
+  uint8_t SelfTestRunning() { return (m_TestStep != GFI_ST_IDLE) ? 1 : 0; }
   void SetTestSuccess() { testSuccess = 1; }
   uint8_t SelfTestSuccess() { return testSuccess; }
   uint8_t SelfTestInProgress() { return testInProgress; }
+  void PulseTick(); // timer 2 ISR only
 #endif
 };
@@ -0,0 +1,211 @@
+/*
+ * 该文件是 Open EVSE 的一部分。
+ *
+ * Open EVSE 是自由软件；你可以在 GNU 通用公共许可证（由自由软件基金会发布）的条款下重新分发和/或修改它；无论是版本 3，还是（你选择的）任何更高版本。
+ *
+ * Open EVSE 被分发的目的是希望它能有用，但不提供任何担保；甚至没有对适销性或特定用途的隐含担保。详见 GNU 通用公共许可证的详细说明。
+ *
+ * 你应该已收到一份 GNU 通用公共许可证副本；与 Open EVSE 一起，查看文件 COPYING。如果没有，请写信给自由软件基金会，地址为：
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA。
+ */
+
+#include "GroupShare.h"
+#include "EvseStates.h"
+
+void GroupMember::Init(uint8_t groupamps,uint8_t fallbackamps,unsigned long ms)
+{
+  m_GroupAmps = groupamps;
+  m_FallbackAmps = fallbackamps;
+  m_AllocMs = ms;
+  // 协调器还没有分配之前按后备电流运行
+  m_Alloc = (fallbackamps >= GS_MIN_AMPS) ? fallbackamps : 0;
+  m_Flags = groupamps ? (GSF_JOINED|GSF_FALLBACK) : 0;
+}
+
+uint8_t GroupMember::Allocate(uint8_t amps,unsigned long ms)
+{
+  if (!m_GroupAmps) return 0;
+
+  if (amps < GS_MIN_AMPS) amps = 0;  // 低于 J1772 最小电流只能暂停
+  else if (amps > m_GroupAmps) amps = m_GroupAmps;
+
+  m_AllocMs = ms;
+  m_Flags &= ~GSF_FALLBACK;
+  if (amps == m_Alloc) return 0;
+  m_Alloc = amps;
+  return 1;
+}
+
+uint8_t GroupMember::Poll(unsigned long ms)
+{
+  if (!m_GroupAmps || (m_Flags & GSF_FALLBACK)) return 0;
+  if ((ms - m_AllocMs) < GS_TIMEOUT_MS) return 0;
+
+  // 协调器失联：只降不升，取当前分配和后备电流中较小的一个
+  // 这样所有成员加起来不会超过协调器最后一次的分配，也不会超过后备电流之和
+  m_Flags |= GSF_FALLBACK;
+  uint8_t amps = (m_FallbackAmps < m_Alloc) ? m_FallbackAmps : m_Alloc;
+  if (amps < GS_MIN_AMPS) amps = 0;
+  if (amps == m_Alloc) return 0;
+  m_Alloc = amps;
+  return 1;
+}
+
+void GroupAllocator::InitUnit(GS_UNIT *u)
+{
+  u->online = 0;
+  u->state = 0;
+  u->flags = 0;
+  u->maxAmps = 0;
+  u->alloc = u->fallbackAmps;  // 成员启动时按后备电流运行
+  u->chargingDa = 0;
+  u->capAmps = 0;
+  u->target = u->alloc;
+  u->send = GS_NO_SEND;
+  u->stale = 1;
+  u->prevAlloc = u->alloc;
+  u->prevState = 0;
+  u->lastSeenMs = 0;
+  u->changeMs = 0;
+}
+
+// 0 = 长时间离线, 1 = 正在充电, 2 = 车辆已连接等待充电, 3 = 空闲
+// 短暂没有应答的成员按最后一次的状态计算
+static uint8_t gsPriority(GS_UNIT *u)
+{
+  if (u->stale) return 0;
+  if (u->state == EVSE_STATE_C) return 1;
+  if (u->state == EVSE_STATE_B) return 2;
+  // 因分配为 0 而暂停、但车辆仍然连接着
+  if ((u->state == EVSE_STATE_SLEEPING) && ((u->flags & (GSF_PAUSED|GSF_EV_CONNECTED)) == (GSF_PAUSED|GSF_EV_CONNECTED))) return 2;
+  return 3;
+}
+
+void GroupAllocator::allocate(GS_UNIT *u,uint8_t cnt,uint8_t groupamps)
+{
+  int avail = groupamps;
+  uint8_t i,prio;
+
+  // 长时间离线的成员可能重启过，按原来的分配或后备电流在充电，两者取大的预留
+  for (i=0;i < cnt;i++) {
+    if (u[i].stale) {
+      u[i].target = (u[i].alloc > u[i].fallbackAmps) ? u[i].alloc : u[i].fallbackAmps;
+      avail -= u[i].target;
+    }
+  }
+
+  // 按优先级先给每个在线成员最小电流：正在充电的不中断，空闲的预留最小电流
+  // 以便插枪后马上可以开始充电。不够分的暂停
+  for (prio=1;prio <= 3;prio++) {
+    for (i=0;i < cnt;i++) {
+      if (gsPriority(&u[i]) != prio) continue;
+      if (avail >= GS_MIN_AMPS) {
+        u[i].target = GS_MIN_AMPS;
+        avail -= GS_MIN_AMPS;
+      }
+      else {
+        u[i].target = 0;
+      }
+    }
+  }
+
+  // 剩下的在需要充电的成员之间平均分配，不超过各自的需求
+  while (avail > 0) {
+    uint8_t n = 0;
+    for (i=0;i < cnt;i++) {
+      prio = gsPriority(&u[i]);
+      if ((prio == 1 || prio == 2) && u[i].target) {
+        uint8_t demand = u[i].maxAmps ? u[i].maxAmps : groupamps;
+        if (u[i].capAmps && (u[i].capAmps < demand)) demand = u[i].capAmps;
+        if (u[i].target < demand) n++;
+      }
+    }
+    if (!n) break;
+
+    int share = avail / n;
+    if (!share) share = 1;
+    for (i=0;(i < cnt) && (avail > 0);i++) {
+      prio = gsPriority(&u[i]);
+      if ((prio == 1 || prio == 2) && u[i].target) {
+        uint8_t demand = u[i].maxAmps ? u[i].maxAmps : groupamps;
+        if (u[i].capAmps && (u[i].capAmps < demand)) demand = u[i].capAmps;
+        int add = demand - u[i].target;
+        if (add > share) add = share;
+        if (add > avail) add = avail;
+        if (add > 0) {
+          u[i].target += add;
+          avail -= add;
+        }
+      }
+    }
+  }
+}
+
+void GroupAllocator::Plan(GS_UNIT *u,uint8_t cnt,uint8_t groupamps,unsigned long ms)
+{
+  uint8_t i;
+
+  // 车辆用不完分配的电流时，把需求限制在实测电流加一点余量，多出来的分给别人
+  // 分配或状态变化后要等车辆调整好 (GS_SETTLE_MS) 再判断
+  for (i=0;i < cnt;i++) {
+    GS_UNIT *p = &u[i];
+    if (!p->online) {
+      if ((ms - p->lastSeenMs) >= GS_STALE_MS) p->stale = 1;
+      continue;
+    }
+    p->stale = 0;
+    p->lastSeenMs = ms;
+    if ((p->alloc != p->prevAlloc) || (p->state != p->prevState)) {
+      p->prevAlloc = p->alloc;
+      p->prevState = p->state;
+      p->changeMs = ms;
+    }
+    if (p->state != EVSE_STATE_C) {
+      p->capAmps = 0;
+    }
+    else if ((ms - p->changeMs) >= GS_SETTLE_MS) {
+      uint8_t cap = (uint8_t)((p->chargingDa + 9) / 10) + GS_HEADROOM_AMPS;
+      if (cap < GS_MIN_AMPS) cap = GS_MIN_AMPS;
+      // 实测电流接近分配值时说明车辆还想要更多，取消限制
+      p->capAmps = (cap <= p->alloc) ? cap : 0;
+    }
+  }
+
+  allocate(u,cnt,groupamps);
+
+  // 减少的马上发出；增加的要等所有减少都已生效、电流已经降下来
+  // 没有应答的成员还没减下来的，同样要等
+  // 每轮都给成员发一次当前分配，防止它们超时进入后备电流。这一轮没有应答的
+  // 也发，只是不会给它增加
+  uint8_t reducing = 0;
+  uint8_t settled = 1;
+  for (i=0;i < cnt;i++) {
+    GS_UNIT *p = &u[i];
+    p->send = GS_NO_SEND;
+    if (p->alloc > p->target) reducing = 1;
+    if (p->stale) continue;
+    p->send = (p->alloc > p->target) ? p->target : p->alloc;
+    if (p->chargingDa > (uint16_t)p->alloc * 10 + GS_DRAW_TOL_DA) {
+      settled = 0;
+    }
+  }
+
+  if (reducing) {
+    m_ReduceMs = ms;
+    m_Holding = 1;
+  }
+  else if (m_Holding && (settled || ((ms - m_ReduceMs) >= GS_SETTLE_MS))) {
+    m_Holding = 0;
+  }
+
+  if (!m_Holding) {
+    for (i=0;i < cnt;i++) {
+      if (u[i].online && (u[i].alloc < u[i].target)) {
+        // 回复可能丢失，发出去就当作已经生效
+        u[i].send = u[i].target;
+        u[i].alloc = u[i].target;
+      }
+    }
+  }
+}
@@ -0,0 +1,129 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#ifndef _GROUP_SHARE_H_
+#define _GROUP_SHARE_H_
+
+#include <stdint.h>
+
+// Several EVSEs sharing one supply circuit.
+// A coordinator polls each member with RAPI GB, works out how to split the
+// circuit with GroupAllocator, and hands out allocations with RAPI SG.
+// Each member runs a GroupMember, which caps its pilot at the allocation
+// and drops to the lower of that and a preconfigured fallback if the
+// coordinator goes quiet.
+// utils/group_coord runs the coordinator side of this on a PC
+
+#define GS_MIN_AMPS 6 // J1772 minimum, below this a unit is paused
+// member falls back if it hears nothing for this long
+#define GS_TIMEOUT_MS 30000UL
+// J1772 gives the EV 5s to follow a lower pilot
+#define GS_SETTLE_MS 6000UL
+// allocation above measured current for an EV that isn't using all of it
+#define GS_HEADROOM_AMPS 2
+// measured current this far over the allocation still counts as settled
+#define GS_DRAW_TOL_DA 5
+// coordinator keeps using a member's last status for this long after it
+// stops answering, then reserves the higher of its allocation and fallback
+// in case it has rebooted onto the fallback
+#define GS_STALE_MS 30000UL
+
+// GB status flags
+#define GSF_JOINED       0x01
+#define GSF_FALLBACK     0x02 // coordinator timed out, running on fallback amps
+#define GSF_PAUSED       0x04 // sleeping because the allocation is 0
+#define GSF_EV_CONNECTED 0x08
+
+// EOFS_DUO_NVFLAGS bits
+#define GS_NVF_JOINED    0x01
+
+class GroupMember {
+  unsigned long m_AllocMs; // when the last allocation arrived
+  uint8_t m_GroupAmps;     // capacity of the shared circuit, 0 = not in a group
+  uint8_t m_FallbackAmps;
+  uint8_t m_Alloc;         // allocation in force, 0 = paused
+  uint8_t m_Flags;         // GSF_xxx
+public:
+  GroupMember() { Init(0,0,0); }
+  // starts out on the fallback until the coordinator speaks
+  void Init(uint8_t groupamps,uint8_t fallbackamps,unsigned long ms);
+  uint8_t Joined() { return m_GroupAmps ? 1 : 0; }
+  uint8_t GroupAmps() { return m_GroupAmps; }
+  uint8_t FallbackAmps() { return m_FallbackAmps; }
+  uint8_t Alloc() { return m_Alloc; }
+  uint8_t Flags() { return m_Flags; }
+  // ceiling on the pilot, 0 = paused, 0xff = not in a group
+  uint8_t Limit() { return m_GroupAmps ? m_Alloc : 0xff; }
+  uint8_t Paused() { return (m_GroupAmps && !m_Alloc) ? 1 : 0; }
+  void SetPaused(uint8_t tf) {
+    if (tf) m_Flags |= GSF_PAUSED;
+    else m_Flags &= ~GSF_PAUSED;
+  }
+
+  // allocation from the coordinator, 0 = pause
+  // returns 1 if Limit() changed
+  uint8_t Allocate(uint8_t amps,unsigned long ms);
+  // call every loop. returns 1 if Limit() changed
+  uint8_t Poll(unsigned long ms);
+};
+
+// coordinator side view of one member
+typedef struct gs_unit {
+  // from the member's GJ/GB responses
+  uint8_t online;       // answered GB this round
+  uint8_t state;        // EVSE_STATE_xxx
+  uint8_t flags;        // GSF_xxx
+  uint8_t maxAmps;      // member's own current capacity setting
+  uint8_t fallbackAmps;
+  uint8_t alloc;        // allocation the member is running on
+  uint16_t chargingDa;  // measured current, 0.1A
+  // maintained by GroupAllocator
+  uint8_t capAmps;      // demand limit of an EV not using its allocation, 0 = none
+  uint8_t target;       // allocation we're heading for
+  uint8_t send;         // allocation to send this round, GS_NO_SEND = none
+  uint8_t stale;        // not heard from for GS_STALE_MS
+  uint8_t prevAlloc;
+  uint8_t prevState;
+  unsigned long lastSeenMs;
+  unsigned long changeMs; // when alloc or state last changed
+} GS_UNIT;
+
+#define GS_NO_SEND 0xff
+
+class GroupAllocator {
+  unsigned long m_ReduceMs; // when we last had to reduce someone
+  uint8_t m_Holding;        // holding back increases until reductions take effect
+  void allocate(GS_UNIT *u,uint8_t cnt,uint8_t groupamps);
+public:
+  GroupAllocator() { m_ReduceMs = 0; m_Holding = 0; }
+  // set u->fallbackAmps first
+  void InitUnit(GS_UNIT *u);
+  // call after refreshing each unit's status. sets u[].send, which is the
+  // current allocation as a keepalive if nothing changes.
+  // reductions go out at once. increases wait until every reduced member
+  // reports the lower allocation and its current has dropped, so the
+  // circuit is never committed past groupamps. an increase is assumed to
+  // have taken effect as soon as it's sent, in case the reply is lost
+  void Plan(GS_UNIT *u,uint8_t cnt,uint8_t groupamps,unsigned long ms);
+  uint8_t Holding() { return m_Holding; }
+};
+
+#endif // _GROUP_SHARE_H_
@@ -19,6 +19,7 @@
  * Boston, MA 02111-1307, USA.
  */
 #include "open_evse.h"
+#include <util/atomic.h>
 
 #ifdef FT_ENDURANCE
 int g_CycleCnt = -1;
@@ -27,34 +28,11 @@ uint8_t g_CycleState;
 #endif
 
 //                                               A/B B/C C/D D DS
-THRESH_DATA J1772EVSEController::m_ThreshData = {875,780,690,0,260};
+THRESH_DATA J1772EVSEController::m_ThreshData = {THRESH_AB_DEFAULT,THRESH_BC_DEFAULT,THRESH_CD_DEFAULT,THRESH_D_DEFAULT,THRESH_DS_DEFAULT};
 
 J1772EVSEController g_EvseController;
 
 #ifdef AMMETER
-static inline unsigned long ulong_sqrt(unsigned long in)
-{
-  unsigned long out = 0;
-  unsigned long bit = 0x40000000ul;
-
-  // "bit" starts at the highest power of four <= the argument.
-  while (bit > in)
-    bit >>= 2;
-
-  while (bit) {
-    unsigned long sum = out + bit;
-    if (in >= sum) {
-      in -= sum;
-      out = (out >> 1) + bit;
-    }
-    else
-      out >>= 1;
-    bit >>= 2;
-  }
-
-  return out;
-}
-
 /**
 读取电流信号并计算电流的有效值（RMS, Root Mean Square），用于监测和测量电流的大小。
 
@@ -91,54 +69,39 @@ void J1772EVSEController::readAmmeter()
 {
   WDT_RESET(); // 重置看门狗计时器，防止系统重启
 
-  unsigned long sum = 0; // 存储样本平方和
-  uint8_t zero_crossings = 0; // 记录零交叉点的数量
-  unsigned long last_zero_crossing_time = 0, now_ms; // 上次零交叉的时间和当前时间（毫秒）
-  uint8_t is_first_sample = 1; // 标记是否为第一次采样
-  uint16_t last_sample; // 上次采样的值
-  unsigned int sample_count = 0; // 记录采样次数
+  AmmeterSampler as; // 零交叉检测和有效值计算见 AmmeterSampler.cpp
+  unsigned long now_ms;
 
   // 循环采样，直到达到了设定的采样间隔
   for(unsigned long start = millis(); ((now_ms = millis()) - start) < CURRENT_SAMPLE_INTERVAL; ) {
-    uint16_t sample = adcCurrent.read(); // 从模拟输入读取电流样本，范围是0到1023
-
-    // 如果这不是第一次采样，并且当前值与上一个值的符号不同，则计为零交叉
-    if (!is_first_sample && ((last_sample > 512) != (sample > 512))) {
-      // 一旦检测到零交叉，避免由于噪声造成的误判断，设置去抖动时间
-      if ((now_ms - last_zero_crossing_time) > CURRENT_ZERO_DEBOUNCE_INTERVAL) {
-        zero_crossings++; // 记录零交叉
-        last_zero_crossing_time = now_ms; // 更新零交叉时间
-      }
-    }
-
-    is_first_sample = 0; // 标记已经完成第一次采样
-    last_sample = sample; // 更新上次采样值
-
-    // 根据零交叉次数选择操作
-    switch(zero_crossings) {
-    case 0:
-      continue; // 还没有检测到零交叉，继续等待
-    case 1:
-    case 2:
-      // 在零交叉后，累加每个采样的平方（用于计算有效值）
-      sum += (unsigned long)(((long)sample - 512) * ((long)sample - 512));
-      sample_count++; // 增加采样次数
-      continue;
-    case 3:
-      // 如果已经采集了三个零交叉点，则计算有效值（RMS）
-      m_AmmeterReading = ulong_sqrt(sum / sample_count); // 计算平方和的均值，然后取平方根
+    // 从模拟输入读取电流样本，范围是0到1023
+    if (as.Sample(adcCurrent.read(),now_ms)) {
+      // 已经采集了三个零交叉点，计算有效值（RMS）
+      m_AmmeterReading = as.Rms();
+      m_AmmeterPeak = as.Peak();
       return; // 返回电流值
     }
   }
 
   // 如果在设定的时间内没有检测到有效数据，假设没有发生振荡，电流为0
   m_AmmeterReading = 0;
+  m_AmmeterPeak = 0;
 
   WDT_RESET(); // 最后再一次重置看门狗计时器
 }
 
-#define MA_PTS 32 // # points in moving average MUST BE power of 2
-#define MA_BITS 5 // log2(MA_PTS)
+void J1772EVSEController::AmmeterBurst(uint8_t cnt,uint32_t *sum,uint32_t *sumsq)
+{
+  *sum = 0;
+  *sumsq = 0;
+  // 每次 readAmmeter() 都会重置看门狗，最多阻塞 cnt*CURRENT_SAMPLE_INTERVAL
+  while (cnt--) {
+    readAmmeter();
+    *sum += m_AmmeterReading;
+    *sumsq += m_AmmeterReading * m_AmmeterReading;
+  }
+}
+
 /*
 uint32_t MovingAverage(uint32_t samp)
 {
@@ -208,6 +171,7 @@ void J1772EVSEController::SaveSettings()
 
   // 写入最大电流容量
   eeprom_write_byte(dest, GetMaxCurrentCapacity());
+  m_SavedCapacity = 0;
 
   // 保存标志位
   SaveEvseFlags();
@@ -333,6 +297,9 @@ void J1772EVSEController::chargingOn()
 #endif
 
   setVFlags(ECVF_CHARGING_ON); // 设置充电标志位
+#ifdef EVENT_LOG
+  g_EventLog.Log(EVT_RELAY,1);
+#endif // EVENT_LOG
 
   // 如果上次会话已经结束，重置累计时间；否则累加
   if (vFlagIsSet(ECVF_SESSION_ENDED)) {
@@ -346,8 +313,44 @@ void J1772EVSEController::chargingOn()
   m_ChargeOnTimeMS = millis(); // 记录充电开始时间
 }
 
-// 关闭充电
-void J1772EVSEController::chargingOff()
+// 进入 STATE C 后闭合继电器（GFI 自测已经通过），并记录启动延迟
+void J1772EVSEController::chargingStart()
+{
+#ifdef FT_GFI_LOCKOUT
+  for(int i = 0; i < GFI_TEST_CYCLES; i++) {
+    m_Gfi.pinTest.write(1);  // 激活 GFI 引脚
+    delayMicroseconds(GFI_PULSE_ON_US);  // 延迟
+    m_Gfi.pinTest.write(0);  // 关闭 GFI 引脚
+    delayMicroseconds(GFI_PULSE_OFF_US);  // 延迟
+    if (m_Gfi.Fault()) break;  // 检查故障
+  }
+  g_OBD.LcdMsg("Closing", "Relay");  // LCD 显示关断继电器
+  delay(150);  // 延迟
+#endif // FT_GFI_LOCKOUT
+
+  chargingOn(); // 启动充电电流
+
+  unsigned long startms = m_ChargeOnTimeMS - m_ChargeReqMs;
+  m_ChargeStartMs = (startms > 0xffff) ? 0xffff : (uint16_t)startms;
+}
+
+// 进入故障状态：先设置 P12 让 EV 停止充电，waitms 后再断开继电器并进入硬故障
+// 等待在后面的 Update() 中处理，不阻塞主循环
+void J1772EVSEController::shutdownStart(uint8_t evsestate,uint16_t waitms)
+{
+#ifdef EVENT_LOG
+  if (m_EvseState != evsestate) g_EventLog.Log(EVT_STATE,evsestate);
+#endif // EVENT_LOG
+  m_EvseState = evsestate;
+  m_Pilot.SetState(PILOT_STATE_P12);  // 暂停 EV
+  m_ShutdownState = evsestate;
+  m_ShutdownWaitMs = waitms;
+  m_ShutdownStartMs = millis();
+}
+
+// 只驱动继电器引脚断开，不做其他处理
+// 在GFI中断里直接调用，所以必须短小、执行时间固定
+void J1772EVSEController::relayOpen()
 {
 #ifdef OEV6
   if (isV6()) {
@@ -371,7 +374,16 @@ void J1772EVSEController::chargingOff()
 #ifdef CHARGINGAC_REG
   pinChargingAC.write(0);
 #endif
+}
 
+// 关闭充电
+void J1772EVSEController::chargingOff()
+{
+  relayOpen(); // 断开继电器
+
+#ifdef EVENT_LOG
+  if (chargingIsOn()) g_EventLog.Log(EVT_RELAY,0); // 也会在GFI中断里调用
+#endif // EVENT_LOG
   clrVFlags(ECVF_CHARGING_ON); // 清除充电标志
 
   m_ChargeOffTimeMS = millis(); // 记录断电时间
@@ -385,6 +397,9 @@ void J1772EVSEController::chargingOff()
 void J1772EVSEController::HardFault(int8_t recoverable)
 {
   SetHardFault(); // 设置故障状态
+#ifdef EVENT_LOG
+  g_EventLog.LogFault(EVT_HARDFAULT,m_EvseState);
+#endif // EVENT_LOG
   g_OBD.Update(OBD_UPD_HARDFAULT); // 更新显示
 
 #ifdef RAPI
@@ -408,23 +423,46 @@ void J1772EVSEController::HardFault(int8_t recoverable)
 
 #ifdef GFI
 // 设置 GFI（漏电）触发状态
+// 在中断里调用
 void J1772EVSEController::SetGfiTripped()
 {
+  unsigned long tripus = micros(); // 进入中断的时间
 #ifdef GFI_SELFTEST
   if (m_Gfi.SelfTestInProgress()) {
     m_Gfi.SetTestSuccess(); // 自检成功
     return;
   }
 #endif
+  relayOpen();                 // 快速路径：先直接断开继电器，不等Update()
+
+  // 记录从进入中断到继电器引脚断开的时间
+  uint16_t openus = (uint16_t)(micros() - tripus);
+  m_GfiOpenUs = openus;
+  if (openus > m_GfiOpenUsMax) m_GfiOpenUsMax = openus;
+  m_GfiTripMs = millis();
+  m_GfiLatched = 1;
+
   setVFlags(ECVF_GFI_TRIPPED); // 设置 GFI 触发标志
 
-  chargingOff();               // 立即关闭充电
+  chargingOff();               // 其余的关闭充电处理
   m_Pilot.SetState(PILOT_STATE_P12); // 切换 PWM 为 P12，通知 EV 停止
 
   m_Gfi.SetFault();            // 设置故障
 
   // 后续将在 Update 中处理
 }
+
+// 读取 GFI 响应时间记录。前两项由 gfi_isr() 写入，多字节的值要关中断一次读完，
+// 后两项也在同一个块里读，这样四个值属于同一次记录
+void J1772EVSEController::GetGfiLatency(uint16_t *openus,uint16_t *openusmax,uint16_t *handledms,uint16_t *handledmsmax)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    *openus = m_GfiOpenUs;
+    *openusmax = m_GfiOpenUsMax;
+    *handledms = m_GfiHandledMs;
+    *handledmsmax = m_GfiHandledMsMax;
+  }
+}
 #endif // GFI
 
 // 启用或禁用二极管检查
@@ -600,6 +638,9 @@ void J1772EVSEController::Disable()
     m_Pilot.SetState(PILOT_STATE_N12);
     // 设置EVSE状态为禁用
     m_EvseState = EVSE_STATE_DISABLED;
+#ifdef EVENT_LOG
+    g_EventLog.Log(EVT_STATE,EVSE_STATE_DISABLED);
+#endif // EVENT_LOG
     // 强制断开充电，不等待EV响应
     chargingOff();
 #ifdef MENNEKES_LOCK
@@ -622,6 +663,9 @@ void J1772EVSEController::Sleep()
     m_Pilot.SetState(PILOT_STATE_P12);
     // 设置EVSE状态为睡眠
     m_EvseState = EVSE_STATE_SLEEPING;
+#ifdef EVENT_LOG
+    g_EventLog.Log(EVT_STATE,EVSE_STATE_SLEEPING);
+#endif // EVENT_LOG
 #ifdef SLEEP_STATUS_REG
     // 打开睡眠状态引脚
     pinSleepStatus.write(1);
@@ -659,10 +703,11 @@ void J1772EVSEController::SetSvcLevel(uint8_t svclvl,uint8_t updatelcd)
 
   SaveEvseFlags(); // 保存服务等级状态
 
-  uint8_t ampacity = GetMaxCurrentCapacity(); // 获取最大电流容量
-
-  // 设置当前电流容量
-  SetCurrentCapacity(ampacity,0,1);
+  // 换到新等级的用户设置，临时设置作废
+  m_SavedCapacity = 0;
+  m_Setpoint.Post(SP_SRC_USER,GetMaxCurrentCapacity() * 10);
+  m_Setpoint.Clear(SP_SRC_TEMP);
+  setpointApply(0);
 
   if (updatelcd) {
     g_OBD.Update(OBD_UPD_FORCE); // 更新LCD显示
@@ -673,13 +718,18 @@ void J1772EVSEController::SetSvcLevel(uint8_t svclvl,uint8_t updatelcd)
 uint8_t J1772EVSEController::GetMaxCurrentCapacity()
 {
   uint8_t svclvl = GetCurSvcLevel(); // 当前服务等级
-  // 从EEPROM读取电流容量设置
-  uint8_t ampacity =  eeprom_read_byte((uint8_t*)((svclvl == 1) ? EOFS_CURRENT_CAPACITY_L1 : EOFS_CURRENT_CAPACITY_L2));
-
-  // 如果读取失败或为0，则使用默认值
-  if ((ampacity == 0xff) || (ampacity == 0)) {
-    ampacity = (svclvl == 1) ? DEFAULT_CURRENT_CAPACITY_L1 : DEFAULT_CURRENT_CAPACITY_L2;
+  // 每次 Update() 都要用，EEPROM 里的设置只在换等级或写入后重新读
+  if (!m_SavedCapacity) {
+    // 从EEPROM读取电流容量设置
+    uint8_t amps = eeprom_read_byte((uint8_t*)((svclvl == 1) ? EOFS_CURRENT_CAPACITY_L1 : EOFS_CURRENT_CAPACITY_L2));
+
+    // 如果读取失败或为0，则使用默认值
+    if ((amps == 0xff) || (amps == 0)) {
+      amps = (svclvl == 1) ? DEFAULT_CURRENT_CAPACITY_L1 : DEFAULT_CURRENT_CAPACITY_L2;
+    }
+    m_SavedCapacity = amps;
   }
+  uint8_t ampacity = m_SavedCapacity;
 
 #ifdef PP_AUTO_AMPACITY
   // 如果车辆连接，自动检测PP引脚允许的最大电流
@@ -736,10 +786,43 @@ void J1772EVSEController::Init()
   // 初始化 EVSE 状态
   m_EvseState = EVSE_STATE_UNKNOWN;
   m_PrevEvseState = EVSE_STATE_UNKNOWN;
+  // 没有待处理的延时关断
+  m_ShutdownState = 0;
+  m_ShutdownWaitMs = 0;
+  m_ShutdownStartMs = 0;
+#ifdef PAFC_PWM
+  m_PlateauHigh = 1023;
+  m_PlateauLow = 1023;
+#endif // PAFC_PWM
 
   // 从 EEPROM 读取设定标志位
   uint16_t rflgs = eeprom_read_word((uint16_t*)EOFS_FLAGS);
 
+  m_Setpoint.Init(MIN_CURRENT_CAPACITY_J1772 * 10,SETPOINT_STEP_AMPS * 10,SETPOINT_DWELL_MS);
+
+#ifdef GROUP_SHARE
+  // 共享线路设置，要在第一次 SetCurrentCapacity() 之前读取
+  uint8_t gsflags = eeprom_read_byte((uint8_t*)EOFS_DUO_NVFLAGS);
+  if ((gsflags != 0xff) && (gsflags & GS_NVF_JOINED)) {
+    m_Group.Init(eeprom_read_byte((uint8_t*)EOFS_GROUP_CURRENT_CAPACITY),
+                 eeprom_read_byte((uint8_t*)EOFS_DUO_SHARED_AMPS),millis());
+  }
+  m_Setpoint.Post(SP_SRC_GROUP,SpAmpsToDa(m_Group.Limit()));
+#endif // GROUP_SHARE
+
+#ifdef PV_SURPLUS
+  uint8_t pvflags = eeprom_read_byte((uint8_t*)EOFS_PV_NVFLAGS);
+  if ((pvflags != 0xff) && (pvflags & PV_NVF_ENABLED)) {
+    m_Pv.Init(1,(int16_t)eeprom_read_word((uint16_t*)EOFS_PV_EXPORT_W),
+              eeprom_read_word((uint16_t*)EOFS_PV_HOLD_SEC));
+  }
+  m_Setpoint.Post(SP_SRC_PV,m_Pv.LimitDa());
+#endif // PV_SURPLUS
+
+#ifdef AUTO_PAUSE
+  m_AutoPaused = 0;
+#endif
+
 #ifdef RGBLCD
   // 根据 EEPROM 设定设置 LCD 背光类型
   if ((rflgs != 0xffff) && (rflgs & ECF_MONO_LCD)) {
@@ -802,6 +885,12 @@ void J1772EVSEController::Init()
 #endif
 
 #ifdef GFI
+  // 在挂上GFI中断之前清零
+  m_GfiLatched = 0;
+  m_GfiOpenUs = 0;
+  m_GfiOpenUsMax = 0;
+  m_GfiHandledMs = 0;
+  m_GfiHandledMsMax = 0;
 #ifdef OEV6
   // 初始化 GFI 模块，判断是否为 V6
   m_Gfi.Init(isV6());
@@ -870,6 +959,7 @@ void J1772EVSEController::Init()
   }
 
   m_AmmeterReading = 0;
+  m_AmmeterPeak = 0;
   m_ChargingCurrent = 0;
 #endif
 
@@ -958,6 +1048,10 @@ void J1772EVSEController::Init()
             m_EvseState == EVSE_STATE_STUCK_RELAY));
 #endif
 
+#ifdef THRESH_CAL
+  threshCal();
+#endif // THRESH_CAL
+
   SetSvcLevel(svclvl);
 
 #ifdef DELAYTIMER
@@ -980,6 +1074,14 @@ void J1772EVSEController::Init()
     m_HsInterval = HS_INTERVAL_DEFAULT;
     m_IFallback = HS_IFALLBACK_DEFAULT;
   }
+  // 逐级降电流的设置，未初始化的 EEPROM 为 0xff 时不启用
+  uint8_t u8 = eeprom_read_byte((uint8_t*)EOFS_HS_TIER2_SEC);
+  m_HsTier2Sec = (u8 == 0xff) ? 0 : u8 * HS_TIER_SEC;
+  u8 = eeprom_read_byte((uint8_t*)EOFS_HS_TIER2_AMPS);
+  m_HsTier2Amps = (u8 == 0xff) ? 0 : u8;
+  u8 = eeprom_read_byte((uint8_t*)EOFS_HS_TIER3_SEC);
+  m_HsTier3Sec = (u8 == 0xff) ? 0 : u8 * HS_TIER_SEC;
+  m_HsTier = 0;
 
   m_HsLastPulse = millis(); // 初始化心跳检测时间戳
 #endif
@@ -988,6 +1090,44 @@ void J1772EVSEController::Init()
 // 读取 Pilot 信号电压值范围
 void J1772EVSEController::ReadPilot(uint16_t *plow, uint16_t *phigh)
 {
+#ifdef PAFC_PWM
+  // PWM 时只在高、低电平平台的中点采样，各 PILOT_PLATEAU_CNT 次取平均，
+  // 不会读到边沿附近的过渡值。高电平以 BOTTOM 为中心，低电平以 TOP 为中心，
+  // ADC 启动后约 PILOT_ADC_DELAY 才采样，所以提前这么多启动
+  uint8_t pwm = (m_Pilot.GetState() == PILOT_STATE_PWM);
+  uint16_t top = m_Pilot.GetTop();
+  uint16_t sumh = 0;
+  uint16_t suml = 0;
+  uint8_t cnth = 0;
+  uint8_t cntl = 0;
+  for (uint8_t i = 0; i < PILOT_PLATEAU_CNT; i++) {
+    if (pwm) {
+      // 没等到同步点的采样丢掉，不同步地读可能读到另一个平台
+      int16_t r = m_Pilot.SampleAt(&adcPilot,PILOT_ADC_DELAY,0,0);
+      if (r >= 0) {
+        sumh += r;
+        cnth++;
+      }
+      r = m_Pilot.SampleAt(&adcPilot,top - PILOT_ADC_DELAY,1,0);
+      if (r >= 0) {
+        suml += r;
+        cntl++;
+      }
+    }
+    else {
+      // 稳态电平随时都可以读
+      sumh += adcPilot.read();
+      suml += adcPilot.read();
+      cnth++;
+      cntl++;
+    }
+  }
+  // 一次都没采到的平台沿用上次的值
+  if (cnth) m_PlateauHigh = (sumh + cnth / 2) / cnth;
+  if (cntl) m_PlateauLow = (suml + cntl / 2) / cntl;
+  uint16_t ph = m_PlateauHigh;
+  uint16_t pl = m_PlateauLow;
+#else // 快速 PWM
   uint16_t pl = 1023; // 初始最小值设为最大
   uint16_t ph = 0;    // 初始最大值设为最小
 
@@ -996,6 +1136,7 @@ void J1772EVSEController::ReadPilot(uint16_t *plow, uint16_t *phigh)
     if (reading > ph) ph = reading;
     else if (reading < pl) pl = reading;
   }
+#endif // PAFC_PWM
 
   // 非 -12V 状态下处理连接状态
   if (m_Pilot.GetState() != PILOT_STATE_N12) {
@@ -1015,9 +1156,63 @@ void J1772EVSEController::ReadPilot(uint16_t *plow, uint16_t *phigh)
     }
   }
 
-  *plow = pl;
-  *phigh = ph;
+  if (plow) *plow = pl;
+  if (phigh) *phigh = ph;
+}
+
+#ifdef PILOT_CHECK
+// pilot 自检：每次 Update() 采一个点，找到边沿后和设定的占空比比较
+// plow/phigh 是本次 ReadPilot() 的读数，用它们的中点区分高低电平
+void J1772EVSEController::pilotCheck(unsigned long curms,uint16_t plow,uint16_t phigh)
+{
+  if ((m_Pilot.GetState() != PILOT_STATE_PWM) || m_ShutdownState ||
+      ((m_EvseState != EVSE_STATE_B) && (m_EvseState != EVSE_STATE_C))) {
+    m_PilotCheck.Abort();
+    m_PchkMs = curms;
+    m_PchkWaitMs = PCHK_START_DELAY_MS;
+    return;
+  }
+
+  if (!m_PilotCheck.Busy()) {
+    if ((curms - m_PchkMs) < m_PchkWaitMs) return;
+    m_PilotCheck.Start(m_Pilot.GetTop(),m_Pilot.GetOcr());
+  }
+  else if (m_PilotCheck.Ocr() != m_Pilot.GetOcr()) {
+    m_PilotCheck.Start(m_Pilot.GetTop(),m_Pilot.GetOcr()); // 检查过程中电流变了，重新开始
+  }
+
+  uint16_t cnt;
+  uint8_t up;
+  m_PilotCheck.Probe(&cnt,&up);
+  int16_t reading = m_Pilot.SampleAt(&adcPilot,cnt,up,1);
+  if (reading < 0) return; // 没等到，下次再采
+
+  // 没有摆幅（驱动坏了）时全部算低电平，找到的占空比会远低于设定值
+  uint8_t high = ((phigh - plow) >= PCHK_MIN_SWING) && ((uint16_t)reading > (plow + phigh) / 2);
+  if (!m_PilotCheck.Sample(high)) return;
+
+  uint8_t rc = m_PilotCheck.Finish(m_Pilot.MeasureFreq());
+  m_PchkMs = curms;
+  m_PchkWaitMs = rc ? 0 : PCHK_INTERVAL_MS; // 失败的马上再查一次
+  if (rc) {
+#ifdef EVENT_LOG
+    g_EventLog.Log(EVT_PILOT,m_PilotCheck.FailCnt(),m_PilotCheck.MeasDuty());
+#endif // EVENT_LOG
+    if (m_PilotCheck.FailCnt() >= PCHK_FAIL_CNT) {
+      m_PilotCheck.ClrFailCnt();
+      // pilot 不可信，EV 看到的电流可能比设定的大，正在充电的给 1 秒停止
+      shutdownStart(EVSE_STATE_PILOT_ERROR,chargingIsOn() ? 1000 : 0);
+    }
+  }
+}
+
+uint8_t J1772EVSEController::PilotCheckNow()
+{
+  if (m_Pilot.GetState() != PILOT_STATE_PWM) return 1;
+  if (!m_PilotCheck.Busy()) m_PchkWaitMs = 0;
+  return 0;
 }
+#endif // PILOT_CHECK
 
 
 // 表 A1 - 引导线电压范围（推荐...根据需要调整）
@@ -1079,6 +1274,18 @@ void J1772EVSEController::Update(uint8_t forcetransition)
     }
   }
 
+  // 正在等待 EV 停止充电，到时间后断开继电器
+  // 等待期间不做状态转换，结果与原来的忙等待相同
+  if (m_ShutdownState) {
+    if ((curms - m_ShutdownStartMs) >= m_ShutdownWaitMs) {
+      m_EvseState = m_ShutdownState;
+      m_ShutdownState = 0;
+      chargingOff();  // 打开 EVSE 继电器，期望 EV 已经断开
+      HardFault(1);  // 发生硬件故障
+    }
+    return;
+  }
+
   // 如果当前状态为休眠状态
   if (m_EvseState == EVSE_STATE_SLEEPING) {
     int8_t cancelTransition = 1;
@@ -1161,6 +1368,9 @@ void J1772EVSEController::Update(uint8_t forcetransition)
       m_NoGndTripCnt++;
       eeprom_write_byte((uint8_t*)EOFS_NOGND_TRIP_CNT,m_NoGndTripCnt);
     }
+#ifdef EVENT_LOG
+    if (prevevsestate != EVSE_STATE_NO_GROUND) g_EventLog.LogFault(EVT_NOGND,GetNoGndTripCnt(),acpinstate);
+#endif // EVENT_LOG
     nofault = 0;
   }
 
@@ -1185,6 +1395,9 @@ void J1772EVSEController::Update(uint8_t forcetransition)
             m_NoGndTripCnt++;
             eeprom_write_byte((uint8_t*)EOFS_NOGND_TRIP_CNT,m_NoGndTripCnt);
           }
+#ifdef EVENT_LOG
+          if (prevevsestate != EVSE_STATE_NO_GROUND) g_EventLog.LogFault(EVT_NOGND,GetNoGndTripCnt(),acpinstate);
+#endif // EVENT_LOG
           m_NoGndStart = curms;
 
           nofault = 0;
@@ -1233,6 +1446,9 @@ void J1772EVSEController::Update(uint8_t forcetransition)
                  ((curms - m_StuckRelayStartTimeMS) > STUCK_RELAY_DELAY) ) ||  // 开始去抖动延迟
                (prevevsestate == EVSE_STATE_STUCK_RELAY) ) { // 已经在故障状态
             // 卡住的继电器
+#ifdef EVENT_LOG
+            if (prevevsestate != EVSE_STATE_STUCK_RELAY) g_EventLog.LogFault(EVT_STUCK,GetStuckRelayTripCnt(),acpinstate);
+#endif // EVENT_LOG
             tmpevsestate = EVSE_STATE_STUCK_RELAY;
             m_EvseState = EVSE_STATE_STUCK_RELAY;
             chargingOff(); // 打开继电器
@@ -1250,6 +1466,25 @@ void J1772EVSEController::Update(uint8_t forcetransition)
     tmpevsestate = EVSE_STATE_GFCI_FAULT; // 设置临时状态为GFCI故障
     m_EvseState = EVSE_STATE_GFCI_FAULT;  // 更新EVSE状态为GFCI故障
 
+    // m_GfiTripMs、m_GfiOpenUs、m_GfiLatched 由 gfi_isr() 写入，关中断一起
+    // 读出快照并清除锁存，防止读到一半又跳闸
+    unsigned long tripms;
+    uint16_t openus;
+    uint8_t latched;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      tripms = m_GfiTripMs;
+      openus = m_GfiOpenUs;
+      latched = m_GfiLatched;
+      m_GfiLatched = 0;
+    }
+    if (latched) {
+      // 记录从中断到主循环处理故障的时间。继电器在中断里已经断开了，
+      // 这个时间只用来观察主循环的延迟
+      unsigned long handledms = millis() - tripms;
+      m_GfiHandledMs = (handledms > 0xffff) ? 0xffff : (uint16_t)handledms;
+      if (m_GfiHandledMs > m_GfiHandledMsMax) m_GfiHandledMsMax = m_GfiHandledMs;
+    }
+
     // 如果之前的状态不是GFCI故障，表示状态转换
     if (prevevsestate != EVSE_STATE_GFCI_FAULT) {
       // 检查GFI触发计数是否小于254，如果小于，则增加
@@ -1257,6 +1492,9 @@ void J1772EVSEController::Update(uint8_t forcetransition)
         m_GfiTripCnt++;
         eeprom_write_byte((uint8_t*)EOFS_GFI_TRIP_CNT,m_GfiTripCnt); // 保存触发计数到EEPROM
       }
+#ifdef EVENT_LOG
+      g_EventLog.LogFault(EVT_GFI,GetGfiTripCnt(),openus);
+#endif // EVENT_LOG
       m_GfiRetryCnt = 0; // 重试计数归零
       m_GfiFaultStartMs = curms; // 记录故障开始的时间戳
     }
@@ -1473,6 +1711,9 @@ void J1772EVSEController::Update(uint8_t forcetransition)
 
     // 状态转换
     if (forcetransition || (m_EvseState != prevevsestate)) {
+  #ifdef EVENT_LOG
+      g_EventLog.Log(EVT_STATE,m_EvseState,phigh);
+  #endif // EVENT_LOG
       if (m_EvseState == EVSE_STATE_A) { // EV 未连接
         chargingOff(); // 关闭充电电流
         m_Pilot.SetState(PILOT_STATE_P12); // 设置到 P12 状态
@@ -1501,38 +1742,28 @@ void J1772EVSEController::Update(uint8_t forcetransition)
           m_Pilot.SetState(PILOT_STATE_P12); // 锁定状态下设置 P12 状态
         }
         else {
-          m_Pilot.SetPWM(m_CurrentCapacity);  // 否则设置 PWM
+          m_Pilot.SetPWMDa(m_CurrentCapacityDa);  // 否则设置 PWM
         }
   #else
-        m_Pilot.SetPWM(m_CurrentCapacity);  // 设置 PWM
+        m_Pilot.SetPWMDa(m_CurrentCapacityDa);  // 设置 PWM
   #endif // AUTH_LOCK
       }
       else if (m_EvseState == EVSE_STATE_C) {
-        m_Pilot.SetPWM(m_CurrentCapacity);  // 设置 PWM
+        m_Pilot.SetPWMDa(m_CurrentCapacityDa);  // 设置 PWM
+        m_ChargeReqMs = curms;  // 用于测量充电启动延迟
+        m_ChargeReqPollMs = curms;
+        m_ChargeStartGapMs = 0;
   #if defined(UL_GFI_SELFTEST) && !defined(NOCHECKS)
-        // 如果启用了 GFI 自测，测试 GFI
-        if (GfiSelfTestEnabled() && m_Gfi.SelfTest()) {
-          // GFI 测试失败 - 硬件故障
-          m_EvseState = EVSE_STATE_GFI_TEST_FAILED;
-          m_Pilot.SetState(PILOT_STATE_P12); // 设置 P12 状态
-          HardFault(1);  // 发生硬件故障
-          return;
+        // 如果启用了 GFI 自测，先测试 GFI，通过后才闭合继电器
+        // 自测在后面的 Update() 中推进，期间主循环不阻塞
+        if (GfiSelfTestEnabled()) {
+          m_Gfi.SelfTestStart();
         }
+        else
   #endif // UL_GFI_SELFTEST
-
-  #ifdef FT_GFI_LOCKOUT
-        for(int i = 0; i < GFI_TEST_CYCLES; i++) {
-          m_Gfi.pinTest.write(1);  // 激活 GFI 引脚
-          delayMicroseconds(GFI_PULSE_ON_US);  // 延迟
-          m_Gfi.pinTest.write(0);  // 关闭 GFI 引脚
-          delayMicroseconds(GFI_PULSE_OFF_US);  // 延迟
-          if (m_Gfi.Fault()) break;  // 检查故障
+        {
+          chargingStart(); // 启动充电电流
         }
-        g_OBD.LcdMsg("Closing", "Relay");  // LCD 显示关断继电器
-        delay(150);  // 延迟
-  #endif // FT_GFI_LOCKOUT
-
-        chargingOn(); // 启动充电电流
       }
       else if (m_EvseState == EVSE_STATE_D) {
         // 不支持通风
@@ -1548,21 +1779,15 @@ void J1772EVSEController::Update(uint8_t forcetransition)
   #ifdef TEMPERATURE_MONITORING
       else if (m_EvseState == EVSE_STATE_OVER_TEMPERATURE) {
         // EVSE 内部过温
-        m_Pilot.SetState(PILOT_STATE_P12);  // 暂停 EV，5 秒内应停止高电流
-
-        // 等待 5 秒钟
-        while ((millis() - curms) < 5000) {
-          wdt_reset();  // 重置看门狗定时器
-        }
-        chargingOff();  // 打开 EVSE 继电器，期望 EV 已经断开
-        HardFault(1);  // 发生硬件故障
+        // 暂停 EV，5 秒内应停止高电流，然后断开继电器
+        shutdownStart(EVSE_STATE_OVER_TEMPERATURE,5000);
       }
   #endif //TEMPERATURE_MONITORING
       else if (m_EvseState == EVSE_STATE_DIODE_CHK_FAILED) {
         chargingOff(); // 关闭充电电流
         // 必须保持 pilot 引脚以继续检查
         // 注意：J1772 规范要求进入状态 F (-12V)，但我们不能这么做，同时保持检查
-        m_Pilot.SetPWM(m_CurrentCapacity);  // 设置 PWM
+        m_Pilot.SetPWMDa(m_CurrentCapacityDa);  // 设置 PWM
         m_Pilot.SetState(PILOT_STATE_P12);  // 设置 P12 状态
         HardFault(1);  // 发生硬件故障
       }
@@ -1613,8 +1838,36 @@ void J1772EVSEController::Update(uint8_t forcetransition)
   #endif // AUTH_LOCK
 
 
+#if defined(UL_GFI_SELFTEST) && !defined(NOCHECKS)
+  // GFI 自测子状态：已经进入 STATE C，但继电器要等自测通过才闭合
+  if (m_Gfi.SelfTestRunning()) {
+    if (m_EvseState != EVSE_STATE_C) {
+      m_Gfi.SelfTestAbort();  // EV 不再请求充电，或者出现了其他故障
+    }
+    else {
+      if ((uint16_t)(curms - m_ChargeReqPollMs) > m_ChargeStartGapMs) {
+        m_ChargeStartGapMs = (uint16_t)(curms - m_ChargeReqPollMs);
+      }
+      m_ChargeReqPollMs = curms;
+
+      uint8_t rc = m_Gfi.SelfTestPoll();
+      if (rc == 0) {
+        chargingStart(); // 自测通过，启动充电电流
+      }
+      else if (rc != GFI_SELFTEST_BUSY) {
+        // GFI 测试失败 - 硬件故障
+        m_EvseState = EVSE_STATE_GFI_TEST_FAILED;
+        m_Pilot.SetState(PILOT_STATE_P12); // 设置 P12 状态
+        HardFault(1);  // 发生硬件故障
+        return;
+      }
+    }
+  }
+#endif // UL_GFI_SELFTEST
+
 #ifdef UL_COMPLIANT
-  if (!nofault && (prevevsestate == EVSE_STATE_C)) {
+  // 如果正在等待关断，继电器还闭合着，由上面的关断子状态进入硬故障
+  if (!nofault && (prevevsestate == EVSE_STATE_C) && !m_ShutdownState) {
     // 如果充电开始后 2 秒内发生故障，认为是硬故障
     if ((curms - m_ChargeOnTimeMS) <= 2000) {
       HardFault(1);  // 触发硬故障处理
@@ -1651,115 +1904,94 @@ void J1772EVSEController::Update(uint8_t forcetransition)
   }
 
 #ifdef OVERCURRENT_THRESHOLD
+  // 两级过流的判断见 AmmeterSampler.cpp 的 OverCurrent
   if (m_EvseState == EVSE_STATE_C) {
-    // 如果充电电流超过设定的过流阈值
-    if (m_ChargingCurrent >= ((m_CurrentCapacity + OVERCURRENT_THRESHOLD) * 1000L)) {
-      if (m_OverCurrentStartMs) {  // 如果已经进入过流状态
-        if ((millis() - m_OverCurrentStartMs) >= OVERCURRENT_TIMEOUT) {
-          // 如果过流时间过长，停止充电并触发硬故障
-          m_EvseState = EVSE_STATE_OVER_CURRENT;
-          m_Pilot.SetState(PILOT_STATE_P12);  // 发送信号让 EV 暂停充电
-          curms = millis();
-          while ((millis() - curms) < 1000) {  // 等待 1 秒钟让 EV 停止充电
-            wdt_reset();
-          }
-          chargingOff();  // 关闭 EVSE 继电器，希望 EV 已断开连接
-
-          // 等待 EV 断开连接
-          HardFault(1);  // 触发硬故障处理
-
-          m_OverCurrentStartMs = 0;  // 清除过流状态
-        }
-      }
-      else {
-        m_OverCurrentStartMs = millis();  // 记录过流开始时间
-      }
+    int32_t limitma = m_CurrentCapacityDa * 100L;
+#if defined(OVERCURRENT_FAST_THRESHOLD) && !defined(FAKE_CHARGING_CURRENT)
+    // 快速过流检测：按每次读数的半周期峰值判断，不等滑动平均
+    int32_t peakma = OverCurrent::PeakMa(m_AmmeterPeak,m_CurrentScaleFactor,m_AmmeterCurrentOffset);
+    if (m_OverCurrent.Fast(peakma,limitma,OVERCURRENT_FAST_THRESHOLD,OVERCURRENT_FAST_READS)) {
+      // 严重过流，不等 EV 反应，立即断开继电器
+      chargingOff();
+      m_ChargingCurrent = peakma;  // 显示过流的幅度
+      shutdownStart(EVSE_STATE_OVER_CURRENT,0);
     }
-    else {
-      m_OverCurrentStartMs = 0;  // 清除过流状态
+    else
+#endif // OVERCURRENT_FAST_THRESHOLD
+    if (m_OverCurrent.Slow(m_ChargingCurrent,limitma,OVERCURRENT_THRESHOLD,OVERCURRENT_TIMEOUT,millis())) {
+      // 过流时间过长，发送信号让 EV 暂停充电，1 秒后断开继电器
+      shutdownStart(EVSE_STATE_OVER_CURRENT,1000);
     }
   }
   else {
-    m_OverCurrentStartMs = 0;  // 清除过流状态
+    m_OverCurrent.Reset();  // 清除过流状态
   }
 #endif // OVERCURRENT_THRESHOLD
 #endif // AMMETER
 
+#ifdef GROUP_SHARE
+  // 协调器失联时降到后备电流
+  if (m_Group.Poll(curms)) {
+    groupApply();
+  }
+#endif // GROUP_SHARE
+#ifdef PV_SURPLUS
+  // 网关失联时降到最小电流
+  if (m_Pv.Poll(curms)) {
+    pvApply();
+  }
+#endif // PV_SURPLUS
+#ifdef AUTO_PAUSE
+  // 暂停期间被手动启用的，重新暂停
+  if (autoPauseWanted() && (m_EvseState >= EVSE_STATE_A) && (m_EvseState <= EVSE_STATE_C)) {
+    autoPauseApply();
+  }
+#endif
 
 #ifdef HEARTBEAT_SUPERVISION
     this->HsExpirationCheck();  // 检查心跳是否丢失，若丢失则执行相应处理
 #endif //HEARTBEAT_SUPERVISION
 
+#ifdef PILOT_CHECK
+  pilotCheck(curms,plow,phigh);
+#endif // PILOT_CHECK
+
 #ifdef TEMPERATURE_MONITORING
     if(TempChkEnabled()) {
-      uint8_t currcap = GetMaxCurrentCapacity();  // 获取当前最大电流容量
-      uint8_t setit = 0;
-
-      if (g_TempMonitor.OverTemperature() && ((g_TempMonitor.m_TMP007_temperature <= TEMPERATURE_INFRARED_RESTORE_AMPERAGE) &&  // 所有传感器的温度需要恢复到较低水平
-                                              (g_TempMonitor.m_MCP9808_temperature <= TEMPERATURE_AMBIENT_RESTORE_AMPERAGE) &&
-                                              (g_TempMonitor.m_DS3231_temperature <= TEMPERATURE_AMBIENT_RESTORE_AMPERAGE))) {  // 恢复为用户的原始电流设置
-        setit = 1;  // 设置为原始电流
-      }
-      else if (g_TempMonitor.OverTemperatureShutdown() && ((g_TempMonitor.m_TMP007_temperature <= TEMPERATURE_INFRARED_THROTTLE_DOWN) &&  // 所有传感器的温度需要恢复到较低水平
-                                                          (g_TempMonitor.m_MCP9808_temperature <= TEMPERATURE_AMBIENT_THROTTLE_DOWN) &&
-                                                          (g_TempMonitor.m_DS3231_temperature <= TEMPERATURE_AMBIENT_THROTTLE_DOWN))) {   // 恢复降流设置
-        currcap /= 2;  // 设置为降流后的电流容量
-        setit = 3;
-      }
-      if (setit) {
-        if (setit <= 2) {
-          g_TempMonitor.SetOverTemperature(setit - 1);  // 设置过温状态
+      // 按最热的传感器及其升温速率连续调整电流，变化速率受限
+      ThermalDerater &td = g_TempMonitor.m_Derater;
+      uint8_t prevamps = td.Active() ? td.Amps() : 0;
+      uint8_t maxcap = GetMaxCurrentCapacity();  // 用户的原始电流设置
+      uint8_t amps = td.Update(curms,maxcap,MIN_CURRENT_CAPACITY_J1772);
+
+      if (td.Active()) {
+        if (amps != prevamps) {
+          m_Setpoint.Post(SP_SRC_THERMAL,amps * 10);
         }
-        else {
-          g_TempMonitor.SetOverTemperatureShutdown(setit - 3);  // 设置过温关机状态
+        if (!g_TempMonitor.OverTemperature()) {
+          g_TempMonitor.SetOverTemperature(1);  // 设置过温状态
         }
-        SetCurrentCapacity(currcap, 0, 1);  // 设置电流容量
-        if (m_Pilot.GetState() != PILOT_STATE_PWM) {
-          m_Pilot.SetPWM(m_CurrentCapacity);  // 设置 PWM 信号
+        if ((amps <= MIN_CURRENT_CAPACITY_J1772) != g_TempMonitor.OverTemperatureShutdown()) {
+          g_TempMonitor.SetOverTemperatureShutdown(amps <= MIN_CURRENT_CAPACITY_J1772);  // 已降到最小电流
         }
       }
+      else if (prevamps) {
+        // 温度恢复，回到用户的原始电流设置
+        g_TempMonitor.SetOverTemperature(0);
+        g_TempMonitor.SetOverTemperatureShutdown(0);
+        m_Setpoint.Clear(SP_SRC_THERMAL);
+      }
     }
 #endif // TEMPERATURE_MONITORING
 
-  if (m_EvseState == EVSE_STATE_C) {
+  // 各限制源的最小值，充电时增加按步长和保持时间逐步进行
+  setpointApply(0);
+
+  // GFI 自测期间继电器还没闭合，m_ChargeOnTimeMS 还是上次充电的
+  if ((m_EvseState == EVSE_STATE_C) && chargingIsOn()) {
     m_ElapsedChargeTimePrev = m_ElapsedChargeTime;  // 记录之前的充电时间
     m_ElapsedChargeTime = (millis() - m_ChargeOnTimeMS) / 1000;  // 计算已充电时间
 
-
-#ifdef TEMPERATURE_MONITORING
-  if(TempChkEnabled()) {
-    if (m_ElapsedChargeTime != m_ElapsedChargeTimePrev) {
-      uint8_t currcap = GetMaxCurrentCapacity();
-      uint8_t setit = 0;
-
-      if (!g_TempMonitor.OverTemperature() && ((g_TempMonitor.m_TMP007_temperature >= TEMPERATURE_INFRARED_THROTTLE_DOWN) ||  // 任一传感器超过阈值会触发动作
-                                               (g_TempMonitor.m_MCP9808_temperature >= TEMPERATURE_AMBIENT_THROTTLE_DOWN) ||
-                                               (g_TempMonitor.m_DS3231_temperature >= TEMPERATURE_AMBIENT_THROTTLE_DOWN))) {   // 降低充电电流
-        currcap /= 2;  // 设置为降流后的电流容量
-        setit = 2;
-      }
-      else if (!g_TempMonitor.OverTemperatureShutdown() && ((g_TempMonitor.m_TMP007_temperature >= TEMPERATURE_INFRARED_SHUTDOWN) ||  // 任一传感器超过阈值会触发关机动作
-                                                              (g_TempMonitor.m_MCP9808_temperature >= TEMPERATURE_AMBIENT_SHUTDOWN) ||
-                                                              (g_TempMonitor.m_DS3231_temperature >= TEMPERATURE_AMBIENT_SHUTDOWN))) {   // 强制关机
-        currcap /= 4;  // 设置为更低的电流容量
-        setit = 4;
-      }
-      if (setit) {
-        if (setit <= 2) {
-          g_TempMonitor.SetOverTemperature(setit - 1);  // 设置过温状态
-        }
-        else {
-          g_TempMonitor.SetOverTemperatureShutdown(setit - 3);  // 设置过温关机状态
-        }
-        SetCurrentCapacity(currcap, 0, 1);  // 设置电流容量
-        if (m_Pilot.GetState() != PILOT_STATE_PWM) {
-          m_Pilot.SetPWM(m_CurrentCapacity);  // 设置 PWM 信号
-        }
-      }
-    }
-  }
-#endif // TEMPERATURE_MONITORING
-
 #ifdef CHARGE_LIMIT
     if (m_chargeLimitTotWs && (g_EnergyMeter.GetSessionWs() >= m_chargeLimitTotWs)) {
       ClrChargeLimit(); // 清除充电限制
@@ -1844,7 +2076,120 @@ void J1772EVSEController::Calibrate(PCALIB_DATA pcd)
 }
 #endif // CALIBRATE
 
-int J1772EVSEController::SetCurrentCapacity(uint8_t amps,uint8_t updatelcd,uint8_t nosave)
+#ifdef THRESH_CAL
+static uint8_t threshFar(uint16_t v,uint16_t def)
+{
+  return ((v > def + THRESH_CAL_MAX_DEV) || (v + THRESH_CAL_MAX_DEV < def)) ? 1 : 0;
+}
+
+static uint8_t threshMoved(uint16_t v,uint16_t saved)
+{
+  return ((v > saved + THRESH_CAL_DEADBAND) || (v + THRESH_CAL_DEADBAND < saved)) ? 1 : 0;
+}
+
+// 由测得的 +12V/-12V 电平按比例算出各状态阈值，0V 点取两者的中点
+// 返回 1 = 结果离默认值太远（开机时连着车辆，或者硬件有问题），不能用
+uint8_t J1772EVSEController::threshDerive(uint16_t p,uint16_t n,PTHRESH_DATA ptd)
+{
+  if (p <= n) return 1;
+  uint16_t zero = (p + n) / 2;
+  ptd->m_ThreshAB = zero + (uint16_t)(((uint32_t)(p - zero) * THRESH_CAL_AB) >> 8);
+  ptd->m_ThreshBC = zero + (uint16_t)(((uint32_t)(p - zero) * THRESH_CAL_BC) >> 8);
+  ptd->m_ThreshCD = zero + (uint16_t)(((uint32_t)(p - zero) * THRESH_CAL_CD) >> 8);
+  ptd->m_ThreshD = THRESH_D_DEFAULT;
+  ptd->m_ThreshDS = zero - (uint16_t)(((uint32_t)(zero - n) * THRESH_CAL_DS) >> 8);
+
+  return (threshFar(ptd->m_ThreshAB,THRESH_AB_DEFAULT) ||
+          threshFar(ptd->m_ThreshBC,THRESH_BC_DEFAULT) ||
+          threshFar(ptd->m_ThreshCD,THRESH_CD_DEFAULT) ||
+          threshFar(ptd->m_ThreshDS,THRESH_DS_DEFAULT)) ? 1 : 0;
+}
+
+void J1772EVSEController::threshSave(uint8_t src)
+{
+  m_ThreshSrc = src;
+  eeprom_write_byte((uint8_t*)EOFS_THRESH_SRC,src);
+  if (src != THRESH_SRC_DEFAULT) {
+    eeprom_write_block(&m_ThreshData,(void*)EOFS_THRESH,sizeof(THRESH_DATA));
+  }
+}
+
+// 开机时读取保存的阈值。不是手动设置的，在没有车辆连接时重新测量 pilot 的
+// +12V/-12V 电平，算出本机的阈值。阈值移动超过死区才写 EEPROM
+void J1772EVSEController::threshCal()
+{
+  m_CalP = 0;
+  m_CalN = 0;
+  m_ThreshSrc = eeprom_read_byte((uint8_t*)EOFS_THRESH_SRC);
+  if ((m_ThreshSrc == THRESH_SRC_AUTO) || (m_ThreshSrc == THRESH_SRC_MANUAL)) {
+    eeprom_read_block(&m_ThreshData,(const void*)EOFS_THRESH,sizeof(THRESH_DATA));
+  }
+  else {
+    m_ThreshSrc = THRESH_SRC_DEFAULT;
+  }
+  if (m_ThreshSrc == THRESH_SRC_MANUAL) return;
+
+  // Calibrate() 会把 pilot 打到 -12V（状态 F），连着车辆时不能做。
+  // 状态 B 的 +9V 已经低于 A/B 阈值，但离默认值没有 THRESH_CAL_MAX_DEV 那么远，
+  // 所以要和当前的 A/B 阈值比较，而不是和默认值加偏差比较
+  if (EvConnected()) return;
+  uint16_t pl,ph;
+  ReadPilot(&pl,&ph);
+  if (ph < m_ThreshData.m_ThreshAB) return;
+
+  CALIB_DATA cd;
+  Calibrate(&cd);
+  m_Pilot.SetState(PILOT_STATE_P12); // Calibrate() 结束时停在 -12V
+
+  THRESH_DATA td;
+  if (((cd.m_pMax - cd.m_pMin) > THRESH_CAL_MAX_SPREAD) ||
+      ((cd.m_nMax - cd.m_nMin) > THRESH_CAL_MAX_SPREAD) ||
+      threshDerive(cd.m_pAvg,cd.m_nAvg,&td)) {
+    return; // 沿用保存的或默认的阈值
+  }
+  m_CalP = cd.m_pAvg;
+  m_CalN = cd.m_nAvg;
+
+  // 每次开机读数都会差一两个数，只在偏离保存值超过死区时才写 EEPROM，
+  // 否则沿用保存的阈值，免得每次开机都写
+  if ((m_ThreshSrc != THRESH_SRC_AUTO) ||
+      threshMoved(td.m_ThreshAB,m_ThreshData.m_ThreshAB) ||
+      threshMoved(td.m_ThreshBC,m_ThreshData.m_ThreshBC) ||
+      threshMoved(td.m_ThreshCD,m_ThreshData.m_ThreshCD) ||
+      threshMoved(td.m_ThreshDS,m_ThreshData.m_ThreshDS)) {
+    m_ThreshData = td;
+    threshSave(THRESH_SRC_AUTO);
+  }
+}
+
+uint8_t J1772EVSEController::SetThresh(PTHRESH_DATA ptd)
+{
+  if (ptd) {
+    if ((ptd->m_ThreshAB > 1023) || (ptd->m_ThreshAB <= ptd->m_ThreshBC) ||
+        (ptd->m_ThreshBC <= ptd->m_ThreshCD) || (ptd->m_ThreshCD <= ptd->m_ThreshDS)) {
+      return 1;
+    }
+    ptd->m_ThreshD = m_ThreshData.m_ThreshD;
+    m_ThreshData = *ptd;
+    threshSave(THRESH_SRC_MANUAL);
+  }
+  else if (m_CalP) {
+    threshDerive(m_CalP,m_CalN,&m_ThreshData);
+    threshSave(THRESH_SRC_AUTO);
+  }
+  else {
+    m_ThreshData.m_ThreshAB = THRESH_AB_DEFAULT;
+    m_ThreshData.m_ThreshBC = THRESH_BC_DEFAULT;
+    m_ThreshData.m_ThreshCD = THRESH_CD_DEFAULT;
+    m_ThreshData.m_ThreshD = THRESH_D_DEFAULT;
+    m_ThreshData.m_ThreshDS = THRESH_DS_DEFAULT;
+    threshSave(THRESH_SRC_DEFAULT);
+  }
+  return 0;
+}
+#endif // THRESH_CAL
+
+int J1772EVSEController::SetCurrentCapacityDa(uint16_t da,uint8_t updatelcd,uint8_t nosave)
 {
   int rc = 0;
   uint8_t maxcurrentcap = (GetCurSvcLevel() == 1) ? MAX_CURRENT_CAPACITY_L1 : m_MaxHwCurrentCapacity;
@@ -1863,39 +2208,198 @@ int J1772EVSEController::SetCurrentCapacity(uint8_t amps,uint8_t updatelcd,uint8
   }
 #endif // PP_AUTO_AMPACITY
 
-  if ((amps >= MIN_CURRENT_CAPACITY_J1772) && (amps <= maxcurrentcap)) {
-    m_CurrentCapacity = amps;
-  }
-  else if (amps < MIN_CURRENT_CAPACITY_J1772) {
-    m_CurrentCapacity = MIN_CURRENT_CAPACITY_J1772;
+  if (da < MIN_CURRENT_CAPACITY_J1772 * 10) {
+    da = MIN_CURRENT_CAPACITY_J1772 * 10;
     rc = 1;
   }
-  else {
-    m_CurrentCapacity = maxcurrentcap;
+  else if (da > maxcurrentcap * 10) {
+    da = maxcurrentcap * 10;
     rc = 2;
   }
 
-  if (!nosave) {
-    #ifdef DEBUG_HS
-      Serial.println(F("SetCurrentCapacity: Writing to EEPROM!"));
-    #endif
-    eeprom_write_byte((uint8_t*)((GetCurSvcLevel() == 1) ? EOFS_CURRENT_CAPACITY_L1 : EOFS_CURRENT_CAPACITY_L2),(byte)m_CurrentCapacity);
+  if (nosave) {
+    m_Setpoint.Post(SP_SRC_TEMP,da);
   }
+  else {
+    // 只有用户设置写入 EEPROM，同时取消临时设置。EEPROM 里只存整数安培
+    m_Setpoint.Post(SP_SRC_USER,da);
+    m_Setpoint.Clear(SP_SRC_TEMP);
+    uint8_t amps = da / 10;
+    uint8_t *eofs = (uint8_t*)((GetCurSvcLevel() == 1) ? EOFS_CURRENT_CAPACITY_L1 : EOFS_CURRENT_CAPACITY_L2);
+    if (eeprom_read_byte(eofs) != amps) {
+      #ifdef DEBUG_HS
+        Serial.println(F("SetCurrentCapacity: Writing to EEPROM!"));
+      #endif
+      eeprom_write_byte(eofs,amps);
+    }
+    m_SavedCapacity = 0; // 设置菜单会先自己写 EEPROM，这里总是重新读
+  }
+
+  setpointApply(updatelcd);
+
+  return rc;
+}
+
+// 按各限制源的最小值更新输出电流
+void J1772EVSEController::setpointApply(uint8_t updatelcd)
+{
+  uint8_t prevamps = GetCurrentCapacity();
+  if (m_Setpoint.Update(millis(),m_EvseState == EVSE_STATE_C)) {
+    m_CurrentCapacityDa = m_Setpoint.Da();
+#ifdef EVENT_LOG
+    // 只记录整数安培的变化，免得余电控制的 0.1A 调整把日志挤满
+    if (GetCurrentCapacity() != prevamps) {
+      g_EventLog.Log(EVT_AMPS,GetCurrentCapacity(),prevamps | ((uint16_t)m_Setpoint.Source() << 8));
+    }
+#endif // EVENT_LOG
 
-  if (m_Pilot.GetState() == PILOT_STATE_PWM) {
-    m_Pilot.SetPWM(m_CurrentCapacity); // 设置 PWM 电流
+    if (m_Pilot.GetState() == PILOT_STATE_PWM) {
+      m_Pilot.SetPWMDa(m_CurrentCapacityDa); // 设置 PWM 电流
+    }
   }
 
   if (updatelcd) {
     g_OBD.Update(OBD_UPD_FORCE); // 强制更新显示
   }
+}
 
-  return rc;
+#ifdef AUTO_PAUSE
+// 共享线路分配为 0、余电不足或心跳丢失到最后一级时要暂停
+uint8_t J1772EVSEController::autoPauseWanted()
+{
+#ifdef GROUP_SHARE
+  if (m_Group.Paused()) return 1;
+#endif // GROUP_SHARE
+#ifdef PV_SURPLUS
+  if (m_Pv.Paused()) return 1;
+#endif // PV_SURPLUS
+#ifdef HEARTBEAT_SUPERVISION
+  if (m_HsTier >= HS_TIER_SLEEP) return 1;
+#endif // HEARTBEAT_SUPERVISION
+  return 0;
+}
+
+// 需要暂停时休眠。都不需要了只唤醒我们自己暂停的，用户设置的休眠不动
+void J1772EVSEController::autoPauseApply()
+{
+  if (autoPauseWanted()) {
+    if ((m_EvseState >= EVSE_STATE_A) && (m_EvseState <= EVSE_STATE_C)) {
+      m_AutoPaused = 1;
+      Sleep();
+    }
+  }
+  else if (m_AutoPaused) {
+    m_AutoPaused = 0;
+    // 不在定时器的充电时段内的，继续休眠
+    if ((m_EvseState == EVSE_STATE_SLEEPING)
+#ifdef DELAYTIMER
+        && !g_DelayTimer.WantsSleep()
+#endif // DELAYTIMER
+        ) {
+      Enable();
+    }
+  }
+#ifdef GROUP_SHARE
+  m_Group.SetPaused(m_AutoPaused && m_Group.Paused());
+#endif // GROUP_SHARE
+}
+#endif
+
+#ifdef GROUP_SHARE
+// 按共享线路的分配调整电流，分配为 0 时暂停充电
+void J1772EVSEController::groupApply()
+{
+  // 不在组里时 Limit() 为 SP_NO_LIMIT
+  SetCurrentLimit(SP_SRC_GROUP,m_Group.Limit());
+  autoPauseApply();
+}
+
+void J1772EVSEController::GroupAllocate(uint8_t amps)
+{
+  if (m_Group.Allocate(amps,millis())) {
+    groupApply();
+  }
+}
+
+void J1772EVSEController::GroupJoin(uint8_t groupamps,uint8_t fallbackamps)
+{
+  if (groupamps < GS_MIN_AMPS) groupamps = 0;
+  if (fallbackamps > groupamps) fallbackamps = groupamps;
+
+  eeprom_write_byte((uint8_t*)EOFS_GROUP_CURRENT_CAPACITY,groupamps);
+  eeprom_write_byte((uint8_t*)EOFS_DUO_SHARED_AMPS,fallbackamps);
+  eeprom_write_byte((uint8_t*)EOFS_DUO_NVFLAGS,groupamps ? GS_NVF_JOINED : 0);
+
+  m_Group.Init(groupamps,fallbackamps,millis());
+  groupApply();
+}
+#endif // GROUP_SHARE
+
+#ifdef PV_SURPLUS
+// 按余电调整电流，余电不足时暂停充电
+void J1772EVSEController::pvApply()
+{
+  // 没有启用时 LimitDa() 为 SP_NO_LIMIT_DA
+  SetCurrentLimitDa(SP_SRC_PV,m_Pv.LimitDa());
+  autoPauseApply();
+}
+
+void J1772EVSEController::PvReading(int32_t gridw,uint16_t volts)
+{
+  if (!volts) volts = m_Voltage / 1000;
+
+  // 车辆正在用的电流
+  uint16_t evda = 0;
+  if ((m_EvseState == EVSE_STATE_C) && chargingIsOn()) {
+#ifdef AMMETER
+    evda = m_ChargingCurrent / 100;
+#else
+    evda = m_CurrentCapacityDa;  // 没有电流表，按用满导引电流算
+#endif // AMMETER
+  }
+
+  if (m_Pv.Reading(gridw,volts,GetMaxCurrentCapacity(),evda,millis())) {
+    pvApply();
+  }
 }
 
+void J1772EVSEController::PvConfig(uint8_t enabled,int16_t exportw,uint16_t holdsec)
+{
+  eeprom_write_byte((uint8_t*)EOFS_PV_NVFLAGS,enabled ? PV_NVF_ENABLED : 0);
+  eeprom_write_word((uint16_t*)EOFS_PV_EXPORT_W,(uint16_t)exportw);
+  eeprom_write_word((uint16_t*)EOFS_PV_HOLD_SEC,holdsec);
+
+  m_Pv.Init(enabled,exportw,holdsec);
+  pvApply();
+}
+#endif // PV_SURPLUS
+
 #ifdef HEARTBEAT_SUPERVISION
+// 按心跳丢失的级别限制电流，最后一级休眠。级别为 0 时取消限制，
+// 电流经过 m_Setpoint 逐步升回去
+void J1772EVSEController::hsApply()
+{
+  if (!m_HsTier) {
+    ClrCurrentLimit(SP_SRC_HEARTBEAT);
+  }
+  else {
+    SetCurrentLimit(SP_SRC_HEARTBEAT,((m_HsTier >= 2) && m_HsTier2Sec) ? m_HsTier2Amps : m_IFallback);
+  }
+  autoPauseApply();
+  g_OBD.Update(OBD_UPD_FORCE);
+}
+
 // 设置心跳监控间隔为 0 以暂停心跳监控
-int J1772EVSEController::HeartbeatSupervision(uint16_t interval, uint8_t amps) {
+// tier2sec/tier3sec: 0 = 不用这一级，否则必须比前一级长
+int J1772EVSEController::HeartbeatSupervision(uint16_t interval, uint8_t amps, uint16_t tier2sec, uint8_t tier2amps, uint16_t tier3sec) {
+  // EEPROM 里每级只存 1 个字节，按 HS_TIER_SEC 向上取整
+  if ((tier2sec > HS_TIER_MAX_SEC) || (tier3sec > HS_TIER_MAX_SEC)) return 1;
+  uint8_t t2 = (tier2sec + HS_TIER_SEC - 1) / HS_TIER_SEC;
+  uint8_t t3 = (tier3sec + HS_TIER_SEC - 1) / HS_TIER_SEC;
+  if (t2 && (!interval || (t2 * HS_TIER_SEC <= interval))) return 1;
+  if (t3 && (!interval || (t3 * HS_TIER_SEC <= interval) || (t3 <= t2))) return 1;
+  if (!t2) tier2amps = 0;
+
   #ifdef DEBUG_HS
     Serial.println(F("HeartbeatSupervision called"));
     Serial.print(F("m_HsInterval was: "));
@@ -1905,8 +2409,15 @@ int J1772EVSEController::HeartbeatSupervision(uint16_t interval, uint8_t amps) {
   #endif
   m_HsInterval = interval;    // 设置间隔为 0 以暂停心跳监控
   m_IFallback = amps;
+  m_HsTier2Sec = t2 * HS_TIER_SEC;
+  m_HsTier2Amps = tier2amps;
+  m_HsTier3Sec = t3 * HS_TIER_SEC;
   m_HsTriggered = 0;         // 每次启动 HEARTBEAT_SUPERVISION 时，清除 "Triggered" 标志
   m_HsLastPulse = millis();  // 更新 m_HsLastPulse
+  if (m_HsTier) {
+    m_HsTier = 0;            // 取消旧设置下的限制
+    hsApply();
+  }
   #ifdef DEBUG_HS
     Serial.print(F("m_HsInterval is: "));
     Serial.println(m_HsInterval);
@@ -1927,6 +2438,15 @@ int J1772EVSEController::HeartbeatSupervision(uint16_t interval, uint8_t amps) {
     #endif
     eeprom_write_byte((uint8_t*)EOFS_HEARTBEAT_SUPERVISION_CURRENT, m_IFallback);
   }
+  if (eeprom_read_byte((uint8_t*)EOFS_HS_TIER2_SEC) != t2) {
+    eeprom_write_byte((uint8_t*)EOFS_HS_TIER2_SEC, t2);
+  }
+  if (eeprom_read_byte((uint8_t*)EOFS_HS_TIER2_AMPS) != m_HsTier2Amps) {
+    eeprom_write_byte((uint8_t*)EOFS_HS_TIER2_AMPS, m_HsTier2Amps);
+  }
+  if (eeprom_read_byte((uint8_t*)EOFS_HS_TIER3_SEC) != t3) {
+    eeprom_write_byte((uint8_t*)EOFS_HS_TIER3_SEC, t3);
+  }
   return 0; // 无错误码
 }
 
@@ -1943,6 +2463,11 @@ int J1772EVSEController::HsPulse() {
     rc = 0;
   }
   m_HsLastPulse = millis(); // 刚刚收到了一个心跳信号，因此重置心跳超时间隔
+  if (m_HsTier && (m_HsTier2Sec || m_HsTier3Sec)) {
+    // 分级模式：心跳恢复就取消限制，不用等确认。丢失的记录仍然要确认
+    m_HsTier = 0;
+    hsApply();
+  }
   #ifdef DEBUG_HS
 	Serial.print(F("                 Time interval  after reset: "));
 	Serial.println((millis() - m_HsLastPulse)/1000);
@@ -1959,24 +2484,13 @@ int J1772EVSEController::HsRestoreAmpacity() {
     #ifdef DEBUG_HS
 	  Serial.println(F("HEARTBEAT_SUPERVISION was previously triggered - checking if OK to restore ampacity"));
     #endif
-    uint8_t maxCapacity = g_EvseController.GetMaxCurrentCapacity();  // 获取当前可设置的最大电流容量
-    #ifdef TEMPERATURE_MONITORING
-      if (!g_TempMonitor.OverTemperature()) { // 确保温度监控未触发过温保护
-	    #ifdef DEBUG_HS
-	      Serial.print(F("Not over temp - OK to restore ampacity to: "));
-		  Serial.println(maxCapacity);
-        #endif
-        rc = g_EvseController.SetCurrentCapacity(maxCapacity,1,1);  // 设置当前电流为最大容量，不写入 EEPROM
-      }
-      else {
-        #ifdef DEBUG_HS
-	      Serial.println(F("Over temp still in force - not restoring ampacity"));
-        #endif
-        rc = 1;  // 由于温度过高，无法恢复电流容量
-      }
-    #else // !TEMPERATURE_MONITORING
-      rc = g_EvseController.SetCurrentCapacity(maxCapacity,1,1);   // 不考虑温度，直接设置最大电流容量
-    #endif // TEMPERATURE_MONITORING
+    // 只取消心跳的限制，温度降额等其他限制仍然有效
+    m_HsLastPulse = millis(); // 主机有回应，算作一次心跳，从第一级重新计时
+    if (m_HsTier) {
+      m_HsTier = 0;
+      hsApply();
+    }
+    rc = 0;
   }
   else {
     rc = 0; // 如果没有触发心跳超时，直接返回
@@ -1985,26 +2499,27 @@ int J1772EVSEController::HsRestoreAmpacity() {
 }
 
 int J1772EVSEController::HsExpirationCheck() {
+  if (!m_HsInterval) return 0;
   unsigned long sinceLastPulse = millis() - m_HsLastPulse;
-  int rc=1;
-  if (m_HsInterval != 0 && sinceLastPulse > (m_HsInterval * 1000)) { // 如果心跳超时
-  	#ifdef DEBUG_HS
-	  Serial.println(F("HsExpirationCheck: Heartbeat timer expired account late or no pulse"));
-	#endif
-    if(m_IFallback < GetCurrentCapacity()) { // 如果当前电流容量不符合心跳超时的限制
-	  #ifdef DEBUG_HS
-	    Serial.println(F("HsExpirationCheck: Reducing Current capacity"));
-	  #endif
-      rc=SetCurrentCapacity(m_IFallback,1,1);  // 降低当前电流容量，不写入 EEPROM
-    }
-    // 心跳超时，可能需要调整电流容量设置
-    m_HsTriggered = HS_MISSEDPULSE_NOACK; // 标记心跳超时并等待确认
-	m_HsLastPulse = millis(); // 重置计时器，等待下一个心跳
-  }
-  else {  // 如果心跳正常且计时器未超时
-    rc = 0; // 无需调整，正常返回
+  // 按距离上一次心跳的时间算出该在哪一级
+  uint8_t tier = 0;
+  if (sinceLastPulse > m_HsInterval * 1000UL) tier = 1;
+  if (m_HsTier2Sec && (sinceLastPulse > m_HsTier2Sec * 1000UL)) tier = 2;
+  if (m_HsTier3Sec && (sinceLastPulse > m_HsTier3Sec * 1000UL)) tier = HS_TIER_SLEEP;
+  if (tier <= m_HsTier) { // 只升级，降级要等心跳恢复或主机确认
+    return 0;
   }
-  return rc;
+  #ifdef DEBUG_HS
+  Serial.println(F("HsExpirationCheck: Heartbeat timer expired account late or no pulse"));
+  #endif
+  // 降电流或休眠。单级模式下一直保持到主机确认 (HsAckMissedPulse)
+  m_HsTier = tier;
+  hsApply();
+#ifdef EVENT_LOG
+  g_EventLog.Log(EVT_HB_MISS,(tier >= HS_TIER_SLEEP) ? 0 : GetCurrentLimit(SP_SRC_HEARTBEAT),tier);
+#endif // EVENT_LOG
+  m_HsTriggered = HS_MISSEDPULSE_NOACK; // 标记心跳超时并等待确认
+  return 1;
 }
 
 int J1772EVSEController::HsAckMissedPulse(uint8_t ack) {
@@ -2151,7 +2666,7 @@ uint8_t J1772EVSEController::SetMaxHwCurrentCapacity(uint8_t amps)
       eeprom_write_byte((uint8_t*)EOFS_MAX_HW_CURRENT_CAPACITY, amps);
       m_MaxHwCurrentCapacity = amps;
       // 如果当前容量大于最大硬件电流容量，则将其调整到最大值
-      if (m_CurrentCapacity > m_MaxHwCurrentCapacity) {
+      if (GetCurrentCapacity() > m_MaxHwCurrentCapacity) {
         SetCurrentCapacity(amps, 1, 1);
       }
       return 0; // 设置成功
@@ -21,32 +21,7 @@
  */
 
 
-// EVSE states for m_EvseState
-#define EVSE_STATE_UNKNOWN 0x00
-#define EVSE_STATE_A       0x01 // vehicle state A 12V - not connected
-#define EVSE_STATE_B       0x02 // vehicle state B 9V - connected, ready
-#define EVSE_STATE_C       0x03 // vehicle state C 6V - charging
-#define EVSE_STATE_D       0x04 // vehicle state D 3V - vent required
-#define EVSE_FAULT_STATE_BEGIN EVSE_STATE_D
-#define EVSE_STATE_DIODE_CHK_FAILED 0x05 // diode check failed
-#define EVSE_STATE_GFCI_FAULT 0x06       // GFCI fault
-#define EVSE_STATE_NO_GROUND 0x07 //bad ground
-#define EVSE_STATE_STUCK_RELAY 0x08 //stuck relay
-#define EVSE_STATE_GFI_TEST_FAILED 0x09 // GFI self-test failure
-#define EVSE_STATE_OVER_TEMPERATURE 0x0A // over temperature error shutdown
-#define EVSE_STATE_OVER_CURRENT 0x0B // over current error shutdown
-//reserved #define EVSE_STATE_PILOT_ERROR 0x0C // pilot self test error
-//reserved #define EVSE_STATE_TEMP_SENSOR_FAULT 0x0D // temp sensor dead
-#define EVSE_STATE_RELAY_CLOSURE_FAULT 0x0E
-#define EVSE_FAULT_STATE_END EVSE_STATE_RELAY_CLOSURE_FAULT
-           
-#define EVSE_STATE_SLEEPING 0xfe // waiting for timer
-#define EVSE_STATE_DISABLED 0xff // disabled
-
-inline int8_t IsEvseFaultState(uint8_t state) {
-  if ((state >= EVSE_FAULT_STATE_BEGIN) && (state <= EVSE_FAULT_STATE_END)) return 1;
-  else return 0;
-}
+#include "EvseStates.h"
 
 typedef struct threshdata {
   uint16_t m_ThreshAB; // state A -> B
@@ -56,6 +31,36 @@ typedef struct threshdata {
   uint16_t m_ThreshDS; // diode short
 } THRESH_DATA,*PTHRESH_DATA;
 
+// compiled in thresholds, ADC counts
+#define THRESH_AB_DEFAULT 875
+#define THRESH_BC_DEFAULT 780
+#define THRESH_CD_DEFAULT 690
+#define THRESH_D_DEFAULT 0
+#define THRESH_DS_DEFAULT 260
+
+#ifdef THRESH_CAL
+// calibrated thresholds go these fractions of the way from the 0V point,
+// halfway between the measured rails, to the +12V level (-12V level for DS).
+// 1/256ths. they are the midpoints between the J1772 table A1 bands, and
+// give the compiled in values on a unit that reads the nominal levels
+#define THRESH_CAL_AB 224 // 10.5V
+#define THRESH_CAL_BC 158 // 7.4V
+#define THRESH_CAL_CD 93  // 4.4V
+#define THRESH_CAL_DS 209 // -9.8V
+// a calibration is rejected if any threshold lands further than this from
+// its default. an EV connected at boot pulls the +12V level well past it
+#define THRESH_CAL_MAX_DEV 60
+// max - min of the readings of a level
+#define THRESH_CAL_MAX_SPREAD 16
+// a new calibration is only written to EEPROM if a threshold moved more
+// than this from the saved one. readings wander a count or two per boot
+#define THRESH_CAL_DEADBAND 4
+// where m_ThreshData came from. EOFS_THRESH_SRC
+#define THRESH_SRC_DEFAULT 0
+#define THRESH_SRC_AUTO    1 // measured at boot
+#define THRESH_SRC_MANUAL  2 // RAPI SX
+#endif // THRESH_CAL
+
 typedef struct calibdata {
   uint16_t m_pMax;
   uint16_t m_pAvg;
@@ -119,6 +124,10 @@ typedef uint8_t (*EvseStateTransitionReqFunc)(uint8_t prevPilotState,uint8_t cur
 #define HS_ACK_COOKIE           0XA5    //ACK will not work unless it contains this cookie
 #define HS_MISSEDPULSE_NOACK    0x02    //HEARTBEAT_SUPERVISION missed a pulse and this has not been acknowleged
 #define HS_MISSEDPULSE          0x01    //HEARTBEAT_SUPERVISION missed a pulse and this is the semi-permanent record flag
+// tier 2/3 times are stored in EEPROM as 1 byte each in HS_TIER_SEC units
+#define HS_TIER_SEC             10
+#define HS_TIER_MAX_SEC         (255*HS_TIER_SEC)
+#define HS_TIER_SLEEP           3       //m_HsTier: last tier, EVSE put to sleep
 //#define DEBUG_HS //Uncomment this for debugging statemnts sent to serial port
 
 
@@ -137,6 +146,13 @@ class J1772EVSEController {
   unsigned long m_GfiFaultStartMs;
   uint8_t m_GfiRetryCnt;
   uint8_t m_GfiTripCnt; // contains tripcnt-1
+  // trip latency record, for proving response times
+  volatile unsigned long m_GfiTripMs; // millis() when gfi_isr() ran
+  volatile uint16_t m_GfiOpenUs;      // isr entry -> relay pins driven open, last trip
+  volatile uint8_t m_GfiLatched;      // trip latched by isr, not yet seen by Update()
+  volatile uint16_t m_GfiOpenUsMax;
+  uint16_t m_GfiHandledMs;            // isr entry -> Update() processed the fault, last trip
+  uint16_t m_GfiHandledMsMax;
 #endif // GFI
   AdcPin adcPilot;
 #ifdef CURRENT_PIN
@@ -181,6 +197,16 @@ class J1772EVSEController {
   uint16_t m_wFlags; // ECF_xxx
   uint16_t m_wVFlags; // ECVF_xxx
   static THRESH_DATA m_ThreshData;
+#ifdef PAFC_PWM
+  // last plateau readings, kept when ReadPilot() can't sync to the PWM
+  uint16_t m_PlateauHigh;
+  uint16_t m_PlateauLow;
+#endif // PAFC_PWM
+#ifdef THRESH_CAL
+  uint8_t m_ThreshSrc;  // THRESH_SRC_xxx
+  uint16_t m_CalP;      // levels measured at boot, 0 = no calibration this boot
+  uint16_t m_CalN;
+#endif // THRESH_CAL
   uint8_t m_EvseState;
   uint8_t m_PrevEvseState;
   uint8_t m_TmpEvseState;
@@ -189,9 +215,15 @@ class J1772EVSEController {
   unsigned long m_TmpEvseStateStart;
   unsigned long m_TmpPilotStateStart;
   uint8_t m_MaxHwCurrentCapacity; // max L2 amps that can be set
-  uint8_t m_CurrentCapacity; // max amps we can output
+  uint8_t m_SavedCapacity; // EOFS_CURRENT_CAPACITY_Lx for the service level, 0 = read it again
+  uint16_t m_CurrentCapacityDa; // max current we can output, 0.1A
+  SetpointArbiter m_Setpoint; // m_CurrentCapacityDa is the lowest of its limits
   unsigned long m_ChargeOnTimeMS; // millis() when relay last closed
   unsigned long m_ChargeOffTimeMS; // millis() when relay last opened
+  unsigned long m_ChargeReqMs; // millis() when we last entered STATE C
+  unsigned long m_ChargeReqPollMs; // last Update() while waiting to close the relay
+  uint16_t m_ChargeStartMs; // STATE C -> relay closed, last session
+  uint16_t m_ChargeStartGapMs; // longest gap between Update() calls in that window
   time_t m_ElapsedChargeTime;
   time_t m_ElapsedChargeTimePrev;
   time_t m_AccumulatedChargeTime;
@@ -202,8 +234,27 @@ class J1772EVSEController {
   MennekesLock m_MennekesLock;
 #endif // MENNEKES_LOCK
 #ifdef OVERCURRENT_THRESHOLD
-  unsigned long m_OverCurrentStartMs;
+  OverCurrent m_OverCurrent;
 #endif // OVERCURRENT_THRESHOLD
+  // graceful shutdown: pilot is at P12 and we're giving the EV time to
+  // stop drawing current before opening the relay and hard faulting
+  uint8_t m_ShutdownState; // fault state to hard fault in, 0 = none pending
+  uint16_t m_ShutdownWaitMs;
+  unsigned long m_ShutdownStartMs;
+#ifdef GROUP_SHARE
+  GroupMember m_Group;
+#endif // GROUP_SHARE
+#ifdef PV_SURPLUS
+  PvSurplus m_Pv;
+#endif // PV_SURPLUS
+#ifdef PILOT_CHECK
+  PilotCheck m_PilotCheck;
+  unsigned long m_PchkMs;     // when the wait for the next run started
+  unsigned long m_PchkWaitMs;
+#endif // PILOT_CHECK
+#ifdef AUTO_PAUSE
+  uint8_t m_AutoPaused; // we put it to sleep for GROUP_SHARE/PV_SURPLUS/HEARTBEAT_SUPERVISION
+#endif
 #ifdef OEV6
   uint8_t m_isV6;
 #endif
@@ -251,7 +302,29 @@ class J1772EVSEController {
 
   uint8_t doPost();
 #endif // ADVPWR
+  void chargingStart();
+  void shutdownStart(uint8_t evsestate,uint16_t waitms);
+  void setpointApply(uint8_t updatelcd);
+#ifdef GROUP_SHARE
+  void groupApply();
+#endif // GROUP_SHARE
+#ifdef PV_SURPLUS
+  void pvApply();
+#endif // PV_SURPLUS
+#ifdef THRESH_CAL
+  uint8_t threshDerive(uint16_t p,uint16_t n,PTHRESH_DATA ptd);
+  void threshSave(uint8_t src);
+  void threshCal();
+#endif // THRESH_CAL
+#ifdef PILOT_CHECK
+  void pilotCheck(unsigned long curms,uint16_t plow,uint16_t phigh);
+#endif // PILOT_CHECK
+#ifdef AUTO_PAUSE
+  uint8_t autoPauseWanted();
+  void autoPauseApply();
+#endif
   void chargingOn();
+  void relayOpen();
   void chargingOff();
   uint8_t chargingIsOn() { return vFlagIsSet(ECVF_CHARGING_ON); }
 
@@ -262,6 +335,7 @@ class J1772EVSEController {
 
 #ifdef AMMETER
   unsigned long m_AmmeterReading;
+  uint16_t m_AmmeterPeak; // larger half cycle peak of the last read, ADC counts
   int32_t m_ChargingCurrent;
   int16_t m_AmmeterCurrentOffset;
   int16_t m_CurrentScaleFactor;
@@ -282,7 +356,14 @@ class J1772EVSEController {
   uint16_t      m_HsInterval;   // Number of seconds HS will wait for a heartbeat before reducing ampacity to m_IFallback.  If 0 disable.
   uint8_t       m_IFallback;    // HEARTBEAT_SUPERVISION fallback current in Amperes.  
   uint8_t       m_HsTriggered;  // Will be 0 if HEARTBEAT_SUPERVISION has never had a missed pulse
-  unsigned long m_HsLastPulse;  // The last time we saw a HS pulse or the last time m_HsInterval elpased without seeing one.  Set to 0 if HEARTBEAT_SUPERVISION triggered                                   
+  unsigned long m_HsLastPulse;  // The last time we saw a HS pulse, or the missed pulse was acked
+  // escalation tiers, seconds since the last pulse like m_HsInterval. 0 = not used
+  // with either one set, the limit is lifted as soon as pulses come back instead of waiting for the ack
+  uint16_t      m_HsTier2Sec;   // reduce further to m_HsTier2Amps
+  uint8_t       m_HsTier2Amps;
+  uint16_t      m_HsTier3Sec;   // go to sleep
+  uint8_t       m_HsTier;       // 0 = pulses OK, 1..HS_TIER_SLEEP = tier in effect
+  void hsApply();
 #endif //HEARTBEAT_SUPERVISION
 
 public:
@@ -329,11 +410,32 @@ public:
 
   uint8_t SetMaxHwCurrentCapacity(uint8_t amps);
   uint8_t GetMaxHwCurrentCapacity() { return m_MaxHwCurrentCapacity; }
+  // whole amps, rounded down
   uint8_t GetCurrentCapacity() { 
-    return m_CurrentCapacity; 
+    return m_CurrentCapacityDa / 10; 
   }
+  uint16_t GetCurrentCapacityDa() { return m_CurrentCapacityDa; }
   uint8_t GetMaxCurrentCapacity();
-  int SetCurrentCapacity(uint8_t amps,uint8_t updatelcd=0,uint8_t nosave=0);
+  // sets the SP_SRC_USER limit, or SP_SRC_TEMP if nosave
+  int SetCurrentCapacity(uint8_t amps,uint8_t updatelcd=0,uint8_t nosave=0) {
+    return SetCurrentCapacityDa(amps * 10,updatelcd,nosave);
+  }
+  // da: 0.1A. only whole amps are saved to EEPROM, the tenths last until
+  // the next reboot or service level change
+  int SetCurrentCapacityDa(uint16_t da,uint8_t updatelcd=0,uint8_t nosave=0);
+  // limits from the other SP_SRC_xxx sources. the pilot gets the lowest
+  // amps = SP_NO_LIMIT / da = SP_NO_LIMIT_DA clears the limit
+  void SetCurrentLimit(uint8_t src,uint8_t amps) { SetCurrentLimitDa(src,SpAmpsToDa(amps)); }
+  void SetCurrentLimitDa(uint8_t src,uint16_t da) {
+    m_Setpoint.Post(src,da);
+    setpointApply(0);
+  }
+  void ClrCurrentLimit(uint8_t src) { SetCurrentLimitDa(src,SP_NO_LIMIT_DA); }
+  // whole amps, SP_NO_LIMIT if none
+  uint8_t GetCurrentLimit(uint8_t src) {
+    uint16_t da = m_Setpoint.GetLimit(src);
+    return (da == SP_NO_LIMIT_DA) ? SP_NO_LIMIT : da / 10;
+  }
 
   time_t GetElapsedChargeTime() { 
     return m_ElapsedChargeTime+m_AccumulatedChargeTime; 
@@ -349,6 +451,15 @@ public:
   PTHRESH_DATA GetThreshData() { 
     return &m_ThreshData; 
   }
+#ifdef THRESH_CAL
+  // override the thresholds, saved to EEPROM. ptd = NULL to go back to
+  // this boot's calibration, or the defaults if there wasn't one
+  // returns 1 if the thresholds aren't in order
+  uint8_t SetThresh(PTHRESH_DATA ptd);
+  uint8_t GetThreshSrc() { return m_ThreshSrc; }
+  uint16_t GetCalP() { return m_CalP; }
+  uint16_t GetCalN() { return m_CalN; }
+#endif // THRESH_CAL
   uint8_t DiodeCheckEnabled() { 
     return (m_wFlags & ECF_DIODE_CHK_DISABLED) ? 0 : 1;
   }
@@ -407,11 +518,16 @@ public:
     else clrVFlags(ECVF_LIMIT_SLEEP);
   }
   uint8_t LimitSleepIsSet() { return vFlagIsSet(ECVF_LIMIT_SLEEP); }
+  void GetChargeStartLatency(uint16_t *startms,uint16_t *gapms) {
+    *startms = m_ChargeStartMs;
+    *gapms = m_ChargeStartGapMs;
+  }
 
 #ifdef GFI
   void SetGfiTripped();
   uint8_t GfiTripped() { return vFlagIsSet(ECVF_GFI_TRIPPED); }
   uint8_t GetGfiTripCnt() { return m_GfiTripCnt+1; }
+  void GetGfiLatency(uint16_t *openus,uint16_t *openusmax,uint16_t *handledms,uint16_t *handledmsmax);
 #ifdef GFI_SELFTEST
   uint8_t GfiSelfTestEnabled() {
     return (m_wFlags & ECF_GFI_TEST_DISABLED) ? 0 : 1;
@@ -430,8 +546,35 @@ public:
   void EnableTempChk(uint8_t tf);
 #endif //TEMPERATURE_MONITORING
 
+#ifdef GROUP_SHARE
+  // allocation from the group coordinator, 0 = pause
+  void GroupAllocate(uint8_t amps);
+  // share a groupamps circuit with other EVSEs. groupamps = 0 to leave
+  void GroupJoin(uint8_t groupamps,uint8_t fallbackamps);
+  GroupMember *GetGroup() { return &m_Group; }
+#endif // GROUP_SHARE
+
+#ifdef AUTO_PAUSE
+  uint8_t AutoPaused() { return m_AutoPaused; }
+#endif
+
+#ifdef PV_SURPLUS
+  // site grid power from the gateway, + = import, - = export
+  // volts = 0 to use the configured voltage
+  void PvReading(int32_t gridw,uint16_t volts);
+  // saved to EEPROM
+  void PvConfig(uint8_t enabled,int16_t exportw,uint16_t holdsec);
+  PvSurplus *GetPv() { return &m_Pv; }
+#endif // PV_SURPLUS
+
+#ifdef PILOT_CHECK
+  // run a pilot check now. returns 1 if the pilot isn't on PWM
+  uint8_t PilotCheckNow();
+  PilotCheck *GetPilotCheck() { return &m_PilotCheck; }
+#endif // PILOT_CHECK
+
 #ifdef HEARTBEAT_SUPERVISION
-int HeartbeatSupervision(uint16_t interval, uint8_t amps);
+int HeartbeatSupervision(uint16_t interval, uint8_t amps, uint16_t tier2sec=0, uint8_t tier2amps=0, uint16_t tier3sec=0);
 int HsPulse();
 int HsRestoreAmpacity();
 int HsExpirationCheck();
@@ -439,6 +582,10 @@ int HsAckMissedPulse(uint8_t ack);
 int GetHearbeatInterval();
 int GetHearbeatCurrent();
 int GetHearbeatTrigger();
+uint16_t GetHsTier2Sec() { return m_HsTier2Sec; }
+uint8_t GetHsTier2Amps() { return m_HsTier2Amps; }
+uint16_t GetHsTier3Sec() { return m_HsTier3Sec; }
+uint8_t GetHsTier() { return m_HsTier; }
 #endif //HEARTBEAT_SUPERVISION
 
 
@@ -490,6 +637,9 @@ int GetHearbeatTrigger();
     else clrVFlags(ECVF_AMMETER_CAL);
   }
 #endif // ECVF_AMMETER_CAL
+  // raw readings for calibration, bypassing the moving average.
+  // measures cnt cycles, cnt <= AMMETER_BURST_MAX
+  void AmmeterBurst(uint8_t cnt,uint32_t *sum,uint32_t *sumsq);
   void ZeroChargingCurrent() { m_ChargingCurrent = 0; }
   uint8_t GetInstantaneousChargingAmps() {
     readAmmeter();
@@ -75,19 +75,19 @@ void J1772Pilot::SetState(PILOT_STATE state)
   m_State = state;  // 更新当前状态
 }
 
-// 设置 EVSE 当前容量（单位：安培），并输出 1KHz 方波到数字引脚 10，通过定时器 1
-int J1772Pilot::SetPWM(int amps)
+// 设置 EVSE 当前容量（单位：0.1A），并输出 1KHz 方波到数字引脚 10，通过定时器 1
+int J1772Pilot::SetPWMDa(uint16_t da)
 {
 #ifdef PAFC_PWM
   // 计算占空比：OCR1A(B) / ICR1 * 100%
 
   unsigned cnt;
-  if ((amps >= 6) && (amps <= 51)) {
+  if ((da >= 60) && (da <= 510)) {
     // 安培值 = (占空比 %) X 0.6
-    cnt = amps * (TOP / 60);  // 计算对应的占空比计数值
-  } else if ((amps > 51) && (amps <= 80)) {
+    cnt = (uint32_t)da * TOP / 600;  // 计算对应的占空比计数值
+  } else if ((da > 510) && (da <= 800)) {
     // 安培值 = (占空比 % - 64) X 2.5
-    cnt = (amps * (TOP / 250)) + (64 * (TOP / 100));  // 计算对应的占空比计数值
+    cnt = ((uint32_t)da * TOP / 2500) + (64 * (TOP / 100));  // 计算对应的占空比计数值
   }
   else {
     return 1;  // 返回 1 表示无效的安培值
@@ -103,11 +103,12 @@ int J1772Pilot::SetPWM(int amps)
 
   return 0;  // 返回 0 表示成功
 #else // 快速 PWM
+  // 分辨率只有 0.4%（约 0.24A），0.1A 的设置向下取到最近的一档
   uint8_t ocr1b = 0;
-  if ((amps >= 6) && (amps <= 51)) {
-    ocr1b = 25 * amps / 6 - 1;  // J1772 协议中定义：可用电流 = (占空比 %) X 0.6
-  } else if ((amps > 51) && (amps <= 80)) {
-    ocr1b = amps + 159;  // J1772 协议中定义：可用电流 = (占空比 % - 64) X 2.5
+  if ((da >= 60) && (da <= 510)) {
+    ocr1b = 25 * da / 60 - 1;  // J1772 协议中定义：可用电流 = (占空比 %) X 0.6
+  } else if ((da > 510) && (da <= 800)) {
+    ocr1b = da / 10 + 159;  // J1772 协议中定义：可用电流 = (占空比 % - 64) X 2.5
   }
   else {
     return 1;  // 返回 1 表示无效的安培值
@@ -137,3 +138,77 @@ int J1772Pilot::SetPWM(int amps)
   }
 #endif // PAFC_PWM
 }
+
+#ifdef PAFC_PWM
+uint16_t J1772Pilot::GetTop()
+{
+  return TOP;
+}
+
+uint16_t J1772Pilot::GetOcr()
+{
+#if (PILOT_IDX == 1) // PB1
+  return OCR1A;
+#else // PB2
+  return OCR1B;
+#endif
+}
+
+// 在 Timer1 计数经过 cnt 的时刻启动 ADC 转换，采样点和 pilot 波形同步
+// 开着中断等到计数进入 cnt 之前的 PILOT_SAMPLE_WINDOW 范围，才关中断等它经过 cnt，
+// 这样关中断的时间不超过十几微秒，采样时刻也不会被中断打乱
+int16_t J1772Pilot::SampleAt(AdcPin *adc,uint16_t cnt,uint8_t up,uint8_t fast)
+{
+  adc->select();
+  uint16_t lo = up ? cnt - PILOT_SAMPLE_WINDOW : cnt;
+  uint16_t hi = up ? cnt : cnt + PILOT_SAMPLE_WINDOW;
+  uint8_t sreg = SREG;
+  unsigned long startms = millis();
+  for (;;) {
+    cli();
+    uint16_t t1 = TCNT1;
+    uint16_t t2 = TCNT1;
+    if ((t1 > lo) && (t1 < hi) && ((t2 > t1) == (up != 0))) break; // 保持关中断
+    SREG = sreg;
+    if ((millis() - startms) > 3) return -1;
+  }
+  if (up) while (TCNT1 < cnt);
+  else while (TCNT1 > cnt);
+
+  // fast: ADC 时钟临时改为 16 分频。启动转换要等下一个 ADC 时钟，128 分频时
+  // 这个等待最长 8us，会让找到的边沿随计数值摆动。只要分清高低电平，精度够用
+  uint8_t adcsra = ADCSRA;
+  if (fast) ADCSRA = (adcsra & ~(_BV(ADPS2)|_BV(ADPS1)|_BV(ADPS0))) | _BV(ADPS2) | _BV(ADSC);
+  else ADCSRA = adcsra | _BV(ADSC);
+  SREG = sreg;
+  while (bit_is_set(ADCSRA, ADSC));
+  uint8_t low = ADCL;
+  uint8_t high = ADCH;
+  ADCSRA = adcsra;
+  return (high << 8) | low;
+}
+
+#ifdef PILOT_CHECK
+// P&F 模式下计数每次回到 BOTTOM 时置位 TOV1，没有用到这个中断，直接查询标志
+uint16_t J1772Pilot::MeasureFreq()
+{
+  unsigned long startus = 0;
+  unsigned long us = 0;
+  unsigned long startms = millis();
+  uint8_t n = 0;
+  TIFR1 = _BV(TOV1); // 写 1 清除之前留下的标志
+  while (n <= PCHK_FREQ_PERIODS) {
+    if (TIFR1 & _BV(TOV1)) {
+      us = micros();
+      TIFR1 = _BV(TOV1);
+      if (!n) startus = us;
+      n++;
+    }
+    else if ((millis() - startms) > (PCHK_FREQ_PERIODS * 2 + 2)) {
+      return 0; // Timer1 没有在运行
+    }
+  }
+  return (uint16_t)(PCHK_FREQ_PERIODS * 10000000UL / (us - startus));
+}
+#endif // PILOT_CHECK
+#endif // PAFC_PWM
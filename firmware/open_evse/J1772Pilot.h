@@ -20,6 +20,15 @@
  * Boston, MA 02111-1307, USA.
  */
 
+#ifdef PAFC_PWM
+// SampleAt() waits for the count with interrupts off from this many counts
+// before cnt, so cnt has to be this far from the end the count comes from
+#define PILOT_SAMPLE_WINDOW 200
+// the ADC samples 1.5 ADC clocks after it is started, plus up to 1 clock to
+// get in step with the ADC clock. 12-20us at the usual 125kHz, in Timer1 counts
+#define PILOT_ADC_DELAY 256
+#endif // PAFC_PWM
+
 typedef enum {
   PILOT_STATE_P12, PILOT_STATE_PWM, PILOT_STATE_N12
 }
@@ -37,5 +46,19 @@ public:
   PILOT_STATE GetState() { 
     return m_State; 
   }
-  int SetPWM(int amps); // 12V 1KHz PWM
+  int SetPWM(int amps) { return SetPWMDa(amps * 10); } // 12V 1KHz PWM
+  // da: 0.1A. PAFC_PWM can set the duty cycle to 1/8000, fast PWM only to 1/250
+  int SetPWMDa(uint16_t da);
+#ifdef PAFC_PWM
+  uint16_t GetTop();
+  uint16_t GetOcr(); // commanded compare value
+  // start adc as the Timer1 count passes cnt, rising if up = 1, falling if 0
+  // fast = 1: 1MHz ADC clock, less accurate but samples sooner and with less jitter
+  // returns the reading, -1 if the count didn't come round
+  int16_t SampleAt(AdcPin *adc,uint16_t cnt,uint8_t up,uint8_t fast);
+#ifdef PILOT_CHECK
+  // times PCHK_FREQ_PERIODS periods. returns the frequency in 0.1Hz, 0 if Timer1 is stopped
+  uint16_t MeasureFreq();
+#endif // PILOT_CHECK
+#endif // PAFC_PWM
 };
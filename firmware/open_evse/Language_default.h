@@ -79,4 +79,5 @@
 #define STR_L1						     "L1"  
 #define STR_L2						     "L2"  
 #define STR_OVER_CURRENT "OVERCURRENT"
+#define STR_PILOT_ERROR "PILOT ERROR"
 //#endif
@@ -100,6 +100,12 @@ LiquidTWI2::LiquidTWI2(uint8_t i2cAddr,uint8_t detectDevice, uint8_t backlightIn
 #endif
 
   _backlightInverted = backlightInverted;
+  _bursting = 0;
+  _burstCnt = 0;
+  memset(&_burstXfer,0,sizeof(_burstXfer));  // status = TWI_XS_DONE
+#ifdef OBD_STATS
+  _txBytes = 0;
+#endif
 
   // 将 i2cAddr 转换为我们的内部类状态
   _i2cAddr = i2cAddr;
@@ -193,6 +199,12 @@ void LiquidTWI2::begin(uint8_t cols, uint8_t lines, uint8_t dotsize) {
         }
     }
 #endif
+
+    // 字节模式：寄存器地址在GPIOA/GPIOB之间切换而不是递增，突发写入用
+    Wire.beginTransmission(MCP23017_ADDRESS | _i2cAddr);
+    wiresend(MCP23017_IOCONA);
+    wiresend(MCP230XX_IOCON_SEQOP);
+    Wire.endTransmission();
 #endif // MCP23017
 #if defined(MCP23017)&&defined(MCP23008)
   }
@@ -235,6 +247,13 @@ void LiquidTWI2::begin(uint8_t cols, uint8_t lines, uint8_t dotsize) {
         }
     }
 #endif
+
+    // 字节模式：寄存器地址不递增，突发写入时可以连续写GPIO
+    // 必须在上面的连续初始化之后设置
+    Wire.beginTransmission(MCP23008_ADDRESS | _i2cAddr);
+    wiresend(MCP23008_IOCON);
+    wiresend(MCP230XX_IOCON_SEQOP);
+    Wire.endTransmission();
 #endif // MCP23008
 #if defined(MCP23017)&&defined(MCP23008)
   }
@@ -330,6 +349,7 @@ void LiquidTWI2::clear()
   if (!_deviceDetected) return;  // 如果设备未检测到，则返回
 #endif
   command(LCD_CLEARDISPLAY);  // 清空显示，设置光标位置为零
+  burstSync();  // 突发模式下先发送完再开始等待
   delayMicroseconds(2000);  // 此命令需要较长时间！
 }
 
@@ -339,6 +359,7 @@ void LiquidTWI2::home()
   if (!_deviceDetected) return;  // 如果设备未检测到，则返回
 #endif
   command(LCD_RETURNHOME);  // 将光标位置设置为零
+  burstSync();  // 突发模式下先发送完再开始等待
   delayMicroseconds(2000);  // 此命令需要较长时间！
 }
 
@@ -476,6 +497,20 @@ inline size_t LiquidTWI2::write(uint8_t value) {
   send(value, HIGH);  // 发送数据
   return 1;
 }
+
+// 突发写入一串字符
+size_t LiquidTWI2::write(const uint8_t *buffer, size_t size) {
+#ifdef DETECT_DEVICE
+  if (!_deviceDetected) return size;  // 如果没有检测到设备，则返回
+#endif
+  uint8_t nested = _bursting;  // 调用者已经在beginBurst()中
+  _bursting = 1;
+  for (size_t i = 0; i < size; i++) {
+    send(buffer[i], HIGH);
+  }
+  if (!nested) endBurst();
+  return size;
+}
 #else
 inline void LiquidTWI2::write(uint8_t value) {
 #ifdef DETECT_DEVICE
@@ -511,8 +546,8 @@ void LiquidTWI2::setBacklight(uint8_t status) {
   if (_mcpType == LTI_TYPE_MCP23017) {
 #endif
 #ifdef MCP23017
-  // LED亮起时，位被清除
-  _backlightBits = M17_BIT_LB | M17_BIT_LG | M17_BIT_LR;  // 所有背光关闭
+  // LED亮起时，位被清除。蜂鸣器位保持不变
+  _backlightBits = (_backlightBits & M17_BIT_BZ) | M17_BIT_LB | M17_BIT_LG | M17_BIT_LR;  // 所有背光关闭
   if (status & RED) _backlightBits &= ~M17_BIT_LR;  // 红色打开
   if (status & GREEN) _backlightBits &= ~M17_BIT_LG;  // 绿色打开
   if (status & BLUE) _backlightBits &= ~M17_BIT_LB;  // 蓝色打开
@@ -549,10 +584,10 @@ void LiquidTWI2::send(uint8_t value, uint8_t mode) {
   if (mode) buf |= (M17_BIT_RS | M17_BIT_EN) >> 8;  // 设置RS和EN
   else buf |= M17_BIT_EN >> 8;  // 只设置EN
 
-  burstBits8b(buf);  // 发送数据
+  strobe8b(buf);  // 发送数据
 
   buf &= ~(M17_BIT_EN >> 8);  // 关闭EN
-  burstBits8b(buf);  // 重新发送
+  strobe8b(buf);  // 重新发送
 
   // 发送低4位
   buf = _backlightBits >> 8;
@@ -564,10 +599,10 @@ void LiquidTWI2::send(uint8_t value, uint8_t mode) {
   if (mode) buf |= (M17_BIT_RS | M17_BIT_EN) >> 8;  // 设置RS和EN
   else buf |= M17_BIT_EN >> 8;  // 只设置EN
 
-  burstBits8b(buf);  // 发送数据
+  strobe8b(buf);  // 发送数据
 
   buf &= ~(M17_BIT_EN >> 8);  // 关闭EN
-  burstBits8b(buf);  // 重新发送
+  strobe8b(buf);  // 重新发送
 #endif // MCP23017
 #if defined(MCP23017) && defined(MCP23008)
   }
@@ -581,10 +616,10 @@ void LiquidTWI2::send(uint8_t value, uint8_t mode) {
   else buf |= 2 << 1;  // 仅启用EN
 
   buf |= (_displaycontrol & LCD_BACKLIGHT) ? 0x80 : 0x00;  // 使用DISPLAYCONTROL命令来掩码背光位
-  burstBits8(buf);  // 发送数据
+  strobe8(buf);  // 发送数据
 
   buf &= ~(1 << 2);  // 关闭EN
-  burstBits8(buf);  // 重新发送
+  strobe8(buf);  // 重新发送
 
   // 发送低4位
   buf = (value & B1111) << 3;  // 提取低4位并左移到数据引脚
@@ -592,9 +627,12 @@ void LiquidTWI2::send(uint8_t value, uint8_t mode) {
   else buf |= 2 << 1;  // 仅启用EN
 
   buf |= (_displaycontrol & LCD_BACKLIGHT) ? 0x80 : 0x00;  // 使用DISPLAYCONTROL命令来掩码背光位
-  burstBits8(buf);  // 发送数据
+  strobe8(buf);  // 发送数据
   buf &= ~(1 << 2);  // 关闭EN
-  burstBits8(buf);  // 重新发送
+  strobe8(buf);  // 重新发送
+  // 突发模式下每字节只间隔约22us，少于HD44780执行一条指令的时间（37us+）
+  // 多发一次同样的值凑够间隔
+  if (_bursting) strobe8(buf);
 #endif // MCP23008
 #if defined(MCP23017) && defined(MCP23008)
   }
@@ -605,11 +643,15 @@ void LiquidTWI2::send(uint8_t value, uint8_t mode) {
 // 值字节顺序为 BA
 void LiquidTWI2::burstBits16(uint16_t value) {
   // 我们在需要时使用此方法将位突发发送到 GPIO 芯片。避免重复的代码。
+  burstSync();  // 排队中的突发传输先发完，保持写入顺序
   Wire.beginTransmission(MCP23017_ADDRESS | _i2cAddr);
   wiresend(MCP23017_GPIOA);
   wiresend(value & 0xFF); // 发送 A 位
   wiresend(value >> 8);   // 发送 B 位
   while(Wire.endTransmission());
+#ifdef OBD_STATS
+  _txBytes += 4; // 地址、寄存器、A、B
+#endif
 }
 
 /*
@@ -623,19 +665,105 @@ void LiquidTWI2::burstBits8a(uint8_t value) {
 */
 void LiquidTWI2::burstBits8b(uint8_t value) {
   // 我们在需要时使用此方法将位突发发送到 GPIO 芯片。避免重复的代码。
+  burstSync();  // 排队中的突发传输先发完，保持写入顺序
   Wire.beginTransmission(MCP23017_ADDRESS | _i2cAddr);
   wiresend(MCP23017_GPIOB);
   wiresend(value); // 最后的位已经压缩，我们完成了。
   while(Wire.endTransmission());
+#ifdef OBD_STATS
+  _txBytes += 3; // 地址、寄存器、数据
+#endif
 }
 #endif // MCP23017
 #ifdef MCP23008
 void LiquidTWI2::burstBits8(uint8_t value) {
   // 我们在需要时使用此方法将位突发发送到 GPIO 芯片。避免重复的代码。
+  burstSync();  // 排队中的突发传输先发完，保持写入顺序
   Wire.beginTransmission(MCP23008_ADDRESS | _i2cAddr);
   wiresend(MCP23008_GPIO);
   wiresend(value); // 最后的位已经压缩，我们完成了。
   while(Wire.endTransmission());
+#ifdef OBD_STATS
+  _txBytes += 3; // 地址、寄存器、数据
+#endif
+}
+#endif // MCP23008
+
+// 在_burstBuf中预留cnt字节，放不下时先发送，返回预留的位置
+uint8_t *LiquidTWI2::burstReserve(uint8_t i2cAddr, uint8_t reg, uint8_t cnt) {
+  if (_burstCnt && ((_burstCnt + cnt) > LTI_BURST_LEN)) {
+    burstFlush();
+  }
+  if (!_burstCnt) {
+    burstWait();  // 上一次的突发传输可能还在发送_burstBuf
+    _burstAddr = i2cAddr | _i2cAddr;
+    _burstBuf[0] = reg;
+    _burstCnt = 1;
+  }
+  uint8_t *p = _burstBuf + _burstCnt;
+  _burstCnt += cnt;
+  return p;
+}
+
+// 把_burstBuf中的突发传输提交到twi队列，不等它发完
+// 和burstBits*一样失败后重发，由burstDone()在中断里重新提交。
+// 次数有限，LCD掉线时不会卡住主循环，丢掉的内容下次刷新屏幕时补上
+void LiquidTWI2::burstFlush() {
+  if (_burstCnt) {
+    _burstXfer.address = _burstAddr;
+    _burstXfer.txData = _burstBuf;
+    _burstXfer.txLen = _burstCnt;
+    _burstXfer.rxLen = 0;
+    _burstXfer.cb = burstDone;
+    _burstXfer.ctx = this;
+    _burstRetries = LTI_BURST_RETRIES;
+    twi_post(&_burstXfer);
+#ifdef OBD_STATS
+    _txBytes += _burstCnt + 1; // 加上地址字节
+#endif
+    _burstCnt = 0;
+  }
+}
+
+// 传输完成的回调，在关中断时调用
+void LiquidTWI2::burstDone(twi_xfer *x) {
+  LiquidTWI2 *lcd = (LiquidTWI2 *)x->ctx;
+  if ((x->status != TWI_XS_DONE) && lcd->_burstRetries) {
+    lcd->_burstRetries--;
+    twi_post(x);
+  }
+}
+
+// 等待提交的突发传输（包括重发）结束，之后才能改写_burstBuf
+void LiquidTWI2::burstWait() {
+  while ((_burstXfer.status == TWI_XS_QUEUED) || (_burstXfer.status == TWI_XS_ACTIVE)) {
+    twi_poll();  // 超时的传输在这里结束
+  }
+}
+
+#ifdef MCP23017
+// 发送一次EN选通，突发模式下加入打开的传输
+// GPIOA/GPIOB成对写入，因为字节模式下寄存器地址在A/B之间切换
+void LiquidTWI2::strobe8b(uint8_t value) {
+  if (_bursting) {
+    uint8_t *p = burstReserve(MCP23017_ADDRESS, MCP23017_GPIOA, 2);
+    p[0] = (uint8_t)_backlightBits; // A 位：背光和蜂鸣器，保持不变
+    p[1] = value;                   // B 位
+  }
+  else {
+    burstBits8b(value);
+  }
+}
+#endif // MCP23017
+#ifdef MCP23008
+// 发送一次EN选通，突发模式下加入打开的传输
+void LiquidTWI2::strobe8(uint8_t value) {
+  if (_bursting) {
+    *burstReserve(MCP23008_ADDRESS, MCP23008_GPIO, 1) = value;
+  }
+  else {
+    burstBits8(value);
+  }
 }
 #endif // MCP23008
 
@@ -653,6 +781,7 @@ uint8_t LiquidTWI2::readRegister(uint8_t reg) {
 
 // 设置寄存器
 void LiquidTWI2::setRegister(uint8_t reg, uint8_t value) {
+    burstSync();  // 不要越过排队中的突发传输
     Wire.beginTransmission(MCP23017_ADDRESS | _i2cAddr);
     wiresend(reg);
     wiresend(value);
@@ -664,6 +793,8 @@ void LiquidTWI2::setRegister(uint8_t reg, uint8_t value) {
 void LiquidTWI2::buzz(long duration, uint16_t freq) {
   int currentRegister = 0;
 
+  burstSync();  // 不要越过排队中的突发传输
+
   // 读取 gpio 寄存器
   Wire.beginTransmission(MCP23017_ADDRESS | _i2cAddr);
   wiresend(MCP23017_GPIOA);
@@ -682,11 +813,13 @@ void LiquidTWI2::buzz(long duration, uint16_t freq) {
         wiresend(MCP23017_GPIOA);
         wiresend(currentRegister |= M17_BIT_BZ);
         while(Wire.endTransmission());
+        _backlightBits |= M17_BIT_BZ;  // 突发模式写 A 口时保持蜂鸣器状态
     while((long)(ontime + (cycletime/2) - micros()) > 0);
         Wire.beginTransmission(MCP23017_ADDRESS | _i2cAddr);
         wiresend(MCP23017_GPIOA);
         wiresend(currentRegister &= ~M17_BIT_BZ);
         while(Wire.endTransmission());
+        _backlightBits &= ~M17_BIT_BZ;
     while((long)(ontime + cycletime - micros()) > 0);
    }
 }
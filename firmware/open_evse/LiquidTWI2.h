@@ -3,6 +3,7 @@
 
 #include <inttypes.h>
 #include "Print.h"
+#include "twi.h"
 
 
 // for memory-constrained projects, comment out the MCP230xx that doesn't apply
@@ -17,6 +18,13 @@
 // code w/o an LCD installed, and not get hung in the write functions
 #define DETECT_DEVICE // enable device detection code
 
+// bytes in one burst transaction, including the register address.
+// same as the Wire buffer
+#define LTI_BURST_LEN 32
+// a failed burst is sent again this many times, then dropped. the next
+// screen update repaints it, and a missing LCD can't hang loop()
+#define LTI_BURST_RETRIES 3
+
 // for setBacklight() with MCP23017
 #define OFF 0x0
 #define RED 0x1
@@ -82,6 +90,11 @@
 #define MCP23017_GPIOB 0x13
 #define MCP23017_OLATB 0x15
 
+// IOCON bit which stops the register address from incrementing
+// after each byte, so that one transaction can write GPIO many times.
+// MCP23017 w/ BANK=0 toggles between the A/B registers instead
+#define MCP230XX_IOCON_SEQOP 0x20
+
 // commands
 #define LCD_CLEARDISPLAY   0x01
 #define LCD_RETURNHOME     0x02
@@ -161,6 +174,24 @@ public:
 	virtual void write(uint8_t);
 #endif
 	void command(uint8_t);
+#if defined(ARDUINO) && (ARDUINO >= 100)
+	// writes a run of characters in as few I2C transactions as possible
+	virtual size_t write(const uint8_t *buffer,size_t size);
+	using Print::write;
+#endif
+	// between beginBurst() and endBurst(), commands and characters are
+	// packed into as few I2C transactions as LTI_BURST_LEN allows,
+	// instead of one transaction per nibble strobe. each one is posted
+	// to the twi queue, so endBurst() returns while the last one is
+	// still going out
+	void beginBurst() { _bursting = 1; }
+	void endBurst() { burstFlush(); _bursting = 0; }
+#ifdef OBD_STATS
+	// bytes sent to the expander by the LCD writes, counting the address
+	// byte of each I2C transaction. resends after an error aren't counted
+	uint32_t TxBytes() { return _txBytes; }
+	void ClearTxBytes() { _txBytes = 0; }
+#endif // OBD_STATS
 #ifdef MCP23017
 	uint8_t readButtons();
   //check registers
@@ -178,13 +209,20 @@ public:
 
 private:
 	void send(uint8_t, uint8_t);
+	uint8_t *burstReserve(uint8_t i2cAddr,uint8_t reg,uint8_t cnt);
+	void burstFlush();
+	void burstWait();
+	void burstSync() { burstFlush(); burstWait(); }
+	static void burstDone(twi_xfer *);
 #ifdef MCP23017
 	void burstBits16(uint16_t);
 	void burstBits8b(uint8_t);
 	//void burstBits8a(uint8_t);
+	void strobe8b(uint8_t);
 #endif
 #ifdef MCP23008
 	void burstBits8(uint8_t);
+	void strobe8(uint8_t);
 #endif
 
 	uint8_t _displayfunction;
@@ -193,11 +231,20 @@ private:
 	uint8_t _numlines,_currline;
 	uint8_t _i2cAddr;
 	uint8_t _backlightInverted;
+	uint8_t _bursting; // in beginBurst()
+	uint8_t _burstCnt; // # bytes in _burstBuf, 0 = none
+	uint8_t _burstAddr; // I2C address of the burst in _burstBuf
+	uint8_t _burstBuf[LTI_BURST_LEN]; // register address, then the strobes
+	uint8_t _burstRetries; // resends left for _burstXfer
+	twi_xfer _burstXfer; // posts _burstBuf
+#ifdef OBD_STATS
+	uint32_t _txBytes;
+#endif // OBD_STATS
 #ifdef DETECT_DEVICE
 	uint8_t _deviceDetected;
 #endif // DETECT_DEVICE
 #ifdef MCP23017
-	uint16_t _backlightBits; // only for MCP23017
+	uint16_t _backlightBits; // only for MCP23017. includes the buzzer bit
 #endif
 #if defined(MCP23017)&&defined(MCP23008)
 	uint8_t _mcpType; // LTI_MODE_xx
@@ -71,12 +71,18 @@ int16_t MCP9808::read16(uint8_t reg) {
 int16_t MCP9808::readAmbient()
 {
   if (isPresent) {  // 如果设备存在
-    int16_t temp = read16(MCP9808_REG_AMBIENT_TEMP) & 0x1FFF;  // 读取环境温度
-    if (temp & 0x1000) temp |= 0xF000;  // 如果温度为负数，则进行符号扩展
-    return (temp * 10) / 16;  // 返回温度（单位：摄氏度 * 10）
+    return ambientC10(read16(MCP9808_REG_AMBIENT_TEMP));  // 读取环境温度
   }
   else {
     return TEMPERATURE_NOT_INSTALLED;  // 如果设备不存在，返回未安装温度传感器的标记
   }
 }
+
+// 把环境温度寄存器的值转换为摄氏度*10
+int16_t MCP9808::ambientC10(int16_t raw)
+{
+  int16_t temp = raw & 0x1FFF;
+  if (temp & 0x1000) temp |= 0xF000;  // 如果温度为负数，则进行符号扩展
+  return (temp * 10) / 16;  // 返回温度（单位：摄氏度 * 10）
+}
 #endif // MCP9808_IS_ON_I2C
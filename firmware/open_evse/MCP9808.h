@@ -60,6 +60,9 @@ class MCP9808 {
 public:
   MCP9808() { isPresent = 0; }
   int8_t begin();
+  int8_t present() { return isPresent; }
 
   int16_t readAmbient();
+  // MCP9808_REG_AMBIENT_TEMP value -> C*10
+  static int16_t ambientC10(int16_t raw);
 };
@@ -0,0 +1,99 @@
+/*
+ * 该文件是 Open EVSE 的一部分。
+ *
+ * Open EVSE 是自由软件；你可以在 GNU 通用公共许可证（由自由软件基金会发布）的条款下重新分发和/或修改它；无论是版本 3，还是（你选择的）任何更高版本。
+ *
+ * Open EVSE 被分发的目的是希望它能有用，但不提供任何担保；甚至没有对适销性或特定用途的隐含担保。详见 GNU 通用公共许可证的详细说明。
+ *
+ * 你应该已收到一份 GNU 通用公共许可证副本；与 Open EVSE 一起，查看文件 COPYING。如果没有，请写信给自由软件基金会，地址为：
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA。
+ */
+
+#include "PilotCheck.h"
+
+void PilotCheck::Reset()
+{
+  m_Top = 1;
+  m_Ocr = 0;
+  m_EdgeIdx = PCHK_EDGES;
+  m_FailCnt = 0;
+  m_Runs = 0;
+  m_Fails = 0;
+  m_CmdDuty = 0;
+  m_MeasDuty = 0;
+  m_Jitter = 0;
+  m_FreqDhz = 0;
+  m_MaxErr = 0;
+}
+
+// 上升半周期的探测点要比 PCHK_WINDOW 大，下降半周期的要比 TOP - PCHK_WINDOW 小
+// 搜索不到的沿会停在边界上，误差很大，按失败处理
+void PilotCheck::edgeStart()
+{
+  if (m_EdgeIdx & 1) {
+    m_Lo = 0;
+    m_Hi = m_Top - PCHK_WINDOW;
+  }
+  else {
+    m_Lo = PCHK_WINDOW;
+    m_Hi = m_Top;
+  }
+}
+
+void PilotCheck::Start(uint16_t top,uint16_t ocr)
+{
+  m_Top = top;
+  m_Ocr = ocr;
+  m_EdgeIdx = 0;
+  edgeStart();
+}
+
+void PilotCheck::Probe(uint16_t *cnt,uint8_t *up)
+{
+  *cnt = m_Lo + (m_Hi - m_Lo) / 2;
+  *up = (m_EdgeIdx & 1) ? 0 : 1;
+}
+
+uint8_t PilotCheck::Sample(uint8_t high)
+{
+  if (!Busy()) return 1;
+
+  uint16_t mid = m_Lo + (m_Hi - m_Lo) / 2;
+  if (high) m_Lo = mid;
+  else m_Hi = mid;
+
+  if ((m_Hi - m_Lo) <= 1) {
+    // 计数小于比较值时为高电平，m_Hi 是第一个低电平的计数
+    m_Edge[m_EdgeIdx++] = m_Hi;
+    if (Busy()) edgeStart();
+  }
+  return Busy() ? 0 : 1;
+}
+
+uint8_t PilotCheck::Finish(uint16_t freqdhz)
+{
+  // ADC 的采样延迟在上升和下降半周期里方向相反，平均后抵消
+  uint32_t sum = 0;
+  for (uint8_t i=0;i < PCHK_EDGES;i++) sum += m_Edge[i];
+  m_MeasDuty = toDuty((uint16_t)((sum + PCHK_EDGES / 2) / PCHK_EDGES));
+  m_CmdDuty = toDuty(m_Ocr);
+
+  uint16_t j0 = (m_Edge[0] > m_Edge[2]) ? m_Edge[0] - m_Edge[2] : m_Edge[2] - m_Edge[0];
+  uint16_t j1 = (m_Edge[1] > m_Edge[3]) ? m_Edge[1] - m_Edge[3] : m_Edge[3] - m_Edge[1];
+  m_Jitter = toDuty((j0 > j1) ? j0 : j1);
+  m_FreqDhz = freqdhz;
+
+  uint16_t err = (m_MeasDuty > m_CmdDuty) ? m_MeasDuty - m_CmdDuty : m_CmdDuty - m_MeasDuty;
+  if (err > m_MaxErr) m_MaxErr = err;
+  uint16_t ferr = (freqdhz > PCHK_FREQ_DHZ) ? freqdhz - PCHK_FREQ_DHZ : PCHK_FREQ_DHZ - freqdhz;
+
+  m_Runs++;
+  if ((err > PCHK_DUTY_TOL) || (ferr > PCHK_FREQ_TOL_DHZ)) {
+    m_Fails++;
+    if (m_FailCnt < 255) m_FailCnt++;
+    return 1;
+  }
+  m_FailCnt = 0;
+  return 0;
+}
@@ -0,0 +1,96 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#ifndef _PILOT_CHECK_H_
+#define _PILOT_CHECK_H_
+
+#include <stdint.h>
+
+// Pilot waveform self check.
+// Timer1 runs in phase and frequency correct mode: the pilot goes low when
+// the count passes the compare value on the way up, and high again when it
+// passes it on the way down. The check starts the ADC as the count passes
+// a chosen value and binary searches for each edge, one sample per call.
+// The ADC samples a fixed time after it is started, which makes the edge
+// found on the way up early and the one found on the way down late by the
+// same amount, so their average is the duty cycle the EV actually sees.
+// Each run finds both edges twice. jitter is the larger of the differences
+// between the two finds of the same edge.
+// utils/pilot_check_test drives the search with a simulated Timer1
+
+#define PCHK_EDGES 4 // up, down, up, down
+// probes stay this far from the end the count comes from.
+// >= PILOT_SAMPLE_WINDOW in J1772Pilot.h
+#define PCHK_WINDOW 200
+// pilot swing needed to tell high from low, ADC counts
+#define PCHK_MIN_SWING 200
+// Timer1 periods timed with micros() for the frequency
+#define PCHK_FREQ_PERIODS 8
+#define PCHK_FREQ_DHZ 10000    // 1kHz, 0.1Hz
+#define PCHK_FREQ_TOL_DHZ 200  // J1772 allows +/- 2%
+#define PCHK_DUTY_TOL 100      // |measured - commanded| duty, 0.01%
+
+class PilotCheck {
+  uint16_t m_Top;   // Timer1 TOP
+  uint16_t m_Ocr;   // commanded compare value
+  uint16_t m_Lo;    // edge search bounds: pilot high at m_Lo, low at m_Hi
+  uint16_t m_Hi;
+  uint16_t m_Edge[PCHK_EDGES];
+  uint8_t m_EdgeIdx; // PCHK_EDGES = no run in progress
+  uint8_t m_FailCnt; // consecutive failed runs
+  uint16_t m_Runs;
+  uint16_t m_Fails;
+  // last run, duty in 0.01%
+  uint16_t m_CmdDuty;
+  uint16_t m_MeasDuty;
+  uint16_t m_Jitter;
+  uint16_t m_FreqDhz;
+  uint16_t m_MaxErr; // worst |measured - commanded| since Reset()
+
+  void edgeStart();
+  uint16_t toDuty(uint16_t cnt) { return (uint16_t)(((uint32_t)cnt * 10000UL + m_Top / 2) / m_Top); }
+public:
+  PilotCheck() { Reset(); }
+  void Reset();
+  void Start(uint16_t top,uint16_t ocr);
+  void Abort() { m_EdgeIdx = PCHK_EDGES; }
+  uint8_t Busy() { return (m_EdgeIdx < PCHK_EDGES) ? 1 : 0; }
+  uint16_t Ocr() { return m_Ocr; }
+  // where to take the next sample. up = 1: while the count is rising
+  void Probe(uint16_t *cnt,uint8_t *up);
+  // pilot level at the probe. returns 1 when all the edges have been found
+  uint8_t Sample(uint8_t high);
+  // freqdhz: measured pilot frequency, 0.1Hz
+  // returns 0 if the run is within tolerance, 1 if not
+  uint8_t Finish(uint16_t freqdhz);
+
+  uint8_t FailCnt() { return m_FailCnt; }
+  void ClrFailCnt() { m_FailCnt = 0; }
+  uint16_t Runs() { return m_Runs; }
+  uint16_t Fails() { return m_Fails; }
+  uint16_t CmdDuty() { return m_CmdDuty; }
+  uint16_t MeasDuty() { return m_MeasDuty; }
+  uint16_t MaxErr() { return m_MaxErr; }
+  uint16_t Jitter() { return m_Jitter; }
+  uint16_t FreqDhz() { return m_FreqDhz; }
+};
+
+#endif // _PILOT_CHECK_H_
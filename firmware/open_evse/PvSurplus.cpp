@@ -0,0 +1,96 @@
+/*
+ * 该文件是 Open EVSE 的一部分。
+ *
+ * Open EVSE 是自由软件；你可以在 GNU 通用公共许可证（由自由软件基金会发布）的条款下重新分发和/或修改它；无论是版本 3，还是（你选择的）任何更高版本。
+ *
+ * Open EVSE 被分发的目的是希望它能有用，但不提供任何担保；甚至没有对适销性或特定用途的隐含担保。详见 GNU 通用公共许可证的详细说明。
+ *
+ * 你应该已收到一份 GNU 通用公共许可证副本；与 Open EVSE 一起，查看文件 COPYING。如果没有，请写信给自由软件基金会，地址为：
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA。
+ */
+
+#include "PvSurplus.h"
+
+void PvSurplus::Init(uint8_t enabled,int16_t exportw,uint16_t holdsec)
+{
+  m_ExportW = exportw;
+  m_HoldSec = holdsec;
+  m_GridW = 0;
+  m_SurplusDa = 0;
+  m_OutDa = PV_MIN_AMPS * 10;
+  m_PrevErrDa = 0;
+  m_ReadingMs = 0;
+  m_HoldMs = 0;
+  // 收到第一个读数之前按最小电流运行
+  m_Flags = enabled ? (PVF_ENABLED|PVF_STALE) : 0;
+}
+
+uint16_t PvSurplus::LimitDa()
+{
+  if (!(m_Flags & PVF_ENABLED)) return 0xffff;
+  if (m_Flags & PVF_PAUSED) return 0;
+  if (m_Flags & PVF_STALE) return PV_MIN_AMPS * 10;
+  return (m_OutDa < PV_MIN_AMPS * 10) ? PV_MIN_AMPS * 10 : m_OutDa;
+}
+
+uint8_t PvSurplus::Reading(int32_t gridw,uint16_t volts,uint8_t maxamps,uint16_t evda,unsigned long ms)
+{
+  if (!(m_Flags & PVF_ENABLED) || !volts) return 0;
+  uint16_t prevlimit = LimitDa();
+
+  // 先限幅再取反，否则 -gridw 在 INT32_MIN 时溢出
+  if (gridw > PV_GRIDW_MAX) gridw = PV_GRIDW_MAX;
+  else if (gridw < -PV_GRIDW_MAX) gridw = -PV_GRIDW_MAX;
+  m_GridW = gridw;
+  m_ReadingMs = ms;
+  m_Flags &= ~PVF_STALE;
+
+  // 可用的余电 = 车辆正在用的 + 超过输出目标的那部分送电
+  int16_t maxda = (int16_t)maxamps * 10;
+  int32_t surplus = (int32_t)evda + (-gridw - m_ExportW) * 10L / volts;
+  if (surplus > maxda) surplus = maxda;
+  else if (surplus < -maxda) surplus = -maxda;
+  m_SurplusDa = (int16_t)surplus;
+
+  // 增量式 PI。误差按控制器输出而不是车辆的实际电流计算，这样暂停或车辆
+  // 用不完的时候积分不会饱和，输出会停在实际可用的余电上
+  int16_t err = m_SurplusDa - m_OutDa;
+  int32_t out = m_OutDa + ((int32_t)PV_KP * (err - m_PrevErrDa) + (int32_t)PV_KI * err) / 256;
+  m_PrevErrDa = err;
+  if (out < 0) out = 0;
+  else if (out > maxda) out = maxda;
+  m_OutDa = (int16_t)out;
+
+  // 余电低于最小电流持续 m_HoldSec 后暂停，高于最小电流加余量持续 m_HoldSec 后恢复
+  int16_t resumeda = PV_MIN_AMPS * 10 + PV_RESUME_MARGIN_DA;
+  if (resumeda > maxda) resumeda = maxda;
+  uint8_t paused = (m_Flags & PVF_PAUSED) ? 1 : 0;
+  uint8_t pause = paused ? (m_OutDa < resumeda) : (m_OutDa < PV_MIN_AMPS * 10);
+  if (pause == paused) {
+    m_Flags &= ~PVF_HOLD;
+  }
+  else if (!(m_Flags & PVF_HOLD)) {
+    m_Flags |= PVF_HOLD;
+    m_HoldMs = ms;
+  }
+  else if ((ms - m_HoldMs) >= (unsigned long)m_HoldSec * 1000UL) {
+    m_Flags ^= PVF_PAUSED;
+    m_Flags &= ~PVF_HOLD;
+  }
+
+  return (LimitDa() != prevlimit) ? 1 : 0;
+}
+
+uint8_t PvSurplus::Poll(unsigned long ms)
+{
+  if ((m_Flags & (PVF_ENABLED|PVF_STALE)) != PVF_ENABLED) return 0;
+  if ((ms - m_ReadingMs) < PV_TIMEOUT_MS) return 0;
+
+  // 网关失联：不知道余电有多少，降到最小电流。已经暂停的保持暂停
+  uint16_t prevlimit = LimitDa();
+  m_Flags |= PVF_STALE;
+  m_Flags &= ~PVF_HOLD;
+  if (m_OutDa > PV_MIN_AMPS * 10) m_OutDa = PV_MIN_AMPS * 10;
+  return (LimitDa() != prevlimit) ? 1 : 0;
+}
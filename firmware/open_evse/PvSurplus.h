@@ -0,0 +1,97 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#ifndef _PV_SURPLUS_H_
+#define _PV_SURPLUS_H_
+
+#include <stdint.h>
+
+// Charge from solar surplus.
+// A gateway pushes the site's grid power with RAPI SW every few seconds.
+// Each reading gives the surplus the EV could use, i.e. what it draws now
+// plus whatever is still going out to the grid beyond the export target.
+// A PI controller steers the pilot limit towards that, so it doesn't chase
+// every passing cloud. If the surplus stays below the J1772 minimum for
+// the hold time the session is paused, and it resumes once there's enough
+// again for the hold time.
+// utils/pv_sim runs this against simulated PV and house load
+
+#define PV_MIN_AMPS 6 // J1772 minimum
+// no reading for this long: limit to PV_MIN_AMPS until they come back
+#define PV_TIMEOUT_MS 60000UL
+// surplus has to be this far above PV_MIN_AMPS to resume, 0.1A
+#define PV_RESUME_MARGIN_DA 10
+// PI gains, 1/256ths per reading
+#define PV_KP 64
+#define PV_KI 128
+#define PV_HOLD_SEC_DEFAULT 300
+// readings are clamped to +-this before use, W. far above any site a
+// single EVSE sits on, and keeps the surplus arithmetic inside int32_t
+#define PV_GRIDW_MAX 10000000L
+
+// flags
+#define PVF_ENABLED 0x01
+#define PVF_PAUSED  0x02 // surplus too low, session paused
+#define PVF_STALE   0x04 // readings stopped
+#define PVF_HOLD    0x08 // pause/resume hold timer running
+
+// EOFS_PV_NVFLAGS bits
+#define PV_NVF_ENABLED 0x01
+
+class PvSurplus {
+  unsigned long m_ReadingMs; // when the last reading arrived
+  unsigned long m_HoldMs;    // when the hold timer started
+  int32_t m_GridW;     // last reading, + = import, - = export
+  int16_t m_ExportW;   // export to hold, - to allow some import
+  int16_t m_SurplusDa; // surplus from the last reading, 0.1A
+  int16_t m_OutDa;     // controller output, 0.1A
+  int16_t m_PrevErrDa;
+  uint16_t m_HoldSec;
+  uint8_t m_Flags;     // PVF_xxx
+public:
+  PvSurplus() { Init(0,0,PV_HOLD_SEC_DEFAULT); }
+  // starts out at PV_MIN_AMPS until the first reading
+  void Init(uint8_t enabled,int16_t exportw,uint16_t holdsec);
+  uint8_t Enabled() { return (m_Flags & PVF_ENABLED) ? 1 : 0; }
+  uint8_t Paused() { return (m_Flags & PVF_PAUSED) ? 1 : 0; }
+  uint8_t Flags() { return m_Flags; }
+  int32_t GridW() { return m_GridW; }
+  int16_t ExportW() { return m_ExportW; }
+  uint16_t HoldSec() { return m_HoldSec; }
+  int16_t SurplusDa() { return m_SurplusDa; }
+  // ceiling on the pilot in 0.1A, 0 = paused, 0xffff = not enabled
+  uint16_t LimitDa();
+  // same in whole amps, rounded down. 0xff = not enabled
+  uint8_t Limit() {
+    uint16_t da = LimitDa();
+    return (da == 0xffff) ? 0xff : da / 10;
+  }
+
+  // gridw: site grid power, + = import, - = export
+  // volts: line voltage. maxamps: the user's current setting
+  // evda: what the EV is drawing now, 0.1A
+  // returns 1 if LimitDa() changed
+  uint8_t Reading(int32_t gridw,uint16_t volts,uint8_t maxamps,uint16_t evda,unsigned long ms);
+  // call every loop. returns 1 if LimitDa() changed
+  uint8_t Poll(unsigned long ms);
+};
+
+#endif // _PV_SURPLUS_H_
@@ -268,3 +268,5 @@ DateTime RTC_DS1307::now() {
     // 返回一个 DateTime 对象，包含获取的日期和时间信息
     return DateTime(y, m, d, hh, mm, ss);
 }
+
+#endif
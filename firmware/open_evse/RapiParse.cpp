@@ -0,0 +1,205 @@
+/*
+ * 该文件是 Open EVSE 的一部分。
+ *
+ * Open EVSE 是自由软件；你可以在 GNU 通用公共许可证（由自由软件基金会发布）的条款下重新分发和/或修改它；无论是版本 3，还是（你选择的）任何更高版本。
+ *
+ * Open EVSE 被分发的目的是希望它能有用，但不提供任何担保；甚至没有对适销性或特定用途的隐含担保。详见 GNU 通用公共许可证的详细说明。
+ *
+ * 你应该已收到一份 GNU 通用公共许可证副本；与 Open EVSE 一起，查看文件 COPYING。如果没有，请写信给自由软件基金会，地址为：
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA。
+ */
+
+#include <stdio.h>
+
+#include "RapiParse.h"
+
+// 把收到的一个字节加入 buf 中的帧
+// 遇到 ESRAPI_SOC 重新开始，帧太长时丢弃，直到下一个 ESRAPI_SOC
+uint8_t RapiFrameByte(char *buf,int8_t *cnt,char c)
+{
+  if (c == ESRAPI_SOC) {
+    buf[0] = ESRAPI_SOC;
+    *cnt = 1;
+  }
+  else if (buf[0] == ESRAPI_SOC) {
+    if (*cnt < ESRAPI_BUFLEN) {
+      if (c == ESRAPI_EOC) {
+        buf[(*cnt)++] = 0;  // 结束字符
+        return 1;
+      }
+      else {
+        buf[(*cnt)++] = c;  // 将字符添加到缓冲区
+      }
+    }
+    else { // 如果字符太多
+      buf[0] = 0;
+      *cnt = 0;
+    }
+  }
+  return 0;
+}
+
+// 把完整的帧就地拆分为令牌并验证校验和
+uint8_t RapiTokenize(char *buf,char *tokens[ESRAPI_MAX_ARGS],int8_t *tokenCnt)
+{
+  // 设定第一个令牌为缓冲区中的第一个字符（跳过SOC标记）
+  // 空命令，例如"$\r"，buf[2]已经在结束符之后
+  if (buf[1] == '\0') {
+    *tokenCnt = 0;
+    return 1;
+  }
+  tokens[0] = &buf[1];
+  char *s = &buf[2]; // 从第二个字符开始
+  int8_t cnt = 1; // 初始化令牌计数
+  uint8_t achkSum = ESRAPI_SOC + buf[1]; // 初始化加法校验和
+  uint8_t xchkSum = ESRAPI_SOC ^ buf[1]; // 初始化XOR校验和
+  uint8_t hchkSum = 0; // 存储接收到的校验和
+  uint8_t chktype = 0; // 校验和类型，0 = 无，1 = 加法，2 = XOR
+
+  // 遍历字符串直到末尾
+  while (*s) {
+    if (*s == ' ') { // 如果遇到空格，表示一个新的令牌开始
+      // 如果令牌数量已经达到最大值，退出解析
+      if (cnt >= ESRAPI_MAX_ARGS) {
+        chktype = 255; // 标记为无效
+        break;
+      }
+      else {
+        achkSum += *s; // 更新加法校验和
+        xchkSum ^= *s; // 更新XOR校验和
+        *s = '\0'; // 用空字符结束当前令牌
+        tokens[cnt++] = ++s; // 设置下一个令牌
+      }
+    }
+    else if ((*s == '*') || (*s == '^')) { // 检查是否为校验和类型指示符
+      if (*s == '*') chktype = 1; // 加法校验和
+      else if (*s == '^') chktype = 2; // XOR校验和
+      *(s++) = '\0'; // 结束令牌
+      hchkSum = htou8(s); // 提取接收到的校验和
+      break;
+    }
+    else {
+      achkSum += *s; // 更新加法校验和
+      xchkSum ^= *(s++); // 更新XOR校验和
+    }
+  }
+
+  // 校验接收到的校验和是否匹配
+  uint8_t rc = ((chktype == 0) || // 如果没有校验和
+               ((chktype == 1) && (hchkSum == achkSum)) || // 加法校验和匹配
+               ((chktype == 2) && (hchkSum == xchkSum))) ? 0 : 1; // XOR校验和匹配
+  *tokenCnt = rc ? 0 : cnt; // 如果校验失败，重置令牌计数
+  return rc; // 返回校验结果
+}
+
+// 最后一个令牌是序列ID（:xx）时去掉它并返回序列ID
+uint8_t RapiSeqId(char *tokens[ESRAPI_MAX_ARGS],int8_t *tokenCnt)
+{
+  if (*tokenCnt > 1) {
+    const char *seqtoken = tokens[*tokenCnt-1];
+    if (*seqtoken == ESRAPI_SOS) {
+      (*tokenCnt)--;
+      return htou8(seqtoken+1); // 解析序列ID
+    }
+  }
+  return INVALID_SEQUENCE_ID;
+}
+
+// 追加XOR校验和与结束符
+void RapiAppendChk(char *buf)
+{
+  char *s = buf;
+  uint8_t chk = 0;
+  while (*s) {
+    chk ^= *(s++); // 计算校验和
+  }
+  sprintf(s,"^%02X",(unsigned)chk); // 格式化校验和为16进制
+  s[3] = ESRAPI_EOC; // 追加结束符
+  s[4] = '\0'; // 字符串结束
+}
+
+// 将2位十六进制字符串转换为uint8_t
+// 遇到字符串结束或无效字符时返回0，不会读取到结束符之后
+uint8_t htou8(const char *s)
+{
+  uint8_t u = 0;
+  for (int i = 0; i < 2; i++) {
+    char c = s[i];
+    if (c == '\0') break;
+    if (i == 1) u <<= 4;
+    if ((c >= '0') && (c <= '9')) {
+      u += c - '0';
+    }
+    else if ((c >= 'A') && (c <= 'F')) {
+      u += c - 'A' + 10;
+    }
+    else if ((c >= 'a') && (c <= 'f')) {
+      u += c - 'a' + 10;
+    }
+    else {
+      // 如果字符无效，返回0
+      return 0;
+    }
+  }
+  return u;
+}
+
+// 将十进制字符串转换为uint32_t
+// 遇到第一个非数字字符时停止，溢出时饱和为0xffffffff
+uint32_t dtou32(const char *s)
+{
+  uint32_t u = 0;
+  while ((*s >= '0') && (*s <= '9')) {
+    uint8_t d = *(s++) - '0';
+    if (u > ((0xffffffffUL - d) / 10)) return 0xffffffffUL;
+    u = u * 10 + d;
+  }
+  return u;
+}
+
+// 将可带负号的十进制字符串转换为int32_t
+int32_t dtoi32(const char *s)
+{
+  if (*s == '-') {
+    uint32_t u = dtou32(s+1);
+    return (u > 0x80000000UL) ? (int32_t)0x80000000UL : -(int32_t)(u - 1) - 1;
+  }
+  else {
+    uint32_t u = dtou32(s);
+    return (u > 0x7fffffffUL) ? 0x7fffffffL : (int32_t)u;
+  }
+}
+
+// 解析可带负号的十进制数，并检查是否在 lo..hi 之内
+// 不是数字、有多余字符或者超出范围时返回1，*v 不变
+uint8_t dtoi32r(const char *s,int32_t lo,int32_t hi,int32_t *v)
+{
+  const char *d = (*s == '-') ? s+1 : s;
+  if ((*d < '0') || (*d > '9')) return 1;
+  const char *e = d;
+  while ((*e >= '0') && (*e <= '9')) e++;
+  if (*e) return 1;
+  // dtou32() 在溢出时饱和，饱和值已经超出任何 int32_t 的范围
+  uint32_t u = dtou32(d);
+  if (u > 0x80000000UL) return 1;
+  int32_t i = dtoi32(s);
+  if ((*s != '-') && (u > 0x7fffffffUL)) return 1;
+  if ((i < lo) || (i > hi)) return 1;
+  *v = i;
+  return 0;
+}
+
+// 将带一位小数的十进制字符串（如 "12.5"）转换为以 0.1 为单位的值
+// 第二位以后的小数忽略，溢出时饱和为0xffff
+uint16_t dtou16d(const char *s)
+{
+  uint32_t u = dtou32(s);
+  if (u > 6553) return 0xffff;
+  u *= 10;
+  while ((*s >= '0') && (*s <= '9')) s++;
+  if ((*s == '.') && (s[1] >= '0') && (s[1] <= '9')) {
+    u += s[1] - '0';
+  }
+  return (uint16_t)u;
+}
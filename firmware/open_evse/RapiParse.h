@@ -0,0 +1,71 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#ifndef _RAPI_PARSE_H_
+#define _RAPI_PARSE_H_
+
+#include <stdint.h>
+
+// RAPI framing, tokenizing and number parsing. Everything here works on
+// untrusted bytes from the serial port or I2C, so none of it may read or
+// write outside the buffers it is given.
+// utils/rapi_fuzz builds this file too
+
+#define ESRAPI_BUFLEN 32
+#define ESRAPI_SOC '$' // start of command
+#define ESRAPI_EOC 0xd // CR end of command
+#define ESRAPI_SOS ':' // start of sequence id
+#define ESRAPI_MAX_ARGS 10
+
+#define INVALID_SEQUENCE_ID 0
+
+// add one received byte to the frame in buf, ESRAPI_BUFLEN long.
+// *cnt = # valid bytes in buf. a frame starts at ESRAPI_SOC, and one
+// that overflows buf is dropped.
+// returns 1 when c was ESRAPI_EOC and buf now holds a complete,
+// null terminated frame
+uint8_t RapiFrameByte(char *buf,int8_t *cnt,char c);
+
+// split a complete frame from RapiFrameByte() into tokens, in place.
+// checks the checksum if there is one: *xx = additive, ^xx = XOR.
+// returns 0 = OK, 1 = empty, too many tokens or bad checksum, *tokenCnt = 0
+uint8_t RapiTokenize(char *buf,char *tokens[ESRAPI_MAX_ARGS],int8_t *tokenCnt);
+
+// if the last token is a sequence id (:xx), remove it and return the id.
+// otherwise return INVALID_SEQUENCE_ID
+uint8_t RapiSeqId(char *tokens[ESRAPI_MAX_ARGS],int8_t *tokenCnt);
+
+// append ^xx (XOR checksum of buf) and ESRAPI_EOC. buf needs 4 more bytes
+void RapiAppendChk(char *buf);
+
+// 2 hex digits. stops at the terminator, 0 if a digit is invalid
+uint8_t htou8(const char *s);
+// decimal, stops at the first non-digit, saturates at 0xffffffff
+uint32_t dtou32(const char *s);
+// decimal w/ optional -, saturates at INT32_MIN/INT32_MAX
+int32_t dtoi32(const char *s);
+// strict decimal w/ optional -, nothing may follow the digits.
+// returns 0 = OK and sets *v, 1 = not a number or outside lo..hi
+uint8_t dtoi32r(const char *s,int32_t lo,int32_t hi,int32_t *v);
+// decimal w/ one optional decimal place, in 0.1 units. saturates at 0xffff
+uint16_t dtou16d(const char *s);
+
+#endif // _RAPI_PARSE_H_
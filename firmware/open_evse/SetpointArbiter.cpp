@@ -0,0 +1,57 @@
+/*
+ * 该文件是 Open EVSE 的一部分。
+ *
+ * Open EVSE 是自由软件；你可以在 GNU 通用公共许可证（由自由软件基金会发布）的条款下重新分发和/或修改它；无论是版本 3，还是（你选择的）任何更高版本。
+ *
+ * Open EVSE 被分发的目的是希望它能有用，但不提供任何担保；甚至没有对适销性或特定用途的隐含担保。详见 GNU 通用公共许可证的详细说明。
+ *
+ * 你应该已收到一份 GNU 通用公共许可证副本；与 Open EVSE 一起，查看文件 COPYING。如果没有，请写信给自由软件基金会，地址为：
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA。
+ */
+
+#include "SetpointArbiter.h"
+
+void SetpointArbiter::Init(uint16_t minda,uint16_t stepda,uint16_t dwellms)
+{
+  for (uint8_t i=0;i < SP_SRC_CNT;i++) {
+    m_Limit[i] = SP_NO_LIMIT_DA;
+  }
+  m_MinDa = minda;
+  m_StepDa = stepda;
+  m_DwellMs = dwellms;
+  m_Da = minda;
+  m_ChangeMs = 0;
+}
+
+uint8_t SetpointArbiter::Source()
+{
+  uint8_t src = SP_SRC_USER;
+  for (uint8_t i=1;i < SP_SRC_CNT;i++) {
+    if (m_Limit[i] < m_Limit[src]) src = i;
+  }
+  return src;
+}
+
+uint16_t SetpointArbiter::Target()
+{
+  uint16_t da = m_Limit[Source()];
+  return (da < m_MinDa) ? m_MinDa : da;
+}
+
+uint8_t SetpointArbiter::Update(unsigned long ms,uint8_t ramp)
+{
+  uint16_t target = Target();
+  if (target == m_Da) return 0;
+
+  if ((target > m_Da) && ramp) {
+    // 增加：上一次变化后要保持 m_DwellMs，每次最多增加 m_StepDa
+    if ((ms - m_ChangeMs) < m_DwellMs) return 0;
+    if ((target - m_Da) > m_StepDa) target = m_Da + m_StepDa;
+  }
+  // 减少马上生效，同样重新开始计算保持时间
+
+  m_Da = target;
+  m_ChangeMs = ms;
+  return 1;
+}
@@ -0,0 +1,92 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#ifndef _SETPOINT_ARBITER_H_
+#define _SETPOINT_ARBITER_H_
+
+#include <stdint.h>
+
+// Each source of a current limit posts it here, and the pilot gets the
+// lowest of them. Decreases take effect at once. While ramping is on,
+// increases go up in steps of at most stepda, and only after the
+// setpoint has held still for dwellms, so the EV isn't jerked around by
+// churning limits.
+// All currents are in 0.1A, the pilot can be set that finely.
+// utils/pv_sim links this in along with PvSurplus
+
+// limit sources
+#define SP_SRC_USER      0 // user setting, the only one saved to EEPROM
+#define SP_SRC_TEMP      1 // volatile setting: RAPI SC V, PP cable ampacity
+#define SP_SRC_THERMAL   2 // temperature derating
+#define SP_SRC_HEARTBEAT 3 // heartbeat supervision fallback
+#define SP_SRC_GROUP     4 // shared circuit allocation
+#define SP_SRC_PV        5 // solar surplus
+#define SP_SRC_SCHEDULE  6 // DelayTimer window cap
+#define SP_SRC_CNT       7
+
+// minimum allowable current in amps
+#ifndef MIN_CURRENT_CAPACITY_J1772
+#define MIN_CURRENT_CAPACITY_J1772 6
+#endif
+
+// while charging, pilot current increases go up at most
+// SETPOINT_STEP_AMPS at a time, each after the pilot has held still for
+// SETPOINT_DWELL_MS. decreases are immediate
+#ifndef SETPOINT_STEP_AMPS
+#define SETPOINT_STEP_AMPS 6
+#endif
+#ifndef SETPOINT_DWELL_MS
+#define SETPOINT_DWELL_MS 4000
+#endif
+
+#define SP_NO_LIMIT_DA 0xffff
+// whole amp callers use this for no limit
+#define SP_NO_LIMIT 0xff
+
+inline uint16_t SpAmpsToDa(uint8_t amps) { return (amps == SP_NO_LIMIT) ? SP_NO_LIMIT_DA : amps * 10; }
+
+class SetpointArbiter {
+  unsigned long m_ChangeMs; // when m_Amps last changed
+  uint16_t m_DwellMs;
+  uint16_t m_Limit[SP_SRC_CNT];
+  uint16_t m_MinDa;
+  uint16_t m_StepDa;
+  uint16_t m_Da;            // setpoint in force
+public:
+  SetpointArbiter() { Init(0,0,0); }
+  // clears all the limits
+  void Init(uint16_t minda,uint16_t stepda,uint16_t dwellms);
+
+  void Post(uint8_t src,uint16_t da) { m_Limit[src] = da; }
+  void Clear(uint8_t src) { m_Limit[src] = SP_NO_LIMIT_DA; }
+  uint16_t GetLimit(uint8_t src) { return m_Limit[src]; }
+
+  // lowest limit, but not less than minda
+  uint16_t Target();
+  // the source that sets Target()
+  uint8_t Source();
+  // moves the setpoint towards Target(). ramp = 0 jumps straight there
+  // returns 1 if Da() changed
+  uint8_t Update(unsigned long ms,uint8_t ramp);
+  uint16_t Da() { return m_Da; }
+};
+
+#endif // _SETPOINT_ARBITER_H_
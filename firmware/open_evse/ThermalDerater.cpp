@@ -0,0 +1,124 @@
+/*
+ * 该文件是 Open EVSE 的一部分。
+ *
+ * Open EVSE 是自由软件；你可以在 GNU 通用公共许可证（由自由软件基金会发布）的条款下重新分发和/或修改它；无论是版本 3，还是（你选择的）任何更高版本。
+ *
+ * Open EVSE 被分发的目的是希望它能有用，但不提供任何担保；甚至没有对适销性或特定用途的隐含担保。详见 GNU 通用公共许可证的详细说明。
+ *
+ * 你应该已收到一份 GNU 通用公共许可证副本；与 Open EVSE 一起，查看文件 COPYING。如果没有，请写信给自由软件基金会，地址为：
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA。
+ */
+
+#include "ThermalDerater.h"
+
+void ThermalDerater::Reset()
+{
+  for (uint8_t i=0;i < TD_SENSOR_CNT;i++) {
+    m_Slope[i] = 0;
+    m_Severity[i] = 0;
+  }
+  m_Valid = 0;
+  m_CapDa = 0xFFFF;
+  m_Amps = 0;
+  m_SlewMs = 0;
+}
+
+void ThermalDerater::Drop(uint8_t idx)
+{
+  m_Valid &= ~(1 << idx);
+  m_Slope[idx] = 0;
+  m_Severity[idx] = 0;
+}
+
+void ThermalDerater::Sample(uint8_t idx,int16_t temp,unsigned long ms,int16_t throttle,int16_t shutdown)
+{
+  uint8_t bit = 1 << idx;
+
+  if (!(m_Valid & bit)) {
+    // 第一个读数，只记录参考点
+    m_RefTemp[idx] = temp;
+    m_RefMs[idx] = ms;
+    m_Slope[idx] = 0;
+    m_Valid |= bit;
+  }
+  else {
+    unsigned long dt = ms - m_RefMs[idx];
+    if (dt >= TD_SLOPE_WINDOW_MS) {
+      // 窗口内的平均升温速率，单位0.1C/分钟，再做一阶平滑
+      int32_t inst = ((int32_t)(temp - m_RefTemp[idx]) * 60000l) / (int32_t)dt;
+      if (inst > 2000) inst = 2000;
+      else if (inst < -2000) inst = -2000;
+      m_Slope[idx] += (int16_t)((inst - m_Slope[idx]) / 4);
+      m_RefTemp[idx] = temp;
+      m_RefMs[idx] = ms;
+    }
+  }
+
+  // 只用升温速率做预测，降温时按当前温度计算，避免过早恢复电流
+  int32_t pred = temp;
+  if (m_Slope[idx] > TD_SLOPE_DEADBAND) {
+    pred += ((int32_t)(m_Slope[idx] - TD_SLOPE_DEADBAND) * TD_PREDICT_MS) / 60000l;
+  }
+
+  int16_t sev;
+  if (pred <= throttle) sev = 0;
+  else if (pred >= shutdown) sev = TD_FULL;
+  else sev = (int16_t)(((pred - throttle) * TD_FULL) / (shutdown - throttle));
+  m_Severity[idx] = sev;
+}
+
+int16_t ThermalDerater::Severity()
+{
+  int16_t sev = 0;
+  for (uint8_t i=0;i < TD_SENSOR_CNT;i++) {
+    if ((m_Valid & (1 << i)) && (m_Severity[i] > sev)) sev = m_Severity[i];
+  }
+  return sev;
+}
+
+uint8_t ThermalDerater::Update(unsigned long curms,uint8_t maxamps,uint8_t minamps)
+{
+  uint16_t maxda = (uint16_t)maxamps * 10;
+  uint16_t minda = (uint16_t)minamps * 10;
+  if (minda > maxda) minda = maxda;
+
+  // 最热的传感器决定目标电流
+  uint16_t target = maxda - (uint16_t)(((uint32_t)(maxda - minda) * Severity()) / TD_FULL);
+
+  uint16_t cap;
+  if (m_CapDa == 0xFFFF) {
+    cap = maxda;
+    // 降幅不到1A时不启动降流，避免在阈值附近反复启停
+    if ((maxda - target) < 10) target = maxda;
+  }
+  else {
+    cap = m_CapDa;
+    if (cap > maxda) cap = maxda;  // 用户调低了电流，立即生效
+  }
+
+  if (target == cap) {
+    m_SlewMs = curms;
+  }
+  else {
+    // 按经过的时间限制变化幅度，不足0.1A时保留时间继续累计
+    uint32_t step = ((uint32_t)(curms - m_SlewMs) * ((target < cap) ? TD_SLEW_DOWN_DA_PER_S : TD_SLEW_UP_DA_PER_S)) / 1000;
+    if (step) {
+      m_SlewMs = curms;
+      if (target < cap) cap = ((uint32_t)(cap - target) > step) ? (cap - step) : target;
+      else cap = ((uint32_t)(target - cap) > step) ? (cap + step) : target;
+    }
+  }
+
+  if (cap >= maxda) {
+    m_CapDa = 0xFFFF;
+    m_Amps = maxamps;
+  }
+  else {
+    // 下降时立即取整，上升时要超过下一个整安培一段距离才提高
+    if ((cap < (uint16_t)m_Amps * 10) || (m_Amps > maxamps)) m_Amps = (uint8_t)(cap / 10);
+    else if (cap >= ((uint16_t)m_Amps + 1) * 10 + TD_AMPS_HYST_DA) m_Amps = (uint8_t)((cap - TD_AMPS_HYST_DA) / 10);
+    m_CapDa = cap;
+  }
+  return m_Amps;
+}
@@ -0,0 +1,131 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#ifndef _THERMAL_DERATER_H_
+#define _THERMAL_DERATER_H_
+
+#include <stdint.h>
+
+// Proportional thermal derating.
+// Each sensor reports its temperature and a pair of thresholds.
+// Below the throttle threshold a sensor asks for nothing, at its shutdown
+// threshold it asks for the minimum current, linear in between.
+// The temperature used is predicted TD_PREDICT_MS ahead from the sensor's
+// rate of rise, so a fast climb starts derating before the threshold is hit.
+// The hottest sensor wins, and the resulting current is slewed towards
+// the target at a bounded rate so the EV sees a smooth ramp.
+// utils/thermal_sim runs this against a model of the enclosure
+
+// sensor indices
+#define TDS_MCP9808 0
+#define TDS_DS3231  1
+#define TDS_TMP007  2
+#define TD_SENSOR_CNT 3
+
+// severity scale: 0 = no derating, TD_FULL = minimum current
+#define TD_FULL 256
+
+// normal operational thresholds in 0.1C, open_evse.h sets lower ones for
+// TESTING_TEMPERATURE_OPERATION.
+// derating starts at THROTTLE_DOWN and reaches the minimum current at
+// SHUTDOWN. at PANIC the EVSE stops charging with an over temperature error
+#ifndef TEMPERATURE_AMBIENT_THROTTLE_DOWN
+#define TEMPERATURE_AMBIENT_THROTTLE_DOWN 650
+#endif
+#ifndef TEMPERATURE_AMBIENT_SHUTDOWN
+#define TEMPERATURE_AMBIENT_SHUTDOWN 680
+#endif
+#ifndef TEMPERATURE_AMBIENT_PANIC
+#define TEMPERATURE_AMBIENT_PANIC 710
+#endif
+#ifndef TEMPERATURE_INFRARED_THROTTLE_DOWN
+#define TEMPERATURE_INFRARED_THROTTLE_DOWN 650
+#endif
+#ifndef TEMPERATURE_INFRARED_SHUTDOWN
+#define TEMPERATURE_INFRARED_SHUTDOWN 700
+#endif
+#ifndef TEMPERATURE_INFRARED_PANIC
+#define TEMPERATURE_INFRARED_PANIC 750
+#endif
+
+// rate of rise is measured over at least this long, because the sensors only
+// resolve 0.1C and a 1 sec delta would be mostly quantization noise
+#ifndef TD_SLOPE_WINDOW_MS
+#define TD_SLOPE_WINDOW_MS 30000ul
+#endif
+// how far ahead to project the temperature using the rate of rise
+#ifndef TD_PREDICT_MS
+#define TD_PREDICT_MS 60000l
+#endif
+// slew limits in 0.1A/sec. reducing current has to be quick,
+// raising it again is slow so we don't oscillate around a threshold
+#ifndef TD_SLEW_DOWN_DA_PER_S
+#define TD_SLEW_DOWN_DA_PER_S 20
+#endif
+#ifndef TD_SLEW_UP_DA_PER_S
+#define TD_SLEW_UP_DA_PER_S 1
+#endif
+// rates of rise below this (0.1C/min) are treated as sensor noise
+#ifndef TD_SLOPE_DEADBAND
+#define TD_SLOPE_DEADBAND 3
+#endif
+// the pilot only takes whole amps. the limit has to climb this far (0.1A)
+// past the next amp before it's offered, so it doesn't dither between two
+// values. derating also doesn't start until it's worth at least 1A
+#ifndef TD_AMPS_HYST_DA
+#define TD_AMPS_HYST_DA 5
+#endif
+
+class ThermalDerater {
+  // per sensor state. temperatures are in 0.1C
+  int16_t m_RefTemp[TD_SENSOR_CNT];   // start of current slope window
+  unsigned long m_RefMs[TD_SENSOR_CNT];
+  int16_t m_Slope[TD_SENSOR_CNT];     // smoothed rate of rise, 0.1C/min
+  int16_t m_Severity[TD_SENSOR_CNT];  // 0..TD_FULL
+  uint8_t m_Valid;                    // bit n set = sensor n has a reference
+
+  uint16_t m_CapDa;     // slewed current limit in 0.1A, 0xFFFF = not derating
+  uint8_t m_Amps;       // whole amps last handed out
+  unsigned long m_SlewMs;
+public:
+  ThermalDerater() { Reset(); }
+  void Reset();
+
+  // feed a new reading. throttle and shutdown are the thresholds for this
+  // sensor in 0.1C
+  void Sample(uint8_t idx,int16_t temp,unsigned long ms,int16_t throttle,int16_t shutdown);
+  // sensor failed or isn't installed, forget it
+  void Drop(uint8_t idx);
+
+  // hottest sensor's severity, 0..TD_FULL
+  int16_t Severity();
+  int16_t Slope(uint8_t idx) { return m_Slope[idx]; }
+
+  // advance the slew and return the current limit in A.
+  // maxamps = user's setting, minamps = lowest current we may offer
+  uint8_t Update(unsigned long curms,uint8_t maxamps,uint8_t minamps);
+  // 1 if Update() is currently limiting below maxamps
+  uint8_t Active() { return (m_CapDa != 0xFFFF) ? 1 : 0; }
+  // last limit returned by Update(), only meaningful while Active()
+  uint8_t Amps() { return m_Amps; }
+};
+
+#endif // _THERMAL_DERATER_H_
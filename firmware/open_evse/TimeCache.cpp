@@ -0,0 +1,77 @@
+/*
+ * 该文件是 Open EVSE 的一部分。
+ *
+ * Open EVSE 是自由软件；你可以在 GNU 通用公共许可证（由自由软件基金会发布）的条款下重新分发和/或修改它；无论是版本 3，还是（你选择的）任何更高版本。
+ *
+ * Open EVSE 被分发的目的是希望它能有用，但不提供任何担保；甚至没有对适销性或特定用途的隐含担保。详见 GNU 通用公共许可证的详细说明。
+ *
+ * 你应该已收到一份 GNU 通用公共许可证副本；与 Open EVSE 一起，查看文件 COPYING。如果没有，请写信给自由软件基金会，地址为：
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA。
+ */
+
+#include "TimeCache.h"
+
+// 从 rtcepoch 重新开始推算和统计漂移
+void TimeCache::restart(uint32_t rtcepoch,uint32_t ms)
+{
+  m_SyncEpoch = rtcepoch;
+  m_SyncMs = ms;
+  m_BaseMs = ms;
+  m_BaseEpoch = rtcepoch;
+  m_CorrSum = 0;
+  m_CorrCnt = 0;
+}
+
+void TimeCache::Sync(uint32_t rtcepoch,uint32_t ms,uint8_t settime)
+{
+  uint8_t first = !m_SyncCnt;
+  m_ReadMs = ms;
+  m_ReadEpoch = rtcepoch;
+  if (m_SyncCnt < 0xffff) m_SyncCnt++;
+
+  if (first || settime) {
+    // 第一次读，或者刚设置过时间
+    restart(rtcepoch,ms);
+    return;
+  }
+
+  int32_t corr = (int32_t)(rtcepoch - Epoch(ms));
+  if (corr == 0) {
+    // 推算正确：把整秒并入基准点，保持秒的相位不变，也免得 millis() 溢出
+    uint32_t secs = (ms - m_SyncMs) / 1000UL;
+    m_SyncEpoch += secs;
+    m_SyncMs += secs * 1000UL;
+  }
+  else if ((corr > TC_MAX_CORR_SEC) || (corr < -TC_MAX_CORR_SEC) ||
+           ((ms - m_BaseMs) >= TC_MAX_BASE_MS)) {
+    // 跳得太多，是别人改了 RTC，不算漂移。
+    // millis() 的差快要溢出时也重新开始，这时候漂移早就算准了
+    restart(rtcepoch,ms);
+  }
+  else {
+    // 重新对齐，秒的边界只挪到刚好和 RTC 一致的位置：
+    // RTC 比推算的快，说明 RTC 刚跳过秒；RTC 比推算的慢，说明它马上就要跳秒。
+    // 每次只挪了几十毫秒，所以不能用累计修正的秒数来算漂移
+    m_SyncEpoch = rtcepoch;
+    m_SyncMs = (corr > 0) ? ms : ms - 999UL;
+    m_CorrSum += (int16_t)corr;
+    if (m_CorrCnt < 0xffff) m_CorrCnt++;
+  }
+}
+
+int32_t TimeCache::DriftPpm()
+{
+  // 比较上次读 RTC 时两边各走了多少：RTC 走的秒数只精确到 1 秒
+  uint32_t basems = m_ReadMs - m_BaseMs;
+  // 时间太短的话，1秒的误差就是几千ppm，没有意义
+  if (!m_SyncCnt || (basems < 3600000UL)) return 0;
+  int32_t diffms = (int32_t)((m_ReadEpoch - m_BaseEpoch) * 1000UL - basems);
+  // 1000000 = 15625 * 64，先把毫秒数除以 64，免得乘法溢出。
+  // 差得多的时候两边一起减半，比例不变
+  while ((diffms > 137000L) || (diffms < -137000L)) {
+    diffms /= 2;
+    basems /= 2;
+  }
+  return (diffms * 15625L) / (int32_t)(basems / 64);
+}
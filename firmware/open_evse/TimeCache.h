@@ -0,0 +1,82 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#ifndef _TIME_CACHE_H_
+#define _TIME_CACHE_H_
+
+#include <stdint.h>
+
+// Wall clock time without an I2C read every time somebody wants it.
+// The RTC is read at boot and every TC_SYNC_MS after that, and in between
+// the time is worked out from millis(). Each sync compares the RTC with
+// what millis() predicted and nudges the second boundary to match. The
+// drift of the CPU clock against the RTC comes from how far the two have
+// each moved since the last restart.
+// Times are unix seconds, same as DateTime::unixtime(). ms is millis(),
+// kept 32 bits wide so rollover works the same off the AVR.
+// utils/schedule_test/time_cache_test checks it against a drifting clock
+
+#define TC_SYNC_MS (10UL*60UL*1000UL)
+// a correction bigger than this is somebody setting the RTC, not drift
+#define TC_MAX_CORR_SEC 60
+// drift stats start over before the millis() difference can roll over
+#define TC_MAX_BASE_MS (30UL*24UL*3600UL*1000UL)
+
+class TimeCache {
+  uint32_t m_SyncMs;    // millis() at m_SyncEpoch
+  uint32_t m_SyncEpoch;
+  uint32_t m_ReadMs;    // when the RTC was last read
+  uint32_t m_ReadEpoch; // and what it said
+  uint32_t m_BaseMs;    // drift is measured from here
+  uint32_t m_BaseEpoch;
+  int16_t m_CorrSum;    // seconds added to the millis() estimate since m_BaseEpoch
+  uint16_t m_SyncCnt;
+  uint16_t m_CorrCnt;
+
+  void restart(uint32_t rtcepoch,uint32_t ms);
+public:
+  TimeCache() { m_SyncCnt = 0; }
+  // rtcepoch: just read from the RTC, ms: millis() at the read
+  // settime: the RTC was just set, don't count the jump as drift
+  void Sync(uint32_t rtcepoch,uint32_t ms,uint8_t settime);
+  uint8_t SyncDue(uint32_t ms) {
+    return (!m_SyncCnt || ((ms - m_ReadMs) >= TC_SYNC_MS)) ? 1 : 0;
+  }
+  uint32_t Epoch(uint32_t ms) {
+    return m_SyncEpoch + (ms - m_SyncMs) / 1000UL;
+  }
+
+  uint16_t SyncCnt() { return m_SyncCnt; }
+  uint16_t CorrCnt() { return m_CorrCnt; }
+  int16_t CorrSum() { return m_CorrSum; }
+  // seconds since the last RTC read
+  uint16_t SecsSinceSync(uint32_t ms) { return (ms - m_ReadMs) / 1000UL; }
+  // drift of millis() against the RTC, + = millis() running slow
+  int32_t DriftPpm();
+
+  static uint8_t Second(uint32_t epoch) { return epoch % 60; }
+  static uint8_t Minute(uint32_t epoch) { return (epoch / 60) % 60; }
+  static uint8_t Hour(uint32_t epoch) { return (epoch / 3600) % 24; }
+  // 0 = Sunday, same as DateTime::dayOfWeek(). 1/1/1970 was a Thursday
+  static uint8_t DayOfWeek(uint32_t epoch) { return (epoch / 86400UL + 4) % 7; }
+};
+
+#endif // _TIME_CACHE_H_
@@ -0,0 +1,75 @@
+/*
+ * 该文件是 Open EVSE 的一部分。
+ *
+ * Open EVSE 是自由软件；你可以在 GNU 通用公共许可证（由自由软件基金会发布）的条款下重新分发和/或修改它；无论是版本 3，还是（你选择的）任何更高版本。
+ *
+ * Open EVSE 被分发的目的是希望它能有用，但不提供任何担保；甚至没有对适销性或特定用途的隐含担保。详见 GNU 通用公共许可证的详细说明。
+ *
+ * 你应该已收到一份 GNU 通用公共许可证副本；与 Open EVSE 一起，查看文件 COPYING。如果没有，请写信给自由软件基金会，地址为：
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA。
+ */
+
+#include "WeekSchedule.h"
+
+// 开始、结束时间各 12 位，和星期、电流一起共 5 字节
+void WsPack(const SCHED_WIN *w,uint8_t *b)
+{
+  b[0] = w->days;
+  b[1] = w->amps;
+  b[2] = (uint8_t)w->start;
+  b[3] = (uint8_t)w->stop;
+  b[4] = ((w->start >> 8) & 0x0f) | ((w->stop >> 4) & 0xf0);
+}
+
+void WsUnpack(const uint8_t *b,SCHED_WIN *w)
+{
+  w->days = b[0];
+  w->amps = b[1];
+  w->start = b[2] | ((uint16_t)(b[4] & 0x0f) << 8);
+  w->stop = b[3] | ((uint16_t)(b[4] & 0xf0) << 4);
+  // 未写过的 EEPROM 是 0xff
+  if ((w->days & 0x80) || (w->start >= WS_MINS_PER_DAY) || (w->stop >= WS_MINS_PER_DAY)) {
+    w->days = 0;
+  }
+}
+
+void WeekSchedule::Begin(uint8_t dow,uint8_t hour,uint8_t min)
+{
+  m_Now = dow * WS_MINS_PER_DAY + hour * 60 + min;
+  m_Next = WS_MINS_PER_WEEK;
+  m_Open = 0;
+  m_Amps = 0;
+}
+
+// 到 t 还有多少分钟，t 就是现在的话是下周
+static uint16_t wsUntil(uint16_t now,uint16_t t)
+{
+  uint16_t d = (t + WS_MINS_PER_WEEK - now) % WS_MINS_PER_WEEK;
+  return d ? d : WS_MINS_PER_WEEK;
+}
+
+void WeekSchedule::Add(const SCHED_WIN *w)
+{
+  if (!w->days || (w->start == w->stop)) return;
+  uint16_t len = (w->stop > w->start) ? (w->stop - w->start) : (w->stop + WS_MINS_PER_DAY - w->start);
+
+  for (uint8_t d=0;d < 7;d++) {
+    if (!(w->days & (1 << d))) continue;
+    uint16_t open = d * WS_MINS_PER_DAY + w->start;
+    uint16_t close = (open + len) % WS_MINS_PER_WEEK;
+
+    if ((m_Now + WS_MINS_PER_WEEK - open) % WS_MINS_PER_WEEK < len) {
+      // 开着。电流取各窗口中最大的，有一个不限流就不限流
+      if (!m_Open || (m_Amps && (!w->amps || (w->amps > m_Amps)))) {
+        m_Amps = w->amps;
+      }
+      m_Open++;
+    }
+
+    uint16_t n = wsUntil(m_Now,open);
+    if (n < m_Next) m_Next = n;
+    n = wsUntil(m_Now,close);
+    if (n < m_Next) m_Next = n;
+  }
+}
@@ -0,0 +1,68 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#ifndef _WEEK_SCHEDULE_H_
+#define _WEEK_SCHEDULE_H_
+
+#include <stdint.h>
+
+// Weekly charging schedule for the DelayTimer.
+// Each window opens on the days in its mask and may run past midnight into
+// the next day. Windows can overlap, the EVSE is awake if any is open, and
+// the current cap is the highest of the open windows' caps.
+// Rather than re-evaluating the table every second, the DelayTimer feeds
+// the windows through a WeekSchedule once, and gets back the state now and
+// how long until anything changes.
+// utils/schedule_test covers windows past midnight and the end of the week
+
+#define WS_MINS_PER_DAY  1440
+#define WS_MINS_PER_WEEK 10080U
+
+typedef struct sched_win {
+  uint8_t days;   // bit 0 = Sunday .. bit 6 = Saturday, 0 = unused
+  uint8_t amps;   // current cap while open, 0 = none
+  uint16_t start; // minute of the day
+  uint16_t stop;  // minute of the day, < start runs into the next day.
+                  // == start is an empty window and is ignored, as with ST
+} SCHED_WIN;
+
+// EEPROM record
+#define WS_PACKED_LEN 5
+void WsPack(const SCHED_WIN *w,uint8_t *b);
+void WsUnpack(const uint8_t *b,SCHED_WIN *w);
+
+class WeekSchedule {
+  uint16_t m_Now;  // minute of the week, 0 = Sunday 00:00
+  uint16_t m_Next; // minutes until the next window opens or closes
+  uint8_t m_Open;  // number of open windows
+  uint8_t m_Amps;  // highest cap of the open windows, 0 = none
+public:
+  // dow: 0 = Sunday
+  void Begin(uint8_t dow,uint8_t hour,uint8_t min);
+  void Add(const SCHED_WIN *w);
+
+  uint8_t Awake() { return m_Open ? 1 : 0; }
+  uint8_t Amps() { return m_Open ? m_Amps : 0; }
+  // WS_MINS_PER_WEEK if there are no windows
+  uint16_t NextMins() { return m_Next; }
+};
+
+#endif // _WEEK_SCHEDULE_H_
@@ -62,11 +62,9 @@ void AdcPin::init(uint8_t _adcNum)
 #endif
 }
 
-// 读取 ADC 值
-uint16_t AdcPin::read()
+// 选择本通道，下一次启动的转换读取它
+void AdcPin::select()
 {
-  uint8_t low, high;  // 存储低字节和高字节的值
-
   // 如果存在 ADCSRB 和 MUX5，设置通道范围（0-7 或 8-15）
 #if defined(ADCSRB) && defined(MUX5)
   ADCSRB = (ADCSRB & ~(1 << MUX5)) | (((channel >> 3) & 0x01) << MUX5);
@@ -77,6 +75,14 @@ uint16_t AdcPin::read()
 #if defined(ADMUX)
   ADMUX = (refMode << 6) | (channel & 0x07);
 #endif
+}
+
+// 读取 ADC 值
+uint16_t AdcPin::read()
+{
+  uint8_t low, high;  // 存储低字节和高字节的值
+
+  select();
 
   // 进行转换前不加延时可能会读取到错误的通道数据
   //delay(1);
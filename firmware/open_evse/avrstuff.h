@@ -148,6 +148,8 @@ public:
   }
 
   void init(uint8_t _adcNum);
+  // select the channel for a conversion started elsewhere, e.g. in step with a timer
+  void select();
   uint16_t read();
 
   static void referenceMode(uint8_t mode) {
@@ -45,6 +45,7 @@
 #include <avr/pgmspace.h> // AVR程序存储器库
 #include <pins_arduino.h> // Arduino引脚定义
 #include "./Wire.h"       // I2C通信库
+#include "./twi.h"        // 异步I2C传输队列
 #include "./RTClib.h"     // RTC时钟库
 #include "open_evse.h"    // Open EVSE相关定义头文件
 
@@ -127,7 +128,9 @@ Menu *g_SettingsMenuList[] = {
 Menu *g_SetupMenuList[] = {
 #ifdef NOSETUP_MENU
   &g_MaxCurrentMenu, // 最大电流菜单
+#ifdef DELAYTIMER_MENU
   &g_RTCMenu,        // RTC菜单
+#endif // DELAYTIMER_MENU
 #else // !NOSETUP_MENU
 #ifdef DELAYTIMER_MENU
   &g_RTCMenu,        // RTC菜单
@@ -166,13 +169,31 @@ OnboardDisplay g_OBD;  // 屏幕显示管理
 // 实例化RTC和延时定时器 - GoldServe
 #ifdef RTC
 RTC_DS1307 g_RTC;  // RTC时钟对象
+TimeCache g_TimeCache;  // 两次读 RTC 之间用 millis() 推算时间
+
+// 读 RTC，校准缓存的时间。settime: RTC 刚被设置过，跳变不算漂移
+void RtcSync(uint8_t settime)
+{
+  uint32_t epoch = g_RTC.now().unixtime();
+  g_TimeCache.Sync(epoch,millis(),settime);
+}
+
+// 当前时间（unix 秒），不读 RTC
+uint32_t RtcEpoch()
+{
+  return g_TimeCache.Epoch(millis());
+}
 
 #if defined(RAPI)
 void SetRTC(uint8_t y, uint8_t m, uint8_t d, uint8_t h, uint8_t mn, uint8_t s) {
   g_RTC.adjust(DateTime(y,m,d,h,mn,s));  // 设置RTC时间
+  RtcSync(1);
+#ifdef DELAYTIMER
+  g_DelayTimer.Reschedule();
+#endif // DELAYTIMER
 }
 void GetRTC(char *buf) {
-  DateTime t = g_RTC.now();  // 获取当前时间
+  DateTime t(RtcEpoch());  // 获取当前时间
   sprintf(buf,"%d %d %d %d %d %d", t.year()-2000, t.month(), t.day(), t.hour(), t.minute(), t.second());
 }
 #endif // RAPI
@@ -252,10 +273,17 @@ char *u2a(unsigned long x, int8_t digits)
   return s;  // 返回填充后的字符串
 }
 
+#ifdef EVENT_LOG
+uint8_t g_ResetCause __attribute__((section(".noinit"))); // 清零之前的 MCUSR，记录到事件日志
+#endif // EVENT_LOG
+
 // wdt_init 通过看门狗定时器重启后关闭看门狗定时器
 void wdt_init(void) __attribute__((naked, used)) __attribute__((section(".init3")));
 void wdt_init(void)
 {
+#ifdef EVENT_LOG
+  g_ResetCause = MCUSR;
+#endif // EVENT_LOG
   MCUSR = 0;  // 清除MCU状态寄存器
   wdt_disable();  // 禁用看门狗定时器
 
@@ -263,8 +291,6 @@ void wdt_init(void)
 }
 
 
-#ifdef TEMPERATURE_MONITORING
-
 #ifdef TEMPERATURE_MONITORING
 
 void TempMonitor::Init()
@@ -273,6 +299,13 @@ void TempMonitor::Init()
   m_MCP9808_temperature = TEMPERATURE_NOT_INSTALLED;  // 230代表23.0°C 使用整数来节省浮点库的使用
   m_DS3231_temperature = TEMPERATURE_NOT_INSTALLED;   // DS3231 RTC自带温度传感器
   m_TMP007_temperature = TEMPERATURE_NOT_INSTALLED;
+  m_MCP9808_ms = 0;
+  m_DS3231_ms = 0;
+  m_TMP007_ms = 0;
+  m_Step = TMS_IDLE;
+  m_Pending = 0;
+  memset(&m_Xfer,0,sizeof(m_Xfer));  // status = TWI_XS_DONE
+  m_Derater.Reset();
 
 #ifdef TEMPERATURE_MONITORING_NY
   LoadThresh();  // 如果有NY的条件，加载温度阈值
@@ -287,48 +320,132 @@ void TempMonitor::Init()
 #endif // TMP007_IS_ON_I2C
 }
 
-void TempMonitor::Read()
+// 提交一次异步I2C传输，结果在下一次Read()中由collect()取回
+void TempMonitor::post(uint8_t step,uint8_t i2caddr,uint8_t txlen,uint8_t rxlen)
 {
-  unsigned long curms = millis();  // 获取当前的时间戳
-  if ((curms - m_LastUpdate) >= TEMPMONITOR_UPDATE_INTERVAL) {  // 如果时间间隔足够长，更新温度值
-#ifdef TMP007_IS_ON_I2C
-    m_TMP007_temperature = m_tmp007.readObjTempC10();   // 使用TI TMP007红外传感器读取温度
-#endif
-#ifdef MCP9808_IS_ON_I2C
-    m_MCP9808_temperature = m_tempSensor.readAmbient();  // 从MCP9808传感器读取温度
-#endif
+  m_Xfer.address = i2caddr;
+  m_Xfer.txData = m_TxBuf;
+  m_Xfer.txLen = txlen;
+  m_Xfer.rxData = m_RxBuf;
+  m_Xfer.rxLen = rxlen;
+  m_Pending = step;
+  twi_post(&m_Xfer);
+}
 
-#ifdef RTC
-#ifdef OPENEVSE_2
-    m_DS3231_temperature = TEMPERATURE_NOT_INSTALLED;  // 如果是OpenEVSE II，DS3231传感器不使用
-#else // !OPENEVSE_2
-    // 下面的代码读取DS3231 RTC的内置温度传感器
-    Wire.beginTransmission(DS1307_ADDRESS);
-    wiresend(uint8_t(0x0e));  // 设置寄存器地址
-    wiresend( 0x20 );          // 写入位5以启动温度转换
-    Wire.endTransmission();
-
-    Wire.beginTransmission(DS1307_ADDRESS);
-    wiresend(uint8_t(0x11));  // 设置读取寄存器
-    Wire.endTransmission();
-
-    if(Wire.requestFrom(DS1307_ADDRESS, 2)) {  // 请求从DS3231读取温度数据
-    m_DS3231_temperature = (((int16_t)wirerecv()) << 8) | (wirerecv()); // 读取高字节和低字节
-    m_DS3231_temperature = m_DS3231_temperature >> 6;  // 去掉最低的6位
-    if (m_DS3231_temperature & 0x0200) m_DS3231_temperature |= 0xFE00;  // 如果是负数，进行符号扩展
-    m_DS3231_temperature = (m_DS3231_temperature * 10) / 4;  // 将温度转换为0.25°C分辨率
-                                                                        // 注意：设备的符号位只影响上字节
-                                                                        // 小的副作用是：-0.25°C、-0.5°C和-0.75°C的实际温度
-                                                                        // 会被读取为正数，显示为+0.25°C…
-                                                                        // 这是一种硬件限制，不用在软件中尝试修复
+// 处理已完成的传输
+void TempMonitor::collect(unsigned long curms)
+{
+  uint8_t ok = (m_Xfer.status == TWI_XS_DONE);
+  int16_t raw = (((int16_t)m_RxBuf[0]) << 8) | m_RxBuf[1];
+
+  switch (m_Pending) {
+#ifdef MCP9808_IS_ON_I2C
+  case TMS_MCP9808:
+    if (ok) {
+      m_MCP9808_temperature = MCP9808::ambientC10(raw);
+      m_MCP9808_ms = curms;
+      m_Derater.Sample(TDS_MCP9808,m_MCP9808_temperature,curms,TEMPERATURE_AMBIENT_THROTTLE_DOWN,TEMPERATURE_AMBIENT_SHUTDOWN);
+    }
+    else {
+      m_MCP9808_temperature = TEMPERATURE_NOT_INSTALLED;
+      m_Derater.Drop(TDS_MCP9808);
     }
-    else
+    break;
+#endif // MCP9808_IS_ON_I2C
+#ifdef TMP007_IS_ON_I2C
+  case TMS_TMP007:
+    m_TMP007_temperature = ok ? Adafruit_TMP007::objTempC10(raw) : TEMPERATURE_NOT_INSTALLED;
+    if (m_TMP007_temperature != TEMPERATURE_NOT_INSTALLED) {
+      m_TMP007_ms = curms;
+      m_Derater.Sample(TDS_TMP007,m_TMP007_temperature,curms,TEMPERATURE_INFRARED_THROTTLE_DOWN,TEMPERATURE_INFRARED_SHUTDOWN);
+    }
+    else m_Derater.Drop(TDS_TMP007);
+    break;
+#endif // TMP007_IS_ON_I2C
+#ifdef DS3231_TEMP
+  case TMS_DS3231_READ:
+    if (ok) {
+      m_DS3231_temperature = raw >> 6;  // 去掉最低的6位
+      if (m_DS3231_temperature & 0x0200) m_DS3231_temperature |= 0xFE00;  // 如果是负数，进行符号扩展
+      m_DS3231_temperature = (m_DS3231_temperature * 10) / 4;  // 将温度转换为0.25°C分辨率
+                                                                // 注意：设备的符号位只影响上字节
+                                                                // 小的副作用是：-0.25°C、-0.5°C和-0.75°C的实际温度
+                                                                // 会被读取为正数，显示为+0.25°C…
+                                                                // 这是一种硬件限制，不用在软件中尝试修复
+      m_DS3231_ms = curms;
+      m_Derater.Sample(TDS_DS3231,m_DS3231_temperature,curms,TEMPERATURE_AMBIENT_THROTTLE_DOWN,TEMPERATURE_AMBIENT_SHUTDOWN);
+    }
+    else {
       m_DS3231_temperature = TEMPERATURE_NOT_INSTALLED;
+      m_Derater.Drop(TDS_DS3231);
+    }
+    break;
+#endif // DS3231_TEMP
+  }
+  m_Pending = 0;
+}
 
-#endif // OPENEVSE_2
-#endif // RTC
+// 分步读取温度：每次调用最多提交一个异步I2C传输，结果在之后的调用中取回
+// DS3231先启动转换，等其他传感器读完并且转换时间到了再读结果
+void TempMonitor::Read()
+{
+  // 上一个传输还没完成
+  if ((m_Xfer.status == TWI_XS_QUEUED) || (m_Xfer.status == TWI_XS_ACTIVE)) return;
 
+  unsigned long curms = millis();  // 获取当前的时间戳
+  if (m_Pending) collect(curms);
+
+  if (m_Step == TMS_IDLE) {
+    if ((curms - m_LastUpdate) < TEMPMONITOR_UPDATE_INTERVAL) return;
     m_LastUpdate = curms;  // 更新最后更新时间
+    m_Step = TMS_DS3231_CONV;
+  }
+
+  for (;;) {
+    uint8_t step = m_Step++;
+    switch (step) {
+#ifdef DS3231_TEMP
+    case TMS_DS3231_CONV:
+      m_TxBuf[0] = 0x0e;  // 控制寄存器
+      m_TxBuf[1] = 0x20;  // 写入位5以启动温度转换
+      post(step,DS1307_ADDRESS,2,0);
+      m_ConvStartMs = curms;
+      return;
+#endif // DS3231_TEMP
+#ifdef MCP9808_IS_ON_I2C
+    case TMS_MCP9808:
+      if (!m_tempSensor.present()) {
+        m_MCP9808_temperature = TEMPERATURE_NOT_INSTALLED;
+        m_Derater.Drop(TDS_MCP9808);
+        break;
+      }
+      m_TxBuf[0] = MCP9808_REG_AMBIENT_TEMP;
+      post(step,MCP9808_ADDRESS,1,2);
+      return;
+#endif // MCP9808_IS_ON_I2C
+#ifdef TMP007_IS_ON_I2C
+    case TMS_TMP007:
+      m_TxBuf[0] = TMP007_TOBJ;
+      post(step,m_tmp007.address(),1,2);
+      return;
+#endif // TMP007_IS_ON_I2C
+#ifdef DS3231_TEMP
+    case TMS_DS3231_READ:
+      if ((curms - m_ConvStartMs) < DS3231_CONV_MS) {
+        m_Step = step;  // 转换还没完成，下次再来
+        return;
+      }
+      m_TxBuf[0] = 0x11;  // 温度寄存器
+      post(step,DS1307_ADDRESS,1,2);
+      return;
+#endif // DS3231_TEMP
+    default:
+      if (step >= TMS_DONE) {
+        m_Step = TMS_IDLE;
+        return;
+      }
+      break;  // 未启用的传感器，跳过
+    }
   }
 }
 #endif // TEMPERATURE_MONITORING
@@ -414,8 +531,14 @@ void OnboardDisplay::Init()
   SetRedLed(0);  // 设置红色LED为关闭状态
 #endif
 
+#ifdef OBD_STATS
+  m_LcdWrCnt = 0;
+  m_UpdUs = 0;
+  m_StatsStartMs = millis();
+#endif // OBD_STATS
+
 #ifdef LCD16X2
-  LcdBegin(LCD_MAX_CHARS_PER_LINE, 2);  // 初始化LCD显示，设置每行字符数和行数
+  LcdBegin(LCD_MAX_CHARS_PER_LINE, LCD_MAX_LINES);  // 初始化LCD显示，设置每行字符数和行数
   LcdSetBacklightColor(WHITE);  // 设置背光颜色为白色
 
 #if defined(DELAYTIMER)
@@ -435,6 +558,7 @@ void OnboardDisplay::Init()
   MakeChar(5,CustomChar_5);  // 创建时间限制时钟图标
 #endif // TIME_LIMIT
   m_Lcd.clear();  // 清空LCD显示
+  shadowInit();   // LCD已清空，影子缓冲区与之同步
 
 #ifdef OPENEVSE_2
   LcdPrint_P(0,PSTR("Open EVSE II"));  // 显示Open EVSE II的标题
@@ -448,14 +572,64 @@ void OnboardDisplay::Init()
 #endif //#ifdef LCD16X2
 }
 
-// 在LCD屏幕上打印文本
 #ifdef LCD16X2
+// 初始化影子缓冲区 - 调用前LCD必须已经清空
+void OnboardDisplay::shadowInit()
+{
+  memset(m_Shadow,' ',sizeof(m_Shadow));
+  memset(m_LcdBuf,' ',sizeof(m_LcdBuf));
+  m_CurX = 0;
+  m_CurY = 0;
+}
+
+// 只把与LCD当前内容不同的字符发送出去
+// 每段连续变化的字符只需要一次光标移动，因为HD44780写入后光标自动右移
+// LiquidTWI2在突发模式下把所有光标移动和字符打包进尽量少的I2C传输
+void OnboardDisplay::LcdFlush()
+{
+#ifndef I2CLCD_PCF8574
+  m_Lcd.beginBurst();
+#endif
+  for (uint8_t y=0;y < LCD_MAX_LINES;y++) {
+    int8_t hwx = -1; // LCD硬件光标所在列，-1 = 未知
+    for (uint8_t x=0;x < LCD_MAX_CHARS_PER_LINE;x++) {
+      uint8_t c = m_Shadow[y][x];
+      if (c != m_LcdBuf[y][x]) {
+        if (hwx != x) {
+          m_Lcd.setCursor(x,y);
+#ifdef OBD_STATS
+          m_LcdWrCnt++;
+#endif
+        }
+        m_Lcd.write(c);
+#ifdef OBD_STATS
+        m_LcdWrCnt++;
+#endif
+        m_LcdBuf[y][x] = c;
+        hwx = x + 1;
+      }
+    }
+  }
+#ifndef I2CLCD_PCF8574
+  m_Lcd.endBurst();
+#endif
+}
+
+// 清空LCD并按影子缓冲区完整重绘
+// 用于LCD内容可能已损坏的情况（PERIODIC_LCD_REFRESH_MS）
+void OnboardDisplay::LcdRefresh()
+{
+  m_Lcd.clear();
+  memset(m_LcdBuf,' ',sizeof(m_LcdBuf));
+  LcdFlush();
+}
+
+// 在LCD屏幕上打印文本
 void OnboardDisplay::LcdPrint(int x,int y,const char *s)
 {
-  m_Lcd.setCursor(x,y);  // 设置光标位置
-  m_Lcd.print(s);  // 在LCD上打印文本
+  LcdSetCursor(x,y);  // 设置光标位置
+  LcdPrint(s);  // 在LCD上打印文本
 }
-#endif // LCD16X2
 
 // LcdPrint_P：将程序存储器中的字符串打印到LCD显示器
 void OnboardDisplay::LcdPrint_P(PGM_P s)
@@ -465,7 +639,7 @@ void OnboardDisplay::LcdPrint_P(PGM_P s)
   // 确保缓冲区末尾是字符串结束符
   m_strBuf[LCD_MAX_CHARS_PER_LINE] = 0;
   // 打印缓冲区内容到LCD显示器
-  m_Lcd.print(m_strBuf);
+  LcdPrint(m_strBuf);
 }
 
 // LcdPrint_P：在指定的y坐标上打印程序存储器中的字符串
@@ -484,10 +658,8 @@ void OnboardDisplay::LcdPrint_P(int x, int y, PGM_P s)
   // 从程序存储器中复制字符串到缓冲区
   strncpy_P(m_strBuf, s, LCD_MAX_CHARS_PER_LINE);
   m_strBuf[LCD_MAX_CHARS_PER_LINE] = 0;
-  // 设置光标位置到指定的x、y坐标
-  m_Lcd.setCursor(x, y);
-  // 打印缓冲区内容到LCD显示器
-  m_Lcd.print(m_strBuf);
+  // 在指定的x、y坐标打印
+  LcdPrint(x, y, m_strBuf);
 }
 
 // LcdMsg_P：在LCD上打印两行信息
@@ -502,20 +674,18 @@ void OnboardDisplay::LcdMsg_P(PGM_P l1, PGM_P l2)
 // LcdPrint：在LCD上指定的y坐标打印字符串，并用空格填充剩余部分
 void OnboardDisplay::LcdPrint(int y, const char *s)
 {
-  // 设置光标位置到第0列、第y行
-  m_Lcd.setCursor(0, y);
-  uint8_t i, len = strlen(s);
-  // 如果字符串长度超过LCD每行最大字符数，截断长度
-  if (len > LCD_MAX_CHARS_PER_LINE)
-    len = LCD_MAX_CHARS_PER_LINE;
-  // 打印字符串内容
-  for (i = 0; i < len; i++) {
-    m_Lcd.write(s[i]);
+  if (y >= LCD_MAX_LINES) return;
+  uint8_t i;
+  // 复制字符串内容，超过LCD每行最大字符数的部分截断
+  for (i = 0; (i < LCD_MAX_CHARS_PER_LINE) && s[i]; i++) {
+    m_Shadow[y][i] = s[i];
   }
   // 用空格填充剩余部分，确保整行都被填满
-  for (i = len; i < LCD_MAX_CHARS_PER_LINE; i++) {
-    m_Lcd.write(' ');
+  for (; i < LCD_MAX_CHARS_PER_LINE; i++) {
+    m_Shadow[y][i] = ' ';
   }
+  LcdSetCursor(LCD_MAX_CHARS_PER_LINE, y);
+  shadowChanged();
 }
 
 // LcdMsg：打印两行信息到LCD
@@ -528,9 +698,51 @@ void OnboardDisplay::LcdMsg(const char *l1, const char *l2)
 }
 #endif // LCD16X2
 
+#ifdef OBD_STATS
+// 返回自上次调用以来每秒发往LCD的I2C字节数、每秒HD44780写入次数
+// 和每秒在Update()中花费的微秒数，并清零
+void OnboardDisplay::GetStats(uint32_t *bytesps,uint16_t *wrps,uint32_t *updusps)
+{
+  uint32_t secs = (millis() - m_StatsStartMs + 500UL) / 1000UL;
+  if (!secs) secs = 1;
+#if defined(LCD16X2) && !defined(I2CLCD_PCF8574)
+  *bytesps = m_Lcd.TxBytes() / secs;
+  m_Lcd.ClearTxBytes();
+#elif defined(LCD16X2)
+  // LiquidCrystal_I2C每次HD44780写入固定发送4个单字节传输，各带地址字节
+  *bytesps = m_LcdWrCnt * 8 / secs;
+#else
+  *bytesps = 0;
+#endif
+  *wrps = (uint16_t)(m_LcdWrCnt / secs);
+  *updusps = m_UpdUs / secs;
+  m_LcdWrCnt = 0;
+  m_UpdUs = 0;
+  m_StatsStartMs = millis();
+}
+#endif // OBD_STATS
 
 // Update：根据更新模式更新显示内容
+// 绘制全部写入影子缓冲区，最后一次性把变化发送到LCD
 void OnboardDisplay::Update(int8_t updmode)
+{
+#ifdef OBD_STATS
+  unsigned long startus = micros();
+#endif
+#ifdef LCD16X2
+  m_bFlags |= OBDF_DEFER_FLUSH;
+#endif
+  update(updmode);
+#ifdef LCD16X2
+  m_bFlags &= ~OBDF_DEFER_FLUSH;
+  LcdFlush();
+#endif
+#ifdef OBD_STATS
+  m_UpdUs += micros() - startus;
+#endif
+}
+
+void OnboardDisplay::update(int8_t updmode)
 {
   // 如果更新被禁用并且控制器不在故障状态下，则不进行更新
   if (updateDisabled() && !g_EvseController.InFaultState()) return;
@@ -550,8 +762,6 @@ void OnboardDisplay::Update(int8_t updmode)
       // 如果发生硬故障，需要在硬故障外部调用时处理
       updmode = OBD_UPD_HARDFAULT; // 设置更新模式为硬故障更新
     }
-  }
-}
 
 #ifdef LCD16X2
     sprintf(g_sTmp, g_sRdyLAstr, (int)svclvl, currentcap);  // 将服务等级和电流容量格式化为字符串
@@ -727,6 +937,20 @@ void OnboardDisplay::Update(int8_t updmode)
 #endif
       break;
 #endif // OVERCURRENT_THRESHOLD
+#ifdef PILOT_CHECK
+    case EVSE_STATE_PILOT_ERROR:  // pilot 自检失败
+      SetGreenLed(0);  // 关闭绿色LED灯
+      SetRedLed(1);    // 开启红色LED灯
+#ifdef LCD16X2 // 使用Adafruit RGB LCD屏
+      LcdSetBacklightColor(RED);  // 设置背景灯为红色
+      LcdPrint_P(0,g_psSvcReq);  // 显示“服务请求”信息
+      strcpy_P(g_sTmp,g_psPilotError);
+      // 最后一次测到的占空比
+      sprintf(g_sTmp+strlen(g_sTmp)," %u%%",(g_EvseController.GetPilotCheck()->MeasDuty() + 50) / 100);
+      LcdPrint(1,g_sTmp);
+#endif
+      break;
+#endif // PILOT_CHECK
     case EVSE_STATE_NO_GROUND:  // 无地线
       SetGreenLed(0);  // 关闭绿色LED灯
       SetRedLed(1);    // 开启红色LED灯
@@ -819,6 +1043,7 @@ void OnboardDisplay::Update(int8_t updmode)
 #endif
     }
 #endif // TEMPERATURE_MONITORING
+  }
 
 // 将任何需要定期更新的内容放在这里
 // 以下代码每秒只运行一次
@@ -845,7 +1070,7 @@ if (((curms - m_LastUpdateMs) >= 1000) || (updmode == OBD_UPD_FORCE)) {
 #endif // GFI
 
 #ifdef RTC
-  DateTime currentTime = g_RTC.now();  // 获取当前RTC时间
+  uint32_t curepoch = RtcEpoch();  // 获取当前时间
 #endif
 
 #ifdef LCD16X2
@@ -954,14 +1179,15 @@ if (((curms - m_LastUpdateMs) >= 1000) || (updmode == OBD_UPD_FORCE)) {
 #endif
       }
     }
-    else if (g_TempMonitor.BlinkAlarm() == 0) {
-      // 如果闪烁停止，恢复正常显示
-      g_TempMonitor.SetBlinkAlarm(1);
-      SetRedLed(0);
+    else {
+      if (g_TempMonitor.BlinkAlarm() == 0) {
+        // 如果闪烁停止，恢复正常显示
+        g_TempMonitor.SetBlinkAlarm(1);
+        SetRedLed(0);
 #ifdef LCD16X2
-      LcdSetBacklightColor(TEAL);  // 设置LCD背景色为青色
+        LcdSetBacklightColor(TEAL);  // 设置LCD背景色为青色
 #endif
-    }
+      }
 #endif // TEMPERATURE_MONITORING
 #ifndef KWH_RECORDING
     // 格式化并显示已充电时间（时:分:秒）
@@ -973,7 +1199,7 @@ if (((curms - m_LastUpdateMs) >= 1000) || (updmode == OBD_UPD_FORCE)) {
     g_sTmp[8] = ' ';
     g_sTmp[9] = ' ';
     g_sTmp[10] = ' ';
-    sprintf(g_sTmp + 11, g_sHHMMfmt, currentTime.hour(), currentTime.minute());
+    sprintf(g_sTmp + 11, g_sHHMMfmt, TimeCache::Hour(curepoch), TimeCache::Minute(curepoch));
 #endif
     LcdPrint(1, g_sTmp);  // 在LCD上显示充电时间
 #endif // KWH_RECORDING
@@ -993,7 +1219,7 @@ if (((curms - m_LastUpdateMs) >= 1000) || (updmode == OBD_UPD_FORCE)) {
     }
 #endif // AUTH_LOCK
     LcdPrint_P(g_psSleeping);  // 显示"睡眠"信息
-    sprintf(g_sTmp, "%02d:%02d:%02d", currentTime.hour(), currentTime.minute(), currentTime.second());
+    sprintf(g_sTmp, "%02d:%02d:%02d", TimeCache::Hour(curepoch), TimeCache::Minute(curepoch), TimeCache::Second(curepoch));
     LcdPrint(0, 1, g_sTmp);  // 显示当前时间
     if (g_DelayTimer.IsTimerEnabled()) {
       // 如果计时器启用，显示延时器的开始和结束时间
@@ -1710,6 +1936,7 @@ Menu *RlyChkMenu::Select()
   return &g_SetupMenu;  // 返回设置菜单
 }
 #endif // ADVPWR
+#endif // NOSETUP_MENU
 
 // MaxCurrentMenu类的构造函数
 MaxCurrentMenu::MaxCurrentMenu()
@@ -2025,6 +2252,10 @@ Menu *RTCMenuMinute::Select()
   g_min = m_CurIdx; // 设置当前分钟
   DtsStrPrint1(g_year, g_month, g_day, g_hour, m_CurIdx, 4); // 打印更新后的时间
   g_RTC.adjust(DateTime(g_year, g_month, g_day, g_hour, g_min, 0)); // 更新 RTC 时间
+  RtcSync(1);
+#ifdef DELAYTIMER
+  g_DelayTimer.Reschedule();
+#endif // DELAYTIMER
   delay(500); // 延迟 500 毫秒
   return &g_SetupMenu; // 返回到设置菜单
 }
@@ -2253,7 +2484,9 @@ Menu *DelayMenuStopMin::Select()
   delay(500);  // 延迟 500 毫秒
   return &g_SettingsMenu;  // 返回设置菜单
 }
+#endif // DELAYTIMER_MENU
 
+#ifdef CHARGE_LIMIT
 // ChargeLimitMenu：充电限制菜单类
 ChargeLimitMenu::ChargeLimitMenu()
 {
@@ -2596,40 +2829,92 @@ void DelayTimer::Init() {
 
   // 清除手动覆盖设置
   ClrManualOverride();
+
+  m_SchedCnt = countWindows();
+  m_SchedAmps = 0;
+  Reschedule();
 }
 
-uint8_t DelayTimer::IsInAwakeTimeInterval()
+// 从 EEPROM 读出每周计划的第 idx 个时段
+void DelayTimer::GetWindow(uint8_t idx,SCHED_WIN *w)
 {
-  uint8_t inTimeInterval = false;
+  uint8_t b[WS_PACKED_LEN];
+  for (uint8_t i=0;i < WS_PACKED_LEN;i++) {
+    b[i] = eeprom_read_byte((uint8_t*)(EOFS_TIMER_SCHED + idx*WS_PACKED_LEN + i));
+  }
+  WsUnpack(b,w);
+}
 
-  // 判断定时器是否启用并且时间设置有效
-  if (IsTimerEnabled() && IsTimerValid()) {
-    DateTime t = g_RTC.now();
-    uint8_t currHour = t.hour();
-    uint8_t currMin = t.minute();
+void DelayTimer::SetWindow(uint8_t idx,const SCHED_WIN *w)
+{
+  uint8_t b[WS_PACKED_LEN];
+  WsPack(w,b);
+  for (uint8_t i=0;i < WS_PACKED_LEN;i++) {
+    eeprom_write_byte((uint8_t*)(EOFS_TIMER_SCHED + idx*WS_PACKED_LEN + i),b[i]);
+  }
+  m_SchedCnt = countWindows();
+  Reschedule();
+}
 
-    uint16_t startTimerMinutes = m_StartTimerHour * 60 + m_StartTimerMin;
-    uint16_t stopTimerMinutes = m_StopTimerHour * 60 + m_StopTimerMin;
-    uint16_t currTimeMinutes = currHour * 60 + currMin;
+uint8_t DelayTimer::countWindows()
+{
+  SCHED_WIN w;
+  uint8_t cnt = 0;
+  for (uint8_t i=0;i < DT_SCHED_CNT;i++) {
+    GetWindow(i,&w);
+    if (w.days) cnt++;
+  }
+  return cnt;
+}
 
-    // 判断停止时间是否跨越午夜
-    if (stopTimerMinutes < startTimerMinutes) { // 结束时间是第二天的时间
+// 按当前时间算出现在是否在充电时段、时段的电流限制，以及到下一次变化
+// 还有多久。之后每秒的检查只需要比较 millis()
+void DelayTimer::reschedule()
+{
+  unsigned long curms = millis();
+  uint32_t t = g_TimeCache.Epoch(curms);
+  WeekSchedule ws;
+  SCHED_WIN w;
 
-      // 判断当前时间是否在有效区间内
-      if ( ( (currTimeMinutes >= startTimerMinutes) && (currTimeMinutes > stopTimerMinutes) ) ||
-           ( (currTimeMinutes <= startTimerMinutes) && (currTimeMinutes < stopTimerMinutes) ) ){
-        inTimeInterval = true;
-      }
+  ws.Begin(TimeCache::DayOfWeek(t),TimeCache::Hour(t),TimeCache::Minute(t));
+  if (m_SchedCnt) {
+    for (uint8_t i=0;i < DT_SCHED_CNT;i++) {
+      GetWindow(i,&w);
+      ws.Add(&w);
     }
-    else { // 不跨越午夜
-      // 判断当前时间是否在有效区间内
-      if ((currTimeMinutes >= startTimerMinutes) && (currTimeMinutes < stopTimerMinutes)) {
-        inTimeInterval = true;
-      }
+  }
+  else {
+    // 没有每周计划，用每天的开始/停止时间
+    w.days = 0x7f;
+    w.amps = 0;
+    w.start = m_StartTimerHour * 60 + m_StartTimerMin;
+    w.stop = m_StopTimerHour * 60 + m_StopTimerMin;
+    ws.Add(&w);
+  }
+
+  m_Awake = ws.Awake();
+  if (ws.Amps() != m_SchedAmps) {
+    m_SchedAmps = ws.Amps();
+    g_EvseController.SetCurrentLimit(SP_SRC_SCHEDULE,m_SchedAmps ? m_SchedAmps : SP_NO_LIMIT);
+  }
+
+  // 定期重新计算，用上 g_TimeCache 读 RTC 后修正的时间
+  unsigned long ms = ws.NextMins() * 60000UL - TimeCache::Second(t) * 1000UL;
+  if (ms > DT_RESYNC_MS) ms = DT_RESYNC_MS;
+  m_NextMs = curms + ms;
+}
+
+uint8_t DelayTimer::IsInAwakeTimeInterval()
+{
+  // 判断定时器是否启用并且时间设置有效
+  if (IsTimerEnabled() && IsTimerValid()) {
+    if ((long)(millis() - m_NextMs) >= 0) {
+      reschedule();
     }
+    return m_Awake;
   }
 
-  return inTimeInterval;
+  return false;
 }
 
 void DelayTimer::CheckTime()
@@ -2647,7 +2932,12 @@ void DelayTimer::CheckTime()
       if (inTimeInterval) { // 当前时间处于充电时段
         if (!ManualOverrideIsSet()) {
           // 如果没有手动覆盖并且 EVSE 处于睡眠状态，则启用 EVSE
-          if (evseState == EVSE_STATE_SLEEPING) {
+          // 共享线路、余电不足或心跳丢失暂停的不唤醒
+          if ((evseState == EVSE_STATE_SLEEPING)
+#ifdef AUTO_PAUSE
+              && !g_EvseController.AutoPaused()
+#endif
+              ) {
             g_EvseController.Enable();
           }
         }
@@ -2680,6 +2970,7 @@ void DelayTimer::Enable(){
   m_DelayTimerEnabled = 0x01;
   eeprom_write_byte((uint8_t*)EOFS_TIMER_FLAGS, m_DelayTimerEnabled);
   ClrManualOverride();
+  Reschedule();
   g_EvseController.SetDelayTimerOnFlag();
   g_OBD.Update(OBD_UPD_FORCE);
 }
@@ -2688,6 +2979,9 @@ void DelayTimer::Disable(){
   m_DelayTimerEnabled = 0x00;
   eeprom_write_byte((uint8_t*)EOFS_TIMER_FLAGS, m_DelayTimerEnabled);
   ClrManualOverride();
+  // 时段的电流限制也一起取消
+  m_SchedAmps = 0;
+  g_EvseController.ClrCurrentLimit(SP_SRC_SCHEDULE);
   g_EvseController.ClrDelayTimerOnFlag();
   g_OBD.Update(OBD_UPD_FORCE);
 }
@@ -2720,6 +3014,10 @@ void EvseReset()
   Wire.begin(); // 初始化 I2C 总线
   g_OBD.Init(); // 初始化 OBD
 
+#ifdef RTC
+  RtcSync(0); // 第一次读 RTC，之后每 TC_SYNC_MS 读一次
+#endif // RTC
+
 #ifdef RAPI
   RapiInit(); // 初始化 RAPI
 #endif
@@ -2767,6 +3065,10 @@ void setup()
 #ifdef PP_AUTO_AMPACITY
   g_EvseController.SetStateTransitionReqFunc(&StateTransitionReqFunc);  // 设置电动汽车充电站的状态转换请求函数
 #endif //PP_AUTO_AMPACITY
+#ifdef EVENT_LOG
+  g_EventLog.Init();  // 在 EvseReset() 之前，记录初始化过程中的事件
+  g_EventLog.Log(EVT_BOOT,g_ResetCause);
+#endif // EVENT_LOG
   EvseReset();  // 重置电动汽车充电站
 
 #ifdef TEMPERATURE_MONITORING
@@ -2790,6 +3092,8 @@ void loop()
 {
   WDT_RESET();  // 重置看门狗定时器，防止重启
 
+  twi_poll();  // 结束超时的异步I2C传输，启动排队中的传输
+
   g_EvseController.Update();  // 更新电动汽车充电站的状态
 
 #ifdef KWH_RECORDING
@@ -2801,6 +3105,9 @@ void loop()
   {
     static unsigned long lastlcdreset = 0;
     if ((millis()-lastlcdreset) > PERIODIC_LCD_REFRESH_MS) {  // 如果经过的时间大于定时刷新间隔
+#ifdef LCD16X2
+      g_OBD.LcdRefresh();  // 清屏并完整重绘，这是唯一会清空LCD的地方
+#endif
       g_OBD.Update(OBD_UPD_FORCE);  // 强制更新LCD
       lastlcdreset = millis();  // 记录上次LCD刷新时间
     }
@@ -2812,6 +3119,10 @@ void loop()
 
   ProcessInputs();  // 处理输入
 
+#ifdef RTC
+  if (g_TimeCache.SyncDue(millis())) RtcSync(0);  // 定期读 RTC，校准 millis() 的误差
+#endif // RTC
+
   // 延迟定时器处理 - GoldServe
 #ifdef DELAYTIMER
   g_DelayTimer.CheckTime();  // 检查延迟定时器的状态
@@ -36,6 +36,7 @@
 #include <avr/eeprom.h>
 #include <pins_arduino.h>
 #include "./Wire.h"
+#include "./twi.h"
 #include "avrstuff.h"
 #include "i2caddr.h"
 
@@ -49,7 +50,7 @@
 #define clrBits(flags,bits) (flags &= ~(bits))
 
 #ifndef VERSION
-#define VERSION "8.2.3"
+#define VERSION "8.3.0"
 #endif // !VERSION
 
 #include "Language_default.h"   //Default language should always be included as bottom layer
@@ -131,6 +132,10 @@ typedef unsigned long time_t;
 
 // stop charging after a certain kWh reached - requires KWH_RECORDING
 #define CHARGE_LIMIT
+#ifdef CHARGE_LIMIT
+// highest kWh limit offered by the charge limit menu
+#define MAX_CHARGE_LIMIT 40
+#endif // CHARGE_LIMIT
 
 // support Mennekes (IEC 62196) type 2 locking pin
 #define MENNEKES_LOCK
@@ -195,15 +200,49 @@ extern AutoCurrentCapacityController g_ACCController;
 
 #define HEARTBEAT_SUPERVISION // Heartbeat Supervision support
 
+// RAM ring of timestamped state changes, trips, relay operations, setpoint
+// changes and RAPI set commands. dump with RAPI GR
+#define EVENT_LOG
+#ifdef EVENT_LOG
+#define EVENT_LOG_CNT 16 // records in RAM, 8 bytes each. MUST BE power of 2
+// also keep the last EVENT_LOG_EE_CNT fault class events in EEPROM
+#define EVENT_LOG_EEPROM
+#define EVENT_LOG_EE_CNT 8
+#endif // EVENT_LOG
+
+// several EVSEs sharing one supply circuit. a coordinator on the RAPI
+// link hands out allocations with SG, see utils/group_coord
+//#define GROUP_SHARE
+
+// charge from solar surplus. a gateway pushes the site's grid power with
+// RAPI SW, and the pilot follows the surplus. enable/configure with SU
+//#define PV_SURPLUS
+
+// the EVSE puts itself to sleep when the group allocation or the solar
+// surplus runs out, or the heartbeat has been gone for the last tier
+#if defined(GROUP_SHARE) || defined(PV_SURPLUS) || defined(HEARTBEAT_SUPERVISION)
+#define AUTO_PAUSE
+#endif
+
 #ifdef AMMETER
 
 // if OVERCURRENT_THRESHOLD is defined, then EVSE will hard fault in
 // the event that the EV is pulling more current than it's allowed to
 // declare overcurrent when charging amps > pilot amps + OVERCURRENT_THRESHOLD
-//#define OVERCURRENT_THRESHOLD 5 // A
+// the OC_xxx defaults are in AmmeterSampler.h, shared with utils/overcurrent_sim
+//#define OVERCURRENT_THRESHOLD OC_SLOW_AMPS // A
 // go to error state overcurrent by OVERCURRENT_THRESHOLD amps
 // for OVERCURRENT_TIMEOUT ms
-//#define OVERCURRENT_TIMEOUT 10000UL // ms
+//#define OVERCURRENT_TIMEOUT OC_SLOW_MS // ms
+// fast tier, requires OVERCURRENT_THRESHOLD. the slow tier above works on
+// the 32 read average of the RMS current. this one works on the per half
+// cycle peak of each ammeter read, and trips straight away with no
+// graceful shutdown wait on a gross overcurrent
+// declare overcurrent when the peak, converted to RMS as a sine,
+// is > pilot amps + OVERCURRENT_FAST_THRESHOLD
+//#define OVERCURRENT_FAST_THRESHOLD OC_FAST_AMPS // A
+// for OVERCURRENT_FAST_READS consecutive ammeter reads (~1 line cycle each)
+//#define OVERCURRENT_FAST_READS OC_FAST_READS
 
 // if there's no accurate voltmeter, hardcode voltages
 #ifndef MV_FOR_L1
@@ -288,6 +327,15 @@ extern AutoCurrentCapacityController g_ACCController;
 #define DELAYTIMER_MENU
 #endif
 
+#ifdef DELAYTIMER
+// windows in the weekly schedule, set with RAPI SD. the daily ST/menu
+// window is used when they're all empty
+#define DT_SCHED_CNT 8
+// the schedule is only worked out when a window opens or closes, and at
+// least this often to pick up g_TimeCache's corrections
+#define DT_RESYNC_MS (10UL*60UL*1000UL)
+#endif // DELAYTIMER
+
 #else // !RTC
 // this weird error comes out if RTC not defined, due to a bug in g++
 //D:\git\open_evse\firmware\open_evse\open_evse.ino: In function 'ProcessInputs'//:
@@ -334,10 +382,29 @@ extern AutoCurrentCapacityController g_ACCController;
 // when not defined, use fast PWM -> 1/250 resolution
 #define PAFC_PWM
 
+// measure the pilot +12V and -12V levels at boot when no EV is connected,
+// and set the state thresholds from them instead of the compiled in ones.
+// saved in EEPROM. view/override with RAPI GX/SX
+//#define THRESH_CAL
+#ifdef THRESH_CAL
+#define CALIBRATE
+#endif
+
+// check the pilot duty cycle and frequency the EV actually sees against the
+// commanded value every few minutes, and fault if they're out of tolerance.
+// results with RAPI GQ. needs PAFC_PWM: the edge search relies on Timer1
+// counting both up and down
+//#define PILOT_CHECK
+
 // glynhudson reports that LCD gets corrupted by EMC testing during CE
 // certification.. redraw display periodically when enabled
 //#define PERIODIC_LCD_REFRESH_MS 120000UL
 
+// count I2C bytes and HD44780 writes sent to the LCD, and time spent in
+// OnboardDisplay::Update()
+// read/reset w/ RAPI $T1 (requires RAPI_T_COMMANDS)
+//#define OBD_STATS
+
 // when closing DC relay set to HIGH for m_relayCloseMs, then
 // switch to m_relayHoldPwm
 // ONLY WORKS PWM-CAPABLE PINS!!!
@@ -374,6 +441,10 @@ extern AutoCurrentCapacityController g_ACCController;
 #error INVALID_CONFIG - GFI NEEDED FOR GFI SELF TEST
 #endif
 
+#if defined(PILOT_CHECK) && !defined(PAFC_PWM)
+#error INVALID CONFIG - PILOT_CHECK NEEDS PAFC_PWM
+#endif
+
 // for testing print various diagnostic messages to the UART
 //#define SERDBG
 
@@ -428,6 +499,7 @@ extern AutoCurrentCapacityController g_ACCController;
 #define WATCHDOG_TIMEOUT WDTO_2S
 
 #define LCD_MAX_CHARS_PER_LINE 16
+#define LCD_MAX_LINES 2
 
 #define TMP_BUF_SIZE ((LCD_MAX_CHARS_PER_LINE+1)*2)
 
@@ -445,10 +517,7 @@ extern AutoCurrentCapacityController g_ACCController;
 #define DEFAULT_CURRENT_CAPACITY_L2 24
 #endif
 
-// minimum allowable current in amps
-#ifndef MIN_CURRENT_CAPACITY_J1772
-#define MIN_CURRENT_CAPACITY_J1772 6
-#endif
+// minimum allowable current in amps: MIN_CURRENT_CAPACITY_J1772 in SetpointArbiter.h
 
 // maximum allowable current in amps
 #ifndef MAX_CURRENT_CAPACITY_L1
@@ -458,6 +527,8 @@ extern AutoCurrentCapacityController g_ACCController;
 #define MAX_CURRENT_CAPACITY_L2 80 // J1772 Max for L2 = 80
 #endif
 
+// the pilot ramp, SETPOINT_STEP_AMPS and SETPOINT_DWELL_MS, is in SetpointArbiter.h
+
 //J1772EVSEController
 
 #define CURRENT_PIN 0 // analog current reading pin ADCx
@@ -566,8 +637,8 @@ extern AutoCurrentCapacityController g_ACCController;
 // for shared power pool
 #define EOFS_GROUP_CURRENT_CAPACITY 31 // 1 byte
 // non-volatile flags
-#define EOFS_DUO_NVFLAGS 32 // 1 byte
-#define EOFS_DUO_SHARED_AMPS 33 // 1 byte
+#define EOFS_DUO_NVFLAGS 32 // 1 byte GS_NVF_xxx
+#define EOFS_DUO_SHARED_AMPS 33 // 1 byte GROUP_SHARE fallback amps
 //
 // Reserved for HEARTBEAT_SUPERVISION (3 Bytes)
 //
@@ -579,6 +650,27 @@ extern AutoCurrentCapacityController g_ACCController;
 #define EOFS_RELAY_CLOSE_MS 37 // 1 byte
 #define EOFS_RELAY_HOLD_PWM 38 // 1 byte
 
+// PV_SURPLUS
+#define EOFS_PV_NVFLAGS 39 // 1 byte PV_NVF_xxx
+#define EOFS_PV_EXPORT_W 40 // 2 bytes signed
+#define EOFS_PV_HOLD_SEC 42 // 2 bytes
+
+// DELAYTIMER weekly schedule, DT_SCHED_CNT * WS_PACKED_LEN bytes
+#define EOFS_TIMER_SCHED 44
+
+// HEARTBEAT_SUPERVISION escalation tiers
+#define EOFS_HS_TIER2_SEC 84 // 1 byte, HS_TIER_SEC units
+#define EOFS_HS_TIER2_AMPS 85 // 1 byte
+#define EOFS_HS_TIER3_SEC 86 // 1 byte, HS_TIER_SEC units
+
+// THRESH_CAL
+#define EOFS_THRESH_SRC 87 // 1 byte THRESH_SRC_xxx
+#define EOFS_THRESH 88 // sizeof(THRESH_DATA) = 10 bytes
+
+// EVENT_LOG_EEPROM
+#define EOFS_EVENT_LOG_HEAD 440 // 1 byte
+#define EOFS_EVENT_LOG 441 // EVENT_LOG_EE_CNT * 8 bytes
+
 #define EOFS_MAX_HW_CURRENT_CAPACITY 511 // 1 byte
 
 
@@ -624,6 +716,9 @@ extern AutoCurrentCapacityController g_ACCController;
 // GFI pulse should be 50% duty cycle
 #define GFI_PULSE_ON_US 8333 // 1/2 of roughly 60 Hz.
 #define GFI_PULSE_OFF_US 8334 // 1/2 of roughly 60 Hz.
+// the pulses are generated by timer 2 in CTC mode, prescaler 1024
+// both half cycles use GFI_PULSE_ON_US
+#define GFI_PULSE_OCR2A ((uint8_t)((((F_CPU / 1024ul) * GFI_PULSE_ON_US) / 1000000ul) - 1))
 #endif
 #endif // GFI
 
@@ -681,9 +776,21 @@ extern AutoCurrentCapacityController g_ACCController;
 #endif // RTC
 
 // for J1772.ReadPilot()
+// PAFC_PWM: samples of each plateau, taken in step with Timer1. 1 per 1ms period
+#define PILOT_PLATEAU_CNT 4
+// fast PWM: back to back reads for the min/max
 // 1x = 114us 20x = 2.3ms 100x = 11.3ms
 #define PILOT_LOOP_CNT 100
 
+#ifdef PILOT_CHECK
+// a run takes one sample per Update(), about 50 loops
+#define PCHK_START_DELAY_MS 2000UL // after the PWM comes on
+#define PCHK_INTERVAL_MS 300000UL
+// failed runs in a row before EVSE_STATE_PILOT_ERROR. a failed run is
+// repeated straight away
+#define PCHK_FAIL_CNT 3
+#endif // PILOT_CHECK
+
 #ifdef AMMETER
 // This multiplier is the number of milliamps per A/d converter unit.
 
@@ -704,28 +811,16 @@ extern AutoCurrentCapacityController g_ACCController;
 // Craig K, I arrived at 213 by scaling my previous multiplier of 225 down by the ratio of my panel meter reading of 28 with the OpenEVSE uncalibrated reading of 29.6
 // then upped the scale factor to 220 after fixing the zero offset by subtracing 900ma
 //#define DEFAULT_CURRENT_SCALE_FACTOR 220 // for RB = 22 - measured by Craig on his new OpenEVSE V3
-// NOTE: setting DEFAULT_CURRENT_SCALE_FACTOR TO 0 will disable the ammeter
-// until it is overridden via RAPI
 //#define DEFAULT_CURRENT_SCALE_FACTOR 220   // Craig K, average of three OpenEVSE controller calibrations
-#ifdef OPENEVSE_2
-#define DEFAULT_CURRENT_SCALE_FACTOR 186   // OpenEVSE II with a 27 Ohm burden resistor, after a 2-point calibration at 12.5A and 50A
-#else
-#define DEFAULT_CURRENT_SCALE_FACTOR 220   // OpenEVSE v2.5 and v3 with a 22 Ohm burden resistor (note that the schematic may say 28 Ohms by mistake)
-#endif
-
-// subtract this from ammeter current reading to correct zero offset
-#ifdef OPENEVSE_2
-#define DEFAULT_AMMETER_CURRENT_OFFSET 230 // OpenEVSE II with a 27 Ohm burden resistor, after a 2-point calibration at 12.5A and 50A
-#else
-#define DEFAULT_AMMETER_CURRENT_OFFSET 0   // OpenEVSE v2.5 and v3 with a 22 Ohm burden resistor.  Could use a more thorough calibration exercise to nails this down.
-#endif
+// the DEFAULT_CURRENT_SCALE_FACTOR and DEFAULT_AMMETER_CURRENT_OFFSET in use
+// are in AmmeterSampler.h, along with CURRENT_SAMPLE_INTERVAL
 
-// The maximum number of milliseconds to sample an ammeter pin in order to find three zero-crossings.
-// one and a half cycles at 50 Hz is 30 ms.
-#define CURRENT_SAMPLE_INTERVAL 35
+// max # cycles for RAPI GA n. blocks the main loop for up to this many
+// CURRENT_SAMPLE_INTERVALs
+#define AMMETER_BURST_MAX 16
 
-// Once we detect a zero-crossing, we should not look for one for another quarter cycle or so. 1/4 // cycle at 50 Hz is 5 ms.
-#define CURRENT_ZERO_DEBOUNCE_INTERVAL 5
+// CURRENT_ZERO_DEBOUNCE_INTERVAL and the moving average length are in
+// AmmeterSampler.h too, which is also built into utils/overcurrent_sim
 
 #endif // AMMETER
 
@@ -738,68 +833,24 @@ extern AutoCurrentCapacityController g_ACCController;
 // #define TESTING_TEMPERATURE_OPERATION // Set this flag to play with very low sensor thresholds or to evaluate the code.
                                          // Leave it commented out instead to run with normal temperature thresholds.
 
-// Temperature thresholds below are expressed as 520 meaning 52.0C to save from needing floating point library
-// Keep any adjustments that you make at least 2C apart, giving things some hysterisis.  (example is 580 is 3C apart from 550)
-// The RESTORE_AMPERAGE value must be lower than the THROTTLE_DOWN value
+// Temperature thresholds are expressed as 520 meaning 52.0C to save from needing floating point library
+// Current is derated proportionally from the user's setting at THROTTLE_DOWN to the 6A minimum at SHUTDOWN,
+// using the temperature predicted from each sensor's rate of rise (see ThermalDerater.h for the slew/prediction tunables)
 // The THROTTLE_DOWN value must be lower than the SHUTDOWN value
 // The SHUTDOWN value must be lower than the PANIC value
-#ifndef TESTING_TEMPERATURE_OPERATION
-// normal oerational thresholds just below
-// This is the temperature in the enclosure where we tell the car to draw 1/2 amperage.
-#ifdef OPENEVSE_2
-#define TEMPERATURE_AMBIENT_THROTTLE_DOWN 650
-#else
-#define TEMPERATURE_AMBIENT_THROTTLE_DOWN 650
-#endif
-
-// If the OpenEVSE responds nicely to the lower current drawn and temperatures in the enclosure
-// recover to this level we can kick the current back up to the user's original amperage setting.
-#ifdef OPENEVSE_2
-#define TEMPERATURE_AMBIENT_RESTORE_AMPERAGE 620
-#else
-#define TEMPERATURE_AMBIENT_RESTORE_AMPERAGE 620
-#endif
-
-// This is the temperature in the enclosure where we tell the car to draw 1/4 amperage or 6A is minimum.
-#ifdef OPENEVSE_2
-#define TEMPERATURE_AMBIENT_SHUTDOWN 680
-#else
-#define TEMPERATURE_AMBIENT_SHUTDOWN 680
-#endif
-
-//  At this temperature gracefully tell the EV to quit drawing any current, and leave the EVSE in
-//  an over temperature error state.  The EVSE can be restart from the button or unplugged.
-//  If temperatures get to this level it is advised to open the enclosure to look for trouble.
-#ifdef OPENEVSE_2
-#define TEMPERATURE_AMBIENT_PANIC 710
-#else
-#define TEMPERATURE_AMBIENT_PANIC 710
-#endif
-
-#define TEMPERATURE_INFRARED_THROTTLE_DOWN 650    // This is the temperature seen  by the IR sensor where we tell the car to draw 1/2 amperage.
-#define TEMPERATURE_INFRARED_RESTORE_AMPERAGE 600 // If the OpenEVSE responds nicely to the lower current drawn and temperatures in the enclosure
-                                                  // recover to this level we can kick the current back up to the user's original amperage setting.
-#define TEMPERATURE_INFRARED_SHUTDOWN 700         // This is the temperature in the enclosure where we tell the car to draw 1/4 amperage or 6A is minimum.
-
-#define TEMPERATURE_INFRARED_PANIC 750            //  At this temperature gracefully tell the EV to quit drawing any current, and leave the EVSE in
-                                                  //  an over temperature error state.  The EVSE can be restart from the button or unplugged.
-                                                  //  If temperatures get to this level it is advised to open the enclosure to look for trouble.
-#else  //TESTING_TEMPERATURE_OPERATION
+// The normal operational thresholds are in ThermalDerater.h, so that utils/thermal_sim runs with the same ones
+#ifdef TESTING_TEMPERATURE_OPERATION
 
 // Below are good values for testing purposes at room temperature with an EV simulator and no actual high current flowing
-#define TEMPERATURE_AMBIENT_THROTTLE_DOWN 290     // This is the temperature in the enclosure where we tell the car to draw 1/2 amperage.
-#define TEMPERATURE_AMBIENT_RESTORE_AMPERAGE 270  // If the OpenEVSE responds nicely to the lower current drawn and temperatures in the enclosure
-                                                  // recover to this level we can kick the current back up to the user's original amperage setting.
-#define TEMPERATURE_AMBIENT_SHUTDOWN 310          // This is the temperature in the enclosure where we tell the car to draw 1/4 amperage or 6A is minimum.
+#define TEMPERATURE_AMBIENT_THROTTLE_DOWN 290     // This is the temperature in the enclosure where we start derating the charging current.
+#define TEMPERATURE_AMBIENT_SHUTDOWN 310          // This is the temperature in the enclosure where derating reaches the 6A minimum.
 
 #define TEMPERATURE_AMBIENT_PANIC 330             //  At this temperature gracefully tell the EV to quit drawing any current, and leave the EVSE in
                                                   //  an over temperature error state.  The EVSE can be restart from the button or unplugged.
                                                   //  If temperatures get to this level it is advised to open the enclosure to look for trouble.
 
-#define TEMPERATURE_INFRARED_THROTTLE_DOWN 330    // This is the temperature seen  by the IR sensor where we tell the car to draw 1/2 amperage.
-#define TEMPERATURE_INFRARED_RESTORE_AMPERAGE 270 // If the OpenEVSE responds nicely to the lower current drawn and temperatures in the enclosure
-                                                  // recover to this level we can kick the current back up to the user's original amperage setting.
-#define TEMPERATURE_INFRARED_SHUTDOWN 360         // This is the temperature in the enclosure where we tell the car to draw 1/4 amperage or 6A is minimum.
+#define TEMPERATURE_INFRARED_THROTTLE_DOWN 330    // This is the temperature seen  by the IR sensor where we start derating the charging current.
+#define TEMPERATURE_INFRARED_SHUTDOWN 360         // This is the temperature in the enclosure where derating reaches the 6A minimum.
 
 #define TEMPERATURE_INFRARED_PANIC 400            // At this temperature gracefully tell the EV to quit drawing any current, and leave the EVSE in
                                                   // an over temperature error state.  The EVSE can be restart from the button or unplugged.
@@ -840,6 +891,7 @@ typedef union union4b {
 #define OBDF_MONO_BACKLIGHT 0x01
 #define OBDF_AMMETER_DIRTY  0x80
 #define OBDF_UPDATE_DISABLED 0x40
+#define OBDF_DEFER_FLUSH    0x20 // in Update() - flush shadow when done
 
 // OnboardDisplay::Update()
 #define OBD_UPD_NORMAL    0
@@ -863,10 +915,40 @@ class OnboardDisplay
   uint8_t m_bFlags;
   char m_strBuf[LCD_MAX_CHARS_PER_LINE+1];
   unsigned long m_LastUpdateMs;
+#ifdef LCD16X2
+  // shadow framebuffer. the Lcd* functions only draw into m_Shadow.
+  // LcdFlush() sends the cells which differ from m_LcdBuf, which mirrors
+  // what is currently on the LCD
+  uint8_t m_Shadow[LCD_MAX_LINES][LCD_MAX_CHARS_PER_LINE];
+  uint8_t m_LcdBuf[LCD_MAX_LINES][LCD_MAX_CHARS_PER_LINE];
+  uint8_t m_CurX,m_CurY; // shadow cursor
+#endif // LCD16X2
+#ifdef OBD_STATS
+  uint32_t m_LcdWrCnt; // # HD44780 writes (chars + cursor moves)
+  uint32_t m_UpdUs; // total time spent in Update()
+  uint32_t m_StatsStartMs;
+#endif // OBD_STATS
 
   int8_t updateDisabled() { return  m_bFlags & OBDF_UPDATE_DISABLED; }
 
   void MakeChar(uint8_t n, PGM_P bytes);
+#ifdef LCD16X2
+  void shadowInit();
+  void shadowWrite(uint8_t c) {
+    if ((m_CurX < LCD_MAX_CHARS_PER_LINE) && (m_CurY < LCD_MAX_LINES)) {
+      m_Shadow[m_CurY][m_CurX] = c;
+    }
+    m_CurX++;
+  }
+  void shadowPrint(const char *s) {
+    while (*s) shadowWrite(*(s++));
+  }
+  // outside of Update(), draw immediately
+  void shadowChanged() {
+    if (!(m_bFlags & OBDF_DEFER_FLUSH)) LcdFlush();
+  }
+#endif // LCD16X2
+  void update(int8_t updmode);
 public:
   OnboardDisplay();
   void Init();
@@ -897,7 +979,8 @@ public:
 #endif // I2CLCD
   }
   void LcdPrint(const char *s) {
-    m_Lcd.print(s);
+    shadowPrint(s);
+    shadowChanged();
   }
   void LcdPrint_P(PGM_P s);
   void LcdPrint(int y,const char *s);
@@ -905,24 +988,32 @@ public:
   void LcdPrint(int x,int y,const char *s);
   void LcdPrint_P(int x,int y,PGM_P s);
   void LcdPrint(int i) {
-    m_Lcd.print(i);
+    itoa(i,m_strBuf,10);
+    LcdPrint(m_strBuf);
   }
   void LcdSetCursor(int x,int y) {
-    m_Lcd.setCursor(x,y);
+    m_CurX = x;
+    m_CurY = y;
   }
   void LcdClearLine(int y) {
-    m_Lcd.setCursor(0,y);
-    for (uint8_t i=0;i < LCD_MAX_CHARS_PER_LINE;i++) {
-      m_Lcd.write(' ');
+    if (y < LCD_MAX_LINES) {
+      memset(m_Shadow[y],' ',LCD_MAX_CHARS_PER_LINE);
+      shadowChanged();
     }
-    m_Lcd.setCursor(0,y);
+    LcdSetCursor(0,y);
   }
+  // clears the shadow only. the LCD itself is only cleared by LcdRefresh()
   void LcdClear() {
-    m_Lcd.clear();
+    memset(m_Shadow,' ',sizeof(m_Shadow));
+    LcdSetCursor(0,0);
+    shadowChanged();
   }
   void LcdWrite(uint8_t data) {
-    m_Lcd.write(data);
+    shadowWrite(data);
+    shadowChanged();
   }
+  void LcdFlush();
+  void LcdRefresh();
   void LcdMsg(const char *l1,const char *l2);
   void LcdMsg_P(PGM_P l1,PGM_P l2);
   void LcdSetBacklightType(uint8_t t,uint8_t update=OBD_UPD_FORCE) { // BKL_TYPE_XXX
@@ -966,6 +1057,11 @@ public:
   }
   int8_t UpdatesDisabled() { return (m_bFlags & OBDF_UPDATE_DISABLED) ? 1 : 0; }
   void Update(int8_t updmode=OBD_UPD_NORMAL); // OBD_UPD_xxx
+#ifdef OBD_STATS
+  // I2C bytes sent to the LCD/sec, HD44780 writes/sec and avg time spent
+  // in Update() per sec since last reset
+  void GetStats(uint32_t *bytesps,uint16_t *wrps,uint32_t *updusps);
+#endif // OBD_STATS
 };
 
 #ifdef GFI
@@ -975,10 +1071,23 @@ public:
 #ifdef TEMPERATURE_MONITORING
 #include "./MCP9808.h"  //  adding the ambient temp sensor to I2C
 #include "./Adafruit_TMP007.h"   //  adding the TMP007 IR I2C sensor
+#include "./ThermalDerater.h"
 
 
 #define TEMPERATURE_NOT_INSTALLED -2560 // fake temp to return when hardware not installed
 #define TEMPMONITOR_UPDATE_INTERVAL 1000ul
+#if defined(RTC) && !defined(OPENEVSE_2)
+#define DS3231_TEMP // read the DS3231 RTC's temperature sensor
+// DS3231 temperature conversion takes up to 200ms
+#define DS3231_CONV_MS 250ul
+#endif
+// TempMonitor.m_Step - Read() does one step per call
+#define TMS_IDLE        0
+#define TMS_DS3231_CONV 1 // start DS3231 conversion
+#define TMS_MCP9808     2
+#define TMS_TMP007      3
+#define TMS_DS3231_READ 4 // collect DS3231 conversion
+#define TMS_DONE        5
 // TempMonitor.m_Flags
 #define TMF_OVERTEMPERATURE          0x01
 #define TMF_OVERTEMPERATURE_SHUTDOWN 0x02
@@ -987,6 +1096,17 @@ public:
 class TempMonitor {
   uint8_t m_Flags;
   unsigned long m_LastUpdate;
+  uint8_t m_Step; // TMS_xxx next step
+  uint8_t m_Pending; // TMS_xxx step whose transfer is in m_Xfer, 0 = none
+  twi_xfer m_Xfer;
+  uint8_t m_TxBuf[2];
+  uint8_t m_RxBuf[2];
+#ifdef DS3231_TEMP
+  unsigned long m_ConvStartMs;
+#endif
+
+  void post(uint8_t step,uint8_t i2caddr,uint8_t txlen,uint8_t rxlen);
+  void collect(unsigned long curms);
 public:
 #ifdef MCP9808_IS_ON_I2C
   MCP9808 m_tempSensor;
@@ -998,6 +1118,12 @@ public:
   int16_t m_MCP9808_temperature;  // 230 means 23.0C  Using an integer to save on floating point library use
   int16_t m_DS3231_temperature;   // the DS3231 RTC has a built in temperature sensor
   int16_t m_TMP007_temperature;
+  // millis() when each temperature was last read successfully
+  unsigned long m_MCP9808_ms;
+  unsigned long m_DS3231_ms;
+  unsigned long m_TMP007_ms;
+  // maps the readings above to a pilot current limit
+  ThermalDerater m_Derater;
 
   TempMonitor() {}
   void Init();
@@ -1027,6 +1153,36 @@ public:
 };
 #endif // TEMPERATURE_MONITORING
 
+#ifdef AMMETER
+#include "AmmeterSampler.h"
+#endif // AMMETER
+
+#ifdef EVENT_LOG
+#include "EventLog.h"
+#endif // EVENT_LOG
+
+#ifdef GROUP_SHARE
+#include "GroupShare.h"
+#endif // GROUP_SHARE
+
+#ifdef PV_SURPLUS
+#include "PvSurplus.h"
+#endif // PV_SURPLUS
+
+#ifdef RTC
+#include "TimeCache.h"
+#endif // RTC
+
+#ifdef PILOT_CHECK
+#include "PilotCheck.h"
+#endif // PILOT_CHECK
+
+#ifdef DELAYTIMER
+#include "WeekSchedule.h"
+#endif // DELAYTIMER
+
+#include "SetpointArbiter.h"
+
 #include "J1772Pilot.h"
 #include "J1772EvseController.h"
 
@@ -1317,12 +1473,29 @@ class DelayTimer {
   uint8_t m_StopTimerHour;
   uint8_t m_StopTimerMin;
   uint8_t m_ManualOverride;
+  uint8_t m_SchedCnt; // windows in use in the weekly schedule
+  uint8_t m_Awake;    // schedule state as of the last reschedule()
+  uint8_t m_SchedAmps;
   unsigned long m_LastCheck;
+  unsigned long m_NextMs; // millis() of the next window change or resync
+  void reschedule();
+  uint8_t countWindows();
 public:
   DelayTimer(){
     m_LastCheck = - (60ul * 1000ul);
   };
   void Init();
+  // work the schedule out again at the next CheckTime(). call when the
+  // settings or the RTC change
+  void Reschedule() { m_NextMs = millis(); }
+  // idx < DT_SCHED_CNT. w->days = 0 to clear
+  void SetWindow(uint8_t idx,const SCHED_WIN *w);
+  void GetWindow(uint8_t idx,SCHED_WIN *w);
+  uint8_t GetSchedAmps() { return m_SchedAmps; }
+  // the timer is keeping the EVSE asleep
+  uint8_t WantsSleep() {
+    return (IsTimerEnabled() && IsTimerValid() && !ManualOverrideIsSet() && !IsInAwakeTimeInterval()) ? 1 : 0;
+  }
   void CheckTime();
   void Enable();
   void Disable();
@@ -1355,6 +1528,7 @@ public:
     m_StartTimerMin = min;
     eeprom_write_byte((uint8_t*)EOFS_TIMER_START_HOUR, m_StartTimerHour);
     eeprom_write_byte((uint8_t*)EOFS_TIMER_START_MIN, m_StartTimerMin);
+    Reschedule();
     //    g_EvseController.SaveSettings();
   };
   void SetStopTimer(uint8_t hour, uint8_t min){
@@ -1362,10 +1536,12 @@ public:
     m_StopTimerMin = min;
     eeprom_write_byte((uint8_t*)EOFS_TIMER_STOP_HOUR, m_StopTimerHour);
     eeprom_write_byte((uint8_t*)EOFS_TIMER_STOP_MIN, m_StopTimerMin);
+    Reschedule();
     //    g_EvseController.SaveSettings();
   };
   uint8_t IsInAwakeTimeInterval(); //
   uint8_t IsTimerValid(){
+     if (m_SchedCnt) return 1;
      if (m_StartTimerHour || m_StartTimerMin || m_StopTimerHour || m_StopTimerMin){ // Check not all equal 0
        if ((m_StartTimerHour == m_StopTimerHour) && (m_StartTimerMin == m_StopTimerMin)){ // Check start time not equal to stop time
          return 0;
@@ -1400,6 +1576,11 @@ extern char g_sSpace[];
 #define g_sSpace " "
 
 
+#ifdef RTC
+extern TimeCache g_TimeCache;
+void RtcSync(uint8_t settime);
+uint32_t RtcEpoch();
+#endif // RTC
 #ifdef DELAYTIMER
 extern DelayTimer g_DelayTimer;
 #endif
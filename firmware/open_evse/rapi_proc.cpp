@@ -41,52 +41,6 @@ void getMcuId(uint8_t *mcuid)
 }
 #endif // MCU_ID_LEN
 
-// 将2位十六进制字符串转换为uint8_t
-uint8_t htou8(const char *s)
-{
-  uint8_t u = 0;
-  for (int i = 0; i < 2; i++) {
-    char c = s[i];
-    if (c != '\0') {
-      if (i == 1) u <<= 4;
-      if ((c >= '0') && (c <= '9')) {
-        u += c - '0';
-      }
-      else if ((c >= 'A') && (c <= 'F')) {
-        u += c - 'A' + 10;
-      }
-      else if ((c >= 'a') && (c <= 'f')) {
-        u += c - 'a' + 10;
-      }
-      else {
-        // 如果字符无效，返回0
-        return 0;
-      }
-    }
-  }
-  return u;
-}
-
-// 将十进制字符串转换为uint32_t
-uint32_t dtou32(const char *s)
-{
-  uint32_t u = 0;
-  while (*s) {
-    u *= 10;
-    u += *(s++) - '0'; // 转换每个数字
-  }
-  return u;
-}
-
-#ifdef RAPI_I2C
-// 从主机接收数据 - 提示：这是一个中断服务例程（ISR）调用！
-// 提示2：不要在这里处理数据，数据收集仅在主循环中进行处理！
-void receiveEvent(int numBytes)
-{
-  // 在此不做任何处理
-}
-#endif // RAPI_I2C
-
 // RAPI处理器构造函数
 EvseRapiProcessor::EvseRapiProcessor()
 {
@@ -114,29 +68,14 @@ int EvseRapiProcessor::doCmd()
       char c = read();  // 读取数据
       if (echo) write(c);  // 如果启用了回显，则写回数据
 
-      if (c == ESRAPI_SOC) {
-        buffer[0] = ESRAPI_SOC;
-        bufCnt = 1;
-      }
-      else if (buffer[0] == ESRAPI_SOC) {
-        if (bufCnt < ESRAPI_BUFLEN) {
-          if (c == ESRAPI_EOC) {
-            buffer[bufCnt++] = 0;  // 结束字符
-            if (!tokenize(buffer)) {
-              rc = processCmd();  // 处理命令
-            }
-            else {
-              reset();  // 重置
-              curReceivedSeqId = INVALID_SEQUENCE_ID; // 接收序列ID无效
-              response(0);  // 响应
-            }
-          }
-          else {
-            buffer[bufCnt++] = c;  // 将字符添加到缓冲区
-          }
+      if (RapiFrameByte(buffer,&bufCnt,c)) {  // 收到完整的帧
+        if (!tokenize(buffer)) {
+          rc = processCmd();  // 处理命令
         }
-        else { // 如果字符太多
+        else {
           reset();  // 重置
+          curReceivedSeqId = INVALID_SEQUENCE_ID; // 接收序列ID无效
+          response(0);  // 响应
         }
       }
     }
@@ -194,58 +133,6 @@ void EvseRapiProcessor::sendButtonPress(uint8_t long_press)
 }
 #endif // RAPI_BTN
 
-// 解析接收到的命令并验证校验和
-int EvseRapiProcessor::tokenize(char *buf)
-{
-  // 设定第一个令牌为缓冲区中的第一个字符（跳过SOC标记）
-  tokens[0] = &buf[1];
-  char *s = &buf[2]; // 从第二个字符开始
-  tokenCnt = 1; // 初始化令牌计数
-  uint8_t achkSum = ESRAPI_SOC + buf[1]; // 初始化加法校验和
-  uint8_t xchkSum = ESRAPI_SOC ^ buf[1]; // 初始化XOR校验和
-  uint8_t hchkSum; // 存储接收到的校验和
-  uint8_t chktype = 0; // 校验和类型，0 = 无，1 = 加法，2 = XOR
-
-  // 遍历字符串直到末尾
-  while (*s) {
-    if (*s == ' ') { // 如果遇到空格，表示一个新的令牌开始
-      // 如果令牌数量已经达到最大值，退出解析
-      if (tokenCnt >= ESRAPI_MAX_ARGS) {
-        chktype = 255; // 标记为无效
-        break;
-      }
-      else {
-        achkSum += *s; // 更新加法校验和
-        xchkSum ^= *s; // 更新XOR校验和
-        *s = '\0'; // 用空字符结束当前令牌
-        tokens[tokenCnt++] = ++s; // 设置下一个令牌
-      }
-    }
-    else if ((*s == '*') || (*s == '^')) { // 检查是否为校验和类型指示符
-      if (*s == '*') chktype = 1; // 加法校验和
-      else if (*s == '^') chktype = 2; // XOR校验和
-      *(s++) = '\0'; // 结束令牌
-      hchkSum = htou8(s); // 提取接收到的校验和
-      break;
-    }
-    else {
-      achkSum += *s; // 更新加法校验和
-      xchkSum ^= *(s++); // 更新XOR校验和
-    }
-  }
-
-  // 校验接收到的校验和是否匹配
-  int rc = ((chktype == 0) || // 如果没有校验和
-           ((chktype == 1) && (hchkSum == achkSum)) || // 加法校验和匹配
-           ((chktype == 2) && (hchkSum == xchkSum))) ? 0 : 1; // XOR校验和匹配
-  if (rc) tokenCnt = 0; // 如果校验失败，重置令牌计数
-  // 可以取消注释下面的调试信息
-  // sprintf(g_sTmp,"trc: %d",rc);
-  // g_EIRP.writeStr(g_sTmp);
-
-  return rc; // 返回校验结果
-}
-
 uint8_t g_inRapiCommand = 0; // 标记当前是否在处理RAPI命令
 
 // 处理接收到的RAPI命令
@@ -264,13 +151,16 @@ int EvseRapiProcessor::processCmd()
   }
 #endif // RAPI_SENDER
 
-  // 初始化当前接收的序列ID为无效值
-  curReceivedSeqId = INVALID_SEQUENCE_ID;
-  const char *seqtoken = tokens[tokenCnt-1]; // 获取当前令牌数组中的最后一个元素
-  if ((tokenCnt > 1) && (*seqtoken == ESRAPI_SOS)) { // 如果令牌数量大于1并且最后一个令牌是 SOS
-      curReceivedSeqId = htou8(++seqtoken); // 解析序列ID
-      tokenCnt--; // 减少令牌数量
-  }
+  // 最后一个令牌是序列ID时取出来，响应时带回
+  curReceivedSeqId = RapiSeqId(tokens,&tokenCnt);
+
+#ifdef EVENT_LOG
+  // 处理函数会把响应 sprintf 到 buffer，tokens 指向 buffer，所以事件记录要用的
+  // 命令字和参数必须在 switch 之前取出来
+  char logCmd0 = tokens[0][0];
+  char logCmd1 = tokens[0][1];
+  uint8_t logArg = (tokenCnt > 1) ? (uint8_t)dtou32(tokens[1]) : 0;
+#endif // EVENT_LOG
 
   // 用bufCnt作为标志，在response()中表示有数据需要写入
   bufCnt = 0;
@@ -324,7 +214,7 @@ int EvseRapiProcessor::processCmd()
                       g_EvseController.EnableDiodeCheck(u1.u8); // 启用二极管检查
                       break;
                   case 'E': // 命令回显
-                      echo = ((u1.u8 == '0') ? 0 : 1); // 设置回显标志
+                      echo = u1.u8; // 设置回显标志
                       break;
   #ifdef ADVPWR
                   case 'F': // GFI自检
@@ -450,9 +340,13 @@ int EvseRapiProcessor::processCmd()
   #ifdef AMMETER
       case 'A': // 设置电流系数
           if (tokenCnt == 3) {
-              g_EvseController.SetCurrentScaleFactor(dtou32(tokens[1])); // 设置电流系数
-              g_EvseController.SetAmmeterCurrentOffset(dtou32(tokens[2])); // 设置电流偏移
-              rc = 0;
+              // 两个设置都是 int16_t，超出范围的拒绝，不截断
+              if (!dtoi32r(tokens[1],0,32767,&u1.i32) &&
+                  !dtoi32r(tokens[2],-32768,32767,&u2.i32)) {
+                  g_EvseController.SetCurrentScaleFactor((int16_t)u1.i32); // 设置电流系数
+                  g_EvseController.SetAmmeterCurrentOffset((int16_t)u2.i32); // 设置电流偏移，可为负数
+                  rc = 0;
+              }
           }
           break;
   #endif // AMMETER
@@ -482,24 +376,34 @@ int EvseRapiProcessor::processCmd()
                   else {
                       u1.u8 = 0; // 设置为非volatile
                   }
-  #ifdef TEMPERATURE_MONITORING
-                  if (g_TempMonitor.OverTemperature() &&
-                      (u2.u8 > g_EvseController.GetCurrentCapacity())) {
-                      // 如果当前温度过高，不允许增加电流容量
-                      rc = 1;
+                  // 温度降额等其他限制仍然有效，输出取其中最小的
+                  // 可以带一位小数，这时也用一位小数回复
+                  u3.u16 = dtou16d(tokens[1]);
+                  rc = g_EvseController.SetCurrentCapacityDa(u3.u16, 1, u1.u8); // 设置电流容量
+
+                  u3.u16 = g_EvseController.GetCurrentCapacityDa();
+                  if (strchr(tokens[1],'.')) {
+                    sprintf(buffer, "%u.%u", u3.u16 / 10, u3.u16 % 10); // 输出当前电流容量
                   }
                   else {
-                      rc = g_EvseController.SetCurrentCapacity(u2.u8, 1, u1.u8); // 设置电流容量
+                    sprintf(buffer, "%d", (int)(u3.u16 / 10)); // 输出当前电流容量
                   }
-  #else // !TEMPERATURE_MONITORING
-                  rc = g_EvseController.SetCurrentCapacity(u2.u8, 1, u1.u8); // 设置电流容量
-  #endif // TEMPERATURE_MONITORING
-
-                  sprintf(buffer, "%d", (int)g_EvseController.GetCurrentCapacity()); // 输出当前电流容量
               }
               bufCnt = 1; // 标记响应文本输出
           }
           break;
+#ifdef GROUP_SHARE
+    case 'G': // 协调器下发的共享线路分配电流
+      // 先按 uint32_t 检查范围再缩窄，超过 255A 的分配拒绝
+      if ((tokenCnt == 2) && g_EvseController.GetGroup()->Joined() &&
+          ((u1.u32 = dtou32(tokens[1])) <= 255)) {
+        g_EvseController.GroupAllocate(u1.u8);
+        sprintf(buffer,"%d",(int)g_EvseController.GetGroup()->Alloc()); // 实际生效的分配
+        bufCnt = 1; // 标记响应文本输出
+        rc = 0;
+      }
+      break;
+#endif // GROUP_SHARE
 #ifdef CHARGE_LIMIT
     case 'H': // 设置充电限制
       if (tokenCnt == 2) {
@@ -515,11 +419,27 @@ int EvseRapiProcessor::processCmd()
       break;
 #endif // CHARGE_LIMIT
 
+#ifdef GROUP_SHARE
+    case 'J': // 加入/离开共享线路分组
+      if ((tokenCnt == 2) || (tokenCnt == 3)) {
+        u1.u32 = dtou32(tokens[1]); // 线路总电流，0 = 离开分组
+        u2.u32 = (tokenCnt == 3) ? dtou32(tokens[2]) : 0; // 后备电流
+        // 先按 uint32_t 检查范围再缩窄
+        if ((u1.u32 <= 255) && (u2.u32 <= 255)) {
+          g_EvseController.GroupJoin(u1.u8,u2.u8);
+          rc = 0;
+        }
+      }
+      break;
+#endif // GROUP_SHARE
+
 #ifdef KWH_RECORDING
     case 'K': // 设置累计的千瓦时
-      g_EnergyMeter.SetTotkWh(dtou32(tokens[1])); // 设置累计的千瓦时
-      g_EnergyMeter.SaveTotkWh(); // 保存累计千瓦时
-      rc = 0; // 成功
+      if (tokenCnt == 2) {
+        g_EnergyMeter.SetTotkWh(dtou32(tokens[1])); // 设置累计的千瓦时
+        g_EnergyMeter.SaveTotkWh(); // 保存累计千瓦时
+        rc = 0; // 成功
+      }
       break;
 #endif // KWH_RECORDING
 
@@ -547,13 +467,89 @@ int EvseRapiProcessor::processCmd()
 #ifdef VOLTMETER
     case 'M': // 设置电压计
       if (tokenCnt == 3) {
-        g_EvseController.SetVoltmeter(dtou32(tokens[1]), dtou32(tokens[2])); // 设置电压计的值
-        rc = 0; // 成功
+        // 比例因子是 uint16_t。偏移量按 int32_t 解析，和 GM 的输出一致，
+        // 以补码存入 uint32_t，ReadVoltmeter() 的无符号加法就是减去它
+        if (!dtoi32r(tokens[1],0,0xffff,&u1.i32) &&
+            !dtoi32r(tokens[2],(int32_t)0x80000000UL,0x7fffffffL,&u2.i32)) {
+          g_EvseController.SetVoltmeter((uint16_t)u1.i32,(uint32_t)u2.i32); // 设置电压计的值
+          rc = 0; // 成功
+        }
       }
       break;
 #endif // VOLTMETER
 
+#ifdef THRESH_CAL
+    case 'X': // 手动设置 pilot 状态阈值，SX 0 取消
+      if (tokenCnt == 5) {
+        u1.u32 = dtou32(tokens[1]);
+        u2.u32 = dtou32(tokens[2]);
+        u3.u32 = dtou32(tokens[3]);
+        u4.u32 = dtou32(tokens[4]);
+        // 先按 uint32_t 检查范围再缩窄，SetThresh() 再检查是否超过 ADC 的范围
+        if ((u1.u32 <= 0xffff) && (u2.u32 <= 0xffff) && (u3.u32 <= 0xffff) && (u4.u32 <= 0xffff)) {
+          THRESH_DATA td;
+          td.m_ThreshAB = u1.u16;
+          td.m_ThreshBC = u2.u16;
+          td.m_ThreshCD = u3.u16;
+          td.m_ThreshDS = u4.u16;
+          rc = g_EvseController.SetThresh(&td);
+        }
+      }
+      else if ((tokenCnt == 2) && !dtou32(tokens[1])) {
+        rc = g_EvseController.SetThresh(NULL);
+      }
+      break;
+#endif // THRESH_CAL
+
+#ifdef PILOT_CHECK
+    case 'Q': // 马上做一次 pilot 自检，结果用 GQ 读取
+      if (tokenCnt == 1) {
+        rc = g_EvseController.PilotCheckNow();
+      }
+      break;
+#endif // PILOT_CHECK
+
 #ifdef DELAYTIMER
+    case 'D': // 设置每周计划的一个时段
+      if ((tokenCnt == 3) || (tokenCnt == 7) || (tokenCnt == 8)) {
+        extern DelayTimer g_DelayTimer;
+        SCHED_WIN w;
+        u1.u32 = dtou32(tokens[1]); // 时段序号
+        w.days = htou8(tokens[2]) & 0x7f; // 星期掩码，0 = 清除
+        w.start = w.stop = 0;
+        w.amps = 0;
+        if (tokenCnt >= 7) {
+          // 先按 uint32_t 检查范围再换算成分钟
+          u2.u32 = dtou32(tokens[3]);
+          u3.u32 = dtou32(tokens[4]);
+          if ((u2.u32 > 23) || (u3.u32 > 59)) break;
+          w.start = u2.u16 * 60 + u3.u16;
+          u2.u32 = dtou32(tokens[5]);
+          u3.u32 = dtou32(tokens[6]);
+          if ((u2.u32 > 23) || (u3.u32 > 59)) break;
+          w.stop = u2.u16 * 60 + u3.u16;
+          // 和 ST 一样，开始和结束相同的时段无效
+          if (w.days && (w.start == w.stop)) break;
+          if (tokenCnt == 8) {
+            u2.u32 = dtou32(tokens[7]); // 时段内的电流限制
+            if (u2.u32 > 255) break;
+            w.amps = u2.u8;
+          }
+        }
+        else if (w.days) break;
+        if (u1.u32 < DT_SCHED_CNT) {
+          g_DelayTimer.SetWindow(u1.u8,&w);
+          if (w.days) {
+            g_DelayTimer.Enable();
+          }
+          else if (!g_DelayTimer.IsTimerValid()) {
+            g_DelayTimer.Disable();
+          }
+          rc = 0;
+        }
+      }
+      break;
+
     case 'T': // 设置定时器
       if (tokenCnt == 5) {
         extern DelayTimer g_DelayTimer; // 延迟定时器实例
@@ -575,6 +571,24 @@ int EvseRapiProcessor::processCmd()
       break;
 #endif // DELAYTIMER
 
+#ifdef PV_SURPLUS
+    case 'U': // 余电充电设置
+      if ((tokenCnt >= 2) && (tokenCnt <= 4)) {
+        PvSurplus *pv = g_EvseController.GetPv();
+        u1.i32 = (tokenCnt >= 3) ? dtoi32(tokens[2]) : pv->ExportW(); // 目标送电功率，可为负数
+        if (u1.i32 > 32767) u1.i32 = 32767;
+        else if (u1.i32 < -32768) u1.i32 = -32768;
+        u2.u32 = (tokenCnt == 4) ? dtou32(tokens[3]) : pv->HoldSec(); // 暂停/恢复的保持时间
+        u3.u32 = dtou32(tokens[1]); // 0 = 关闭，1 = 只用余电
+        // 先按 uint32_t 检查范围再缩窄
+        if ((u3.u32 <= 1) && (u2.u32 <= 0xffff)) {
+          g_EvseController.PvConfig(u3.u8,(int16_t)u1.i32,u2.u16);
+          rc = 0;
+        }
+      }
+      break;
+#endif // PV_SURPLUS
+
 #if defined(KWH_RECORDING) && !defined(VOLTMETER)
     case 'V': // 设置电压（当不使用电压计时）
       if (tokenCnt == 2) {
@@ -584,19 +598,50 @@ int EvseRapiProcessor::processCmd()
       break;
 #endif // defined(KWH_RECORDING) && !defined(VOLTMETER)
 
+#ifdef PV_SURPLUS
+    case 'W': // 网关推送的电网功率
+      if (((tokenCnt == 2) || (tokenCnt == 3)) && g_EvseController.GetPv()->Enabled() &&
+          ((u1.u32 = (tokenCnt == 3) ? dtou32(tokens[2]) : 0) <= 0xffff)) {
+        g_EvseController.PvReading(dtoi32(tokens[1]),u1.u16);
+        sprintf(buffer,"%d",(int)g_EvseController.GetPv()->Limit()); // 余电允许的电流
+        bufCnt = 1; // 标记响应文本输出
+        rc = 0;
+      }
+      break;
+#endif // PV_SURPLUS
+
 #ifdef HEARTBEAT_SUPERVISION
     case 'Y': // 心跳监控
       if (tokenCnt == 1)  { // 这是一个心跳请求
         rc = g_EvseController.HsPulse(); // 发送心跳信号
       }
       else if (tokenCnt == 3) { // 这是一个完整的心跳监控命令，包含两个参数
-        rc = 0;
-        u1.u16 = (uint16_t)dtou32(tokens[1]); // HS间隔，单位：秒。0表示禁用
-        u2.u8 = (uint8_t)dtou32(tokens[2]);  // HS回退电流，单位：安培
-        if (u1.u16 == 0) { // 检查是否禁用
-          rc = g_EvseController.HsRestoreAmpacity(); // 恢复电流容量
+        u1.u32 = dtou32(tokens[1]); // HS间隔，单位：秒。0表示禁用
+        u2.u32 = dtou32(tokens[2]); // HS回退电流，单位：安培
+        // 先按 uint32_t 检查范围再缩窄
+        if ((u1.u32 > 0xffff) || (u2.u32 > 255)) {
+          rc = 1;
+        }
+        else {
+          rc = 0;
+          if (u1.u16 == 0) { // 检查是否禁用
+            rc = g_EvseController.HsRestoreAmpacity(); // 恢复电流容量
+          }
+          rc |= g_EvseController.HeartbeatSupervision(u1.u16, u2.u8); // 配置心跳监控
+        }
+      }
+      else if ((tokenCnt == 5) || (tokenCnt == 6)) { // 分级设置：再加上第二级的时间和电流，以及休眠的时间
+        u1.u32 = dtou32(tokens[1]); // 第一级时间，秒。0表示禁用
+        u2.u32 = dtou32(tokens[2]); // 第一级电流
+        u3.u32 = dtou32(tokens[3]); // 第二级时间，秒，0 = 不用
+        u4.u32 = dtou32(tokens[4]); // 第二级电流
+        uint32_t tier3sec = (tokenCnt == 6) ? dtou32(tokens[5]) : 0; // 休眠时间，秒
+        if ((u1.u32 > 0xffff) || (u2.u32 > 255) || (u3.u32 > 0xffff) || (u4.u32 > 255) || (tier3sec > 0xffff)) {
+          rc = 1;
+        }
+        else {
+          rc = g_EvseController.HeartbeatSupervision(u1.u16, u2.u8, u3.u16, u4.u8, (uint16_t)tier3sec);
         }
-        rc |= g_EvseController.HeartbeatSupervision(u1.u16, u2.u8); // 配置心跳监控
       }
       else if (tokenCnt == 2) { // 这是一个心跳监控丢失的确认命令
         u1.u8 = (uint8_t)dtou32(tokens[1]); // 魔法值（标识丢失）
@@ -605,7 +650,8 @@ int EvseRapiProcessor::processCmd()
       else { // 参数数量无效，返回错误
         rc = 1; // 无效的参数数量
       }
-      sprintf(buffer,"%d %d %d", g_EvseController.GetHearbeatInterval(), g_EvseController.GetHearbeatCurrent(), g_EvseController.GetHearbeatTrigger());
+      sprintf(buffer,"%d %d %d %u %u %u %u", g_EvseController.GetHearbeatInterval(), g_EvseController.GetHearbeatCurrent(), g_EvseController.GetHearbeatTrigger(),
+              g_EvseController.GetHsTier2Sec(), g_EvseController.GetHsTier2Amps(), g_EvseController.GetHsTier3Sec(), g_EvseController.GetHsTier());
       bufCnt = 1; // 标记响应文本输出
       break;
 #endif // HEARTBEAT_SUPERVISION
@@ -653,6 +699,18 @@ int EvseRapiProcessor::processCmd()
 #endif // MENNEKES_LOCK
 #ifdef AMMETER
     case 'A': // 获取电表设置
+      if (tokenCnt == 2) { // 校准用：连续测量 n 个周期，返回原始有效值的和与平方和
+        // 先按 uint32_t 检查范围再缩窄，否则 "GA 272" 会变成 16
+        u1.u32 = dtou32(tokens[1]);
+        if (u1.u32 && (u1.u32 <= AMMETER_BURST_MAX)) {
+          uint32_t sum,sumsq;
+          g_EvseController.AmmeterBurst(u1.u8,&sum,&sumsq);
+          sprintf(buffer,"%d %lu %lu",u1.u8,sum,sumsq);
+          bufCnt = 1; // 标记响应文本输出
+          rc = 0;
+        }
+        break;
+      }
       u1.i = g_EvseController.GetCurrentScaleFactor(); // 获取当前电流比例因子
       u2.i = g_EvseController.GetAmmeterCurrentOffset(); // 获取电流偏移量
       sprintf(buffer,"%d %d",u1.i,u2.i); // 输出比例因子和偏移量
@@ -660,6 +718,21 @@ int EvseRapiProcessor::processCmd()
       rc = 0;
       break;
 #endif // AMMETER
+#ifdef GROUP_SHARE
+    case 'B': // 获取共享线路成员状态，供协调器轮询
+      u1.u8 = g_EvseController.GetGroup()->Flags();
+      if (g_EvseController.EvConnected()) u1.u8 |= GSF_EV_CONNECTED;
+#ifdef AMMETER
+      u2.i32 = g_EvseController.GetChargingCurrent() / 100; // 0.1A
+#else
+      u2.i32 = 0;
+#endif // AMMETER
+      sprintf(buffer,"%d %02x %02x %d %ld",(int)g_EvseController.GetGroup()->Alloc(),u1.u8,
+              g_EvseController.GetState(),(int)g_EvseController.GetMaxCurrentCapacity(),u2.i32);
+      bufCnt = 1; // 标记响应文本输出
+      rc = 0;
+      break;
+#endif // GROUP_SHARE
     case 'C': // 获取电流容量范围
       u1.i = MIN_CURRENT_CAPACITY_J1772; // 最小电流容量（J1772）
       if (g_EvseController.GetCurSvcLevel() == 2) { // 服务级别2
@@ -677,6 +750,17 @@ int EvseRapiProcessor::processCmd()
 #ifdef DELAYTIMER
     case 'D': // 获取延时计时器设置
       extern DelayTimer g_DelayTimer;
+      if (tokenCnt == 2) { // 每周计划的一个时段
+        SCHED_WIN w;
+        u1.u32 = dtou32(tokens[1]);
+        if (u1.u32 < DT_SCHED_CNT) {
+          g_DelayTimer.GetWindow(u1.u8,&w);
+          sprintf(buffer,"%02x %d %d %d %d %d",w.days,w.start / 60,w.start % 60,w.stop / 60,w.stop % 60,w.amps);
+          bufCnt = 1; // 标记响应文本输出
+          rc = 0;
+        }
+        break;
+      }
       if (g_DelayTimer.IsTimerEnabled()) { // 如果计时器启用
 	u1.i = g_DelayTimer.GetStartTimerHour(); // 获取启动小时
 	u2.i = g_DelayTimer.GetStartTimerMin(); // 获取启动分钟
@@ -754,6 +838,30 @@ int EvseRapiProcessor::processCmd()
       }
       break;
 #endif // MCU_ID_LEN
+#ifdef GROUP_SHARE
+    case 'J': // 获取共享线路分组设置
+      sprintf(buffer,"%d %d",(int)g_EvseController.GetGroup()->GroupAmps(),(int)g_EvseController.GetGroup()->FallbackAmps());
+      bufCnt = 1; // 标记响应文本输出
+      rc = 0;
+      break;
+#endif // GROUP_SHARE
+#ifdef RTC
+    case 'K': // 获取时钟缓存的统计：同步次数、修正次数、累计修正秒数、漂移ppm、距上次同步的秒数
+      u1.u32 = millis();
+      sprintf(buffer,"%u %u %d %ld %u",g_TimeCache.SyncCnt(),g_TimeCache.CorrCnt(),g_TimeCache.CorrSum(),
+              g_TimeCache.DriftPpm(),g_TimeCache.SecsSinceSync(u1.u32));
+      bufCnt = 1; // 标记响应文本输出
+      rc = 0;
+      break;
+#endif // RTC
+#ifdef GFI
+    case 'L': // 获取GFI跳闸延迟
+      g_EvseController.GetGfiLatency(&u1.u16,&u2.u16,&u3.u16,&u4.u16);
+      sprintf(buffer,"%u %u %u %u",u1.u16,u2.u16,u3.u16,u4.u16);
+      bufCnt = 1; // 标记响应文本输出
+      rc = 0;
+      break;
+#endif // GFI
 
 #ifdef VOLTMETER
     case 'M': // 获取电压信息
@@ -784,6 +892,57 @@ int EvseRapiProcessor::processCmd()
       break;
 #endif // TEMPERATURE_MONITORING
 
+#ifdef PILOT_CHECK
+    case 'Q': // 获取 pilot 自检结果
+      {
+        PilotCheck *pc = g_EvseController.GetPilotCheck();
+        sprintf(buffer,"%u %u %u %u %u %u %u",pc->Runs(),pc->Fails(),pc->CmdDuty(),pc->MeasDuty(),
+                pc->MaxErr(),pc->Jitter(),pc->FreqDhz());
+        bufCnt = 1; // 标记响应文本输出
+        rc = 0;
+      }
+      break;
+#endif // PILOT_CHECK
+
+#ifdef THRESH_CAL
+    case 'X': // 获取 pilot 状态阈值、来源和开机时测得的电平
+      {
+        PTHRESH_DATA ptd = g_EvseController.GetThreshData();
+        sprintf(buffer,"%u %u %u %u %u %u %u",ptd->m_ThreshAB,ptd->m_ThreshBC,ptd->m_ThreshCD,ptd->m_ThreshDS,
+                g_EvseController.GetThreshSrc(),g_EvseController.GetCalP(),g_EvseController.GetCalN());
+        bufCnt = 1; // 标记响应文本输出
+        rc = 0;
+      }
+      break;
+#endif // THRESH_CAL
+
+#ifdef EVENT_LOG
+    case 'R': // 读取事件记录
+      if (tokenCnt == 1) {
+        sprintf(buffer,"%u %u %lu",g_EventLog.Count(),g_EventLog.Seq(),millis());
+        bufCnt = 1; // 设置标志，表示输出响应文本
+        rc = 0;
+      }
+      else {
+        EVENT_REC rec;
+        u1.u8 = (uint8_t)dtou32(tokens[tokenCnt-1]); // 记录序号，0 = 最新
+#ifdef EVENT_LOG_EEPROM
+        if ((tokenCnt == 3) && (*tokens[1] == 'E')) {
+          rc = g_EventLog.GetSaved(u1.u8,&rec) ? -1 : 0; // EEPROM 中的故障记录
+        }
+        else
+#endif // EVENT_LOG_EEPROM
+        if (tokenCnt == 2) {
+          rc = g_EventLog.Get(u1.u8,&rec) ? -1 : 0;
+        }
+        if (rc == 0) {
+          sprintf(buffer,"%lu %u %u %u",rec.ms,rec.type,rec.a,rec.b);
+          bufCnt = 1; // 设置标志，表示输出响应文本
+        }
+      }
+      break;
+#endif // EVENT_LOG
+
     case 'S': // 获取当前状态
       u1.u8 = g_EvseController.GetState(); // 获取设备状态
       u2.u8 = g_EvseController.GetPilotState(); // 获取引导状态
@@ -818,9 +977,22 @@ int EvseRapiProcessor::processCmd()
       rc = 0; // 设置返回值为0，表示处理成功
       break;
 
+#ifdef PV_SURPLUS
+    case 'W': // 获取余电充电状态
+      {
+        PvSurplus *pv = g_EvseController.GetPv();
+        sprintf(buffer,"%02x %d %d %ld %d %u",pv->Flags(),(int)pv->Limit(),pv->SurplusDa(),
+                (long)pv->GridW(),pv->ExportW(),pv->HoldSec());
+      }
+      bufCnt = 1; // 设置标志，表示输出响应文本
+      rc = 0;
+      break;
+#endif // PV_SURPLUS
+
 #ifdef HEARTBEAT_SUPERVISION
     case 'Y': // 获取心跳监控信息
-      sprintf(buffer,"%d %d %d", g_EvseController.GetHearbeatInterval(), g_EvseController.GetHearbeatCurrent(), g_EvseController.GetHearbeatTrigger()); // 获取心跳监控的间隔、当前电流和触发条件
+      sprintf(buffer,"%d %d %d %u %u %u %u", g_EvseController.GetHearbeatInterval(), g_EvseController.GetHearbeatCurrent(), g_EvseController.GetHearbeatTrigger(),
+              g_EvseController.GetHsTier2Sec(), g_EvseController.GetHsTier2Amps(), g_EvseController.GetHsTier3Sec(), g_EvseController.GetHsTier()); // 获取心跳监控的间隔、电流、触发状态和分级设置
       bufCnt = 1; // 设置标志，表示输出响应文本
       rc = 0; // 设置返回值为0，表示处理成功
       break;
@@ -843,6 +1015,20 @@ int EvseRapiProcessor::processCmd()
       }
       break;
 #endif // FAKE_CHARGING_CURRENT
+#ifdef OBD_STATS
+    case '1': // 获取LCD统计数据并清零
+      g_OBD.GetStats(&u1.u32,&u2.u16,&u3.u32);
+      sprintf(buffer,"%lu %u %lu",u1.u32,u2.u16,u3.u32);
+      bufCnt = 1; // 设置标志，表示输出响应文本
+      rc = 0;
+      break;
+#endif // OBD_STATS
+    case '2': // 获取上次充电的启动延迟
+      g_EvseController.GetChargeStartLatency(&u1.u16,&u2.u16);
+      sprintf(buffer,"%u %u",u1.u16,u2.u16);
+      bufCnt = 1; // 设置标志，表示输出响应文本
+      rc = 0;
+      break;
     }
     break;
 #endif // RAPI_T_COMMANDS
@@ -870,6 +1056,14 @@ int EvseRapiProcessor::processCmd()
     ; // 默认情况，不做任何操作
   }
 
+#ifdef EVENT_LOG
+  // 记录成功的设置命令。协调器和网关周期性发送的 SG、SW 不记录，否则会把记录冲掉
+  if ((rc == 0) && ((logCmd0 == 'S') || (logCmd0 == 'F')) &&
+      !((logCmd0 == 'S') && ((logCmd1 == 'G') || (logCmd1 == 'W')))) {
+    g_EventLog.Log(EVT_RAPI,logCmd0,((uint16_t)logCmd1 << 8) | logArg);
+  }
+#endif // EVENT_LOG
+
   if (bufCnt != -1){ // 如果bufCnt不等于-1
     response((rc == 0) ? 1 : 0); // 调用response函数，传递成功或失败标志
   }
@@ -884,19 +1078,6 @@ int EvseRapiProcessor::processCmd()
   return rc; // 返回操作结果
 }
 
-// 追加校验和
-void EvseRapiProcessor::appendChk(char *buf)
-{
-  char *s = buf;
-  uint8_t chk = 0;
-  while (*s) {
-    chk ^= *(s++); // 计算校验和
-  }
-  sprintf(s,"^%02X",(unsigned)chk); // 格式化校验和为16进制
-  s[3] = ESRAPI_EOC; // 追加结束符
-  s[4] = '\0'; // 字符串结束
-}
-
 // 响应函数
 void EvseRapiProcessor::response(uint8_t ok)
 {
@@ -1059,6 +1240,15 @@ void EvseSerialRapiProcessor::init()
 
 #ifdef RAPI_I2C
 
+volatile uint8_t EvseI2cRapiProcessor::rxBuf[RAPI_I2C_RXBUF_LEN];
+volatile uint8_t EvseI2cRapiProcessor::rxHead;
+volatile uint8_t EvseI2cRapiProcessor::rxTail;
+volatile uint8_t EvseI2cRapiProcessor::txBuf[RAPI_I2C_TXBUF_LEN];
+volatile uint8_t EvseI2cRapiProcessor::txHead;
+volatile uint8_t EvseI2cRapiProcessor::txTail;
+volatile uint8_t EvseI2cRapiProcessor::rxOverflowCnt;
+volatile uint8_t EvseI2cRapiProcessor::txOverflowCnt;
+
 // EvseI2cRapiProcessor类构造函数
 EvseI2cRapiProcessor::EvseI2cRapiProcessor()
 {
@@ -1068,15 +1258,89 @@ EvseI2cRapiProcessor::EvseI2cRapiProcessor()
 // 初始化函数
 void EvseI2cRapiProcessor::init()
 {
+  rxHead = rxTail = 0;
+  txHead = txTail = 0;
+
   // 启动I2C通信，使用RAPI_I2C_LOCAL_ADDR作为设备地址
   Wire.begin(RAPI_I2C_LOCAL_ADDR);
-  // 定义接收数据的函数，接收来自主设备的数据
-  Wire.onReceive(receiveEvent);
+  // 主设备写入的数据在ISR中立即移入接收环形缓冲区
+  Wire.onReceive(onReceive);
+  // 主设备读取时从发送队列中取出响应/异步通知
+  Wire.onRequest(onRequest);
 
   // 调用父类EvseRapiProcessor的初始化函数
   EvseRapiProcessor::init();
 }
 
+// 从主机接收数据 - 提示：这是一个中断服务例程（ISR）调用！
+// 只把字节拷贝到接收环形缓冲区，命令在主循环的doCmd()中处理
+// 立即取走Wire的接收缓冲区，避免被LCD/RTC等主模式读取覆盖
+void EvseI2cRapiProcessor::onReceive(int numBytes)
+{
+  while (Wire.available()) {
+    uint8_t c = Wire.read();
+    if ((uint8_t)(rxHead - rxTail) < RAPI_I2C_RXBUF_LEN) {
+      rxBuf[rxHead & (RAPI_I2C_RXBUF_LEN-1)] = c;
+      rxHead++;
+    }
+    else {
+      // 缓冲区满，丢弃字符 - doCmd()会因为校验和错误而返回NK
+      rxOverflowCnt++;
+    }
+  }
+}
+
+// 主机读取数据 - 提示：这是一个中断服务例程（ISR）调用！
+// 每次返回固定长度RAPI_I2C_TX_FRAMELEN的帧：
+// 第1字节为有效字符数n，后跟n个字符，其余为填充
+void EvseI2cRapiProcessor::onRequest()
+{
+  uint8_t frame[RAPI_I2C_TX_FRAMELEN];
+  uint8_t n = 0;
+  while ((n < (RAPI_I2C_TX_FRAMELEN-1)) && (txTail != txHead)) {
+    frame[++n] = txBuf[txTail & (RAPI_I2C_TXBUF_LEN-1)];
+    txTail++;
+  }
+  frame[0] = n;
+  for (uint8_t i=n+1;i < RAPI_I2C_TX_FRAMELEN;i++) {
+    frame[i] = 0;
+  }
+  // 从模式下twi_transmit()会替换发送缓冲区，所以必须一次写入整帧
+  Wire.write(frame,RAPI_I2C_TX_FRAMELEN);
+}
+
+int EvseI2cRapiProcessor::read()
+{
+  if (rxTail == rxHead) return -1;
+  uint8_t c = rxBuf[rxTail & (RAPI_I2C_RXBUF_LEN-1)];
+  rxTail++;
+  return c;
+}
+
+// 将字符放入发送队列，等待主机读取
+// 队列满时丢弃字符，不阻塞主循环
+int EvseI2cRapiProcessor::write(uint8_t u8)
+{
+  if ((uint8_t)(txHead - txTail) < RAPI_I2C_TXBUF_LEN) {
+    txBuf[txHead & (RAPI_I2C_TXBUF_LEN-1)] = u8;
+    txHead++;
+    return 1;
+  }
+  else {
+    txOverflowCnt++;
+    return 0;
+  }
+}
+
+int EvseI2cRapiProcessor::write(const char *str)
+{
+  int cnt = 0;
+  while (*str) {
+    cnt += write((uint8_t)*(str++));
+  }
+  return cnt;
+}
+
 #endif // RAPI_I2C
 
 // 创建EvseSerialRapiProcessor的全局对象g_ESRP
@@ -1109,8 +1373,8 @@ void RapiInit()
 
   // 如果定义了GPPBUGKLUDGE宏，设置特定的缓冲区
 #ifdef GPPBUGKLUDGE
-  static char g_rapiI2ClBuffer[ESRAPI_BUFLEN];
-  g_ESRP.setBuffer(g_rapiI2CBuffer);
+  static char g_rapiI2CBuffer[ESRAPI_BUFLEN];
+  g_EIRP.setBuffer(g_rapiI2CBuffer);
 #endif // GPPBUGKLUDGE
 #endif // RAPI_I2C
 }
@@ -1124,19 +1388,6 @@ void RapiDoCmd()
 #endif
 
 #ifdef RAPI_I2C
-  // 如果使用I2C接口，在紧密循环中运行RapiDoCmd时，需要延时
-  // 这是因为在硬故障时，I2C无法接收字符。没有延时时，I2C会丢失字符
-#define RDCDELAY 6
-#ifdef RDCDELAY
-  static unsigned long lastdocmd;  // 上次执行命令的时间
-  unsigned long msnow = millis();  // 获取当前时间
-  // 如果两次执行命令的时间间隔小于RDCDELAY，执行延时
-  if ((msnow - lastdocmd) < RDCDELAY) {
-    delay(RDCDELAY - (msnow - lastdocmd));
-  }
-  lastdocmd = msnow;  // 更新上次执行命令的时间
-#endif // RDCDELAY
-
   // 调用g_EIRP的doCmd函数
   g_EIRP.doCmd();
 #endif // RAPI_I2C
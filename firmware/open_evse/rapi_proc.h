@@ -172,6 +172,8 @@ S5 A|M|0|1 - Mennekes lock setting
    1 = lock (valid only in manual mode)
    n.b. requires MENNEKES_LOCK. manual mode is volatile - always boots in automatic mode
 SA currentscalefactor currentoffset - set ammeter settings
+ currentscalefactor 0-32767, currentoffset -32768-32767
+ $NK if either is out of range
 SB - clear boot lock
   when BOOTLOCK is defined, EVSE won't allow charging after boot up until SB is received
  response: $OK 0 = unlock success
@@ -180,9 +182,12 @@ SC amps [V|M]- set current capacity
  response:
    if amps < minimum current capacity, will set to minimum and return $NK ampsset
    if amps > maximum current capacity, will set to maximum and return $NK ampsset
-   if in over temperature status, raising current capacity will fail and return $NK ampsset
    otherwise return $OK ampsset
-   ampsset: the resultant current capacity
+   ampsset: the resultant current capacity. it can be lower than amps while
+     temperature derating, heartbeat fallback or a group allocation is in
+     force, which keep limiting the pilot until they clear. while charging,
+     increases are ramped up SETPOINT_STEP_AMPS at a time every
+     SETPOINT_DWELL_MS, so ampsset can also lag behind for a few seconds
    default action is to save new current capacity to EEPROM for the currently active service level.
    if V is specified, then new current capacity is volatile, and will be
      reset to previous value at next reboot
@@ -190,6 +195,32 @@ SC amps [V|M]- set current capacity
      to EEPROM. subsequent calls the $SC cannot exceed value set bye $SC M
      the value cannot be changed/erased via RAPI commands. Subsequent calls
      to $SC M will return $NK
+   amps can have one decimal, e.g. 12.5, to set the pilot in 0.1A steps. ampsset
+     is then returned with one decimal too. only whole amps are saved to EEPROM,
+     the tenths last until the next reboot or service level change. M ignores them
+ $SC 12.5 V^7A
+SD idx days starthr startmin endhr endmin [amps] - set weekly schedule window
+ idx: 0-7
+ days(hex): bit 0 = Sunday .. bit 6 = Saturday
+ a window that ends before its start runs into the next day
+ $NK if the start and end are the same, as with ST
+ amps: current cap while the window is open, 0 = none. overlapping
+   windows get the highest cap
+ enables the timer. while any window is set the ST start/end times are
+ ignored
+SD idx 0 - clear window
+ disables the timer if no windows are left and no ST times are set
+ $SD 0 1f 22 0 6 0^62 - weeknights 22:00-06:00
+ $SD 1 41 10 0 15 0 16^25 - weekends 10:00-15:00 at 16A
+ $SD 1 0^32
+SG amps - set group allocation (GROUP_SHARE). sent by the coordinator
+ amps: allocation for this EVSE, 0 = pause. < 6 is treated as 0
+ pilot current is capped at amps without touching the EEPROM setting. the
+ allocation must be refreshed at least every 30 sec, otherwise the EVSE
+ drops to the lower of amps and its fallback amps
+ response: $OK allocamps
+ $NK if not in a group or amps > 255
+ $SG 16^17
 SH kWh - set cHarge limit to kWh
  NOTES:
   - allowed only when EV connected in State B or C
@@ -199,6 +230,14 @@ SH kWh - set cHarge limit to kWh
  response:
   $OK - accepted
   $NK - invalid EVSE state
+SJ groupamps [fallbackamps] - join a group of EVSEs sharing a groupamps circuit
+ fallbackamps: limit when the coordinator goes quiet, 0 = pause. to keep the
+   circuit safe with no coordinator, the fallbackamps of all the members
+   must add up to no more than groupamps
+ saved to EEPROM. groupamps = 0 to leave the group
+ $NK if either value > 255
+ $SJ 80 20^37
+ $SJ 0^2D
 SK - set accumulated Wh (v1.0.3+)
  $SK 0^2C - set accumulated Wh to 0
 SL 1|2|A  - set service level L1/L2/Auto
@@ -206,15 +245,48 @@ SL 1|2|A  - set service level L1/L2/Auto
  $SL 2*15
  $SL A*24
 SM voltscalefactor voltoffset - set voltMeter settings
+ voltscalefactor 0-65535, voltoffset signed 32-bit decimal
+ $NK if either is out of range
+SQ - run a pilot check now (PILOT_CHECK)
+ the check finds the pilot edges one sample per loop, so it finishes about
+ a second later. read the result with GQ
+ $NK if the pilot isn't on PWM
+ $SQ^26
 ST starthr startmin endhr endmin - set timer
  $ST 0 0 0 0^23 - cancel timer
+SU 0|1 [exportw [holdsec]] - configure solar surplus charging (PV_SURPLUS)
+ 1 = charge from surplus only, the pilot follows the grid readings pushed
+   with SW. until the first reading and if the readings stop for 60 sec,
+   the pilot is held at 6A
+ exportw: export to keep going to the grid, W. negative to allow some import
+ holdsec: pause when the surplus is under 6A for this long, resume when it
+   has been over 7A for this long. default 300
+ omitted values are left as they are. saved to EEPROM
+ $NK if the flag isn't 0 or 1, or holdsec is over 65535
+ $SU 1 200 300^32
+ $SU 0^32
 SV mv - Set Voltage for power calculations to mv millivolts
  $SV 223576 - set voltage to 223.576
  NOTES:
   - only available if VOLTMETER not defined and KWH_RECORDING defined
   - volatile - value is lost, and replaced with VOLTS_FOR_Lx at boot
+SW gridw [volts] - site grid power reading (PV_SURPLUS). sent by the gateway
+ gridw: + = importing, - = exporting, W. push one every few seconds
+ volts: line voltage, default is the voltage set with SV or measured
+ response: $OK pvamps
+ pvamps: pilot limit from the surplus, 0 = paused
+ $NK if surplus charging isn't enabled with SU, or volts is over 65535
+ $SW -3500 240^3D
+SX ab bc cd ds - override the pilot thresholds (THRESH_CAL)
+SX 0 - go back to the calibrated thresholds
+ ab bc cd ds: state A/B, B/C, C/D and diode short thresholds, ADC counts. see GX
+ saved to EEPROM, and no longer calibrated at boot until SX 0.
+ SX 0 uses this boot's calibration if there was one, else the compiled in defaults
+ $NK unless 1023 >= ab > bc > cd > ds
+ $SX 0^3F
 SY heartbeatinterval hearbeatcurrentlimit
- Response includes heartbeatinterval hearbeatcurrentlimit hearbeattrigger
+SY heartbeatinterval hearbeatcurrentlimit tier2sec tier2amps [sleepsec]
+ Response includes heartbeatinterval hearbeatcurrentlimit hearbeattrigger tier2sec tier2amps sleepsec tier
  hearbeattrigger: 0 - There has never been a missed pulse, 
  2 - there is a missed pulse, and HS is still in current limit
  1 - There was a missed pulse once, but it has since been acknowledged. Ampacity has been successfully restored to max permitted 
@@ -222,6 +294,15 @@ SY heartbeatinterval hearbeatcurrentlimit
  $SY        //This is a heartbeat supervision pulse.  Need one every heartbeatinterval seconds.
  $SY 165    //This is an acknowledgement of a missed pulse.  Magic Cookie = 165 (=0XA5)
  When you send a pulse, an NK response indicates that a previous pulse was missed and has not yet been acked
+ Tiers: with no pulse for tier2sec seconds the limit drops further to tier2amps,
+ and after sleepsec seconds the EVSE goes to sleep. 0 = tier not used. each must be longer
+ than the one before. tier2sec/sleepsec are saved in 10 second steps, rounded up, max 2540.
+ With either tier set, the limit is lifted as soon as pulses come back, ramping up at the
+ setpoint slew rate, and the EVSE wakes up again. hearbeattrigger stays 2 until acked.
+ The 2 argument form clears the tiers.
+ $NK if a time is over 65535 or a current over 255, before anything is changed
+ tier: 0 = pulses OK, 1 = hearbeatcurrentlimit, 2 = tier2amps, 3 = asleep
+ $SY 30 16 120 6 900  //16A after 30s without a pulse, 6A after 2 min, sleep after 15 min
 
 G0 - get EV connect state
  response: $OK connectstate
@@ -252,6 +333,24 @@ G5 - get Mennekes settings
 GA - get ammeter settings
  response: $OK currentscalefactor currentoffset
  $GA^22
+GA n - ammeter calibration burst: measure n line cycles back to back, 1-16
+ response: $OK n sum sumsq
+ sum, sumsq - sum and sum of squares of the raw per cycle RMS readings,
+   ADC counts, i.e. before currentscalefactor and currentoffset
+ reads the CT directly, so it works whether or not the relay is closed.
+ blocks the main loop for up to n*35ms
+ $GA 16^05
+ n.b. lets a calibration tool take a few hundred readings in seconds
+   instead of waiting for GG to average 32 loops per reading
+
+GB - get group member status (GROUP_SHARE)
+ response: $OK allocamps flags evsestate maxamps chargingda
+ allocamps(dec): allocation in force, 0 = paused
+ flags(hex): GSF_xxx 1 = in a group, 2 = on fallback, 4 = paused, 8 = EV connected
+ evsestate(hex): EVSE_STATE_xxx
+ maxamps(dec): configured current capacity
+ chargingda(dec): measured current in 0.1A
+ $GB^21
 
 GC - get current capacity info
  response: $OK minamps hmaxamps pilotamps cmaxamps
@@ -270,6 +369,10 @@ GD - get Delay timer
    all values decimal
    if timer disabled, starthr=startmin=endhr=endmin=0
  $GD^27
+GD idx - get weekly schedule window
+ response: $OK days starthr startmin endhr endmin amps
+   days hex, the rest decimal. days = 0 = unused
+ $GD 0^37
 
 GE - get settings
  response: $OK amps(decimal) flags(hex)
@@ -299,6 +402,34 @@ GI - get MCU ID - requires MCU_ID_LEN to be defined
 	unknown in 328P. The first 6 characters are ASCII, and the rest are
 	hexadecimal.
 
+GJ - get group settings (GROUP_SHARE)
+ response: $OK groupamps fallbackamps
+ groupamps = 0 = not in a group
+ $GJ^29
+
+GK - get clocK cache stats (RTC)
+ response: $OK synccnt corrcnt corrsum driftppm secsincesync
+ the RTC is read every 10 minutes, in between the time is worked out from millis()
+ synccnt - RTC reads since boot
+ corrcnt - reads where the millis() estimate was off
+ corrsum - seconds added to the estimate by those corrections
+ driftppm - drift of millis() against the RTC, + = millis() slow. 0 until an hour has gone by
+ setting the time restarts corrcnt, corrsum and driftppm. all values decimal
+ $GK^28
+
+GL - get GFI trip latency
+ response: $OK openus maxopenus handledms maxhandledms
+ openus - microseconds from gfi interrupt entry to relay pins driven open, last trip
+ maxopenus - worst openus since boot
+ handledms - milliseconds from gfi interrupt to the main loop processing the fault, last trip
+ maxhandledms - worst handledms since boot
+ all values decimal. the relay is opened directly from the interrupt, so
+ handledms does not delay opening the relay. it only shows main loop latency.
+ time from the GFI CT signal to interrupt entry is not included. it is bounded
+ by the longest section that runs with interrupts disabled
+ n.b. requires GFI
+ $GL^2F
+
 GM - get voltMeter settings
  response: $OK voltcalefactor voltoffset
  $GM^2E
@@ -316,6 +447,39 @@ GP - get temPerature (v1.0.3+)
  if any temperature sensor is not installed, its return value is -2560
  $GP^33
 
+GQ - get pilot check results (PILOT_CHECK)
+ response: $OK runs fails cmdduty measduty maxerr jitter freq
+ the duty cycle and frequency at the pilot pin are measured every 5 minutes
+ while the pilot is on PWM, and 2 seconds after it comes on
+ runs - checks since boot
+ fails - checks out of tolerance. a failed check is repeated straight away,
+  and 3 in a row go to EVSE_STATE_PILOT_ERROR
+ cmdduty - duty cycle set for the current capacity, last check
+ measduty - duty cycle measured, last check
+ maxerr - worst |measduty - cmdduty| since boot
+ jitter - spread between repeated finds of the same edge, last check
+ freq - pilot frequency, last check, 0.1Hz
+ duty values are in 0.01%. tolerance is 1% duty and 1kHz +/- 20Hz
+ $GQ^32
+
+GR - get event log summary
+ response: $OK cnt seq ms
+ cnt - number of records in the RAM event log
+ seq - total events logged since boot. if it changes while paging with GR n,
+  the log has moved on and the records have shifted
+ ms - current millis(), to turn record times into ages
+ $GR^31
+GR n - get RAM event log record n, 0 = newest
+GR E n - get EEPROM fault record n, 0 = newest (#define EVENT_LOG_EEPROM)
+ response: $OK ms type a b
+ ms - millis() when logged. for EEPROM records it's the RTC unix time
+      instead if there is an RTC
+ type, a, b - see EVT_xxx in EventLog.h
+ returns $NK if there is no record n
+ $GR 0^21
+ $GR E 0^44
+ n.b. requires #define EVENT_LOG
+
 GS - get state
  response: $OK evsestate elapsed pilotstate vflags
  evsestate(hex): EVSE_STATE_xxx
@@ -326,6 +490,7 @@ GS - get state
 
 GT - get time (RTC)
  response: $OK yr mo day hr min sec       yr=2-digit year
+ the RTC is only read every 10 minutes, see GK
  $GT^37
 
 GU - get energy usage (v1.0.3+)
@@ -334,6 +499,15 @@ GU - get energy usage (v1.0.3+)
  Whacc - total Wh accumulated over all charging sessions, note you'll divide Wh by 1000 to get kWh
  $GU^36
 
+GW - get solar surplus status (PV_SURPLUS)
+ response: $OK flags pvamps surplusda gridw exportw holdsec
+ flags(hex): PVF_xxx 1 = enabled, 2 = paused, 4 = no readings, 8 = hold timer running
+ pvamps(dec): pilot limit from the surplus, 0 = paused, 255 = not enabled
+ surplusda(dec): surplus from the last reading in 0.1A
+ gridw(dec): last reading
+ exportw, holdsec(dec): SU settings
+ $GW^34
+
 GV - get version
  response: $OK firmware_version protocol_version
  NOTE: protocol_version is deprecated. too hard to maintain variants.
@@ -344,9 +518,32 @@ T commands for debugging only #define RAPI_T_COMMMANDS
 T0 amps - set fake charging current
  response: $OK
  $T0 75
+T1 - get and reset display stats #define OBD_STATS
+ response: $OK i2cbytes lcdwrites updateus
+ i2cbytes = bytes per second sent to the LCD over I2C, including the
+  address byte of each transaction
+ lcdwrites = # HD44780 writes (chars + cursor moves) per second
+ updateus = microseconds per second spent in OnboardDisplay::Update()
+ $T1
+T2 - get charge start latency of the last session
+ response: $OK startms maxgapms
+ startms = ms from entering STATE C to closing the relay
+ maxgapms = longest time between J1772EVSEController::Update() calls
+  while waiting for the GFI self test. 0 if the self test is disabled
+ $T2
  
+GX - get pilot thresholds (THRESH_CAL)
+ response: $OK ab bc cd ds src prail nrail
+ ab bc cd ds: state A/B, B/C, C/D and diode short thresholds, ADC counts
+ src: 0 = compiled in defaults, 1 = calibrated at boot, 2 = set with SX
+ prail nrail: +12V and -12V pilot levels measured at boot, ADC counts.
+  0 0 if there was no calibration this boot: EV connected, unsteady
+  readings, thresholds too far from the defaults, or src = 2
+ the thresholds are placed between the J1772 bands, scaled to the levels
+ $GX^3B
+
 GY - Get Hearbeat Supervision Status
- Response includes heartbeatinterval hearbeatcurrentlimit hearbeattrigger
+ Response includes heartbeatinterval hearbeatcurrentlimit hearbeattrigger tier2sec tier2amps sleepsec tier
  hearbeattrigger: 0 - There has never been a missed pulse, 
  2 - there is a missed pulse, and HS is still in current limit
  1 - There was a missed pulse once, but it has since been acknkoledged. Ampacity has been successfully restored to max permitted 
@@ -358,28 +555,35 @@ Z0 closems holdpwm
    holdpwm(dec) = pwm duty cycle for relay hold 0-255
 
 
+ **** RAPI over I2C (RAPI_I2C) ****
+
+the EVSE is an I2C slave at RAPI_I2C_LOCAL_ADDR.
+commands: master writes the command bytes as-is. they are buffered by the
+ TWI receive interrupt, so the master doesn't need to pace its writes.
+responses and async notifications ($AT/$AB/$AN/$WF): queued on the EVSE
+ and collected by the master with fixed-length reads of
+ RAPI_I2C_TX_FRAMELEN bytes. the 1st byte of each frame is the count n of
+ valid characters which follow. the rest of the frame is padding.
+ n = 0 means nothing is pending.
+
  *
  */
 
 #ifdef RAPI
 
-#define RAPIVER "5.2.1"
+#define RAPIVER "5.3.0"
+
+// framing, tokenizing and number parsing, shared with utils/rapi_fuzz
+#include "RapiParse.h"
 
 #define WIFI_MODE_AP 0
 #define WIFI_MODE_CLIENT 1
 #define WIFI_MODE_AP_DEFAULT 2
 
-#define ESRAPI_BUFLEN 32
-#define ESRAPI_SOC '$' // start of command
-#define ESRAPI_EOC 0xd // CR end of command
-#define ESRAPI_SOS ':' // start of sequence id
-#define ESRAPI_MAX_ARGS 10
 // for RAPI_SENDER
 #define RAPIS_TIMEOUT_MS 500
 #define RAPIS_BUFLEN 20
 
-#define INVALID_SEQUENCE_ID 0
-
 class EvseRapiProcessor {
 #ifdef GPPBUGKLUDGE
   char *buffer;
@@ -414,11 +618,11 @@ private:
     bufCnt = 0;
   }
 
-  int tokenize(char *buf);
+  int tokenize(char *buf) { return RapiTokenize(buf,tokens,&tokenCnt); }
   int processCmd();
 
   void response(uint8_t ok);
-  void appendChk(char *buf);
+  void appendChk(char *buf) { RapiAppendChk(buf); }
   
 #ifdef RAPI_SENDER
   char sendbuf[RAPIS_BUFLEN]; // input buffer
@@ -460,17 +664,41 @@ extern EvseSerialRapiProcessor g_ESRP;
 
 
 #ifdef RAPI_I2C
+// ring buffer sizes - must be powers of 2
+#ifndef RAPI_I2C_RXBUF_LEN
+#define RAPI_I2C_RXBUF_LEN 64
+#endif
+#ifndef RAPI_I2C_TXBUF_LEN
+#define RAPI_I2C_TXBUF_LEN 64
+#endif
+// # bytes the master reads per poll, including the count byte. <= BUFFER_LENGTH
+#define RAPI_I2C_TX_FRAMELEN 16
+
 class EvseI2cRapiProcessor : public EvseRapiProcessor {
-  int available() { return Wire.available(); }
-  int read() { return Wire.read(); }
-  void writeStart() { Wire.beginTransmission(RAPI_I2C_REMOTE_ADDR); }
-  void writeEnd() { Wire.endTransmission(); }
-  int write(uint8_t u8) { return Wire.write(u8); }
-  int write(const char *str) { return Wire.write(str); }
+  // rxBuf is filled by onReceive() and drained by read()
+  // txBuf is filled by write() and drained by onRequest()
+  // single producer/single consumer w/ 8-bit indices, so no locking needed
+  static volatile uint8_t rxBuf[RAPI_I2C_RXBUF_LEN];
+  static volatile uint8_t rxHead,rxTail;
+  static volatile uint8_t txBuf[RAPI_I2C_TXBUF_LEN];
+  static volatile uint8_t txHead,txTail;
+  static volatile uint8_t rxOverflowCnt,txOverflowCnt;
+
+  int available() { return (uint8_t)(rxHead - rxTail); }
+  int read();
+  int write(uint8_t u8);
+  int write(const char *str);
 
 public:
   EvseI2cRapiProcessor();
   void init();
+
+  // TWI ISR callbacks
+  static void onReceive(int numBytes);
+  static void onRequest();
+
+  uint8_t getRxOverflowCnt() { return rxOverflowCnt; }
+  uint8_t getTxOverflowCnt() { return txOverflowCnt; }
 };
 
 extern EvseI2cRapiProcessor g_EIRP;
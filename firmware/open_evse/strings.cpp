@@ -130,3 +130,6 @@ const char *g_DelayMenuItems[] = STR_YESNO_SETSTART_SETSTOP;
 #ifdef OVERCURRENT_THRESHOLD
 const char g_psOverCurrent[] PROGMEM = STR_OVER_CURRENT;
 #endif // OVERCURRENT_THRESHOLD
+#ifdef PILOT_CHECK
+const char g_psPilotError[] PROGMEM = STR_PILOT_ERROR;
+#endif // PILOT_CHECK
@@ -127,3 +127,6 @@ extern const char *g_DelayMenuItems[];
 #ifdef OVERCURRENT_THRESHOLD
 extern const char g_psOverCurrent[] PROGMEM;
 #endif // OVERCURRENT_THRESHOLD
+#ifdef PILOT_CHECK
+extern const char g_psPilotError[] PROGMEM;
+#endif // PILOT_CHECK
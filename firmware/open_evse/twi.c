@@ -10,6 +10,9 @@
   你应该已经收到了 GNU 较宽松公共许可证的副本；如果没有，写信给 Free Software Foundation，Inc.，地址是 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  美国。
 
   2012 年由 Todd Krein 修改（todd@krein.org），实现了重复启动功能。
+
+  增加了由 ISR 驱动的异步主机传输队列（twi_post/twi_poll），
+  所有主机传输都有超时，总线卡死时复位 TWI 而不是一直等待。
 */
 
 #include <math.h>
@@ -18,6 +21,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/twi.h>
+#include "Arduino.h" // millis()
 
 #ifndef cbi
 #define cbi(sfr, bit) (_SFR_BYTE(sfr) &= ~_BV(bit))  // 清除特定位
@@ -29,18 +33,21 @@
 
 #include "./twi.h"
 
-#define false 0
-#define true (!false)
+// twi_stop()等待停止条件发送完成的最大循环次数
+#define TWI_STOP_SPINS 10000
 
 static volatile uint8_t twi_state;                  // TWI 状态
 static volatile uint8_t twi_slarw;                  // 读取或写入操作标记
 static volatile uint8_t twi_sendStop;               // 是否在事务结束时发送停止信号
 static volatile uint8_t twi_inRepStart;            // 是否处于重复启动中
+static volatile uint8_t twi_blocking;              // 阻塞式传输占用总线中，异步队列暂停
+static volatile uint8_t twi_async;                 // 当前主机传输属于异步队列头部
 
 static void (*twi_onSlaveTransmit)(void);           // 从设备发送数据时调用的回调函数
 static void (*twi_onSlaveReceive)(uint8_t*, int);   // 从设备接收数据时调用的回调函数
 
 static uint8_t twi_masterBuffer[TWI_BUFFER_LENGTH];  // 主设备数据缓冲区
+static uint8_t * volatile twi_masterPtr;            // ISR使用的数据指针：阻塞式指向twi_masterBuffer，异步直接指向调用者缓冲区
 static volatile uint8_t twi_masterBufferIndex;      // 主设备数据缓冲区索引
 static volatile uint8_t twi_masterBufferLength;     // 主设备数据缓冲区长度
 
@@ -53,6 +60,9 @@ static volatile uint8_t twi_rxBufferIndex;          // 接收数据缓冲区索
 
 static volatile uint8_t twi_error;                  // 错误状态
 
+static twi_xfer * volatile twi_qHead;              // 异步传输队列，头部是正在进行的传输
+static twi_xfer * volatile twi_qTail;
+
 /*
  * 函数 twi_init
  * 描述     初始化 TWI 引脚并设置 TWI 位速率
@@ -95,6 +105,143 @@ void twi_setAddress(uint8_t address)
   TWAR = address << 1;  // 设置从设备地址
 }
 
+/*
+ * 函数 twi_reset
+ * 描述     总线卡死时关闭并重新启用 TWI 模块，放弃当前传输
+ *          必须在关中断或 ISR 中调用
+ */
+static void twi_reset(void)
+{
+  TWCR = 0;  // 关闭 TWI，释放 SDA/SCL
+  twi_state = TWI_READY;
+  twi_inRepStart = false;
+  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+}
+
+/*
+ * 函数 twi_setupPhase
+ * 描述     为异步传输的写阶段或读阶段设置 ISR 使用的状态
+ *          数据直接从调用者的缓冲区发送/接收，不经过 twi_masterBuffer
+ */
+static void twi_setupPhase(twi_xfer *x, uint8_t rw)
+{
+  twi_masterBufferIndex = 0;
+  if (rw == TW_WRITE) {
+    twi_state = TWI_MTX;
+    twi_masterPtr = x->txData;
+    twi_masterBufferLength = x->txLen;
+  }
+  else {
+    twi_state = TWI_MRX;
+    twi_masterPtr = x->rxData;
+    twi_masterBufferLength = x->rxLen - 1;  // 倒数第二个字节后发送 NACK
+  }
+  twi_slarw = rw | (x->address << 1);
+}
+
+/*
+ * 函数 twi_kick
+ * 描述     总线空闲时启动异步队列头部的传输
+ *          必须在关中断或 ISR 中调用
+ */
+static void twi_kick(void)
+{
+  twi_xfer *x = twi_qHead;
+  if (!x || (x->status != TWI_XS_QUEUED) || (twi_state != TWI_READY) ||
+      twi_inRepStart || twi_blocking) {
+    return;
+  }
+  x->status = TWI_XS_ACTIVE;
+  x->startMs = millis();
+  twi_async = true;
+  twi_sendStop = true;
+  twi_error = 0xFF;
+  twi_setupPhase(x, (x->txLen || !x->rxLen) ? TW_WRITE : TW_READ);
+  // 发送启动信号
+  TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);
+}
+
+/*
+ * 函数 twi_asyncDone
+ * 描述     结束异步队列头部的传输，调用回调，然后启动下一个传输
+ *          必须在关中断或 ISR 中调用，总线必须已经释放
+ */
+static void twi_asyncDone(uint8_t status)
+{
+  twi_xfer *x = twi_qHead;
+  twi_async = false;
+  twi_qHead = x->next;
+  if (!twi_qHead) twi_qTail = NULL;
+  // 先出队再回调，回调里可以重新提交同一个传输
+  x->status = status;
+  if (x->cb) x->cb(x);
+  twi_kick();
+}
+
+/*
+ * 函数 twi_claimBus
+ * 描述     阻塞式传输前等待当前传输（异步或从机）结束，然后占用总线
+ *          排队中的异步传输会等到 twi_endBlocking() 之后再开始
+ * 输出     0 .. 成功
+ *          1 .. 超时，TWI 已被复位
+ */
+static uint8_t twi_claimBus(void)
+{
+  unsigned long startms = millis();
+  for (;;) {
+    uint8_t sreg = SREG;
+    cli();
+    if (TWI_READY == twi_state) {
+      twi_blocking = true;
+      SREG = sreg;
+      return 0;
+    }
+    SREG = sreg;
+    twi_poll();  // 处理卡死的异步传输
+    if ((millis() - startms) >= TWI_TIMEOUT_MS) {
+      cli();
+      twi_reset();
+      if (twi_async) twi_asyncDone(TWI_XS_TIMEOUT);
+      SREG = sreg;
+      return 1;
+    }
+  }
+}
+
+/*
+ * 函数 twi_endBlocking
+ * 描述     阻塞式传输结束，恢复异步队列
+ */
+static void twi_endBlocking(void)
+{
+  uint8_t sreg = SREG;
+  cli();
+  twi_blocking = false;
+  twi_kick();
+  SREG = sreg;
+}
+
+/*
+ * 函数 twi_waitWhile
+ * 描述     等待阻塞式传输离开 state 状态
+ * 输出     0 .. 成功
+ *          1 .. 超时，TWI 已被复位
+ */
+static uint8_t twi_waitWhile(uint8_t state)
+{
+  unsigned long startms = millis();
+  while(state == twi_state){
+    if ((millis() - startms) >= TWI_TIMEOUT_MS) {
+      uint8_t sreg = SREG;
+      cli();
+      twi_reset();
+      SREG = sreg;
+      return 1;
+    }
+  }
+  return 0;
+}
+
 /*
  * 函数 twi_readFrom
  * 描述     尝试成为 TWI 总线主设备并从总线上读取一系列字节
@@ -114,14 +261,15 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length, uint8_t sen
   }
 
   // 等待 TWI 准备好，成为主设备接收器
-  while(TWI_READY != twi_state){
-    continue;
+  if (twi_claimBus()) {
+    return 0;
   }
   twi_state = TWI_MRX;  // 设置 TWI 状态为接收器模式
   twi_sendStop = sendStop;
   twi_error = 0xFF;  // 重置错误状态
 
   // 初始化缓冲区索引变量
+  twi_masterPtr = twi_masterBuffer;
   twi_masterBufferIndex = 0;
   twi_masterBufferLength = length - 1;  // 接收时需要在倒数第二个字节时设置 NACK
 
@@ -140,8 +288,8 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length, uint8_t sen
     TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTA);  // 发送启动信号
 
   // 等待读取操作完成
-  while(TWI_MRX == twi_state){
-    continue;
+  if (twi_waitWhile(TWI_MRX)) {
+    length = 0;
   }
 
   if (twi_masterBufferIndex < length)
@@ -152,6 +300,7 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length, uint8_t sen
     data[i] = twi_masterBuffer[i];
   }
 
+  twi_endBlocking();
   return length;
 }
 
@@ -169,6 +318,7 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length, uint8_t sen
  *          2 .. 地址发送，收到 NACK
  *          3 .. 数据发送，收到 NACK
  *          4 .. 其他 TWI 错误（如总线仲裁丢失，总线错误等）
+ *          5 .. 超时，TWI 已被复位
  */
 uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait, uint8_t sendStop)
 {
@@ -180,14 +330,15 @@ uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait
   }
 
   // 等待 TWI 准备好，成为主设备发送器
-  while(TWI_READY != twi_state){
-    continue;
+  if (twi_claimBus()) {
+    return 5;
   }
   twi_state = TWI_MTX;  // 设置 TWI 状态为发送器模式
   twi_sendStop = sendStop;
   twi_error = 0xFF;  // 重置错误状态
 
   // 初始化缓冲区索引变量
+  twi_masterPtr = twi_masterBuffer;
   twi_masterBufferIndex = 0;
   twi_masterBufferLength = length;
 
@@ -211,9 +362,11 @@ uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait
     TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);  // 发送启动信号
 
   // 等待写入操作完成
-  while(wait && (TWI_MTX == twi_state)){
-    continue;
+  if (wait && twi_waitWhile(TWI_MTX)) {
+    twi_endBlocking();
+    return 5;
   }
+  twi_endBlocking();
 
   // 检查是否有错误
   if (twi_error == 0xFF)
@@ -310,8 +463,13 @@ void twi_stop(void)
 
   // 等待停止条件在总线上被执行
   // TWINT 在停止条件后不会再被设置
+  // SCL被从设备拉低时停止条件永远不会完成，超过 TWI_STOP_SPINS 次则复位TWI
+  uint16_t spins = TWI_STOP_SPINS;
   while(TWCR & _BV(TWSTO)){
-    continue;  // 等待直到停止条件执行完成
+    if (!--spins) {
+      twi_reset();
+      return;
+    }
   }
 
   // 更新TWI状态
@@ -333,6 +491,60 @@ void twi_releaseBus(void)
   twi_state = TWI_READY;  // 状态设置为准备就绪
 }
 
+/*
+ * 函数 twi_post
+ * 描述    把异步主机传输加入队列，总线空闲时立即开始
+ *         完成后设置 x->status 并调用 x->cb
+ * 输入    x: 传输描述，x->status 必须不是 TWI_XS_QUEUED/TWI_XS_ACTIVE
+ * 输出    0: 成功
+ *         1: 参数错误或该传输已经在队列中
+ */
+uint8_t twi_post(twi_xfer *x)
+{
+  if ((x->status == TWI_XS_QUEUED) || (x->status == TWI_XS_ACTIVE)) {
+    return 1;
+  }
+  if ((x->txLen && !x->txData) || (x->rxLen && !x->rxData)) {
+    return 1;
+  }
+
+  uint8_t sreg = SREG;
+  cli();
+  x->next = NULL;
+  x->status = TWI_XS_QUEUED;
+  if (twi_qTail) twi_qTail->next = x;
+  else twi_qHead = x;
+  twi_qTail = x;
+  twi_kick();
+  SREG = sreg;
+  return 0;
+}
+
+/*
+ * 函数 twi_poll
+ * 描述    从主循环调用：超时的异步传输复位TWI并以 TWI_XS_TIMEOUT 结束，
+ *         总线空闲时启动排队中的传输
+ */
+void twi_poll(void)
+{
+  uint8_t sreg = SREG;
+  cli();
+  twi_xfer *x = twi_qHead;
+  if (x) {
+    if (twi_async) {
+      uint8_t tmo = x->timeoutMs ? x->timeoutMs : TWI_TIMEOUT_MS;
+      if ((millis() - x->startMs) >= tmo) {
+        twi_reset();
+        twi_asyncDone(TWI_XS_TIMEOUT);
+      }
+    }
+    else {
+      twi_kick();
+    }
+  }
+  SREG = sreg;
+}
+
 // 中断服务例程（ISR），处理TWI（I2C）总线的不同状态
 ISR(TWI_vect)
 {
@@ -351,8 +563,18 @@ ISR(TWI_vect)
       // 如果有数据需要发送，发送数据；否则停止
       if(twi_masterBufferIndex < twi_masterBufferLength){
         // 将数据写入输出寄存器并发送ACK
-        TWDR = twi_masterBuffer[twi_masterBufferIndex++];
+        TWDR = twi_masterPtr[twi_masterBufferIndex++];
         twi_reply(1);
+      }else if (twi_async) {
+        // 异步传输：有读阶段则发送重复START，否则结束传输
+        if (twi_qHead->rxLen) {
+          twi_setupPhase(twi_qHead, TW_READ);
+          TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE);
+        }
+        else {
+          twi_stop();
+          twi_asyncDone(TWI_XS_DONE);
+        }
       }else{
         // 如果设置了发送停止条件，发送停止条件；否则准备发送重复的START条件
         if (twi_sendStop)
@@ -368,20 +590,23 @@ ISR(TWI_vect)
     case TW_MT_SLA_NACK:  // 地址发送完毕，接收到NACK
       twi_error = TW_MT_SLA_NACK;  // 设置错误状态
       twi_stop();  // 发送停止条件
+      if (twi_async) twi_asyncDone(TWI_XS_NACK);
       break;
     case TW_MT_DATA_NACK: // 数据发送完毕，接收到NACK
       twi_error = TW_MT_DATA_NACK;  // 设置错误状态
       twi_stop();  // 发送停止条件
+      if (twi_async) twi_asyncDone(TWI_XS_NACK);
       break;
     case TW_MT_ARB_LOST: // 丢失总线仲裁
       twi_error = TW_MT_ARB_LOST;  // 设置错误状态
       twi_releaseBus();  // 释放总线
+      if (twi_async) twi_asyncDone(TWI_XS_ERROR);
       break;
 
     // 主机接收器状态
     case TW_MR_DATA_ACK: // 数据接收，发送ACK
       // 将接收到的数据放入缓冲区
-      twi_masterBuffer[twi_masterBufferIndex++] = TWDR;
+      twi_masterPtr[twi_masterBufferIndex++] = TWDR;
     case TW_MR_SLA_ACK:  // 地址发送完毕，接收到ACK
       // 如果还有数据需要接收，发送ACK；否则发送NACK
       if(twi_masterBufferIndex < twi_masterBufferLength){
@@ -392,8 +617,12 @@ ISR(TWI_vect)
       break;
     case TW_MR_DATA_NACK: // 数据接收，发送NACK
       // 将最后一个字节放入缓冲区
-      twi_masterBuffer[twi_masterBufferIndex++] = TWDR;
-      if (twi_sendStop)
+      twi_masterPtr[twi_masterBufferIndex++] = TWDR;
+      if (twi_async) {
+        twi_stop();
+        twi_asyncDone(TWI_XS_DONE);
+      }
+      else if (twi_sendStop)
         twi_stop();
       else {
         twi_inRepStart = true;  // 设置标志，准备发送START
@@ -404,6 +633,7 @@ ISR(TWI_vect)
       break;
     case TW_MR_SLA_NACK: // 地址发送完毕，接收到NACK
       twi_stop();  // 发送停止条件
+      if (twi_async) twi_asyncDone(TWI_XS_NACK);
       break;
     // TW_MR_ARB_LOST 在 TW_MT_ARB_LOST 状态处理中
 
@@ -492,6 +722,10 @@ ISR(TWI_vect)
     case TW_BUS_ERROR: // 总线错误，非法的停止/开始条件
       twi_error = TW_BUS_ERROR;  // 设置错误状态
       twi_stop();  // 发送停止条件
+      if (twi_async) twi_asyncDone(TWI_XS_ERROR);
       break;
   }
+
+  // 阻塞式或从机传输结束后，启动排队中的异步传输
+  twi_kick();
 }
@@ -33,7 +33,46 @@
   #define TWI_MTX   2
   #define TWI_SRX   3
   #define TWI_STX   4
-  
+
+  // max time a master transfer may take before the TWI is reset
+  // and the transfer fails, so a hung bus can't stall loop()
+  #define TWI_TIMEOUT_MS 25
+
+  // twi_xfer.status
+  #define TWI_XS_DONE    0 // completed OK
+  #define TWI_XS_QUEUED  1 // waiting for the bus
+  #define TWI_XS_ACTIVE  2 // in progress
+  #define TWI_XS_NACK    3 // address or data NACKed
+  #define TWI_XS_ERROR   4 // arbitration lost or bus error
+  #define TWI_XS_TIMEOUT 5 // timed out - TWI was reset
+
+  struct twi_xfer;
+  // called w/ interrupts disabled, from the TWI ISR or from twi_poll()
+  // keep it short. may twi_post() the same or another transfer
+  typedef void (*twi_xfer_cb)(struct twi_xfer *);
+
+  // asynchronous master transfer. writes txLen bytes from txData, then
+  // reads rxLen bytes into rxData after a repeated start. either length
+  // can be 0. the struct and buffers belong to the caller and must stay
+  // untouched while status is TWI_XS_QUEUED or TWI_XS_ACTIVE
+  typedef struct twi_xfer {
+    uint8_t address;
+    uint8_t *txData;
+    uint8_t txLen;
+    uint8_t *rxData;
+    uint8_t rxLen;
+    uint8_t timeoutMs; // 0 = TWI_TIMEOUT_MS
+    twi_xfer_cb cb; // NULL = poll status instead
+    void *ctx; // for the caller's use
+    volatile uint8_t status; // TWI_XS_xxx. must be initialized to TWI_XS_DONE
+    // private
+    struct twi_xfer *next;
+    unsigned long startMs;
+  } twi_xfer;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
   void twi_init(void);
   void twi_setAddress(uint8_t);
   uint8_t twi_readFrom(uint8_t, uint8_t*, uint8_t, uint8_t);
@@ -44,6 +83,11 @@
   void twi_reply(uint8_t);
   void twi_stop(void);
   void twi_releaseBus(void);
+  uint8_t twi_post(twi_xfer *);
+  void twi_poll(void);
+#ifdef __cplusplus
+}
+#endif
 
 #endif
 
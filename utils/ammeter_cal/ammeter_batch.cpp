@@ -0,0 +1,537 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Batch Ammeter Calibrator
+ *
+ * Multi-point version of ammeter_cal. Takes a few hundred raw readings at
+ * each of several known loads with pipelined RAPI GA n bursts (or GG on
+ * firmware without them), fits currentscalefactor and currentoffset by
+ * least squares with outlier rejection, then saves them with SA and
+ * checks them against the last load
+ *
+ * build: g++ -O2 -o ammeter_batch ammeter_batch.cpp ../rapi_client/rapi_client.cpp
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "../rapi_client/rapi_client.h"
+
+#define VERSTR "V1.0"
+
+#define MAX_LOADS 16
+// must match AMMETER_BURST_MAX and CURRENT_SAMPLE_INTERVAL in open_evse.h
+#define BURST_MAX 16
+#define CYCLE_MAX_MS 35
+// the firmware's MovingAverage() truncates, so GG reads on average half a
+// count below the mean of the raw readings that GA n returns
+#define MA_TRUNC 0.5
+// residuals are never considered noisier than this, mA. keeps a very
+// clean data set from rejecting good readings over rounding
+#define MIN_SIGMA_MA 20.0
+#define MAX_FIT_ITERS 10
+
+struct Samp {
+  double x;   // raw reading, ADC counts as the moving average would see it
+  double y;   // reference current, mA
+  int8_t keep;
+};
+
+struct Fit {
+  double slope;
+  double icpt;
+  int used;
+  int rejected;
+  int iters;
+  double rmsErr; // mA, over the samples used
+  double maxErr;
+};
+
+struct BurstCtx {
+  std::vector<Samp> *samps;
+  double refMa;
+  int8_t useGG;
+  int8_t failed;
+  int pending;
+  double lastGG;
+  int ggSkip;
+  std::vector<double> latencies;
+};
+
+static void usage(const char *pname)
+{
+  printf("Usage: %s [options] -l amps,amps,... device\n",pname);
+  printf("       %s -B\n",pname);
+  printf(" -b baud      serial baud rate (default 115200)\n");
+  printf(" -B           benchmark the fit on synthetic data, no EVSE needed\n");
+  printf(" -c cycles    line cycles per GA n burst, 1-%d (default 16)\n",BURST_MAX);
+  printf(" -e mA        don't save if the residual rms is worse than this (default 300)\n");
+  printf(" -g           read GG instead of GA n, for older firmware. much slower\n");
+  printf(" -k sigma     reject readings further than this from the fit (default 3)\n");
+  printf(" -l amps,...  known load currents to calibrate at, at least 2 different\n");
+  printf(" -n count     readings per load (default 16)\n");
+  printf(" -s           don't save, just print the fit\n");
+  printf(" -w ms        settling time after each load is applied (default 1000)\n");
+  printf(" -y           don't wait for Enter before each load\n");
+}
+
+// ordinary least squares y = slope*x + icpt over the samples kept
+// returns 1 if the x's don't spread out enough to fit a line
+static int8_t lsq(const std::vector<Samp> &s,double *slope,double *icpt)
+{
+  double n = 0,mx = 0,my = 0;
+  size_t i;
+  for (i=0;i < s.size();i++) {
+    if (!s[i].keep) continue;
+    n += 1;
+    mx += s[i].x;
+    my += s[i].y;
+  }
+  if (n < 2) return 1;
+  mx /= n;
+  my /= n;
+  // centered sums, no cancellation with large x
+  double sxx = 0,sxy = 0;
+  for (i=0;i < s.size();i++) {
+    if (!s[i].keep) continue;
+    double dx = s[i].x - mx;
+    sxx += dx * dx;
+    sxy += dx * (s[i].y - my);
+  }
+  if (sxx < 1e-9) return 1;
+  *slope = sxy / sxx;
+  *icpt = my - *slope * mx;
+  return 0;
+}
+
+// fit, then drop readings more than k robust sigmas off the line and refit
+// until the set of readings used stops changing. sigma comes from the
+// median absolute residual, so the outliers don't inflate it
+static int8_t fitRobust(std::vector<Samp> &s,double k,Fit *f)
+{
+  std::vector<double> ar;
+  size_t i;
+  for (i=0;i < s.size();i++) s[i].keep = 1;
+  memset(f,0,sizeof(*f));
+
+  for (f->iters=1;;f->iters++) {
+    if (lsq(s,&f->slope,&f->icpt)) return 1;
+
+    ar.clear();
+    for (i=0;i < s.size();i++) {
+      if (s[i].keep) ar.push_back(fabs(s[i].y - (f->slope * s[i].x + f->icpt)));
+    }
+    std::nth_element(ar.begin(),ar.begin()+ar.size()/2,ar.end());
+    double sigma = 1.4826 * ar[ar.size()/2];
+    if (sigma < MIN_SIGMA_MA) sigma = MIN_SIGMA_MA;
+
+    int changed = 0;
+    for (i=0;i < s.size();i++) {
+      int8_t keep = (fabs(s[i].y - (f->slope * s[i].x + f->icpt)) <= k * sigma) ? 1 : 0;
+      if (keep != s[i].keep) {
+        s[i].keep = keep;
+        changed++;
+      }
+    }
+    if (!changed || (f->iters == MAX_FIT_ITERS)) break;
+  }
+
+  double sumsq = 0;
+  f->used = f->rejected = 0;
+  f->maxErr = 0;
+  for (i=0;i < s.size();i++) {
+    if (!s[i].keep) {
+      f->rejected++;
+      continue;
+    }
+    double e = fabs(s[i].y - (f->slope * s[i].x + f->icpt));
+    sumsq += e * e;
+    if (e > f->maxErr) f->maxErr = e;
+    f->used++;
+  }
+  if (f->used < 2) return 1;
+  f->rmsErr = sqrt(sumsq / f->used);
+  return 0;
+}
+
+// standard normal via Box-Muller
+static double gauss()
+{
+  double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+  double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+// time the fit on data that looks like a real run, with a few wild readings
+// thrown in, and check it recovers the scale and offset it was made with
+static int benchmark()
+{
+  const double scale = 184.0,offset = -120.0; // mA = raw*scale - offset
+  const double amps[] = { 0, 6, 16, 32 };
+  const int perLoad = 256;
+  const int runs = 200;
+
+  srand(1);
+  std::vector<Samp> s;
+  size_t i;
+  for (i=0;i < sizeof(amps)/sizeof(amps[0]);i++) {
+    double y = amps[i] * 1000.0;
+    for (int j=0;j < perLoad;j++) {
+      Samp smp;
+      smp.x = (y + offset) / scale + 0.4 * gauss();
+      if ((rand() % 50) == 0) smp.x += (rand() % 2) ? 25 : -25; // glitch
+      smp.y = y;
+      s.push_back(smp);
+    }
+  }
+
+  Fit f;
+  double startMs = RapiClient::NowMs();
+  for (int r=0;r < runs;r++) {
+    if (fitRobust(s,3.0,&f)) {
+      printf("ERROR fit failed\n");
+      return 1;
+    }
+  }
+  double ms = (RapiClient::NowMs() - startMs) / runs;
+
+  printf("%d readings at %d loads, %d runs\n",(int)s.size(),(int)(sizeof(amps)/sizeof(amps[0])),runs);
+  printf("fit: %.3fms (%d iterations)\n",ms,f.iters);
+  printf("scale=%.2f offset=%.1f (made with %.0f %.0f)\n",f.slope,-f.icpt,scale,offset);
+  printf("used %d rejected %d, residual rms %.0fmA max %.0fmA\n",f.used,f.rejected,f.rmsErr,f.maxErr);
+  return ((fabs(f.slope - scale) > 1.0) || (fabs(-f.icpt - offset) > 50.0)) ? 1 : 0;
+}
+
+static void burstCb(const RapiResp *resp,void *ctx)
+{
+  BurstCtx *bc = (BurstCtx *)ctx;
+  bc->pending--;
+  if (resp->rc != RAPI_RC_OK) {
+    printf("ERROR %s: rc=%d %s\n",resp->cmd,resp->rc,resp->line);
+    bc->failed = 1;
+    return;
+  }
+  bc->latencies.push_back(resp->latencyMs);
+
+  Samp smp;
+  smp.y = bc->refMa;
+  smp.keep = 1;
+  if (bc->useGG) {
+    // GG only changes once per moving average window, don't count the
+    // same average over and over
+    if (resp->tokenCnt < 2) { bc->failed = 1; return; }
+    double ma = atof(resp->tokens[1]);
+    if (ma == bc->lastGG) return;
+    bc->lastGG = ma;
+    // the window in progress when the load changed is a mix of before and
+    // after, and the first value is the one before that
+    if (bc->ggSkip) {
+      bc->ggSkip--;
+      return;
+    }
+    smp.x = ma;
+  }
+  else {
+    if (resp->tokenCnt < 4) { bc->failed = 1; return; }
+    double n = atof(resp->tokens[1]);
+    smp.x = atof(resp->tokens[2]) / n - MA_TRUNC;
+  }
+  bc->samps->push_back(smp);
+}
+
+// take cnt readings at the load that's applied now
+// returns 0 on success
+static int8_t collect(RapiClient &client,BurstCtx *bc,int cnt,int cycles)
+{
+  char cmd[16];
+  if (bc->useGG) strcpy(cmd,"GG");
+  else sprintf(cmd,"GA %d",cycles);
+
+  size_t start = bc->samps->size();
+  bc->failed = 0;
+  bc->pending = 0;
+  bc->lastGG = -1;
+  bc->ggSkip = 2;
+  // GG readings only trickle in, give up if they stop altogether
+  double deadlineMs = RapiClient::NowMs() + (bc->useGG ? cnt * 3000.0 : cnt * (cycles * CYCLE_MAX_MS + 1000.0));
+  while (!bc->failed && ((int)(bc->samps->size() - start) + (bc->useGG ? 0 : bc->pending) < cnt)) {
+    if (RapiClient::NowMs() > deadlineMs) {
+      printf("ERROR timed out, %d of %d readings\n",(int)(bc->samps->size() - start),cnt);
+      bc->failed = 1;
+      break;
+    }
+    int8_t rc = client.SendCmd(cmd,burstCb,bc);
+    if (rc == RAPI_RC_OK) bc->pending++;
+    else if (rc != RAPI_RC_BUSY) return 1;
+    if (client.Poll(5) < 0) return 1;
+  }
+  while (bc->pending) {
+    if (client.Poll(50) < 0) return 1;
+  }
+  if ((int)(bc->samps->size() - start) > cnt) bc->samps->resize(start + cnt);
+  return bc->failed;
+}
+
+static int8_t parseLoads(const char *s,double *loads,int *cnt)
+{
+  *cnt = 0;
+  while (*s) {
+    char *end;
+    double a = strtod(s,&end);
+    if ((end == s) || (a < 0) || (*cnt == MAX_LOADS)) return 1;
+    loads[(*cnt)++] = a;
+    s = end;
+    if (*s == ',') s++;
+  }
+  for (int i=1;i < *cnt;i++) {
+    if (loads[i] != loads[0]) return 0;
+  }
+  return 1;
+}
+
+static int8_t setAmmeter(RapiClient &client,int scale,int offset)
+{
+  char cmd[32];
+  char resp[RAPIC_BUFLEN];
+  sprintf(cmd,"SA %d %d",scale,offset);
+  return (client.Command(cmd,resp,sizeof(resp)) == RAPI_RC_OK) ? 0 : 1;
+}
+
+int main(int argc,char *argv[])
+{
+  printf("OpenEVSE Batch Ammeter Calibrator %s  %s %s\n\n",VERSTR,__DATE__,__TIME__);
+
+  uint32_t baud = 115200;
+  int cycles = 16;
+  int perLoad = 16;
+  int8_t useGG = 0;
+  double k = 3.0;
+  double loads[MAX_LOADS];
+  int loadCnt = 0;
+  int8_t save = 1;
+  long settleMs = 1000;
+  int8_t prompt = 1;
+  double maxErr = 300;
+  int opt;
+  while ((opt = getopt(argc,argv,"b:Bc:e:gk:l:n:sw:y")) != -1) {
+    switch (opt) {
+    case 'b': baud = (uint32_t)atol(optarg); break;
+    case 'B': return benchmark();
+    case 'c': cycles = atoi(optarg); break;
+    case 'e': maxErr = atof(optarg); break;
+    case 'g': useGG = 1; break;
+    case 'k': k = atof(optarg); break;
+    case 'l':
+      if (parseLoads(optarg,loads,&loadCnt)) {
+        printf("ERROR -l needs at least 2 different loads\n");
+        return 1;
+      }
+      break;
+    case 'n': perLoad = atoi(optarg); break;
+    case 's': save = 0; break;
+    case 'w': settleMs = atol(optarg); break;
+    case 'y': prompt = 0; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if ((optind != argc-1) || (loadCnt < 2) || (cycles < 1) || (cycles > BURST_MAX) ||
+      (perLoad < 2) || (k <= 0)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char *devName = argv[optind];
+  RapiClient client;
+  if (client.Open(devName,baud)) {
+    printf("ERROR opening %s\n",devName);
+    return 2;
+  }
+  client.SetTimeout(cycles * CYCLE_MAX_MS * RAPIC_DEFAULT_WINDOW + 1000);
+
+  char resp[RAPIC_BUFLEN];
+  if (client.Command("GV",resp,sizeof(resp)) != RAPI_RC_OK) {
+    printf("ERROR getting version\n");
+    return 2;
+  }
+  char ver[RAPIC_BUFLEN];
+  if (sscanf(resp+3,"%40s",ver) != 1) strcpy(ver,"?");
+  printf("OpenEVSE Firmware Version: %s\n",ver);
+
+  int oscale,ooffset;
+  if ((client.Command("GA",resp,sizeof(resp)) != RAPI_RC_OK) ||
+      (sscanf(resp+3,"%d %d",&oscale,&ooffset) != 2)) {
+    printf("ERROR getting current ammeter settings, is AMMETER enabled?\n");
+    return 2;
+  }
+  printf("current settings:  scale=%d offset=%d\n",oscale,ooffset);
+
+  if (!useGG) {
+    char cmd[16];
+    sprintf(cmd,"GA %d",cycles);
+    if (client.Command(cmd,resp,sizeof(resp)) != RAPI_RC_OK) {
+      printf("GA n not supported, falling back to GG\n");
+      useGG = 1;
+    }
+  }
+  if (useGG) {
+    // GG reports raw*scale - offset, so make it report raw. it only reads
+    // the ammeter while charging or in calibration mode, if there is one
+    client.Command("S2 1",resp,sizeof(resp));
+    if (setAmmeter(client,1,0)) {
+      printf("ERROR setting ammeter for calibration\n");
+      return 2;
+    }
+  }
+
+  std::vector<Samp> samps;
+  BurstCtx bc;
+  bc.samps = &samps;
+  bc.useGG = useGG;
+  double collectMs = 0;
+  int rc = 0;
+  int i;
+  for (i=0;i < loadCnt;i++) {
+    if (prompt) {
+      printf("\nApply a load of %.1fA to the EVSE and press Enter...",loads[i]);
+      fflush(stdout);
+      int c;
+      while (((c = getchar()) != '\n') && (c != EOF));
+    }
+    if (settleMs > 0) usleep((useconds_t)(settleMs * 1000));
+
+    bc.refMa = loads[i] * 1000.0;
+    size_t start = samps.size();
+    double startMs = RapiClient::NowMs();
+    if (collect(client,&bc,perLoad,cycles)) {
+      rc = 3;
+      goto bye;
+    }
+    double ms = RapiClient::NowMs() - startMs;
+    collectMs += ms;
+
+    double sum = 0,sumsq = 0;
+    size_t j;
+    for (j=start;j < samps.size();j++) {
+      sum += samps[j].x;
+      sumsq += samps[j].x * samps[j].x;
+    }
+    double n = (double)(samps.size() - start);
+    double mean = sum / n;
+    double sd = sqrt(std::max(0.0,sumsq / n - mean * mean));
+    printf("\n%5.1fA: %d readings in %.0fms, raw %.2f sd %.2f\n",loads[i],(int)n,ms,mean,sd);
+  }
+
+  {
+    Fit f;
+    double fitStartMs = RapiClient::NowMs();
+    if (fitRobust(samps,k,&f)) {
+      printf("ERROR can't fit, readings don't change with the load\n");
+      rc = 4;
+      goto bye;
+    }
+    double fitMs = RapiClient::NowMs() - fitStartMs;
+
+    std::sort(bc.latencies.begin(),bc.latencies.end());
+    printf("\ncollected %d readings in %.1fs, %s latency median %.0fms\n",(int)samps.size(),collectMs / 1000.0,
+           useGG ? "GG" : "GA n",bc.latencies.empty() ? 0 : bc.latencies[bc.latencies.size()/2]);
+    printf("fit in %.2fms, %d iterations, used %d rejected %d\n",fitMs,f.iters,f.used,f.rejected);
+    printf("scale=%.2f offset=%.1f residual rms %.0fmA max %.0fmA\n",f.slope,-f.icpt,f.rmsErr,f.maxErr);
+
+    long scale = lround(f.slope);
+    long offset = lround(-f.icpt);
+    if ((scale < 1) || (scale > 32767) || (offset < -32768) || (offset > 32767)) {
+      printf("ERROR scale/offset out of range\n");
+      rc = 4;
+      goto bye;
+    }
+
+    // what the firmware will report at each load with the rounded settings
+    printf("\n  load   reads      err\n");
+    for (i=0;i < loadCnt;i++) {
+      double sum = 0;
+      int n = 0;
+      for (size_t j=0;j < samps.size();j++) {
+        if (samps[j].keep && (samps[j].y == loads[i] * 1000.0)) {
+          sum += samps[j].x;
+          n++;
+        }
+      }
+      if (n) {
+        double ma = (sum / n) * scale - offset;
+        printf("%5.1fA %6.2fA %+6.0fmA\n",loads[i],ma / 1000.0,ma - loads[i] * 1000.0);
+      }
+    }
+
+    if (f.rmsErr > maxErr) {
+      printf("\nERROR residual rms %.0fmA > %.0fmA, check the loads and try again\n",f.rmsErr,maxErr);
+      rc = 4;
+      goto bye;
+    }
+    if (!save) {
+      printf("\nnot saving (-s): scale=%ld offset=%ld\n",scale,offset);
+      goto bye;
+    }
+
+    printf("\nSaving ammeter settings: scale=%ld offset=%ld\n",scale,offset);
+    int vscale,voffset;
+    if (setAmmeter(client,(int)scale,(int)offset) ||
+        (client.Command("GA",resp,sizeof(resp)) != RAPI_RC_OK) ||
+        (sscanf(resp+3,"%d %d",&vscale,&voffset) != 2) ||
+        (vscale != scale) || (voffset != offset)) {
+      printf("ERROR saving ammeter settings\n");
+      rc = 5;
+      goto bye;
+    }
+
+    // the last load should still be on. read it back once more
+    if (!useGG) {
+      std::vector<Samp> vs;
+      BurstCtx vbc;
+      vbc.samps = &vs;
+      vbc.refMa = loads[loadCnt-1] * 1000.0;
+      vbc.useGG = 0;
+      if (!collect(client,&vbc,4,cycles)) {
+        double sum = 0;
+        for (size_t j=0;j < vs.size();j++) sum += vs[j].x;
+        double ma = (sum / vs.size()) * scale - offset;
+        printf("check at %.1fA: %.2fA (%+.0fmA)\n",loads[loadCnt-1],ma / 1000.0,ma - vbc.refMa);
+      }
+    }
+    printf("\nSuccess\n");
+    if (useGG) client.Command("S2 0",resp,sizeof(resp));
+    return 0;
+  }
+
+ bye:
+  if (useGG) {
+    printf("\nRestoring ammeter settings: scale=%d offset=%d\n",oscale,ooffset);
+    if (setAmmeter(client,oscale,ooffset)) {
+      printf("ERROR restoring ammeter settings\n");
+    }
+    client.Command("S2 0",resp,sizeof(resp));
+  }
+  return rc;
+}
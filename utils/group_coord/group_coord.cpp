@@ -0,0 +1,207 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Group Share Coordinator
+ *
+ * Shares one supply circuit between several EVSEs built with GROUP_SHARE.
+ * Polls each EVSE with RAPI GB, splits the circuit with the firmware's
+ * GroupAllocator and sends the allocations with RAPI SG.
+ * Stands in for a gateway: any host that can reach all the EVSEs' RAPI
+ * serial ports can run it
+ *
+ * build: g++ -O2 -o group_coord group_coord.cpp ../rapi_client/rapi_client.cpp ../../firmware/open_evse/GroupShare.cpp
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../rapi_client/rapi_client.h"
+#include "../../firmware/open_evse/GroupShare.h"
+
+#define VERSTR "V1.0"
+
+#define MAX_UNITS 16
+
+struct Member {
+  const char *devName;
+  RapiClient client;
+};
+
+static Member g_Members[MAX_UNITS];
+static GS_UNIT g_Units[MAX_UNITS];
+
+static void usage(const char *pname)
+{
+  printf("Usage: %s -g groupamps [options] device ...\n",pname);
+  printf(" -b baud      serial baud rate (default 115200)\n");
+  printf(" -f amps      fallback amps for -j (default groupamps / # of devices)\n");
+  printf(" -g amps      capacity of the shared circuit\n");
+  printf(" -j           (re)join the EVSEs to the group with SJ before starting\n");
+  printf(" -p ms        poll interval (default 2000)\n");
+  printf(" -v           print every round, not just changes\n");
+}
+
+// RAPI GB -> allocamps flags evsestate maxamps chargingda
+static int8_t readStatus(Member *m,GS_UNIT *u)
+{
+  char resp[RAPIC_BUFLEN];
+  if (m->client.Command("GB",resp,sizeof(resp)) != RAPI_RC_OK) return 1;
+
+  int alloc,maxamps;
+  unsigned flags,state;
+  long da;
+  if (sscanf(resp+3,"%d %x %x %d %ld",&alloc,&flags,&state,&maxamps,&da) != 5) return 1;
+  u->alloc = (uint8_t)alloc;
+  u->flags = (uint8_t)flags;
+  u->state = (uint8_t)state;
+  u->maxAmps = (uint8_t)maxamps;
+  u->chargingDa = (da < 0) ? 0 : (uint16_t)da;
+  return 0;
+}
+
+int main(int argc,char *argv[])
+{
+  printf("OpenEVSE Group Share Coordinator %s  %s %s\n\n",VERSTR,__DATE__,__TIME__);
+
+  uint32_t baud = 115200;
+  int groupAmps = 0;
+  int fallbackAmps = -1;
+  int8_t join = 0;
+  long pollMs = 2000;
+  int8_t verbose = 0;
+  int opt;
+  while ((opt = getopt(argc,argv,"b:f:g:jp:v")) != -1) {
+    switch (opt) {
+    case 'b': baud = (uint32_t)atol(optarg); break;
+    case 'f': fallbackAmps = atoi(optarg); break;
+    case 'g': groupAmps = atoi(optarg); break;
+    case 'j': join = 1; break;
+    case 'p': pollMs = atol(optarg); break;
+    case 'v': verbose = 1; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  int cnt = argc - optind;
+  if ((groupAmps < GS_MIN_AMPS) || (groupAmps > 255) || (cnt < 1) || (cnt > MAX_UNITS)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (fallbackAmps < 0) fallbackAmps = groupAmps / cnt;
+  if (fallbackAmps < GS_MIN_AMPS) fallbackAmps = 0;
+
+  GroupAllocator ga;
+  int i;
+  int fallbackTot = 0;
+  for (i=0;i < cnt;i++) {
+    Member *m = &g_Members[i];
+    m->devName = argv[optind+i];
+    if (m->client.Open(m->devName,baud)) {
+      printf("ERROR opening %s\n",m->devName);
+      return 2;
+    }
+    m->client.SetAutoReconnect(1);
+
+    char cmd[32];
+    char resp[RAPIC_BUFLEN];
+    if (join) {
+      sprintf(cmd,"SJ %d %d",groupAmps,fallbackAmps);
+      if (m->client.Command(cmd,resp,sizeof(resp)) != RAPI_RC_OK) {
+        printf("ERROR %s: %s failed, is GROUP_SHARE enabled?\n",m->devName,cmd);
+        return 2;
+      }
+    }
+
+    int gamps = 0,famps = 0;
+    if ((m->client.Command("GJ",resp,sizeof(resp)) != RAPI_RC_OK) ||
+        (sscanf(resp+3,"%d %d",&gamps,&famps) != 2)) {
+      printf("ERROR %s: GJ failed, is GROUP_SHARE enabled?\n",m->devName);
+      return 2;
+    }
+    if (gamps != groupAmps) {
+      printf("ERROR %s: in a %dA group, not %dA. use -j to rejoin\n",m->devName,gamps,groupAmps);
+      return 2;
+    }
+    g_Units[i].fallbackAmps = (uint8_t)famps;
+    fallbackTot += famps;
+    ga.InitUnit(&g_Units[i]);
+    printf("%s: fallback %dA\n",m->devName,famps);
+  }
+  if (fallbackTot > groupAmps) {
+    printf("WARNING: fallbacks add up to %dA, more than the %dA circuit if we go away\n",fallbackTot,groupAmps);
+  }
+  printf("\n");
+
+  char prevLine[512] = "";
+  for (;;) {
+    double startMs = RapiClient::NowMs();
+
+    for (i=0;i < cnt;i++) {
+      g_Units[i].online = readStatus(&g_Members[i],&g_Units[i]) ? 0 : 1;
+    }
+    ga.Plan(g_Units,cnt,groupAmps,(unsigned long)startMs);
+
+    for (i=0;i < cnt;i++) {
+      GS_UNIT *u = &g_Units[i];
+      if (u->send == GS_NO_SEND) continue;
+      char cmd[16];
+      char resp[RAPIC_BUFLEN];
+      int alloc;
+      sprintf(cmd,"SG %d",u->send);
+      if ((g_Members[i].client.Command(cmd,resp,sizeof(resp)) == RAPI_RC_OK) &&
+          (sscanf(resp+3,"%d",&alloc) == 1)) {
+        u->alloc = (uint8_t)alloc;
+      }
+    }
+
+    // one line per round: state/alloc/measured per EVSE
+    char line[512];
+    int len = 0;
+    long drawDa = 0;
+    for (i=0;i < cnt;i++) {
+      GS_UNIT *u = &g_Units[i];
+      if (u->online) {
+        len += sprintf(line+len," %02x/%2d/%4.1f%s",u->state,u->alloc,u->chargingDa / 10.0,
+                       (u->flags & GSF_FALLBACK) ? "F" : " ");
+        drawDa += u->chargingDa;
+      }
+      else {
+        len += sprintf(line+len," --/%2d/ -- ",u->alloc);
+      }
+    }
+    len += sprintf(line+len," | %5.1fA%s",drawDa / 10.0,ga.Holding() ? " hold" : "");
+    if (verbose || strcmp(line,prevLine)) {
+      time_t t = time(NULL);
+      char ts[16];
+      strftime(ts,sizeof(ts),"%H:%M:%S",localtime(&t));
+      printf("%s%s\n",ts,line);
+      strcpy(prevLine,line);
+    }
+
+    double left = pollMs - (RapiClient::NowMs() - startMs);
+    if (left > 0) usleep((useconds_t)(left * 1000));
+  }
+
+  return 0;
+}
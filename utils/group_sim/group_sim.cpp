@@ -0,0 +1,326 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Group Share Simulator
+ *
+ * Runs several EVSEs on one shared circuit, each with the firmware's
+ * GroupMember and a simple EV model, plus a coordinator running
+ * GroupAllocator over a lossy RAPI link (GB poll, SG allocation).
+ * Checks the EVs never draw more than the circuit between them, and that
+ * the split converges to what it should by given times
+ *
+ * build: g++ -O2 -o group_sim group_sim.cpp ../../firmware/open_evse/GroupShare.cpp
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../firmware/open_evse/EvseStates.h"
+#include "../../firmware/open_evse/GroupShare.h"
+
+#define VERSTR "V1.0"
+
+#define TICK_MS 100
+#define MA_TICKS 20     // ammeter moving average, ~2s
+#define MAX_UNITS 8
+#define MAX_CHECKS 3
+#define UNIT_MAX_AMPS 32
+
+struct EvSpec {
+  long arriveMs;        // -1 = no EV
+  long departMs;        // -1 = stays
+  uint8_t evMax;        // onboard charger limit
+};
+
+struct Check {
+  long ms;              // 0 = unused
+  int amps[MAX_UNITS];  // expected draw, -1 = don't care
+};
+
+struct Scenario {
+  const char *name;
+  const char *desc;
+  uint8_t groupAmps;
+  uint8_t unitCnt;
+  uint8_t fallbackAmps;
+  double loss;          // chance of losing each message
+  long outStartMs;      // coordinator outage, -1 = none
+  long outEndMs;
+  long durationMs;
+  EvSpec ev[MAX_UNITS];
+  Check checks[MAX_CHECKS];
+};
+
+#define NOEV { -1,-1,0 }
+#define ANY -1
+
+static const Scenario g_Scenarios[] = {
+  { "even", "4 EVs plug in together on an 80A circuit",
+    80, 4, 20, 0, -1, -1, 60000,
+    { {0,-1,32}, {0,-1,32}, {0,-1,32}, {0,-1,32} },
+    { {30000, {20,20,20,20}} } },
+  { "arrive", "third EV arrives while two charge at full rate",
+    80, 4, 20, 0, -1, -1, 90000,
+    { {0,-1,32}, {0,-1,32}, {30000,-1,32}, NOEV },
+    { {25000, {32,32,0,0}}, {60000, {25,25,24,0}} } },
+  { "depart", "two of four EVs leave, the others take up the slack",
+    80, 4, 20, 0, -1, -1, 120000,
+    { {0,-1,32}, {0,-1,32}, {0,60000,32}, {0,60000,32} },
+    { {50000, {20,20,20,20}}, {100000, {32,32,0,0}} } },
+  { "limited", "one EV only takes 16A, the rest is shared out",
+    80, 4, 20, 0, -1, -1, 90000,
+    { {0,-1,32}, {0,-1,16}, {0,-1,32}, NOEV },
+    { {70000, {28,16,28,0}} } },
+  { "oversub", "8 EVs on a 40A circuit, 2 have to wait",
+    40, 8, 0, 0, -1, -1, 90000,
+    { {0,-1,32}, {1000,-1,32}, {2000,-1,32}, {3000,-1,32},
+      {4000,-1,32}, {5000,-1,32}, {6000,-1,32}, {7000,-1,32} },
+    { {60000, {7,7,7,7,6,6,0,0}} } },
+  { "outage", "coordinator goes away for 2 minutes, an EV arrives meanwhile",
+    80, 4, 20, 0, 40000, 160000, 220000,
+    { {0,-1,32}, {0,-1,32}, {100000,-1,32}, NOEV },
+    { {95000, {20,20,0,0}}, {130000, {20,20,6,0}}, {200000, {25,25,24,0}} } },
+  { "lossy", "third EV arrives, 30% of messages lost",
+    80, 4, 20, 0.3, -1, -1, 150000,
+    { {0,-1,32}, {0,-1,32}, {30000,-1,32}, NOEV },
+    { {120000, {25,25,24,0}} } },
+};
+#define SCENARIO_CNT (int)(sizeof(g_Scenarios)/sizeof(g_Scenarios[0]))
+
+// one EVSE + EV
+struct Unit {
+  GroupMember gm;
+  uint8_t state;
+  uint8_t pilot;        // advertised amps
+  uint8_t target;       // EV wants to draw this
+  long targetMs;        // when target last changed
+  long respMs;          // EV reaction time to a pilot change
+  double draw;          // actual current
+  double hist[MA_TICKS];
+  int histIdx;
+};
+
+static int lost(double loss)
+{
+  return (loss > 0) && ((double)rand() / RAND_MAX < loss);
+}
+
+// J1772EVSEController::groupApply() and the Update() checks
+static void unitUpdate(Unit *u,const EvSpec *ev,long ms)
+{
+  u->gm.Poll(ms);
+  int plugged = (ev->arriveMs >= 0) && (ms >= ev->arriveMs) && ((ev->departMs < 0) || (ms < ev->departMs));
+
+  if (u->gm.Paused()) {
+    if (u->state != EVSE_STATE_SLEEPING) u->gm.SetPaused(1);
+    u->state = EVSE_STATE_SLEEPING;
+  }
+  else {
+    if (u->gm.Flags() & GSF_PAUSED) u->gm.SetPaused(0);
+    u->state = plugged ? EVSE_STATE_C : EVSE_STATE_A;
+  }
+
+  uint8_t lim = u->gm.Limit();
+  if (lim < GS_MIN_AMPS) lim = GS_MIN_AMPS;
+  u->pilot = (lim < UNIT_MAX_AMPS) ? lim : UNIT_MAX_AMPS;
+
+  // EV follows the pilot after its reaction time, unplugging is instant
+  uint8_t tgt = (u->state == EVSE_STATE_C) ? ((ev->evMax < u->pilot) ? ev->evMax : u->pilot) : 0;
+  if (tgt != u->target) {
+    u->target = tgt;
+    u->targetMs = ms;
+  }
+  if (!plugged) u->draw = 0;
+  else if ((ms - u->targetMs) >= u->respMs) u->draw = u->target;
+
+  u->hist[u->histIdx] = u->draw;
+  if (++u->histIdx == MA_TICKS) u->histIdx = 0;
+}
+
+// RAPI GB
+static void unitStatus(Unit *u,const EvSpec *ev,long ms,GS_UNIT *gu)
+{
+  int plugged = (ev->arriveMs >= 0) && (ms >= ev->arriveMs) && ((ev->departMs < 0) || (ms < ev->departMs));
+  double avg = 0;
+  for (int i=0;i < MA_TICKS;i++) avg += u->hist[i];
+  avg /= MA_TICKS;
+
+  gu->alloc = u->gm.Alloc();
+  gu->flags = u->gm.Flags() | (plugged ? GSF_EV_CONNECTED : 0);
+  gu->state = u->state;
+  gu->maxAmps = UNIT_MAX_AMPS;
+  gu->chargingDa = (uint16_t)(avg * 10 + 0.5);
+}
+
+static int runScenario(const Scenario *sc,long pollMs,FILE *csv)
+{
+  Unit units[MAX_UNITS];
+  GS_UNIT gu[MAX_UNITS];
+  GroupAllocator ga;
+  int i;
+
+  for (i=0;i < sc->unitCnt;i++) {
+    Unit *u = &units[i];
+    u->gm.Init(sc->groupAmps,sc->fallbackAmps,0);
+    u->state = EVSE_STATE_A;
+    u->pilot = 0;
+    u->target = 0;
+    u->targetMs = 0;
+    u->respMs = 1500 + 500 * i;  // J1772 allows up to 5s
+    u->draw = 0;
+    for (int j=0;j < MA_TICKS;j++) u->hist[j] = 0;
+    u->histIdx = 0;
+    gu[i].fallbackAmps = sc->fallbackAmps;
+    ga.InitUnit(&gu[i]);
+  }
+
+  double maxDraw = 0;
+  int maxAlloc = 0;
+  long overMs = 0;
+  int fail = 0;
+  char why[256] = "";
+  int chk = 0;
+
+  for (long ms=0;ms <= sc->durationMs;ms += TICK_MS) {
+    for (i=0;i < sc->unitCnt;i++) unitUpdate(&units[i],&sc->ev[i],ms);
+
+    // coordinator round
+    int out = (sc->outStartMs >= 0) && (ms >= sc->outStartMs) && (ms < sc->outEndMs);
+    if (!out && !(ms % pollMs)) {
+      for (i=0;i < sc->unitCnt;i++) {
+        gu[i].online = !lost(sc->loss) && !lost(sc->loss);  // request and response
+        if (gu[i].online) unitStatus(&units[i],&sc->ev[i],ms,&gu[i]);
+      }
+      ga.Plan(gu,sc->unitCnt,sc->groupAmps,(unsigned long)ms);
+      for (i=0;i < sc->unitCnt;i++) {
+        if (gu[i].send == GS_NO_SEND) continue;
+        if (lost(sc->loss)) continue;
+        units[i].gm.Allocate(gu[i].send,(unsigned long)ms);
+        unitUpdate(&units[i],&sc->ev[i],ms);
+        if (!lost(sc->loss)) gu[i].alloc = units[i].gm.Alloc();  // $OK allocamps
+      }
+    }
+
+    double draw = 0;
+    int alloc = 0;
+    for (i=0;i < sc->unitCnt;i++) {
+      draw += units[i].draw;
+      // what the EVSEs are committed to: the pilot, or the idle reservation
+      alloc += units[i].gm.Paused() ? 0 : units[i].pilot;
+    }
+    if (draw > maxDraw) maxDraw = draw;
+    if (alloc > maxAlloc) maxAlloc = alloc;
+    if (draw > sc->groupAmps + 0.01) overMs += TICK_MS;
+
+    if (csv && !(ms % 1000)) {
+      fprintf(csv,"%s,%ld,%.1f,%d",sc->name,ms,draw,ga.Holding());
+      for (i=0;i < sc->unitCnt;i++) {
+        fprintf(csv,",%d,%d,%.1f",units[i].state,units[i].gm.Alloc(),units[i].draw);
+      }
+      fprintf(csv,"\n");
+    }
+
+    if ((chk < MAX_CHECKS) && sc->checks[chk].ms && (ms == sc->checks[chk].ms)) {
+      for (i=0;i < sc->unitCnt;i++) {
+        int want = sc->checks[chk].amps[i];
+        double got = units[i].draw;
+        if ((want != ANY) && ((got < want - 1) || (got > want + 1)) && !fail) {
+          fail = 1;
+          sprintf(why," unit %d drawing %.1fA at %lds, expected %dA",i,got,ms / 1000,want);
+        }
+      }
+      chk++;
+    }
+  }
+
+  if (overMs && !fail) {
+    fail = 1;
+    sprintf(why," over the %dA circuit for %ldms",sc->groupAmps,overMs);
+  }
+
+  printf("%-8s %-4s circuit %3dA  max draw %5.1fA  max committed %3dA%s\n",
+         sc->name,fail ? "FAIL" : "ok",sc->groupAmps,maxDraw,maxAlloc,why);
+  return fail;
+}
+
+static void usage(const char *pname)
+{
+  printf("Usage: %s [options] [scenario ...]\n",pname);
+  printf(" -o file      write a once a second CSV trace to file\n");
+  printf(" -p ms        coordinator poll interval (default 2000, multiple of %d)\n",TICK_MS);
+  printf(" -r seed      random seed for message loss (default 1)\n");
+  printf(" -s           list scenarios\n");
+  printf("runs all scenarios if none are given\n");
+}
+
+int main(int argc,char *argv[])
+{
+  printf("OpenEVSE Group Share Simulator %s  %s %s\n\n",VERSTR,__DATE__,__TIME__);
+
+  const char *csvFile = NULL;
+  long pollMs = 2000;
+  unsigned seed = 1;
+  int opt;
+  while ((opt = getopt(argc,argv,"o:p:r:s")) != -1) {
+    switch (opt) {
+    case 'o': csvFile = optarg; break;
+    case 'p': pollMs = atol(optarg); break;
+    case 'r': seed = (unsigned)atol(optarg); break;
+    case 's':
+      for (int i=0;i < SCENARIO_CNT;i++) printf("%-8s %s\n",g_Scenarios[i].name,g_Scenarios[i].desc);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if ((pollMs < TICK_MS) || (pollMs % TICK_MS)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *csv = NULL;
+  if (csvFile) {
+    csv = fopen(csvFile,"w");
+    if (!csv) {
+      printf("ERROR opening %s\n",csvFile);
+      return 2;
+    }
+    fprintf(csv,"scenario,ms,draw,holding,state/alloc/draw per unit...\n");
+  }
+
+  srand(seed);
+  int fails = 0;
+  int ran = 0;
+  for (int i=0;i < SCENARIO_CNT;i++) {
+    int want = (optind >= argc);
+    for (int j=optind;j < argc;j++) {
+      if (!strcmp(argv[j],g_Scenarios[i].name)) want = 1;
+    }
+    if (!want) continue;
+    fails += runScenario(&g_Scenarios[i],pollMs,csv);
+    ran++;
+  }
+
+  if (csv) fclose(csv);
+  printf("\n%d/%d scenarios passed\n",ran - fails,ran);
+  return fails ? 3 : 0;
+}
@@ -0,0 +1,253 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Overcurrent Simulator
+ *
+ * Feeds synthetic current transformer waveforms through the firmware's
+ * AmmeterSampler and OverCurrent, the two overcurrent tiers used by
+ * J1772EVSEController::Update(), and checks each scenario trips
+ * (or doesn't) the way it should
+ *
+ * build: g++ -O2 -o overcurrent_sim overcurrent_sim.cpp ../../firmware/open_evse/AmmeterSampler.cpp
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "../../firmware/open_evse/AmmeterSampler.h"
+
+#define VERSTR "V1.0"
+
+#define ADC_US 112      // analogRead() at the default ADC prescaler
+#define NOISE_CNT 2     // +/- ADC counts of noise
+
+enum { WAVE_SINE,WAVE_HALF,WAVE_SPIKES };
+enum { EXPECT_NONE,EXPECT_FAST,EXPECT_SLOW };
+
+struct Scenario {
+  const char *name;
+  const char *desc;
+  uint8_t pilotAmps;
+  double amps;          // before the fault
+  double faultAmps;
+  long faultMs;         // fault starts here, -1 = never
+  long faultLenMs;      // -1 = until the end
+  uint8_t wave;         // shape of the fault current
+  double lineHz;
+  long durationMs;
+  uint8_t expect;
+};
+
+static const Scenario g_Scenarios[] = {
+  { "normal", "32A load on a 32A pilot",
+    32, 32, 0, -1, -1, WAVE_SINE, 60, 5000, EXPECT_NONE },
+  { "overload", "EV ignores the pilot and pulls 40A, slow tier's job",
+    32, 32, 40, 1000, -1, WAVE_SINE, 60, 20000, EXPECT_SLOW },
+  { "fault", "70A fault on a 32A pilot",
+    32, 32, 70, 1000, -1, WAVE_SINE, 60, 3000, EXPECT_FAST },
+  { "gross", "200A fault, CT input clips at the ADC rails",
+    32, 32, 200, 1000, -1, WAVE_SINE, 60, 3000, EXPECT_FAST },
+  { "fault50", "70A fault on a 50Hz supply",
+    32, 32, 70, 1000, -1, WAVE_SINE, 50, 3000, EXPECT_FAST },
+  { "halfwave", "100A half wave rectified fault",
+    32, 32, 100, 1000, -1, WAVE_HALF, 60, 3000, EXPECT_FAST },
+  { "inrush", "2 cycle 80A inrush, must not trip",
+    32, 32, 80, 1000, 33, WAVE_SINE, 60, 3000, EXPECT_NONE },
+  { "spikes", "32A with single sample spikes to the ADC rail",
+    32, 32, 32, 1000, -1, WAVE_SPIKES, 60, 5000, EXPECT_NONE },
+};
+#define SCENARIO_CNT (int)(sizeof(g_Scenarios)/sizeof(g_Scenarios[0]))
+
+struct Sim {
+  const Scenario *sc;
+  double us;            // simulated time
+  unsigned long spikeCnt;
+};
+
+static uint16_t adcRead(Sim *sim)
+{
+  const Scenario *sc = sim->sc;
+  double t = sim->us / 1000000.0;
+  long ms = (long)(sim->us / 1000.0);
+  sim->us += ADC_US;
+
+  int infault = (sc->faultMs >= 0) && (ms >= sc->faultMs) &&
+    ((sc->faultLenMs < 0) || (ms < sc->faultMs + sc->faultLenMs));
+  double amps = infault ? sc->faultAmps : sc->amps;
+  double ph = sin(2.0 * M_PI * sc->lineHz * t);
+  if (infault && (sc->wave == WAVE_HALF) && (ph < 0)) ph = 0;
+
+  // CT + burden: ADC counts RMS = mA / scale factor
+  double pk = (amps * 1000.0 / DEFAULT_CURRENT_SCALE_FACTOR) * sqrt(2.0);
+  double v = AS_MIDPOINT + pk * ph + (double)((rand() % (2 * NOISE_CNT + 1)) - NOISE_CNT);
+  if (infault && (sc->wave == WAVE_SPIKES) && !(++sim->spikeCnt % 41)) {
+    v = (sim->spikeCnt & 0x40) ? 1023 : 0;
+  }
+  if (v < 0) v = 0;
+  else if (v > 1023) v = 1023;
+  return (uint16_t)v;
+}
+
+// J1772EVSEController::readAmmeter()
+static void readAmmeter(Sim *sim,unsigned long *rms,uint16_t *peak)
+{
+  AmmeterSampler as;
+  unsigned long start = (unsigned long)(sim->us / 1000.0);
+  unsigned long now_ms;
+  while (((now_ms = (unsigned long)(sim->us / 1000.0)) - start) < CURRENT_SAMPLE_INTERVAL) {
+    if (as.Sample(adcRead(sim),now_ms)) {
+      *rms = as.Rms();
+      *peak = as.Peak();
+      return;
+    }
+  }
+  *rms = 0;
+  *peak = 0;
+}
+
+static int runScenario(const Scenario *sc,long loopMs,FILE *csv)
+{
+  Sim sim;
+  sim.sc = sc;
+  sim.us = 0;
+  sim.spikeCnt = 0;
+
+  unsigned long tot = 0;
+  int maIdx = 0;
+  long chargingMa = 0;
+  OverCurrent oc;
+  uint8_t tripped = EXPECT_NONE;
+  long tripMs = -1;
+  long maxPeakMa = 0;
+  long reads = 0;
+
+  while (!tripped && (sim.us / 1000.0 < sc->durationMs)) {
+    unsigned long rms;
+    uint16_t peak;
+    readAmmeter(&sim,&rms,&peak);
+    unsigned long curms = (unsigned long)(sim.us / 1000.0);
+    reads++;
+
+    // MovingAverage()
+    tot += rms;
+    if (++maIdx == MA_PTS) {
+      chargingMa = (long)(tot / MA_PTS) * DEFAULT_CURRENT_SCALE_FACTOR - DEFAULT_AMMETER_CURRENT_OFFSET;
+      if (chargingMa < 0) chargingMa = 0;
+      tot = 0;
+      maIdx = 0;
+    }
+
+    // J1772EVSEController::Update()
+    long limitma = sc->pilotAmps * 1000L;
+    long peakma = OverCurrent::PeakMa(peak,DEFAULT_CURRENT_SCALE_FACTOR,DEFAULT_AMMETER_CURRENT_OFFSET);
+    if (peakma > maxPeakMa) maxPeakMa = peakma;
+    if (oc.Fast(peakma,limitma,OC_FAST_AMPS,OC_FAST_READS)) tripped = EXPECT_FAST;
+    else if (oc.Slow(chargingMa,limitma,OC_SLOW_AMPS,OC_SLOW_MS,curms)) tripped = EXPECT_SLOW;
+    if (tripped) tripMs = (long)curms;
+
+    if (csv) {
+      fprintf(csv,"%s,%lu,%lu,%u,%ld,%ld,%d\n",sc->name,curms,rms,peak,peakma,chargingMa,tripped);
+    }
+
+    // rest of the main loop
+    sim.us += loopMs * 1000.0;
+  }
+
+  int fail = 0;
+  char why[256] = "";
+  if (tripped != sc->expect) {
+    fail = 1;
+    sprintf(why," expected %s",(sc->expect == EXPECT_FAST) ? "fast trip" : (sc->expect == EXPECT_SLOW) ? "slow trip" : "no trip");
+  }
+  long after = ((tripMs >= 0) && (sc->faultMs >= 0)) ? tripMs - sc->faultMs : -1;
+  // fast: a few reads, allowing for the fault starting part way through one.
+  // slow: the timeout plus filling the moving average twice
+  long maxTripMs = (sc->expect == EXPECT_FAST) ?
+    (OC_FAST_READS + 1) * (CURRENT_SAMPLE_INTERVAL + loopMs) :
+    OC_SLOW_MS + 2 * MA_PTS * (CURRENT_SAMPLE_INTERVAL + loopMs);
+  if (!fail && (sc->expect != EXPECT_NONE) && (after > maxTripMs)) {
+    fail = 1; sprintf(why," too slow, limit %ldms",maxTripMs);
+  }
+
+  printf("%-9s %-4s %-4s trip@%6ldms (+%5ldms)  max peak %5.1fA  avg %5.1fA  %ld reads%s\n",
+         sc->name,fail ? "FAIL" : "ok",
+         (tripped == EXPECT_FAST) ? "fast" : (tripped == EXPECT_SLOW) ? "slow" : "none",
+         tripMs,after,maxPeakMa / 1000.0,chargingMa / 1000.0,reads,why);
+  return fail;
+}
+
+static void usage(const char *pname)
+{
+  printf("Usage: %s [options] [scenario ...]\n",pname);
+  printf(" -l ms        time spent in the rest of the main loop per ammeter read (default 20)\n");
+  printf(" -o file      write a per read CSV trace to file\n");
+  printf(" -s           list scenarios\n");
+  printf("runs all scenarios if none are given\n");
+}
+
+int main(int argc,char *argv[])
+{
+  printf("OpenEVSE Overcurrent Simulator %s  %s %s\n\n",VERSTR,__DATE__,__TIME__);
+
+  const char *csvFile = NULL;
+  long loopMs = 20;
+  int opt;
+  while ((opt = getopt(argc,argv,"l:o:s")) != -1) {
+    switch (opt) {
+    case 'l': loopMs = atol(optarg); break;
+    case 'o': csvFile = optarg; break;
+    case 's':
+      for (int i=0;i < SCENARIO_CNT;i++) printf("%-9s %s\n",g_Scenarios[i].name,g_Scenarios[i].desc);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  FILE *csv = NULL;
+  if (csvFile) {
+    csv = fopen(csvFile,"w");
+    if (!csv) {
+      printf("ERROR opening %s\n",csvFile);
+      return 2;
+    }
+    fprintf(csv,"scenario,ms,rms,peak,peakma,chargingma,tripped\n");
+  }
+
+  srand(1);
+  int fails = 0;
+  int ran = 0;
+  for (int i=0;i < SCENARIO_CNT;i++) {
+    int want = (optind >= argc);
+    for (int j=optind;j < argc;j++) {
+      if (!strcmp(argv[j],g_Scenarios[i].name)) want = 1;
+    }
+    if (!want) continue;
+    fails += runScenario(&g_Scenarios[i],loopMs,csv);
+    ran++;
+  }
+
+  if (csv) fclose(csv);
+  printf("\n%d/%d scenarios passed\n",ran - fails,ran);
+  return fails ? 3 : 0;
+}
@@ -0,0 +1,144 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Pilot Check Test
+ *
+ * Runs the firmware's PilotCheck edge search against a simulated Timer1
+ * in phase and frequency correct mode, an ADC that samples a little
+ * after it is started, and a pilot driver with slow edges.
+ * Checks the duty cycle it measures and whether the run passes
+ *
+ * build: g++ -O2 -o pilot_check_test pilot_check_test.cpp ../../firmware/open_evse/PilotCheck.cpp
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../firmware/open_evse/PilotCheck.h"
+
+#define VERSTR "V1.0"
+
+// 16MHz, 1kHz: J1772Pilot.cpp TOP
+#define TOP 8000
+// SampleAt() with fast set: ADC clock /16, sample and hold 1.5 ADC clocks
+// after the start, which waits for the next ADC clock
+#define ADC_DELAY 24
+#define ADC_JITTER 16
+#define MAX_PROBES 200
+
+struct Case {
+  const char *name;
+  uint16_t ocr;
+  uint16_t fall;     // counts the pilot goes low late on the way up
+  uint16_t rise;     // counts the pilot goes high late on the way down
+  uint8_t stuck;     // driver dead, no swing: everything reads low
+  uint16_t freqdhz;
+  uint8_t rc;        // expected Finish()
+};
+
+static const Case g_Cases[] = {
+  { "6A",          800,  0,   0,   0, 10000, 0 },
+  { "16A",         2133, 0,   0,   0, 10000, 0 },
+  { "48A",         6400, 0,   0,   0, 10000, 0 },
+  { "80A",         7680, 0,   0,   0, 10000, 0 },
+  { "slow_edges",  2133, 60,  60,  0, 10000, 0 },
+  { "slow_fall",   2133, 120, 0,   0, 10000, 0 },
+  { "skew",        2133, 240, 0,   0, 10000, 1 },
+  { "skew_80A",    7680, 0,   240, 0, 10000, 1 },
+  { "stuck",       2133, 0,   0,   1, 10000, 1 },
+  { "freq_lo",     2133, 0,   0,   0, 9790,  1 },
+  { "freq_hi_ok",  2133, 0,   0,   0, 10190, 0 },
+};
+#define CASE_CNT (int)(sizeof(g_Cases)/sizeof(g_Cases[0]))
+
+// pilot level the ADC sees when it is started as Timer1 passes cnt
+static uint8_t pilotAt(const Case *c,uint16_t cnt,uint8_t up)
+{
+  if (c->stuck) return 0;
+  int32_t s = up ? cnt + ADC_DELAY + rand() % ADC_JITTER : cnt - ADC_DELAY - rand() % ADC_JITTER;
+  // Timer1 turns around at TOP and BOTTOM
+  if (s > TOP) {
+    s = 2 * TOP - s;
+    up = 0;
+  }
+  else if (s < 0) {
+    s = -s;
+    up = 1;
+  }
+  // compare match clears the pilot on the way up, sets it on the way down
+  return up ? (s < (int32_t)c->ocr + c->fall) : (s < (int32_t)c->ocr - c->rise);
+}
+
+static uint8_t runCheck(PilotCheck *pc,const Case *c)
+{
+  pc->Start(TOP,c->ocr);
+  for (int i=0;i < MAX_PROBES;i++) {
+    uint16_t cnt;
+    uint8_t up;
+    pc->Probe(&cnt,&up);
+    if (pc->Sample(pilotAt(c,cnt,up))) return pc->Finish(c->freqdhz);
+  }
+  return 255;
+}
+
+static int runCase(const Case *c)
+{
+  PilotCheck pc;
+  uint8_t rc = runCheck(&pc,c);
+  // what the EV sees: high from the late rise to the late fall
+  uint16_t duty = (uint16_t)(((uint32_t)(2 * c->ocr + c->fall - c->rise) * 10000UL / 2 + TOP / 2) / TOP);
+  int32_t err = (int32_t)pc.MeasDuty() - duty;
+  // the search ends on a count, ADC_JITTER makes each edge wobble
+  int fail = (rc != c->rc) || (!c->stuck && (abs(err) > (ADC_JITTER * 10000 / TOP)));
+  printf("%-11s %-4s cmd %5u meas %5u ev %5u jitter %3u freq %5u rc %d\n",c->name,fail ? "FAIL" : "ok",
+         pc.CmdDuty(),pc.MeasDuty(),duty,pc.Jitter(),pc.FreqDhz(),rc);
+  return fail;
+}
+
+// consecutive failures count up and a good run clears them
+static int checkFailCnt()
+{
+  PilotCheck pc;
+  int fail = 0;
+  for (int i=1;i <= 3;i++) {
+    runCheck(&pc,&g_Cases[8]); // stuck
+    if (pc.FailCnt() != i) fail = 1;
+  }
+  runCheck(&pc,&g_Cases[1]); // 16A
+  if (pc.FailCnt() || (pc.Runs() != 4) || (pc.Fails() != 3)) fail = 1;
+  runCheck(&pc,&g_Cases[6]); // skew
+  if ((pc.FailCnt() != 1) || (pc.MaxErr() < 100)) fail = 1;
+  printf("%-11s %-4s runs %u fails %u maxerr %u\n","failcnt",fail ? "FAIL" : "ok",pc.Runs(),pc.Fails(),pc.MaxErr());
+  return fail;
+}
+
+int main()
+{
+  printf("OpenEVSE Pilot Check Test %s  %s %s\n\n",VERSTR,__DATE__,__TIME__);
+  srand(1);
+
+  int fails = 0;
+  for (int i=0;i < CASE_CNT;i++) {
+    fails += runCase(&g_Cases[i]);
+  }
+  fails += checkFailCnt();
+
+  printf("\n%d/%d cases passed\n",CASE_CNT + 1 - fails,CASE_CNT + 1);
+  return fails ? 3 : 0;
+}
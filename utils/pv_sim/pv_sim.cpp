@@ -0,0 +1,331 @@
+// -*- C++ -*-
+/*
+ * Open EVSE PV Surplus Simulator
+ *
+ * Runs the firmware's PvSurplus and SetpointArbiter against simulated
+ * rooftop PV and house load profiles, with a gateway pushing the grid
+ * meter reading over RAPI SW and a simple EV model.
+ * Checks how much of the EV's energy came from the PV, how often the
+ * session was paused, and what the EV draws at given times
+ *
+ * build: g++ -O2 -o pv_sim pv_sim.cpp ../../firmware/open_evse/PvSurplus.cpp ../../firmware/open_evse/SetpointArbiter.cpp
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../firmware/open_evse/EvseStates.h"
+#include "../../firmware/open_evse/PvSurplus.h"
+#include "../../firmware/open_evse/SetpointArbiter.h"
+
+#define VERSTR "V1.0"
+
+#define TICK_MS 100
+#define MA_TICKS 20        // ammeter moving average, ~2s
+#define METER_LAG_TICKS 10 // grid meter reading is ~1s old by the time it arrives
+#define EV_RESP_MS 2000    // J1772 allows up to 5s
+#define VOLTS 240
+#define USER_AMPS 32
+#define MAX_CHECKS 3
+
+// PV profiles
+#define PVP_FLAT    0
+#define PVP_CLOUDS  1 // 60s down to 25% every 5 min
+#define PVP_SUNSET  2 // down to 0 over the first 60% of the run
+#define PVP_SUNRISE 3 // up from 0 over the first 60% of the run
+#define PVP_DAY     4 // sine over the run, with broken cloud
+
+struct Check {
+  long ms;   // 0 = unused
+  int amps;  // expected draw, 0 = paused
+};
+#define ANY_AMPS -1
+
+struct Scenario {
+  const char *name;
+  const char *desc;
+  uint8_t profile;   // PVP_xxx
+  double pvW;        // peak PV output
+  double houseW;     // base house load
+  int16_t exportW;   // export target
+  uint16_t holdSec;
+  uint8_t evMax;     // onboard charger limit
+  long evMaxMs;      // ... changes to evMax2 at evMaxMs, -1 = never
+  uint8_t evMax2;
+  long loadMs;       // extra house load of loadW from loadMs to loadEndMs, -1 = none
+  long loadEndMs;
+  double loadW;
+  long outStartMs;   // gateway outage, -1 = none
+  long outEndMs;
+  long durationMs;
+  double minPv;      // min fraction of the EV's energy that has to come from the PV
+  int maxPauses;
+  Check checks[MAX_CHECKS];
+};
+
+static const Scenario g_Scenarios[] = {
+  { "steady", "6kW PV, 500W house load",
+    PVP_FLAT, 6000, 500, 0, 120, 32, -1, 0, -1, -1, 0, -1, -1, 600000,
+    0.97, 0, { {120000,22}, {590000,22} } },
+  { "export", "as steady, holding 1kW export",
+    PVP_FLAT, 6000, 500, 1000, 120, 32, -1, 0, -1, -1, 0, -1, -1, 600000,
+    0.99, 0, { {120000,18}, {590000,18} } },
+  { "clouds", "60s clouds every 5 min, shorter than the hold time",
+    PVP_CLOUDS, 6000, 500, 0, 120, 32, -1, 0, -1, -1, 0, -1, -1, 1800000,
+    0.85, 0, { {200000,6}, {290000,22} } },
+  { "kettle", "3kW kettle for 3 min",
+    PVP_FLAT, 6000, 500, 0, 120, 32, -1, 0, 300000, 480000, 3000, -1, -1, 900000,
+    0.97, 0, { {290000,22}, {400000,10}, {600000,22} } },
+  { "evcap", "EV only takes 13A for 10 min, then wants more",
+    PVP_FLAT, 6000, 500, 0, 120, 13, 600000, 32, -1, -1, 0, -1, -1, 1200000,
+    0.97, 0, { {300000,13}, {660000,22} } },
+  { "sunset", "PV fades to nothing over 30 min",
+    PVP_SUNSET, 5000, 300, 0, 120, 32, -1, 0, -1, -1, 0, -1, -1, 3000000,
+    0.85, 1, { {300000,16}, {2900000,0} } },
+  { "sunrise", "PV comes up from nothing over 30 min",
+    PVP_SUNRISE, 5000, 300, 0, 120, 32, -1, 0, -1, -1, 0, -1, -1, 3000000,
+    0.80, 1, { {200000,0}, {2900000,19} } },
+  { "outage", "gateway goes quiet for 3 min",
+    PVP_FLAT, 6000, 500, 0, 120, 32, -1, 0, -1, -1, 0, 300000, 480000, 900000,
+    0.97, 0, { {290000,22}, {400000,6}, {600000,22} } },
+  { "day", "10 hour day with broken cloud, 5 min hold",
+    PVP_DAY, 7000, 400, 0, 300, 32, -1, 0, -1, -1, 0, -1, -1, 36000000,
+    0.85, 2, { {18000000,ANY_AMPS} } },
+};
+#define SCENARIO_CNT (int)(sizeof(g_Scenarios)/sizeof(g_Scenarios[0]))
+
+static double pvOutput(const Scenario *sc,long ms)
+{
+  double f = 1;
+  switch (sc->profile) {
+  case PVP_CLOUDS:
+    if ((ms % 300000) >= 150000 && (ms % 300000) < 210000) f = 0.25;
+    break;
+  case PVP_SUNSET:
+    f = 1 - ms / (0.6 * sc->durationMs);
+    break;
+  case PVP_SUNRISE:
+    f = ms / (0.6 * sc->durationMs);
+    break;
+  case PVP_DAY: {
+    f = sin(M_PI * ms / sc->durationMs);
+    // a different cloud cover every 2 min, repeatable from run to run
+    unsigned h = (unsigned)(ms / 120000) * 2654435761u;
+    h ^= h >> 13;
+    if ((h & 7) < 2) f *= 0.3 + (h >> 8) % 50 / 100.0;
+    break;
+  }
+  }
+  if (f < 0) f = 0;
+  else if (f > 1) f = 1;
+  return sc->pvW * f;
+}
+
+static double houseLoad(const Scenario *sc,long ms)
+{
+  double w = sc->houseW;
+  if ((sc->loadMs >= 0) && (ms >= sc->loadMs) && (ms < sc->loadEndMs)) w += sc->loadW;
+  return w;
+}
+
+static int runScenario(const Scenario *sc,long pushMs,FILE *csv)
+{
+  PvSurplus pv;
+  SetpointArbiter sp;
+  pv.Init(1,sc->exportW,sc->holdSec);
+  sp.Init(PV_MIN_AMPS * 10,SETPOINT_STEP_AMPS * 10,SETPOINT_DWELL_MS);
+  sp.Post(SP_SRC_USER,USER_AMPS * 10);
+  sp.Post(SP_SRC_PV,pv.LimitDa());
+
+  uint8_t state = EVSE_STATE_C;
+  double target = 0;  // EV wants to draw this
+  long targetMs = 0;
+  double draw = 0;
+  double hist[MA_TICKS];
+  double gridHist[METER_LAG_TICKS];
+  int histIdx = 0;
+  int i;
+  for (i=0;i < MA_TICKS;i++) hist[i] = 0;
+  for (i=0;i < METER_LAG_TICKS;i++) gridHist[i] = 0;
+
+  double evWs = 0;     // EV energy
+  double evPvWs = 0;   // ... of which came from the PV
+  double importWs = 0; // extra grid import because of the EV
+  int pauses = 0;
+  int changes = 0;
+  int fail = 0;
+  char why[256] = "";
+  int chk = 0;
+
+  for (long ms=0;ms <= sc->durationMs;ms += TICK_MS) {
+    double pvW = pvOutput(sc,ms);
+    double houseW = houseLoad(sc,ms);
+    double grid = houseW + draw * VOLTS - pvW;
+    gridHist[(ms / TICK_MS) % METER_LAG_TICKS] = grid;
+
+    // gateway pushes RAPI SW gridw volts
+    int out = (sc->outStartMs >= 0) && (ms >= sc->outStartMs) && (ms < sc->outEndMs);
+    uint8_t changed = pv.Poll((unsigned long)ms);
+    if (!out && !(ms % pushMs)) {
+      double avg = 0;
+      for (i=0;i < MA_TICKS;i++) avg += hist[i];
+      avg /= MA_TICKS;
+      double lagged = gridHist[((ms / TICK_MS) + 1) % METER_LAG_TICKS];
+      changed |= pv.Reading((int32_t)lround(lagged),VOLTS,USER_AMPS,(uint16_t)(avg * 10 + 0.5),(unsigned long)ms);
+    }
+    if (changed) sp.Post(SP_SRC_PV,pv.LimitDa());
+
+    // J1772EVSEController::autoPauseApply()
+    if (pv.Paused() && (state == EVSE_STATE_C)) {
+      state = EVSE_STATE_SLEEPING;
+      pauses++;
+    }
+    else if (!pv.Paused() && (state == EVSE_STATE_SLEEPING)) {
+      state = EVSE_STATE_C;
+    }
+    if (sp.Update((unsigned long)ms,state == EVSE_STATE_C)) changes++;
+
+    // EV follows the pilot after its reaction time
+    uint8_t evMax = ((sc->evMaxMs >= 0) && (ms >= sc->evMaxMs)) ? sc->evMax2 : sc->evMax;
+    double pilot = sp.Da() / 10.0;
+    double tgt = (state == EVSE_STATE_C) ? ((evMax < pilot) ? evMax : pilot) : 0;
+    if (tgt != target) {
+      target = tgt;
+      targetMs = ms;
+    }
+    if (!tgt) draw = 0; // relay opens
+    else if ((ms - targetMs) >= EV_RESP_MS) draw = target;
+    hist[histIdx] = draw;
+    if (++histIdx == MA_TICKS) histIdx = 0;
+
+    double evW = draw * VOLTS;
+    double spareW = pvW - houseW;
+    if (spareW < 0) spareW = 0;
+    evWs += evW * TICK_MS / 1000.0;
+    evPvWs += ((evW < spareW) ? evW : spareW) * TICK_MS / 1000.0;
+    if (evW > spareW) importWs += (evW - spareW) * TICK_MS / 1000.0;
+
+    if (csv && !(ms % 1000)) {
+      fprintf(csv,"%s,%ld,%.0f,%.0f,%.0f,%d,%d,%.1f,%.1f\n",sc->name,ms,pvW,houseW,grid,
+              (int)pv.SurplusDa(),pv.Limit(),sp.Da() / 10.0,draw);
+    }
+
+    if ((chk < MAX_CHECKS) && sc->checks[chk].ms && (ms == sc->checks[chk].ms)) {
+      int want = sc->checks[chk].amps;
+      if ((want != ANY_AMPS) && ((draw < want - 1) || (draw > want + 1)) && !fail) {
+        fail = 1;
+        sprintf(why," drawing %.1fA at %lds, expected %dA",draw,ms / 1000,want);
+      }
+      chk++;
+    }
+  }
+
+  double pvFrac = evWs ? evPvWs / evWs : 1;
+  if (!fail && (pvFrac < sc->minPv)) {
+    fail = 1;
+    sprintf(why," only %.0f%% from PV, expected %.0f%%",pvFrac * 100,sc->minPv * 100);
+  }
+  if (!fail && (pauses > sc->maxPauses)) {
+    fail = 1;
+    sprintf(why," %d pauses, expected at most %d",pauses,sc->maxPauses);
+  }
+
+  printf("%-8s %-4s EV %6.2fkWh  from PV %5.1f%%  import %5.2fkWh  pauses %d  setpoint changes %3d%s\n",
+         sc->name,fail ? "FAIL" : "ok",evWs / 3600000.0,pvFrac * 100,importWs / 3600000.0,
+         pauses,changes,why);
+  return fail;
+}
+
+// readings at the ends of the int32_t range must saturate, not overflow
+static int checkLimits()
+{
+  PvSurplus pv;
+  int fail = 0;
+  pv.Init(1,0,PV_HOLD_SEC_DEFAULT);
+  pv.Reading(INT32_MIN,VOLTS,USER_AMPS,0,0);
+  if (pv.SurplusDa() != USER_AMPS * 10) fail = 1;
+  pv.Reading(INT32_MAX,VOLTS,USER_AMPS,0,1000);
+  if (pv.SurplusDa() != -USER_AMPS * 10) fail = 1;
+  printf("%-8s %-4s SW at INT32_MIN/INT32_MAX\n","limits",fail ? "FAIL" : "ok");
+  return fail;
+}
+
+static void usage(const char *pname)
+{
+  printf("Usage: %s [options] [scenario ...]\n",pname);
+  printf(" -o file      write a once a second CSV trace to file\n");
+  printf(" -p ms        gateway push interval (default 5000, multiple of %d)\n",TICK_MS);
+  printf(" -s           list scenarios\n");
+  printf("runs all scenarios if none are given\n");
+}
+
+int main(int argc,char *argv[])
+{
+  printf("OpenEVSE PV Surplus Simulator %s  %s %s\n\n",VERSTR,__DATE__,__TIME__);
+
+  const char *csvFile = NULL;
+  long pushMs = 5000;
+  int opt;
+  while ((opt = getopt(argc,argv,"o:p:s")) != -1) {
+    switch (opt) {
+    case 'o': csvFile = optarg; break;
+    case 'p': pushMs = atol(optarg); break;
+    case 's':
+      for (int i=0;i < SCENARIO_CNT;i++) printf("%-8s %s\n",g_Scenarios[i].name,g_Scenarios[i].desc);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if ((pushMs < TICK_MS) || (pushMs % TICK_MS)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *csv = NULL;
+  if (csvFile) {
+    csv = fopen(csvFile,"w");
+    if (!csv) {
+      printf("ERROR opening %s\n",csvFile);
+      return 2;
+    }
+    fprintf(csv,"scenario,ms,pvw,housew,gridw,surplusda,pvlimit,pilot,draw\n");
+  }
+
+  int fails = checkLimits();
+  int ran = 1;
+  for (int i=0;i < SCENARIO_CNT;i++) {
+    int want = (optind >= argc);
+    for (int j=optind;j < argc;j++) {
+      if (!strcmp(argv[j],g_Scenarios[i].name)) want = 1;
+    }
+    if (!want) continue;
+    fails += runScenario(&g_Scenarios[i],pushMs,csv);
+    ran++;
+  }
+
+  if (csv) fclose(csv);
+  printf("\n%d/%d scenarios passed\n",ran - fails,ran);
+  return fails ? 3 : 0;
+}
@@ -0,0 +1,456 @@
+// -*- C++ -*-
+/*
+ * Open EVSE RAPI Client Library
+ *
+ * Copyright (c) 2013-2023 Sam C. Lin <lincomatic@gmail.com>
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+
+#include "rapi_client.h"
+
+static speed_t baudToSpeed(uint32_t baud)
+{
+  switch (baud) {
+  case 9600: return B9600;
+  case 19200: return B19200;
+  case 38400: return B38400;
+  case 57600: return B57600;
+  case 115200: return B115200;
+  case 230400: return B230400;
+  default: return 0;
+  }
+}
+
+static uint8_t htou8(const char *s)
+{
+  uint8_t u = 0;
+  for (int i=0;i < 2;i++) {
+    char c = s[i];
+    u <<= 4;
+    if ((c >= '0') && (c <= '9')) u += c - '0';
+    else if ((c >= 'A') && (c <= 'F')) u += c - 'A' + 10;
+    else if ((c >= 'a') && (c <= 'f')) u += c - 'a' + 10;
+    else return 0;
+  }
+  return u;
+}
+
+double RapiClient::NowMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+uint8_t RapiClient::XorChk(const char *s,int len)
+{
+  uint8_t chk = 0;
+  for (int i=0;i < len;i++) {
+    chk ^= (uint8_t)s[i];
+  }
+  return chk;
+}
+
+RapiClient::RapiClient()
+{
+  m_fd = -1;
+  *m_devName = 0;
+  m_baud = 115200;
+  m_window = RAPIC_DEFAULT_WINDOW;
+  m_timeoutMs = RAPIC_DEFAULT_TIMEOUT_MS;
+  m_autoReconnect = 0;
+  m_reconnectMs = RAPIC_DEFAULT_RECONNECT_MS;
+  m_lastOpenTryMs = 0;
+  memset(m_pending,0,sizeof(m_pending));
+  m_inFlight = 0;
+  m_nextSeqId = 1;
+  m_sendOrder = 0;
+  m_rxCnt = 0;
+  m_asyncCb = NULL;
+  m_asyncCtx = NULL;
+  m_linkCb = NULL;
+  m_linkCtx = NULL;
+  memset(&m_stats,0,sizeof(m_stats));
+}
+
+RapiClient::~RapiClient()
+{
+  Close();
+}
+
+int8_t RapiClient::openPort()
+{
+  m_lastOpenTryMs = NowMs();
+
+  int fd = open(m_devName,O_RDWR|O_NOCTTY|O_NONBLOCK);
+  if (fd < 0) return 1;
+
+  // ptys accept the same settings, so no special casing is needed
+  struct termios tio;
+  if (tcgetattr(fd,&tio) == 0) {
+    cfmakeraw(&tio);
+    speed_t spd = baudToSpeed(m_baud);
+    if (spd) {
+      cfsetispeed(&tio,spd);
+      cfsetospeed(&tio,spd);
+    }
+    tio.c_cflag |= CLOCAL|CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(fd,TCSANOW,&tio);
+    tcflush(fd,TCIOFLUSH);
+  }
+
+  m_fd = fd;
+  m_rxCnt = 0;
+  if (m_linkCb) m_linkCb(1,m_linkCtx);
+  return 0;
+}
+
+int8_t RapiClient::Open(const char *devname,uint32_t baud)
+{
+  Close();
+  strncpy(m_devName,devname,sizeof(m_devName)-1);
+  m_devName[sizeof(m_devName)-1] = 0;
+  m_baud = baud;
+  return openPort();
+}
+
+void RapiClient::Close()
+{
+  if (m_fd >= 0) {
+    close(m_fd);
+    m_fd = -1;
+  }
+  failPending(RAPI_RC_IOERR);
+}
+
+// called when a read/write fails. everything in flight is lost
+void RapiClient::dropLink()
+{
+  if (m_fd >= 0) {
+    close(m_fd);
+    m_fd = -1;
+    if (m_linkCb) m_linkCb(0,m_linkCtx);
+  }
+  m_rxCnt = 0;
+  failPending(RAPI_RC_IOERR);
+}
+
+void RapiClient::failPending(int8_t rc)
+{
+  for (int i=1;i < 256;i++) {
+    if (m_pending[i].inUse) {
+      complete(&m_pending[i],rc,NULL);
+    }
+  }
+}
+
+void RapiClient::SetWindow(int window)
+{
+  if (window < 1) window = 1;
+  else if (window > 255) window = 255;
+  m_window = window;
+}
+
+uint8_t RapiClient::getSendSequenceId()
+{
+  // skip 0 (invalid) and ids still in flight
+  for (int i=0;i < 255;i++) {
+    uint8_t seqId = m_nextSeqId++;
+    if (m_nextSeqId == 0) m_nextSeqId = 1;
+    if (!m_pending[seqId].inUse) return seqId;
+  }
+  return 0;
+}
+
+int8_t RapiClient::SendCmd(const char *cmd,RapiRespCallback cb,void *ctx)
+{
+  if (m_fd < 0) return RAPI_RC_NOLINK;
+  if (m_inFlight >= m_window) return RAPI_RC_BUSY;
+
+  uint8_t seqId = getSendSequenceId();
+  if (!seqId) return RAPI_RC_BUSY;
+
+  char buf[RAPIC_BUFLEN+16];
+  int len = snprintf(buf,sizeof(buf)-4,"%c%s %c%02X",ESRAPI_SOC,cmd,ESRAPI_SOS,seqId);
+  if ((len < 0) || (len >= (int)sizeof(buf)-4)) return RAPI_RC_NK;
+  len += sprintf(buf+len,"^%02X%c",(unsigned)XorChk(buf,len),ESRAPI_EOC);
+
+  Pending *p = &m_pending[seqId];
+  p->inUse = 1;
+  p->seqId = seqId;
+  p->order = m_sendOrder++;
+  p->cb = cb;
+  p->ctx = ctx;
+  strncpy(p->cmd,cmd,sizeof(p->cmd)-1);
+  p->cmd[sizeof(p->cmd)-1] = 0;
+  p->sentMs = NowMs();
+  m_inFlight++;
+  m_stats.sentCnt++;
+
+  if (WriteRaw(buf,len)) {
+    // dropLink() already completed this command w/ RAPI_RC_IOERR
+    return RAPI_RC_IOERR;
+  }
+
+  return RAPI_RC_OK;
+}
+
+int8_t RapiClient::WriteRaw(const char *buf,int len)
+{
+  if (m_fd < 0) return 1;
+
+  int ofs = 0;
+  while (ofs < len) {
+    int n = write(m_fd,buf+ofs,len-ofs);
+    if (n > 0) {
+      ofs += n;
+    }
+    else if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+      struct pollfd pfd = { m_fd,POLLOUT,0 };
+      poll(&pfd,1,(int)m_timeoutMs);
+    }
+    else {
+      dropLink();
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void RapiClient::complete(Pending *p,int8_t rc,char *line)
+{
+  RapiResp resp;
+  char cmd[RAPIC_BUFLEN];
+
+  // free the slot before calling back, so the callback can send right away
+  strcpy(cmd,p->cmd);
+  RapiRespCallback cb = p->cb;
+  void *ctx = p->ctx;
+  resp.latencyMs = NowMs() - p->sentMs;
+  resp.seqId = p->seqId;
+  p->inUse = 0;
+  m_inFlight--;
+
+  resp.rc = rc;
+  resp.cmd = cmd;
+  resp.tokenCnt = 0;
+  resp.line = "";
+
+  char tbuf[RAPIC_BUFLEN];
+  if (line) {
+    resp.line = line;
+    // tokenize "$OK p1 p2 :ss" -> OK p1 p2
+    strcpy(tbuf,line+1);
+    char *hat = strrchr(tbuf,'^');
+    if (!hat) hat = strrchr(tbuf,'*');
+    if (hat) *hat = 0;
+    char *s = tbuf;
+    while (*s && (resp.tokenCnt < RAPIC_MAX_TOKENS)) {
+      while (*s == ' ') *(s++) = 0;
+      if (!*s || (*s == ESRAPI_SOS)) break;
+      resp.tokens[resp.tokenCnt++] = s;
+      while (*s && (*s != ' ')) s++;
+    }
+  }
+
+  switch (rc) {
+  case RAPI_RC_OK: m_stats.okCnt++; break;
+  case RAPI_RC_NK: m_stats.nkCnt++; break;
+  case RAPI_RC_TIMEOUT: m_stats.timeoutCnt++; break;
+  default: m_stats.ioErrCnt++; break;
+  }
+
+  if (cb) cb(&resp,ctx);
+}
+
+void RapiClient::processLine(char *line)
+{
+  int len = strlen(line);
+
+  // validate checksum. the EVSE always sends XOR (^) checksums, but accept
+  // legacy additive (*) ones too
+  char *chk = strrchr(line,'^');
+  int8_t chkok = 0;
+  if (chk && (strlen(chk) == 3)) {
+    chkok = (XorChk(line,chk-line) == htou8(chk+1)) ? 1 : 0;
+  }
+  else {
+    chk = strrchr(line,'*');
+    if (chk && (strlen(chk) == 3)) {
+      uint8_t sum = 0;
+      for (char *s=line;s < chk;s++) sum += (uint8_t)*s;
+      chkok = (sum == htou8(chk+1)) ? 1 : 0;
+    }
+  }
+  if (!chkok || (len < 3)) {
+    m_stats.chkErrCnt++;
+    return;
+  }
+
+  int8_t rc;
+  if (!strncmp(line+1,"OK",2)) rc = RAPI_RC_OK;
+  else if (!strncmp(line+1,"NK",2)) rc = RAPI_RC_NK;
+  else {
+    // $AT, $AB, $AN, $WF, legacy $ST...
+    m_stats.asyncCnt++;
+    if (m_asyncCb) m_asyncCb(line,m_asyncCtx);
+    return;
+  }
+
+  // look for " :ss" right before the checksum
+  uint8_t seqId = 0;
+  if (((chk - line) >= 4) && (chk[-3] == ESRAPI_SOS) && (chk[-4] == ' ')) {
+    seqId = htou8(chk-2);
+  }
+
+  Pending *p = NULL;
+  if (seqId) {
+    if (m_pending[seqId].inUse) p = &m_pending[seqId];
+  }
+  else {
+    // pre-3.0 firmware doesn't echo sequence ids. commands are processed
+    // in order, so the oldest one in flight is the match
+    for (int i=1;i < 256;i++) {
+      if (m_pending[i].inUse &&
+          (!p || ((int32_t)(m_pending[i].order - p->order) < 0))) {
+        p = &m_pending[i];
+      }
+    }
+  }
+
+  if (p) complete(p,rc,line);
+  else m_stats.orphanCnt++;
+}
+
+void RapiClient::checkTimeouts()
+{
+  double now = NowMs();
+  for (int i=1;i < 256;i++) {
+    if (m_pending[i].inUse && ((now - m_pending[i].sentMs) >= (double)m_timeoutMs)) {
+      complete(&m_pending[i],RAPI_RC_TIMEOUT,NULL);
+    }
+  }
+}
+
+int RapiClient::Poll(int timeoutMs)
+{
+  if (m_fd < 0) {
+    if (m_autoReconnect && *m_devName &&
+        ((NowMs() - m_lastOpenTryMs) >= (double)m_reconnectMs)) {
+      if (!openPort()) m_stats.reconnectCnt++;
+    }
+    if (m_fd < 0) {
+      if (timeoutMs > 0) poll(NULL,0,timeoutMs);
+      return -1;
+    }
+  }
+
+  int lineCnt = 0;
+  struct pollfd pfd = { m_fd,POLLIN,0 };
+  int prc = poll(&pfd,1,timeoutMs);
+  if (prc > 0) {
+    if (pfd.revents & POLLIN) {
+      char buf[256];
+      int n = read(m_fd,buf,sizeof(buf));
+      if ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+        dropLink();
+        return -1;
+      }
+      for (int i=0;i < n;i++) {
+        char c = buf[i];
+        if (c == ESRAPI_SOC) {
+          m_rxBuf[0] = c;
+          m_rxCnt = 1;
+        }
+        else if (m_rxCnt) {
+          if (c == ESRAPI_EOC) {
+            m_rxBuf[m_rxCnt] = 0;
+            m_rxCnt = 0;
+            processLine(m_rxBuf);
+            lineCnt++;
+          }
+          else if (m_rxCnt < (RAPIC_BUFLEN-1)) {
+            m_rxBuf[m_rxCnt++] = c;
+          }
+          else {
+            // runaway line - resync on next $
+            m_rxCnt = 0;
+            m_stats.chkErrCnt++;
+          }
+        }
+      }
+    }
+    else if (pfd.revents & (POLLERR|POLLHUP|POLLNVAL)) {
+      dropLink();
+      return -1;
+    }
+  }
+
+  checkTimeouts();
+
+  return lineCnt;
+}
+
+struct SyncCtx {
+  int8_t done;
+  int8_t rc;
+  char *resp;
+  int resplen;
+};
+
+static void syncCb(const RapiResp *resp,void *ctx)
+{
+  SyncCtx *sc = (SyncCtx *)ctx;
+  sc->done = 1;
+  sc->rc = resp->rc;
+  if (sc->resp && (sc->resplen > 0)) {
+    strncpy(sc->resp,resp->line,sc->resplen-1);
+    sc->resp[sc->resplen-1] = 0;
+  }
+}
+
+int8_t RapiClient::Command(const char *cmd,char *resp,int resplen)
+{
+  SyncCtx sc = { 0,RAPI_RC_IOERR,resp,resplen };
+  if (resp && (resplen > 0)) *resp = 0;
+
+  int8_t rc;
+  while ((rc = SendCmd(cmd,syncCb,&sc)) == RAPI_RC_BUSY) {
+    if (Poll(10) < 0) return RAPI_RC_NOLINK;
+  }
+  if (rc == RAPI_RC_NOLINK) return rc;
+
+  while (!sc.done) {
+    if (Poll(10) < 0) break;
+  }
+  return sc.done ? sc.rc : RAPI_RC_IOERR;
+}
@@ -0,0 +1,172 @@
+// -*- C++ -*-
+/*
+ * Open EVSE RAPI Client Library
+ *
+ * Asynchronous, pipelined RAPI client for Linux hosts.
+ * Talks to the EVSE over a serial port or pty
+ *
+ * Copyright (c) 2013-2023 Sam C. Lin <lincomatic@gmail.com>
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _RAPI_CLIENT_H_
+#define _RAPI_CLIENT_H_
+
+#include <stdint.h>
+
+#define ESRAPI_SOC '$'
+#define ESRAPI_EOC 0xd // CR
+#define ESRAPI_SOS ':' // start of sequence id
+
+// result codes passed to RapiRespCallback
+#define RAPI_RC_OK      0 // $OK received
+#define RAPI_RC_NK      1 // $NK received
+#define RAPI_RC_TIMEOUT 2 // no response within timeout
+#define RAPI_RC_IOERR   3 // link dropped while command was in flight
+#define RAPI_RC_BUSY    4 // SendCmd(): pipeline window full, try again later
+#define RAPI_RC_NOLINK  5 // SendCmd(): link not open
+
+#define RAPIC_BUFLEN 128
+#define RAPIC_MAX_TOKENS 16
+// the firmware's HardwareSerial rx buffer is 64 bytes, so only a couple of
+// short commands can be queued on the EVSE side at once
+#define RAPIC_DEFAULT_WINDOW 2
+#define RAPIC_DEFAULT_TIMEOUT_MS 1000
+#define RAPIC_DEFAULT_RECONNECT_MS 2000
+
+struct RapiResp {
+  int8_t rc;            // RAPI_RC_xxx
+  uint8_t seqId;        // 0 if the response carried no sequence id
+  const char *cmd;      // command as passed to SendCmd()
+  const char *line;     // raw response line w/o EOC, "" on timeout/ioerr
+  int tokenCnt;         // tokens[0] = "OK"/"NK", tokens[1..] = parameters
+  const char *tokens[RAPIC_MAX_TOKENS];
+  double latencyMs;     // send to response/failure
+};
+
+typedef void (*RapiRespCallback)(const RapiResp *resp,void *ctx);
+// msg = async notification line w/o EOC, e.g. "$AT 03 03 32 0100^xx"
+typedef void (*RapiAsyncCallback)(const char *msg,void *ctx);
+// up = 1 when the link (re)opens, 0 when it drops
+typedef void (*RapiLinkCallback)(int8_t up,void *ctx);
+
+struct RapiClientStats {
+  uint32_t sentCnt;
+  uint32_t okCnt;
+  uint32_t nkCnt;
+  uint32_t timeoutCnt;
+  uint32_t ioErrCnt;
+  uint32_t chkErrCnt;  // responses dropped due to bad/missing checksum
+  uint32_t orphanCnt;  // responses with no matching command in flight
+  uint32_t asyncCnt;
+  uint32_t reconnectCnt;
+};
+
+class RapiClient {
+  struct Pending {
+    uint8_t inUse;
+    uint8_t seqId;
+    uint32_t order;     // send order, for matching responses w/o seq id
+    double sentMs;
+    RapiRespCallback cb;
+    void *ctx;
+    char cmd[RAPIC_BUFLEN];
+  };
+
+  int m_fd;
+  char m_devName[RAPIC_BUFLEN];
+  uint32_t m_baud;
+  int m_window;
+  uint32_t m_timeoutMs;
+  int8_t m_autoReconnect;
+  uint32_t m_reconnectMs;
+  double m_lastOpenTryMs;
+
+  Pending m_pending[256]; // indexed by sequence id. 0 is reserved
+  int m_inFlight;
+  uint8_t m_nextSeqId;
+  uint32_t m_sendOrder;
+
+  char m_rxBuf[RAPIC_BUFLEN];
+  int m_rxCnt;
+
+  RapiAsyncCallback m_asyncCb;
+  void *m_asyncCtx;
+  RapiLinkCallback m_linkCb;
+  void *m_linkCtx;
+
+  RapiClientStats m_stats;
+
+  int8_t openPort();
+  void dropLink();
+  void failPending(int8_t rc);
+  void complete(Pending *p,int8_t rc,char *line);
+  void processLine(char *line);
+  void checkTimeouts();
+  uint8_t getSendSequenceId();
+public:
+  RapiClient();
+  ~RapiClient();
+
+  // returns 0 on success
+  int8_t Open(const char *devname,uint32_t baud=115200);
+  void Close();
+  int8_t IsOpen() { return (m_fd >= 0) ? 1 : 0; }
+
+  // max # commands in flight at once
+  void SetWindow(int window);
+  void SetTimeout(uint32_t ms) { m_timeoutMs = ms; }
+  // automatically reopen the port every ms after it drops
+  void SetAutoReconnect(int8_t tf,uint32_t ms=RAPIC_DEFAULT_RECONNECT_MS) {
+    m_autoReconnect = tf;
+    m_reconnectMs = ms;
+  }
+  void SetAsyncCallback(RapiAsyncCallback cb,void *ctx) { m_asyncCb = cb; m_asyncCtx = ctx; }
+  void SetLinkCallback(RapiLinkCallback cb,void *ctx) { m_linkCb = cb; m_linkCtx = ctx; }
+
+  // cmd = command w/o $, sequence id, or checksum, e.g. "SC 16"
+  // a sequence id and XOR checksum are appended before sending.
+  // cb is called exactly once from Poll() when the command completes
+  // returns RAPI_RC_OK if sent, else RAPI_RC_BUSY/RAPI_RC_NOLINK/RAPI_RC_IOERR
+  // on RAPI_RC_IOERR, cb has already been called w/ RAPI_RC_IOERR
+  int8_t SendCmd(const char *cmd,RapiRespCallback cb,void *ctx);
+
+  // write len raw bytes to the link as-is, w/o framing or checksum.
+  // any response they elicit is counted as an orphan. returns 0 on success
+  int8_t WriteRaw(const char *buf,int len);
+
+  // read & dispatch responses, expire timed out commands, handle reconnect
+  // waits up to timeoutMs for input. returns # lines processed, or -1 if
+  // the link is down
+  int Poll(int timeoutMs);
+
+  // synchronous convenience wrapper. resp gets the response line
+  // returns RAPI_RC_xxx
+  int8_t Command(const char *cmd,char *resp,int resplen);
+
+  int InFlight() { return m_inFlight; }
+  int Window() { return m_window; }
+  const RapiClientStats *GetStats() { return &m_stats; }
+
+  static double NowMs();
+  // XOR checksum of len bytes
+  static uint8_t XorChk(const char *s,int len);
+};
+
+#endif // _RAPI_CLIENT_H_
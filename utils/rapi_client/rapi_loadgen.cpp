@@ -0,0 +1,241 @@
+// -*- C++ -*-
+/*
+ * Open EVSE RAPI Load Generator
+ *
+ * Hammers an EVSE (or anything else speaking RAPI on a serial port/pty)
+ * with pipelined commands and reports throughput and latency
+ *
+ * build: g++ -O2 -o rapi_loadgen rapi_loadgen.cpp rapi_client.cpp
+ *
+ * Copyright (c) 2013-2023 Sam C. Lin <lincomatic@gmail.com>
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "rapi_client.h"
+
+#define VERSTR "V1.0"
+
+#define MAX_CMDS 32
+
+struct LoadGen {
+  RapiClient client;
+  const char *cmds[MAX_CMDS];
+  int cmdCnt;
+  int nextCmd;
+  std::vector<double> latencies;
+  int8_t verbose;
+};
+
+static void respCb(const RapiResp *resp,void *ctx)
+{
+  LoadGen *lg = (LoadGen *)ctx;
+  if ((resp->rc == RAPI_RC_OK) || (resp->rc == RAPI_RC_NK)) {
+    lg->latencies.push_back(resp->latencyMs);
+  }
+  if (lg->verbose) {
+    printf("%s -> rc=%d %s (%.2fms)\n",resp->cmd,resp->rc,resp->line,resp->latencyMs);
+  }
+}
+
+static void asyncCb(const char *msg,void *ctx)
+{
+  LoadGen *lg = (LoadGen *)ctx;
+  if (lg->verbose) printf("async: %s\n",msg);
+}
+
+static void linkCb(int8_t up,void *)
+{
+  printf("link %s\n",up ? "up" : "DOWN");
+}
+
+static double percentile(std::vector<double> &v,double pct)
+{
+  if (v.empty()) return 0;
+  size_t idx = (size_t)((pct / 100.0) * (double)(v.size() - 1) + .5);
+  return v[idx];
+}
+
+static void usage(const char *pname)
+{
+  printf("Usage: %s [options] device\n",pname);
+  printf(" -b baud      baud rate (default 115200)\n");
+  printf(" -w window    max commands in flight (default %d)\n",RAPIC_DEFAULT_WINDOW);
+  printf(" -n count     stop after count commands\n");
+  printf(" -d secs      stop after secs seconds (default 10)\n");
+  printf(" -t ms        per command timeout (default %d)\n",RAPIC_DEFAULT_TIMEOUT_MS);
+  printf(" -c cmd       command to send, w/o $ or checksum. may be repeated,\n");
+  printf("              commands are sent round robin (default GS)\n");
+  printf(" -r           reconnect automatically if the link drops\n");
+  printf(" -v           print every response\n");
+  printf(" -o file      append a CSV summary line to file, for tracking\n");
+  printf("              throughput across firmware versions\n");
+  printf("e.g. %s -w 2 -d 30 -c GS -c GG -c GE /dev/ttyUSB0\n",pname);
+}
+
+int main(int argc,char *argv[])
+{
+  printf("OpenEVSE RAPI Load Generator %s  %s %s\n\n",VERSTR,__DATE__,__TIME__);
+
+  LoadGen lg;
+  lg.cmdCnt = 0;
+  lg.nextCmd = 0;
+  lg.verbose = 0;
+
+  uint32_t baud = 115200;
+  int window = RAPIC_DEFAULT_WINDOW;
+  long maxCnt = -1;
+  double durationMs = 10000;
+  uint32_t timeoutMs = RAPIC_DEFAULT_TIMEOUT_MS;
+  int8_t reconnect = 0;
+  const char *csvFile = NULL;
+
+  int opt;
+  while ((opt = getopt(argc,argv,"b:w:n:d:t:c:rvo:")) != -1) {
+    switch (opt) {
+    case 'b': baud = atoi(optarg); break;
+    case 'w': window = atoi(optarg); break;
+    case 'n': maxCnt = atol(optarg); break;
+    case 'd': durationMs = atof(optarg) * 1000.0; break;
+    case 't': timeoutMs = atoi(optarg); break;
+    case 'c':
+      if (lg.cmdCnt < MAX_CMDS) lg.cmds[lg.cmdCnt++] = optarg;
+      break;
+    case 'r': reconnect = 1; break;
+    case 'v': lg.verbose = 1; break;
+    case 'o': csvFile = optarg; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != (argc - 1)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (!lg.cmdCnt) lg.cmds[lg.cmdCnt++] = "GS";
+
+  RapiClient &client = lg.client;
+  client.SetWindow(window);
+  client.SetTimeout(timeoutMs);
+  client.SetAutoReconnect(reconnect);
+  client.SetAsyncCallback(asyncCb,&lg);
+  client.SetLinkCallback(linkCb,&lg);
+
+  if (client.Open(argv[optind],baud)) {
+    printf("ERROR opening %s\n",argv[optind]);
+    return 2;
+  }
+
+  char resp[RAPIC_BUFLEN];
+  char evseVer[RAPIC_BUFLEN];
+  if (client.Command("GV",resp,sizeof(resp)) == RAPI_RC_OK) {
+    printf("EVSE: %s\n",resp);
+    // "$OK fwver rapiver :ss^xk" -> fwver
+    if (sscanf(resp,"$OK %127s",evseVer) != 1) strcpy(evseVer,"?");
+  }
+  else {
+    printf("WARNING: no response to GV\n");
+    strcpy(evseVer,"?");
+  }
+
+  lg.latencies.reserve(100000);
+  const RapiClientStats *stats = client.GetStats();
+  uint32_t sent0 = stats->sentCnt;
+  long sentCnt = 0;
+  double startMs = RapiClient::NowMs();
+  double lastReportMs = startMs;
+  for (;;) {
+    double now = RapiClient::NowMs();
+    int8_t stopSending = (((maxCnt >= 0) && (sentCnt >= maxCnt)) ||
+                        ((now - startMs) >= durationMs)) ? 1 : 0;
+    if (stopSending && !client.InFlight()) break;
+
+    // keep the pipeline full
+    while (!stopSending &&
+           (client.SendCmd(lg.cmds[lg.nextCmd],respCb,&lg) == RAPI_RC_OK)) {
+      lg.nextCmd = (lg.nextCmd + 1) % lg.cmdCnt;
+      if ((maxCnt >= 0) && (++sentCnt >= maxCnt)) break;
+    }
+
+    if ((client.Poll(5) < 0) && !reconnect) {
+      printf("ERROR link dropped\n");
+      break;
+    }
+
+    if (!lg.verbose && ((now - lastReportMs) >= 1000)) {
+      printf("%.0fs: %lu cmds\n",(now - startMs) / 1000.0,
+             (unsigned long)(stats->sentCnt - sent0));
+      lastReportMs = now;
+    }
+  }
+  double elapsedMs = RapiClient::NowMs() - startMs;
+
+  std::vector<double> &l = lg.latencies;
+  std::sort(l.begin(),l.end());
+  double sum = 0;
+  for (size_t i=0;i < l.size();i++) sum += l[i];
+  double cps = (elapsedMs > 0) ? (double)l.size() * 1000.0 / elapsedMs : 0.0;
+
+  printf("\n");
+  printf("elapsed:     %.2f s\n",elapsedMs / 1000.0);
+  printf("window:      %d\n",client.Window());
+  printf("sent:        %lu\n",(unsigned long)(stats->sentCnt - sent0));
+  printf("ok/nk:       %lu/%lu\n",(unsigned long)stats->okCnt,(unsigned long)stats->nkCnt);
+  printf("timeouts:    %lu\n",(unsigned long)stats->timeoutCnt);
+  printf("io errors:   %lu\n",(unsigned long)stats->ioErrCnt);
+  printf("bad chksum:  %lu\n",(unsigned long)stats->chkErrCnt);
+  printf("orphans:     %lu\n",(unsigned long)stats->orphanCnt);
+  printf("async:       %lu\n",(unsigned long)stats->asyncCnt);
+  printf("reconnects:  %lu\n",(unsigned long)stats->reconnectCnt);
+  printf("throughput:  %.1f cmds/s\n",cps);
+  if (!l.empty()) {
+    printf("latency ms:  min %.2f avg %.2f p50 %.2f p99 %.2f max %.2f\n",
+           l.front(),sum / (double)l.size(),percentile(l,50),percentile(l,99),l.back());
+  }
+
+  if (csvFile) {
+    FILE *fp = fopen(csvFile,"a");
+    if (fp) {
+      char ts[32];
+      time_t now = time(NULL);
+      strftime(ts,sizeof(ts),"%Y-%m-%d %H:%M:%S",localtime(&now));
+      if (!ftell(fp)) {
+        fprintf(fp,"time,fwver,window,cmds,secs,cmds_per_sec,p50_ms,p99_ms,timeouts\n");
+      }
+      fprintf(fp,"%s,%s,%d,%lu,%.2f,%.1f,%.3f,%.3f,%lu\n",ts,evseVer,client.Window(),
+              (unsigned long)l.size(),elapsedMs / 1000.0,cps,
+              percentile(l,50),percentile(l,99),(unsigned long)stats->timeoutCnt);
+      fclose(fp);
+    }
+    else {
+      printf("ERROR opening %s\n",csvFile);
+    }
+  }
+
+  client.Close();
+  return (stats->timeoutCnt || stats->ioErrCnt) ? 3 : 0;
+}
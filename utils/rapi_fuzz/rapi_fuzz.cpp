@@ -0,0 +1,199 @@
+// -*- C++ -*-
+/*
+ * Open EVSE RAPI Parser Fuzzer
+ *
+ * libFuzzer target for the firmware's RAPI framing, tokenizing and
+ * number parsing (RapiParse.cpp). Each input is a raw byte stream, fed
+ * one byte at a time into a ESRAPI_BUFLEN heap buffer the same way
+ * EvseRapiProcessor::doCmd() does, so ASan catches any access past it.
+ * Every complete frame is tokenized, its sequence id stripped and each
+ * token run through the number parsers, checking what they promise.
+ * A frame that tokenizes is also rebuilt with RapiAppendChk() and must
+ * come back out the same
+ *
+ * build: clang++ -g -O1 -fsanitize=fuzzer,address,undefined -o rapi_fuzz rapi_fuzz.cpp ../../firmware/open_evse/RapiParse.cpp
+ * run:   ./rapi_fuzz -max_len=256
+ *
+ * without libFuzzer, replay crash files, or with none, feed random input:
+ * build: g++ -g -O1 -fsanitize=address,undefined -DRAPI_FUZZ_MAIN -o rapi_fuzz rapi_fuzz.cpp ../../firmware/open_evse/RapiParse.cpp
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../firmware/open_evse/RapiParse.h"
+
+#define CHECK(x) do { if (!(x)) { fprintf(stderr,"%s:%d: CHECK(%s) failed\n",__FILE__,__LINE__,#x); abort(); } } while (0)
+
+static const int32_t g_Ranges[][2] = {
+  { 0,255 },
+  { -32768,32767 },
+  { (int32_t)0x80000000UL,0x7fffffffL },
+};
+#define RANGE_CNT (int)(sizeof(g_Ranges)/sizeof(g_Ranges[0]))
+
+static void checkNumber(const char *s)
+{
+  htou8(s);
+  dtou16d(s);
+  uint32_t u = dtou32(s);
+  int32_t i = dtoi32(s);
+  if (*s != '-') CHECK((uint32_t)i == ((u > 0x7fffffffUL) ? 0x7fffffffUL : u));
+
+  for (int r=0;r < RANGE_CNT;r++) {
+    int32_t v = 12345;
+    if (!dtoi32r(s,g_Ranges[r][0],g_Ranges[r][1],&v)) {
+      CHECK((v >= g_Ranges[r][0]) && (v <= g_Ranges[r][1]));
+      // a strict parse has to agree with the lenient one
+      CHECK(v == i);
+    }
+    else {
+      CHECK(v == 12345);
+    }
+  }
+}
+
+// put the tokens back together w/ an XOR checksum, it has to tokenize
+// into the same tokens
+static void checkRebuild(char *tokens[],int8_t tokenCnt)
+{
+  char frame[ESRAPI_BUFLEN+8];
+  int len = 1;
+  frame[0] = ESRAPI_SOC;
+  for (int i=0;i < tokenCnt;i++) {
+    int tlen = strlen(tokens[i]);
+    if (len + tlen + 1 >= ESRAPI_BUFLEN) return;
+    if (i) frame[len++] = ' ';
+    memcpy(frame+len,tokens[i],tlen);
+    len += tlen;
+  }
+  frame[len] = '\0';
+  RapiAppendChk(frame);
+  len = strlen(frame);
+  CHECK((len >= 4) && (frame[len-1] == ESRAPI_EOC));
+  // ^xx has to fit too
+  if (len > ESRAPI_BUFLEN) return;
+
+  char *buf = new char[ESRAPI_BUFLEN];
+  buf[0] = 0;
+  int8_t cnt = 0;
+  uint8_t done = 0;
+  for (int i=0;i < len;i++) {
+    CHECK(!done);
+    done = RapiFrameByte(buf,&cnt,frame[i]);
+  }
+  CHECK(done);
+
+  char *rtokens[ESRAPI_MAX_ARGS];
+  int8_t rtokenCnt;
+  CHECK(!RapiTokenize(buf,rtokens,&rtokenCnt));
+  CHECK(rtokenCnt == tokenCnt);
+  for (int i=0;i < tokenCnt;i++) {
+    CHECK(!strcmp(rtokens[i],tokens[i]));
+  }
+  delete [] buf;
+}
+
+static void checkFrame(char *buf,int8_t cnt)
+{
+  CHECK((cnt >= 2) && (cnt <= ESRAPI_BUFLEN));
+  CHECK((buf[0] == ESRAPI_SOC) && (buf[cnt-1] == '\0'));
+
+  char *tokens[ESRAPI_MAX_ARGS];
+  int8_t tokenCnt = -1;
+  if (RapiTokenize(buf,tokens,&tokenCnt)) {
+    CHECK(tokenCnt == 0);
+    return;
+  }
+  CHECK((tokenCnt >= 1) && (tokenCnt <= ESRAPI_MAX_ARGS));
+  for (int i=0;i < tokenCnt;i++) {
+    CHECK((tokens[i] > buf) && (tokens[i] < buf + cnt));
+    CHECK(tokens[i] + strlen(tokens[i]) < buf + cnt);
+  }
+
+  checkRebuild(tokens,tokenCnt);
+
+  int8_t cmdCnt = tokenCnt;
+  uint8_t seqId = RapiSeqId(tokens,&cmdCnt);
+  CHECK((cmdCnt == tokenCnt) || ((cmdCnt == tokenCnt - 1) && (cmdCnt >= 1)));
+  if (cmdCnt == tokenCnt) CHECK(seqId == INVALID_SEQUENCE_ID);
+
+  for (int i=0;i < tokenCnt;i++) {
+    checkNumber(tokens[i]);
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data,size_t size)
+{
+  // exactly ESRAPI_BUFLEN on the heap, so ASan sees any overrun
+  char *buf = new char[ESRAPI_BUFLEN];
+  buf[0] = 0;
+  int8_t cnt = 0;
+  for (size_t i=0;i < size;i++) {
+    if (RapiFrameByte(buf,&cnt,(char)data[i])) {
+      checkFrame(buf,cnt);
+      // EvseRapiProcessor::processCmd() writes its response into the
+      // buffer, leaving no frame in progress
+      buf[0] = 0;
+      cnt = 0;
+    }
+    CHECK((cnt >= 0) && (cnt <= ESRAPI_BUFLEN));
+  }
+  delete [] buf;
+  return 0;
+}
+
+#ifdef RAPI_FUZZ_MAIN
+#define RANDOM_RUNS 1000000
+#define RANDOM_MAXLEN 256
+
+int main(int argc,char *argv[])
+{
+  static uint8_t data[1 << 16];
+  if (argc > 1) {
+    for (int i=1;i < argc;i++) {
+      FILE *fp = fopen(argv[i],"rb");
+      if (!fp) {
+        printf("can't open %s\n",argv[i]);
+        return 1;
+      }
+      size_t size = fread(data,1,sizeof(data),fp);
+      fclose(fp);
+      printf("%s: %u bytes\n",argv[i],(unsigned)size);
+      LLVMFuzzerTestOneInput(data,size);
+    }
+    return 0;
+  }
+
+  // bias the bytes toward the ones the parser cares about
+  static const char special[] = "$\r ^*:-.0123456789AFaf";
+  srand(1);
+  for (int run=0;run < RANDOM_RUNS;run++) {
+    size_t size = rand() % RANDOM_MAXLEN;
+    for (size_t i=0;i < size;i++) {
+      data[i] = (rand() & 3) ? special[rand() % (sizeof(special) - 1)] : rand();
+    }
+    LLVMFuzzerTestOneInput(data,size);
+  }
+  printf("%d random inputs OK\n",RANDOM_RUNS);
+  return 0;
+}
+#endif // RAPI_FUZZ_MAIN
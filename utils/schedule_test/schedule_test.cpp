@@ -0,0 +1,141 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Weekly Schedule Test
+ *
+ * Runs the firmware's WeekSchedule over a table of windows and times,
+ * including windows that run past midnight and past the end of the week,
+ * and checks whether the EVSE is awake, the current cap and how long
+ * until the next change. Also checks the EEPROM packing
+ *
+ * build: g++ -O2 -o schedule_test schedule_test.cpp ../../firmware/open_evse/WeekSchedule.cpp
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../../firmware/open_evse/WeekSchedule.h"
+
+#define VERSTR "V1.0"
+
+#define SUN 0x01
+#define MON 0x02
+#define FRI 0x20
+#define SAT 0x40
+#define WEEKNIGHTS 0x1f // Sun-Thu
+#define HM(h,m) ((h) * 60 + (m))
+#define MAX_WINS 3
+
+struct Case {
+  const char *name;
+  SCHED_WIN wins[MAX_WINS]; // days = 0 = unused
+  uint8_t dow,hour,min;     // now
+  uint8_t awake;
+  uint8_t amps;
+  uint16_t next;            // expected NextMins()
+};
+
+static const Case g_Cases[] = {
+  { "empty", {},
+    3,12,0, 0,0,WS_MINS_PER_WEEK },
+  { "day_in", { { 0x7f,0,HM(10,0),HM(15,0) } },
+    2,12,0, 1,0,HM(3,0) },
+  { "day_out", { { 0x7f,0,HM(10,0),HM(15,0) } },
+    2,16,0, 0,0,HM(18,0) },
+  { "day_open", { { 0x7f,0,HM(10,0),HM(15,0) } },
+    2,10,0, 1,0,HM(5,0) },
+  { "day_close", { { 0x7f,0,HM(10,0),HM(15,0) } },
+    2,15,0, 0,0,HM(19,0) },
+  // 22:00-06:00 Sun-Thu nights
+  { "wrap_eve", { { WEEKNIGHTS,0,HM(22,0),HM(6,0) } },
+    1,23,30, 1,0,HM(6,30) },
+  { "wrap_morn", { { WEEKNIGHTS,0,HM(22,0),HM(6,0) } },
+    2,5,59, 1,0,1 },
+  { "wrap_fri", { { WEEKNIGHTS,0,HM(22,0),HM(6,0) } },
+    5,3,0, 1,0,HM(3,0) },
+  { "wrap_sat", { { WEEKNIGHTS,0,HM(22,0),HM(6,0) } },
+    6,3,0, 0,0,HM(43,0) },
+  // Saturday night runs into Sunday, across the end of the week
+  { "wrap_week", { { SAT,16,HM(22,0),HM(6,0) } },
+    0,2,0, 1,16,HM(4,0) },
+  { "wrap_week2", { { SAT,16,HM(22,0),HM(6,0) } },
+    6,22,0, 1,16,HM(8,0) },
+  { "wrap_week3", { { SAT,16,HM(22,0),HM(6,0) } },
+    0,6,0, 0,0,HM(160,0) },
+  // a one minute window right before midnight
+  { "last_min", { { FRI,0,HM(23,59),0 } },
+    5,23,59, 1,0,1 },
+  // start == stop is empty, as with ST
+  { "equal", { { 0x7f,0,HM(8,0),HM(8,0) } },
+    2,8,0, 0,0,WS_MINS_PER_WEEK },
+  // overlapping windows get the highest cap, no cap wins
+  { "overlap", { { MON,10,HM(0,0),HM(12,0) },{ MON,16,HM(6,0),HM(8,0) } },
+    1,7,0, 1,16,HM(1,0) },
+  { "overlap_nocap", { { MON,10,HM(0,0),HM(12,0) },{ MON,0,HM(6,0),HM(8,0) } },
+    1,7,0, 1,0,HM(1,0) },
+  { "overlap_wrap", { { SUN,10,HM(20,0),HM(2,0) },{ MON,16,HM(1,0),HM(3,0) } },
+    1,1,30, 1,16,HM(0,30) },
+};
+#define CASE_CNT (int)(sizeof(g_Cases)/sizeof(g_Cases[0]))
+
+static int runCase(const Case *c)
+{
+  WeekSchedule ws;
+  ws.Begin(c->dow,c->hour,c->min);
+  for (int i=0;i < MAX_WINS;i++) {
+    if (c->wins[i].days) ws.Add(&c->wins[i]);
+  }
+  int fail = (ws.Awake() != c->awake) || (ws.Amps() != c->amps) || (ws.NextMins() != c->next);
+  printf("%-14s %-4s awake %d amps %2d next %5u",c->name,fail ? "FAIL" : "ok",
+         ws.Awake(),ws.Amps(),ws.NextMins());
+  if (fail) printf("  expected awake %d amps %2d next %5u",c->awake,c->amps,c->next);
+  printf("\n");
+  return fail;
+}
+
+static int checkPacking()
+{
+  int fail = 0;
+  SCHED_WIN w = { SAT,32,HM(23,59),HM(6,30) };
+  SCHED_WIN u;
+  uint8_t b[WS_PACKED_LEN];
+  WsPack(&w,b);
+  WsUnpack(b,&u);
+  if (memcmp(&w,&u,sizeof(w))) fail = 1;
+  // unwritten EEPROM reads back as an unused window
+  memset(b,0xff,sizeof(b));
+  WsUnpack(b,&u);
+  if (u.days) fail = 1;
+  printf("%-14s %-4s\n","packing",fail ? "FAIL" : "ok");
+  return fail;
+}
+
+int main()
+{
+  printf("OpenEVSE Weekly Schedule Test %s  %s %s\n\n",VERSTR,__DATE__,__TIME__);
+
+  int fails = 0;
+  for (int i=0;i < CASE_CNT;i++) {
+    fails += runCase(&g_Cases[i]);
+  }
+  fails += checkPacking();
+
+  printf("\n%d/%d cases passed\n",CASE_CNT + 1 - fails,CASE_CNT + 1);
+  return fails ? 3 : 0;
+}
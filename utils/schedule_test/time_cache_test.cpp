@@ -0,0 +1,132 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Time Cache Test
+ *
+ * Runs the firmware's TimeCache against a simulated RTC and a CPU clock
+ * that runs fast or slow, syncing on the same schedule as the firmware.
+ * Checks how far the time worked out from millis() strays from the RTC,
+ * that the drift estimate comes out right, and that setting the RTC or
+ * millis() rolling over doesn't upset it
+ *
+ * build: g++ -O2 -o time_cache_test time_cache_test.cpp ../../firmware/open_evse/TimeCache.cpp
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../firmware/open_evse/TimeCache.h"
+
+#define VERSTR "V1.0"
+
+#define RUN_HOURS 48
+#define JUMP_HOUR 12
+#define BASE_EPOCH 1789788800UL // Sat 2026-09-19 03:33:20
+#define PPM_TOL 10              // 1s of correction over the run is ~6ppm
+
+struct Case {
+  const char *name;
+  int32_t ppm;           // + = millis() slow against the RTC
+  uint32_t startms;      // millis() at boot
+  uint16_t phasems;      // how far into the RTC's second we boot
+  int32_t jumpsec;       // RTC set by this much at JUMP_HOUR
+  uint8_t settime;       // jump came through SC, not behind our back
+};
+
+static const Case g_Cases[] = {
+  { "exact",      0,    0,            0,   0,    0 },
+  { "slow100",    100,  0,            250, 0,    0 },
+  { "fast100",    -100, 0,            750, 0,    0 },
+  { "slow2000",   2000, 0,            999, 0,    0 },
+  { "fast2000",   -2000,0,            1,   0,    0 },
+  { "rollover",   300,  0xffffffffUL - 3600000UL, 500, 0, 0 },
+  { "set",        100,  0,            0,   3600, 1 },
+  { "set_back",   -100, 0,            0,   -600, 1 },
+  { "set_behind", 100,  0,            0,   3600, 0 },
+};
+#define CASE_CNT (int)(sizeof(g_Cases)/sizeof(g_Cases[0]))
+
+static int runCase(const Case *c)
+{
+  TimeCache tc;
+  int32_t offset = 0;  // RTC adjustments
+  int32_t maxerr = 0;
+  uint8_t stale = 0;   // RTC set behind our back, not read since
+  const uint64_t runms = RUN_HOURS * 3600000UL;
+
+  // step through real time 1ms at a time is too slow, 100ms is plenty
+  for (uint64_t realms = 0;realms <= runms;realms += 100) {
+    uint32_t ms = c->startms + (uint32_t)(realms - (int64_t)realms * c->ppm / 1000000L);
+    uint32_t rtc = BASE_EPOCH + offset + (realms + c->phasems) / 1000UL;
+
+    if (c->jumpsec && (realms == JUMP_HOUR * 3600000UL)) {
+      offset += c->jumpsec;
+      rtc += c->jumpsec;
+      if (c->settime) tc.Sync(rtc,ms,1);
+      else stale = 1;
+    }
+    if (tc.SyncDue(ms)) {
+      tc.Sync(rtc,ms,0);
+      stale = 0;
+    }
+    if (!stale) {
+      int32_t err = (int32_t)(tc.Epoch(ms) - rtc);
+      if (abs(err) > maxerr) maxerr = abs(err);
+    }
+  }
+
+  int32_t ppm = tc.DriftPpm();
+  // a second for not knowing where the RTC's second starts, plus however
+  // much the drift piles up between syncs before a read shows it
+  int32_t errtol = 1 + (int32_t)(((int64_t)labs(c->ppm) * TC_SYNC_MS + 999999999LL) / 1000000000LL);
+  int fail = (maxerr > errtol) || (labs(ppm - c->ppm) > PPM_TOL);
+  printf("%-11s %-4s drift %5ld ppm (%5ld) max err %lds (%lds)  syncs %u corrections %u\n",
+         c->name,fail ? "FAIL" : "ok",(long)ppm,(long)c->ppm,(long)maxerr,(long)errtol,tc.SyncCnt(),tc.CorrCnt());
+  return fail;
+}
+
+static int checkCalendar()
+{
+  int fail = 0;
+  // Sat 2026-09-19 03:33:20
+  if ((TimeCache::DayOfWeek(BASE_EPOCH) != 6) || (TimeCache::Hour(BASE_EPOCH) != 3) ||
+      (TimeCache::Minute(BASE_EPOCH) != 33) || (TimeCache::Second(BASE_EPOCH) != 20)) fail = 1;
+  // Thu 1970-01-01 and Sun 1970-01-04 00:00:00
+  if ((TimeCache::DayOfWeek(0) != 4) || (TimeCache::DayOfWeek(3*86400UL) != 0)) fail = 1;
+  // Sat 23:59:59 -> Sun 00:00:00
+  uint32_t t = 1789862399UL;
+  if ((TimeCache::DayOfWeek(t) != 6) || (TimeCache::Hour(t) != 23) ||
+      (TimeCache::DayOfWeek(t + 1) != 0) || (TimeCache::Hour(t + 1) != 0)) fail = 1;
+  printf("%-11s %-4s\n","calendar",fail ? "FAIL" : "ok");
+  return fail;
+}
+
+int main()
+{
+  printf("OpenEVSE Time Cache Test %s  %s %s\n\n",VERSTR,__DATE__,__TIME__);
+
+  int fails = 0;
+  for (int i=0;i < CASE_CNT;i++) {
+    fails += runCase(&g_Cases[i]);
+  }
+  fails += checkCalendar();
+
+  printf("\n%d/%d cases passed\n",CASE_CNT + 1 - fails,CASE_CNT + 1);
+  return fails ? 3 : 0;
+}
@@ -0,0 +1,249 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Thermal Derating Simulator
+ *
+ * Runs the firmware's ThermalDerater against a first order thermal model
+ * of the enclosure and checks each scenario stays below the panic
+ * thresholds with a bounded current slew
+ *
+ * build: g++ -O2 -o thermal_sim thermal_sim.cpp ../../firmware/open_evse/ThermalDerater.cpp
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "../../firmware/open_evse/SetpointArbiter.h" // MIN_CURRENT_CAPACITY_J1772
+#include "../../firmware/open_evse/ThermalDerater.h"
+
+#define VERSTR "V1.0"
+
+#define LOOP_MS 100      // J1772EVSEController::Update() period
+#define SAMPLE_MS 1000   // TEMPMONITOR_UPDATE_INTERVAL
+
+// enclosure model: dT/dt = (R*I^2 - (T - ambient)/Rth) / Cth
+// with the defaults 32A raises the enclosure ~35C above ambient
+// with a 10 minute time constant. the IR sensor looks at the relay/
+// terminals, which heat faster and further than the air
+struct Model {
+  double ambient;     // C
+  double airT;        // C
+  double irT;         // C
+  double riseAt32;    // steady state air rise at 32A, C
+  double tauS;        // air time constant, sec
+  double irGain;      // IR rise relative to air rise
+  double irTauS;
+};
+
+struct Scenario {
+  const char *name;
+  const char *desc;
+  uint8_t maxAmps;
+  double ambient;
+  double riseAt32;
+  double tauS;
+  long durationS;
+  long ambientStepS;    // when to change ambient, -1 = never
+  double ambientStep;   // new ambient
+  long dropoutS;        // MCP9808 read fails from here ... -1 = never
+  long dropoutLenS;
+  uint8_t expectDerate; // 1 = scenario must derate, 0 = must not
+};
+
+static const Scenario g_Scenarios[] = {
+  { "cool", "mild day, full current, no derating",
+    32, 20.0, 35.0, 600, 3600, -1, 0, -1, 0, 0 },
+  { "hot", "hot day, settles in the derating band",
+    32, 45.0, 35.0, 600, 3600, -1, 0, -1, 0, 1 },
+  { "fastrise", "poor ventilation, short time constant",
+    40, 40.0, 45.0, 180, 2400, -1, 0, -1, 0, 1 },
+  { "cooldown", "hot afternoon then evening, current must come back",
+    32, 45.0, 35.0, 600, 7200, 2400, 20.0, -1, 0, 1 },
+  { "dropout", "ambient sensor drops out for 2 minutes while derating",
+    32, 45.0, 35.0, 600, 3600, -1, 0, 1500, 120, 1 },
+};
+#define SCENARIO_CNT (int)(sizeof(g_Scenarios)/sizeof(g_Scenarios[0]))
+
+static int16_t toC10(double t)
+{
+  // sensors resolve 0.1C at best
+  return (int16_t)floor(t * 10.0);
+}
+
+static int runScenario(const Scenario *sc,FILE *csv)
+{
+  ThermalDerater td;
+  Model m;
+  m.ambient = sc->ambient;
+  m.airT = sc->ambient;
+  m.irT = sc->ambient;
+  m.riseAt32 = sc->riseAt32;
+  m.tauS = sc->tauS;
+  m.irGain = 1.2;
+  m.irTauS = sc->tauS / 3;
+
+  uint8_t amps = sc->maxAmps;
+  uint8_t prevAmps = amps;
+  double peakAir = 0,peakIr = 0;
+  uint8_t minAmps = amps;
+  long firstDerateS = -1;
+  long throttleCrossS = -1;
+  int maxStepDa = 0;      // largest change per second, 0.1A
+  // current swing over the last third of the run, once things have settled
+  uint8_t tailMin = 255,tailMax = 0;
+  uint8_t ampsSec = amps;
+
+  unsigned long durMs = (unsigned long)sc->durationS * 1000;
+  for (unsigned long ms=0;ms <= durMs;ms += LOOP_MS) {
+    long sec = (long)(ms / 1000);
+    if ((sc->ambientStepS >= 0) && (sec >= sc->ambientStepS)) m.ambient = sc->ambientStep;
+
+    // plant
+    double dt = LOOP_MS / 1000.0;
+    double i2 = ((double)amps / 32.0) * ((double)amps / 32.0);
+    double airSS = m.ambient + m.riseAt32 * i2;
+    double irSS = m.ambient + m.riseAt32 * m.irGain * i2;
+    m.airT += (airSS - m.airT) * dt / m.tauS;
+    m.irT += (irSS - m.irT) * dt / m.irTauS;
+    if (m.airT > peakAir) peakAir = m.airT;
+    if (m.irT > peakIr) peakIr = m.irT;
+    if ((throttleCrossS < 0) && ((toC10(m.airT) >= TEMPERATURE_AMBIENT_THROTTLE_DOWN) ||
+                                 (toC10(m.irT) >= TEMPERATURE_INFRARED_THROTTLE_DOWN))) {
+      throttleCrossS = sec;
+    }
+
+    // TempMonitor::Read()
+    if (!(ms % SAMPLE_MS)) {
+      if ((sc->dropoutS >= 0) && (sec >= sc->dropoutS) && (sec < sc->dropoutS + sc->dropoutLenS)) {
+        td.Drop(TDS_MCP9808);
+      }
+      else {
+        td.Sample(TDS_MCP9808,toC10(m.airT),ms,TEMPERATURE_AMBIENT_THROTTLE_DOWN,TEMPERATURE_AMBIENT_SHUTDOWN);
+      }
+      // DS3231 sits on the board, slightly cooler than the MCP9808
+      td.Sample(TDS_DS3231,toC10(m.airT - 1.0),ms,TEMPERATURE_AMBIENT_THROTTLE_DOWN,TEMPERATURE_AMBIENT_SHUTDOWN);
+      td.Sample(TDS_TMP007,toC10(m.irT),ms,TEMPERATURE_INFRARED_THROTTLE_DOWN,TEMPERATURE_INFRARED_SHUTDOWN);
+    }
+
+    // J1772EVSEController::Update()
+    uint8_t a = td.Update(ms,sc->maxAmps,MIN_CURRENT_CAPACITY_J1772);
+    amps = td.Active() ? a : sc->maxAmps;
+    if (amps < minAmps) minAmps = amps;
+    if ((firstDerateS < 0) && (amps < sc->maxAmps)) firstDerateS = sec;
+
+    if (!(ms % 1000)) {
+      int step = abs((int)amps - (int)ampsSec) * 10;
+      if (step > maxStepDa) maxStepDa = step;
+      if (sec >= (sc->durationS * 2) / 3) {
+        if (amps < tailMin) tailMin = amps;
+        if (amps > tailMax) tailMax = amps;
+      }
+      ampsSec = amps;
+      if (csv) {
+        fprintf(csv,"%s,%ld,%.2f,%.2f,%.2f,%d,%d,%d\n",sc->name,sec,m.ambient,m.airT,m.irT,
+                td.Slope(TDS_MCP9808),td.Severity(),amps);
+      }
+    }
+    prevAmps = amps;
+  }
+
+  int fail = 0;
+  char why[256] = "";
+  if (toC10(peakAir) >= TEMPERATURE_AMBIENT_PANIC) {
+    fail = 1; strcat(why," air>=panic");
+  }
+  if (toC10(peakIr) >= TEMPERATURE_INFRARED_PANIC) {
+    fail = 1; strcat(why," ir>=panic");
+  }
+  if (sc->expectDerate != ((minAmps < sc->maxAmps) ? 1 : 0)) {
+    fail = 1; strcat(why,sc->expectDerate ? " no derating" : " unexpected derating");
+  }
+  if (maxStepDa > TD_SLEW_DOWN_DA_PER_S + 10) {
+    // +10 for truncating 0.1A to whole amps
+    fail = 1; strcat(why," slew");
+  }
+  // the pilot only has whole amps, so a slow 1-2A limit cycle is expected
+  if ((tailMax - tailMin) > 2) {
+    fail = 1; strcat(why," oscillation");
+  }
+  if ((sc->ambientStepS >= 0) && (prevAmps != sc->maxAmps)) {
+    fail = 1; strcat(why," not restored");
+  }
+
+  printf("%-9s %-4s peak air %5.1fC ir %5.1fC  min %2dA end %2dA  derate@%5lds throttle@%5lds  max step %d.%dA/s swing %dA%s\n",
+         sc->name,fail ? "FAIL" : "ok",peakAir,peakIr,minAmps,prevAmps,firstDerateS,throttleCrossS,
+         maxStepDa / 10,maxStepDa % 10,tailMax - tailMin,why);
+  return fail;
+}
+
+static void usage(const char *pname)
+{
+  printf("Usage: %s [options] [scenario ...]\n",pname);
+  printf(" -o file      write a per second CSV trace to file\n");
+  printf(" -l           list scenarios\n");
+  printf("runs all scenarios if none are given\n");
+}
+
+int main(int argc,char *argv[])
+{
+  printf("OpenEVSE Thermal Derating Simulator %s  %s %s\n\n",VERSTR,__DATE__,__TIME__);
+
+  const char *csvFile = NULL;
+  int opt;
+  while ((opt = getopt(argc,argv,"o:l")) != -1) {
+    switch (opt) {
+    case 'o': csvFile = optarg; break;
+    case 'l':
+      for (int i=0;i < SCENARIO_CNT;i++) printf("%-9s %s\n",g_Scenarios[i].name,g_Scenarios[i].desc);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  FILE *csv = NULL;
+  if (csvFile) {
+    csv = fopen(csvFile,"w");
+    if (!csv) {
+      printf("ERROR opening %s\n",csvFile);
+      return 2;
+    }
+    fprintf(csv,"scenario,sec,ambient,air,ir,slope,severity,amps\n");
+  }
+
+  int fails = 0;
+  int ran = 0;
+  for (int i=0;i < SCENARIO_CNT;i++) {
+    int want = (optind >= argc);
+    for (int j=optind;j < argc;j++) {
+      if (!strcmp(argv[j],g_Scenarios[i].name)) want = 1;
+    }
+    if (!want) continue;
+    fails += runScenario(&g_Scenarios[i],csv);
+    ran++;
+  }
+
+  if (csv) fclose(csv);
+  printf("\n%d/%d scenarios passed\n",ran - fails,ran);
+  return fails ? 3 : 0;
+}